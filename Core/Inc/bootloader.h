@@ -6,3 +6,7 @@ void reset_to_bootloader();
 // Called by SystemInit() during bootup. Checks 'jump_to_bootloader_magic' variable to see if bootloader should be entered
 void check_bootloader();
 
+// Requests the resident updater (see updater.h) to stay in update mode at the given baud rate (0 = default) and
+// resets CPU
+void reset_to_updater(uint32_t baud);
+
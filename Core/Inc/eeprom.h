@@ -67,12 +67,19 @@
 #define PAGE_FULL             ((uint8_t)0x80)
 
 /* Variables' number */
-#define NB_OF_VAR             ((uint8_t)0x09)
+#define NB_OF_VAR             ((uint8_t)0x10)
 
 /* Exported types ------------------------------------------------------------*/
 /* Exported macro ------------------------------------------------------------*/
+/* Exported variables ------------------------------------------------------- */
+extern uint16_t EE_PageTransferCount;
+extern uint16_t EE_WriteCount;
+
 /* Exported functions ------------------------------------------------------- */
 uint16_t EE_Init(void);
+uint16_t EE_FastInit(void);
+uint16_t EE_Repair(void);
+uint8_t EE_RepairPending(void);
 uint16_t EE_ReadVariable(uint16_t VirtAddress, uint16_t* Data);
 uint16_t EE_WriteVariable(uint16_t VirtAddress, uint16_t Data);
 
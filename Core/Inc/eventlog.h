@@ -0,0 +1,47 @@
+#include "main.h"
+
+/*
+ * Event log: timestamped records of state transitions and faults in a RAM ring buffer of EVENTLOG_SIZE records
+ * (4 bytes each). eventlog_add() disables interrupts only for a few instructions, so it can be called also from
+ * interrupt handlers. With EVENTLOG_RETAIN_OVER_RESET (see main.h) the buffer is placed in .noinit section so that
+ * the log survives a reset (but not power loss). Read over UART with CMD_EXT_GET_EVENTS.
+ *
+ * SysTick is stopped in sleep mode, so the time spent sleeping isn't included in the timestamps.
+ */
+#define EVENTLOG_SIZE           32      // must be a power of 2
+#define EVENTLOG_TIME_SHIFT     7       // timestamp unit is 2^7 = 128 ms (wraps around every 2.3 hours)
+#define EVENTLOG_MAGIC          0x45564c47
+#define EVENTLOG_CHUNK_RECORDS  8       // records per CMD_EXT_GET_EVENTS reply
+
+typedef enum eventlog_id_t {
+    EVENTLOG_BOOT = 1,          // arg: reset flags (RCC_CSR bits 31..24)
+    EVENTLOG_STATUS,            // arg: new motor status (motor_status_t)
+    EVENTLOG_STALL_UP,          // arg: motor current (mA / 16). Stalled while moving up without reaching the top
+    EVENTLOG_STALL_DOWN,        // arg: motor current (mA / 16)
+    EVENTLOG_SENSOR_ERROR,      // No Hall sensor ticks while moving
+    EVENTLOG_UART_ERROR,        // arg: HAL UART error code
+    EVENTLOG_UART_TX_DROP,      // arg: length of the dropped packet
+    EVENTLOG_SLEEP,             // arg: sleep tracking mode
+    EVENTLOG_WAKE_UP,
+    EVENTLOG_OVERCURRENT,       // arg: motor status when the cutoff tripped
+    EVENTLOG_STALL_LOCATION,    // arg: location bin of a low-current stall (STALL_RECOVERY_BINS), bit 7 set when moving down
+    EVENTLOG_BROWNOUT,          // arg: supply voltage (Volts * 30). Motor output was limited because of a supply sag
+    EVENTLOG_HALL_SENSOR_FAILED, // arg: failed Hall sensor (1 or 2). Degraded single-sensor mode was entered
+    EVENTLOG_OVERHEAT,          // arg: estimated motor temperature rise (°C). New moves wait until it has cooled down
+} eventlog_id_t;
+
+typedef struct eventlog_record_t {
+    uint16_t time;              // HAL_GetTick() >> EVENTLOG_TIME_SHIFT
+    uint8_t id;
+    uint8_t arg;
+} eventlog_record_t;
+
+// Called at boot. Clears the log unless a valid one was retained over reset, then adds EVENTLOG_BOOT
+void eventlog_init(uint8_t reset_flags);
+
+void eventlog_add(eventlog_id_t id, uint8_t arg);
+
+uint8_t eventlog_count();
+
+// Index 0 is the newest record
+eventlog_record_t eventlog_get(uint8_t index);
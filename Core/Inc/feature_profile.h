@@ -0,0 +1,85 @@
+/*
+ * feature_profile.h
+ *
+ * Optional subsystems of the firmware, selected by build variant. Disabled subsystems are compiled out completely
+ * (code, RAM buffers and commands). The motor control features and their parameters are in motor.h and main.h.
+ *
+ * FEATURE_PROFILE is set with `make -f STM32Make.make FEATURE_PROFILE=<name>`:
+ *  FEATURE_PROFILE_ESP_FULL: all subsystems, for an ESP module using the extended commands (default)
+ *  FEATURE_PROFILE_ZIGBEE: replacement for the original firmware with the IKEA Zigbee module, which uses only the
+ *    original commands. Speed is changed with flexi-speed and settings are stored to flash
+ *  FEATURE_PROFILE_MINIMAL: motor control only. Nothing is stored to flash and default settings are used on boot
+ */
+
+#ifndef FEATURE_PROFILE_H_
+#define FEATURE_PROFILE_H_
+
+#define FEATURE_PROFILE_ESP_FULL	1
+#define FEATURE_PROFILE_ZIGBEE		2
+#define FEATURE_PROFILE_MINIMAL		3
+
+#ifdef SLIM_BINARY
+#define FEATURE_PROFILE FEATURE_PROFILE_MINIMAL	// earlier name of the minimal build
+#endif
+
+#ifndef FEATURE_PROFILE
+#define FEATURE_PROFILE FEATURE_PROFILE_ESP_FULL
+#endif
+
+#if FEATURE_PROFILE == FEATURE_PROFILE_ESP_FULL
+
+#define EEPROM_SETTINGS_ENABLED		// settings are stored to EEPROM emulation (see eeprom.h)
+#define READ_DEFAULT_MINIMUM_VOLTAGE_FROM_EEPROM
+#define READ_DEFAULT_SPEED_FROM_EEPROM
+#define READ_DEFAULT_IDLE_MODE_SLEEP_DELAY_FROM_EEPROM
+#define LED_BLINK_ENABLED			// non-blocking LED blinking on boot and with CMD_EXT_PING (see led_blink)
+#define FLEXISPEED_ENABLED			// see motor.h
+#define SLEEP_TRACKING_ENABLED		// see main.h
+//#define LOCATION_JOURNAL_ENABLED	// see motor.h
+#define LIFETIME_STATS_ENABLED		// see motor.h
+#define EVENTLOG_ENABLED			// timestamped log of state transitions and faults in RAM (see eventlog.h)
+#define EVENTLOG_RETAIN_OVER_RESET	// keep the log in .noinit RAM section over reset
+#define PROTOCOL_V2_ENABLED			// variable-length frames with CRC and sequence numbers (see protocol_v2.h)
+#define MULTIDROP_BUS_ENABLED		// see main.h
+#define SUNRISE_MODE_ENABLED		// see motor.h
+#define GROUP_MOVE_ENABLED			// see motor.h
+#define MOVE_METERING_ENABLED		// see motor.h
+// For debugging.
+#define BLINK_LEDS_WHEN_SLEEP_MODE_CHANGES
+#define WAKE_UP_USING_BUTTON
+
+#elif FEATURE_PROFILE == FEATURE_PROFILE_ZIGBEE
+
+#define EEPROM_SETTINGS_ENABLED
+#define READ_DEFAULT_MINIMUM_VOLTAGE_FROM_EEPROM
+#define READ_DEFAULT_SPEED_FROM_EEPROM
+#define READ_DEFAULT_IDLE_MODE_SLEEP_DELAY_FROM_EEPROM
+#define LED_BLINK_ENABLED
+#define FLEXISPEED_ENABLED
+#define SLEEP_TRACKING_ENABLED
+
+#elif FEATURE_PROFILE == FEATURE_PROFILE_MINIMAL
+
+#else
+#error "Unknown FEATURE_PROFILE"
+#endif
+
+/*
+ * Debugging and tuning aids. Disabled in all variants because of their RAM usage, enable when needed
+ */
+//#define MOTION_TRACE_ENABLED		// see motor.h
+//#define ISR_PROFILER_ENABLED		// see profiler.h
+//#define MICROBENCH_ENABLED		// see microbench.h
+//#define RAM_STATS_ENABLED			// see ramstats.h. Not supported by the host simulator
+
+#if defined(LOCATION_JOURNAL_ENABLED) && !defined(EEPROM_SETTINGS_ENABLED)
+#error "LOCATION_JOURNAL_ENABLED requires EEPROM_SETTINGS_ENABLED"
+#endif
+#if defined(LIFETIME_STATS_ENABLED) && !defined(EEPROM_SETTINGS_ENABLED)
+#error "LIFETIME_STATS_ENABLED requires EEPROM_SETTINGS_ENABLED"
+#endif
+#if defined(BLINK_LEDS_WHEN_SLEEP_MODE_CHANGES) && !defined(LED_BLINK_ENABLED)
+#error "BLINK_LEDS_WHEN_SLEEP_MODE_CHANGES requires LED_BLINK_ENABLED"
+#endif
+
+#endif /* FEATURE_PROFILE_H_ */
@@ -0,0 +1,56 @@
+#include "main.h"
+
+/*
+ * Append-only log of frequently changing state (curtain location, statistics, lifetime totals) in a dedicated
+ * flash page. Records are written one after another and the page is erased only when it is full, so storing the
+ * state costs just a few halfword writes instead of the page transfers of the EEPROM emulation.
+ *
+ * The latest record is located at boot by binary search: used slots always form a contiguous block at the
+ * start of the page. A record is used only if its CRC matches, so a record torn by power loss is skipped.
+ * The 'valid' halfword is programmed last. It can later be cleared to 0x0000 in place (without erasing)
+ * to mark the location as unreliable, e.g. when the motor starts moving.
+ */
+#define ADDR_FLASH_PAGE_29      ((uint32_t)0x08007400)
+#define FLASHLOG_PAGE_ADDRESS   ADDR_FLASH_PAGE_29  // Must be excluded from FLASH area in linker script
+#define FLASHLOG_PAGE_SIZE      FLASH_PAGE_SIZE
+
+#define FLASHLOG_EMPTY          0xFFFF
+#define FLASHLOG_VALID          0x5AA5
+#define FLASHLOG_INVALID        0x0000
+
+#define FLASHLOG_FLAG_ORIENTATION   0x01
+
+// Lifetime totals (see LIFETIME_STATS_ENABLED in motor.h)
+typedef struct lifetime_stats_t {
+    uint32_t revolutions;       // curtain rod revolutions
+    uint32_t motor_on_time;     // seconds
+    uint16_t calibrations;      // endpoint calibrations at the top position
+    uint16_t stalls_up;
+    uint16_t stalls_down;
+    uint16_t flash_erases;      // flash log page erases and EEPROM emulation page transfers
+} lifetime_stats_t;
+
+typedef struct flashlog_record_t {
+    uint16_t seq;           // incremented for every record (0xFFFF is skipped)
+    uint16_t location;
+    uint16_t lowest_voltage;
+    uint8_t stalled_up_counter;
+    uint8_t stalled_down_counter;
+    lifetime_stats_t lifetime;
+    uint8_t flags;
+    uint8_t crc;            // CRC-8 of the preceding bytes
+    uint16_t valid;         // FLASHLOG_VALID or FLASHLOG_INVALID
+} flashlog_record_t;
+
+#define FLASHLOG_RECORD_COUNT   (FLASHLOG_PAGE_SIZE / sizeof(flashlog_record_t))
+
+extern uint16_t flashlog_erase_count;  // since power-up
+
+// Find the latest record. Returns HAL_OK and copies the record if found
+uint16_t flashlog_init(flashlog_record_t * record);
+
+// Append a record (seq, crc and valid fields are filled in). The page is erased first if it's full
+uint16_t flashlog_append(flashlog_record_t * record);
+
+// Clear the 'valid' halfword of the latest record
+uint16_t flashlog_invalidate();
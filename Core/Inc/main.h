@@ -32,6 +32,7 @@ extern "C" {
 
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
+#include "feature_profile.h"
 
 /* USER CODE END Includes */
 
@@ -41,8 +42,6 @@ extern "C" {
 typedef struct
 {
     volatile uint8_t  flag;     /* Timeout event flag */
-    uint16_t timer;             /* Timeout duration in msec */
-    uint16_t prevCNDTR;         /* Holds previous value of DMA_CNDTR */
 } DMA_Event_t;
 
 /* USER CODE END ET */
@@ -54,7 +53,9 @@ extern uint32_t hall_sys_ticks;
 
 /* Exported macro ------------------------------------------------------------*/
 /* USER CODE BEGIN EM */
-
+// Set or clear an output pin with a single store (used for the MOSFET gates instead of HAL_GPIO_WritePin)
+#define GPIO_SET(port, pin)		((port)->BSRR = (pin))
+#define GPIO_RESET(port, pin)	((port)->BRR = (pin))
 /* USER CODE END EM */
 
 void HAL_TIM_MspPostInit(TIM_HandleTypeDef *htim);
@@ -63,21 +64,36 @@ void HAL_TIM_MspPostInit(TIM_HandleTypeDef *htim);
 void Error_Handler(void);
 
 /* USER CODE BEGIN EFP */
-void hall_sensor_callback( uint8_t sensor, uint8_t value );
+void hall_sensor_callback();
+void hall_edge_callback();
 void motor_stopped();
 void motor_stall_check();
 void pwm_start(uint32_t channel);
 void pwm_stop(uint32_t channel);
 uint16_t get_voltage(); // returned value is Volts * 30 * 16
 uint16_t get_motor_current();
+uint8_t adc_readings_valid();
 uint8_t get_battery_level();
 uint8_t uart_tx_done();
+void uart_send_msg(uint8_t * data, int tx_bytes);
+void uart_send_reply(uint8_t * tx_buffer, uint8_t tx_bytes);
+void uart_send_slotted(uint8_t * data, uint8_t tx_bytes, uint8_t addr);
+void uart_apply_bus_mode();
+void uart_rx_event(uint8_t line_idle);
+uint8_t uart_request_baud_rate(uint8_t sel);
 
 void enter_sleep_mode();
 uint8_t sleep_timer_timeout();
+void post_event(uint8_t event);
+void set_control_period(uint8_t period);
+void system_clock_fast(uint8_t fast);
 uint8_t sleep_timer_enabled();
 void disable_sleep_timer();
 void reset_sleep_timer();
+uint32_t get_sleep_delay();
+void sleep_frame_received();
+uint8_t sleep_mode_ready();
+void sensor_power_process(uint8_t busy);
 
 /* USER CODE END EFP */
 
@@ -111,20 +127,185 @@ void reset_sleep_timer();
 #define HALL_1_SENSOR 0
 #define HALL_2_SENSOR 1
 
+#define HALL_TIMER TIM14	// free running timer with 1 microsecond resolution used for timestamping Hall sensor edges
+
 #define LOW1_PWM_CHANNEL TIM_CHANNEL_1
 #define LOW2_PWM_CHANNEL TIM_CHANNEL_4
 
-#define UART_DMA_BUF_SIZE   64      /* DMA circular buffer size in bytes */
-#define DMA_TIMEOUT_MS      10      /* DMA Timeout duration in msec */
+/*
+ * Trigger the ADC conversions from TIM1 in the middle of PWM on-time instead of converting continuously.
+ * This gives more accurate reading of the average motor current with fewer samples.
+ */
+#define ADC_PWM_SYNC_ENABLED
+#define ADC_TRIGGER_PWM_CHANNEL TIM_CHANNEL_2
+
+/*
+ * Convert the supply voltage only in every ADC_VOLTAGE_INTERVAL-th half of the ADC DMA buffer and motor current alone
+ * in the others. Voltage changes slowly, while current is what the stall and end point detection act on. STM32F0 has
+ * one sampling time for all channels, so the current-only halves are converted with their own ADC_CURRENT_SAMPLETIME
+ * (see main.c), which can be made shorter than ADC_VOLTAGE_SAMPLETIME if the source impedance allows.
+ */
+#define ADC_MULTIRATE_ENABLED
+#define ADC_VOLTAGE_INTERVAL 8	// in buffer halves
+
+/*
+ * Run the core at 48 MHz (HSI/2 * 12 via PLL) while the motor is energized and at 8 MHz (HSI) when idle.
+ * USART1 is clocked directly from HSI so the baud rate is not affected. Prescalers of TIM1, TIM3 and HALL_TIMER are
+ * re-derived when the clock is changed and SysTick is reconfigured by HAL.
+ */
+#define DYNAMIC_CLOCK_ENABLED
+
+/*
+ * Use 10-bit PWM duty cycle resolution instead of 8 bits. The PWM frequency while moving is then
+ * 48 MHz / 2 / 1025 = 23.4 kHz. Duty cycle constants in motor.h are given in 8-bit units and converted
+ * with PWM_DUTY(). Requires DYNAMIC_CLOCK_ENABLED: at 8 MHz the PWM would run at an audible 7.8 kHz, so without it
+ * the 8-bit resolution (10.4 kHz) is used.
+ */
+#ifdef DYNAMIC_CLOCK_ENABLED
+#define PWM_HIGH_RESOLUTION_ENABLED
+#endif
+
+#if defined(PWM_HIGH_RESOLUTION_ENABLED) && !defined(DYNAMIC_CLOCK_ENABLED)
+#error "PWM_HIGH_RESOLUTION_ENABLED requires DYNAMIC_CLOCK_ENABLED"
+#endif
+
+#ifdef PWM_HIGH_RESOLUTION_ENABLED
+#define PWM_EXTRA_BITS 2
+#define PWM_PRESCALER_8MHZ  0   /* TIM1 prescaler at 8 MHz: 8 MHz / 1 / 1025 = 7.8 kHz PWM */
+#define PWM_PRESCALER_48MHZ 1   /* TIM1 prescaler at 48 MHz: 48 MHz / 2 / 1025 = 23.4 kHz PWM (above audible range) */
+#else
+#define PWM_EXTRA_BITS 0
+#define PWM_PRESCALER_8MHZ  2   /* TIM1 prescaler at 8 MHz: 8 MHz / 3 / 257 = 10.4 kHz PWM */
+#define PWM_PRESCALER_48MHZ 8   /* TIM1 prescaler at 48 MHz: 48 MHz / 9 / 257 = 20.8 kHz PWM (above audible range) */
+#endif
+#define PWM_PERIOD (256 << PWM_EXTRA_BITS)	/* TIM1 auto-reload value */
+#define PWM_DUTY(x) ((x) << PWM_EXTRA_BITS)	/* Convert 8-bit duty cycle to TIM1 compare value */
+
+#define UART_DMA_BUF_SIZE   64      /* DMA circular buffer size in bytes. Must be power of 2 */
+#define UART_TX_BUF_SIZE    128     /* DMA tx circular buffer size in bytes. Must be power of 2 */
+#define DMA_TIMEOUT_MS      10      /* Incomplete packet is discarded after this (msec) */
+#define UART_MAX_PACKET_SIZE  40    /* Longest reply (aggregate query with all sections, move log) */
+
+/*
+ * Events posted by interrupt handlers. The main loop sleeps (WFI) until at least one event is pending
+ */
+#define EVENT_TICK          0x01    /* SysTick (every millisecond) */
+#define EVENT_UART          0x02    /* UART data received or transmitted */
+#define EVENT_HALL          0x04    /* Hall sensor edge */
+#define EVENT_ADC           0x08    /* New voltage and current averages */
+#define EVENT_CONTROL       0x10    /* Motor speed controller was run (TIM3) */
+#define EVENT_TIMER         0x20    /* Software timer expired (see swtimer.h) */
+
+// Battery level curve used in status replies. Default is Li-ion battery pack, enable this when powered by a DC adapter
+//#define BATTERY_CURVE_DC_ADAPTER
+
+#ifndef BATTERY_CURVE_DC_ADAPTER
+// Report battery level estimated by coulomb counting instead of the instantaneous voltage (see soc.h)
+#define BATTERY_SOC_ENABLED
+#endif
+
+/*
+ * Interrupt priorities (Cortex-M0 has 4 levels, 0 = highest). Hall sensor edges pre-empt everything else so that no
+ * ticks are lost at high RPM, even while a command is parsed in UART interrupt:
+ *   0: EXTI0_1, EXTI4_15 (Hall sensors), ADC (overcurrent cutoff)
+ *   1: TIM3 (speed controller), TIM1 (PWM dithering)
+ *   2: DMA1 channel 1 (ADC)
+ *   3: UART (DMA1 channels 2-3, USART1), SysTick (stall detection, software timers) and RTC
+ * The priorities of generated code are set in fyrtur-motor-board.ioc (and TICK_INT_PRIORITY). Variables shared
+ * between levels are written by only one of them or accessed with interrupts disabled (see motor_stop, motor_stopped,
+ * motor_hall_poll and motor_stall_check).
+ */
+#define IRQ_PRIORITY_HALL			0
+#define IRQ_PRIORITY_CONTROL		1
+#define IRQ_PRIORITY_ADC			2
+#define IRQ_PRIORITY_HOUSEKEEPING	3
+
+// Keep the location and tuning values in .noinit RAM over reset and skip the calibration after a warm restart
+// (see warmstate.h). HardFault resets the MCU instead of hanging
+#define WARM_RESTART_ENABLED
+
+/*
+ * LED patterns (blink count, on and off times) are queued and shown one after another by the LED software timer
+ * (see led_blink and LED_BLINK_ENABLED in feature_profile.h), so blinking never delays the main loop. Must be power of 2
+ */
+#define LED_PATTERN_QUEUE_SIZE 4
+
+/*
+ * Received packets are parsed when the USART receiver timeout fires UART_RX_TIMEOUT_BITS bit periods after the last
+ * stop bit, instead of waiting for the IDLE line interrupt (a whole idle frame: 4.2 ms at 2400 baud). The IDLE
+ * interrupt is kept as a fall-back. Both flags restart DMA_TIMEOUT_MS if a packet is still incomplete.
+ */
+#define UART_RX_TIMEOUT_ENABLED
+#define UART_RX_TIMEOUT_BITS  2
+
+/*
+ * Baud rate can be raised from the default 2400 (see CMD_EXT_SET_BAUD_RATE). Fall back to 2400 baud if 
+ * no valid packet is received during UART_BAUD_RATE_CONFIRM_TIMEOUT after the change, after UART_MAX_FRAMING_ERRORS 
+ * consecutive framing errors or when waking up from sleep mode
+ */
+#define UART_BAUD_RATE_COUNT  4
+#define UART_BAUD_RATE_CONFIRM_TIMEOUT  1000  // Milliseconds
+#define UART_MAX_FRAMING_ERRORS  3
+
+/*
+ * Multi-drop bus: the first header byte (0x00 in the original protocol) is used as the device address. Frames sent to
+ * our own address (see CMD_EXT_SET_DEVICE_ADDRESS) and broadcast frames (UART_BROADCAST_ADDRESS) are accepted and
+ * replies carry our address. Replies to broadcast frames are delayed by address * UART_REPLY_SLOT_BYTES byte times so
+ * that modules sharing the bus don't collide. While the address is set, TX pin is open-drain with pull-up (wired-AND
+ * bus) and error messages are sent only for frames with our address.
+ * Address 0x00 (default) works exactly like the original firmware.
+ */
+#define UART_BROADCAST_ADDRESS  0x00
+#define UART_REPLY_SLOT_BYTES   (UART_MAX_PACKET_SIZE + 8)
 
 // If this is set to 0, sleep mode is disabled. Debugging with sleep mode on is quite challenging..
+// Read from EEPROM instead if it's stored there (see READ_DEFAULT_IDLE_MODE_SLEEP_DELAY_FROM_EEPROM in feature_profile.h)
+#ifndef DEFAULT_IDLE_MODE_SLEEP_DELAY
 #define DEFAULT_IDLE_MODE_SLEEP_DELAY 3000 // Milliseconds. After this period of inactivity the sleep mode is entered
 //#define DEFAULT_IDLE_MODE_SLEEP_DELAY 0 // Milliseconds. After this period of inactivity the sleep mode is entered
-#define READ_DEFAULT_IDLE_MODE_SLEEP_DELAY_FROM_EEPROM  // Reads default from EEPROM if it's stored there. Otherwise use the value above
+#endif
+
+/*
+ * Adapt the sleep delay to the interval between received frames, so that a controller polling every few seconds
+ * doesn't make the module wake up (and lose the first byte) for every poll. Intervals longer than the configured sleep
+ * delay are averaged (weight 1/2^ADAPTIVE_SLEEP_SMOOTHING_SHIFT, time spent in Stop mode is measured with RTC). If the
+ * average is at most the maximum sleep delay (ParamMaxSleepDelay), the module stays awake for 5/4 of the average
+ * interval. Otherwise the commands are so rare that sleeping between them pays off and the configured delay is used.
+ */
+#define ADAPTIVE_SLEEP_DELAY_ENABLED
+#define DEFAULT_MAX_SLEEP_DELAY 30000	// Milliseconds. 0 = always use the configured delay
+#define ADAPTIVE_SLEEP_SMOOTHING_SHIFT 2
+
+/*
+ * Track passive movement (curtain pulled by hand) during Stop mode. Mode is set with CMD_EXT_SET_SLEEP_TRACKING:
+ *  SLEEP_TRACKING_OFF: Hall sensors are powered off during sleep (lowest current)
+ *  1..SLEEP_TRACKING_MAX_SHIFT: MCU is woken every 2^N / 320 seconds by RTC alarm (clocked by LSI), Hall sensors are
+ *    powered for SLEEP_TRACKING_POWER_UP_TIME and their state is compared against the state before sleeping.
+ *    If it has changed, the MCU stays awake and tracks the movement until idle again. Edges between the checks
+ *    can be missed if the rod is turned fast.
+ *  SLEEP_TRACKING_CONTINUOUS: Hall sensors are kept powered and any edge wakes up the MCU (no edges are missed,
+ *    but the sensor supply current is consumed during sleep)
+ */
+#define SLEEP_TRACKING_OFF 0
+#define SLEEP_TRACKING_MAX_SHIFT 10
+#define SLEEP_TRACKING_CONTINUOUS 0xff
+#define DEFAULT_SLEEP_TRACKING 5	// check every 100 ms
+#define SLEEP_TRACKING_POWER_UP_TIME 100	// Microseconds
 
-// For debugging.
-#define BLINK_LEDS_WHEN_SLEEP_MODE_CHANGES
-#define WAKE_UP_USING_BUTTON  
+/*
+ * Power the Hall sensors and the voltage sensor (PWR_EN) on demand also while awake: while the motor is starting,
+ * energized or coasting, until there have been no Hall sensor edges for SENSOR_POWER_IDLE_DELAY. In between they are
+ * powered every SENSOR_POWER_POLL_INTERVAL for SLEEP_TRACKING_POWER_UP_TIME and the Hall sensor state is compared like
+ * in sleep tracking (passive movement keeps them powered), and every SENSOR_POWER_VOLTAGE_INTERVAL for
+ * SENSOR_POWER_VOLTAGE_TIME to refresh the voltage reading. Otherwise the last voltage reading is kept.
+ * A move powers them up when it's requested, within the settling time before the motor is energized
+ * (MOTOR_SETTLE_MIN_TIME), so starting isn't delayed. With SLEEP_TRACKING_CONTINUOUS they are kept powered.
+ */
+#define SENSOR_POWER_GATING_ENABLED
+#define SENSOR_POWER_IDLE_DELAY 500	// Milliseconds
+#define SENSOR_POWER_POLL_INTERVAL 100	// Milliseconds
+#define SENSOR_POWER_VOLTAGE_INTERVAL 5000	// Milliseconds
+#define SENSOR_POWER_VOLTAGE_TIME 50	// Milliseconds. Enough for ADC_VOLTAGE_WINDOW halves with voltage samples
 
 /* USER CODE END Private defines */
 
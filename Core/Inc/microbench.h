@@ -0,0 +1,28 @@
+#include "main.h"
+
+/*
+ * On-target microbenchmarks of hot-path functions (see MICROBENCH_ENABLED in main.h). The selected kernel is called
+ * N times with interrupts disabled and the elapsed time is measured with the free running 1 us HALL_TIMER. Cortex-M0
+ * has no cycle counter, so the time of a single call is resolved by using a large N (at 8 MHz, 1 us = 8 cycles).
+ * The loop overhead, including the timer reads and the indirect call, is measured with MICROBENCH_EMPTY and should be
+ * subtracted from the other results.
+ *
+ * Kernels with side effects restore the modified state after the run: MICROBENCH_ADC_FILTER restores the filter
+ * window and the averages and MICROBENCH_UART_SEND rewinds the tx buffer after each call (it measures copying to the
+ * buffer while a DMA transfer is active, not the start of a new transfer).
+ */
+typedef enum microbench_kernel_t {
+    MICROBENCH_EMPTY = 0,
+    MICROBENCH_GET_RPM,             // get_rpm
+    MICROBENCH_POSITION,            // location_to_position100fp
+    MICROBENCH_BATTERY_LEVEL,       // get_battery_level
+    MICROBENCH_ADC_FILTER,          // adc_process_half
+    MICROBENCH_STATUS_QUERY,        // handle_command for CMD_GET_STATUS
+    MICROBENCH_UART_SEND,           // uart_send_msg with a status reply sized packet
+    MICROBENCH_KERNEL_COUNT
+} microbench_kernel_t;
+
+#define MICROBENCH_MAX_ITERATIONS_LOG2 10   // limits the time spent with interrupts disabled
+
+// Returns the elapsed time in microseconds, or 0 if the kernel is unknown
+uint32_t microbench_run(microbench_kernel_t kernel, uint16_t iterations);
@@ -27,14 +27,15 @@
 #define REVERSE_ORIENTATION	1	// Curtain is installed in reverse configuration (curtain rod is flipped to "front roll" configuration)
 
 // If != 0,  motor will be stopped if voltage drops below minimum voltage (in order to protect battery)
+// Defaults are read from EEPROM instead if they are stored there (see READ_DEFAULT_*_FROM_EEPROM in feature_profile.h)
 #define DEFAULT_MINIMUM_VOLTAGE (int)(6.7*(1<<MINIMUM_VOLTAGE_DECIMAL_BITS))
 //#define DEFAULT_MINIMUM_VOLTAGE 0	// voltage check is bypassed
-#define READ_DEFAULT_MINIMUM_VOLTAGE_FROM_EEPROM  // Reads default from EEPROM if it's stored there. Otherwise use the value above
 
 #define DEFAULT_FULL_CURTAIN_LEN GEAR_RATIO * (13 + 265.0/360) * 4
 
+#ifndef DEFAULT_TARGET_SPEED
 #define DEFAULT_TARGET_SPEED 18 // RPM
-#define READ_DEFAULT_SPEED_FROM_EEPROM  // Reads default speed from EEPROM if it's stored there. Otherwise use the value above
+#endif
 
 #define DEFAULT_AUTO_CAL_SETTING 1	// auto-calibration is enabled by default
 
@@ -46,8 +47,127 @@ at the top position. Note that this is upper limit is not enforced when starting
 */
 #define DEFAULT_MAX_MOTOR_CURRENT 2048 // in mA.  0 == DISABLED
 
+/*
+ * Fast overcurrent cutoff. The ADC analog watchdog checks every single conversion of the current channel (instead of
+ * the filtered average used by motor_stall_check) and its interrupt (at IRQ_PRIORITY_HALL) disables the TIM1 main
+ * output within microseconds. The trip is then handled like a fault: the motor is stopped and status is Error with
+ * last_error OvercurrentError until the next move command. The trip level must stay above the start-up current peaks.
+ */
+#define HW_OVERCURRENT_ENABLED
+#define OVERCURRENT_TRIP_CURRENT 4000 // in mA
+
+/*
+ * When stall_detection_timeout is 0, use STALL_DETECTION_INTERVALS times the Hall sensor #1 interval expected at
+ * target_speed (or the measured interval if the motor is running slower), limited to
+ * [MIN_STALL_DETECTION_TIMEOUT, MAX_STALL_DETECTION_TIMEOUT]. Stalls are then detected quickly at high speed without
+ * false alarms at low speed. A non-zero stall_detection_timeout is used as a fixed timeout as before.
+ */
+#define ADAPTIVE_STALL_DETECTION_ENABLED
+#define STALL_DETECTION_INTERVALS 8
+#define MIN_STALL_DETECTION_TIMEOUT 60 // Milliseconds
+#define MAX_STALL_DETECTION_TIMEOUT 800 // Milliseconds
+
 /* If no hall sensor interrupts are received during this time period, assume motor is stopped/stalled */
+#ifdef ADAPTIVE_STALL_DETECTION_ENABLED
+#define DEFAULT_STALL_DETECTION_TIMEOUT 0 // Adaptive
+#else
 #define DEFAULT_STALL_DETECTION_TIMEOUT 296 // Milliseconds.
+#endif
+
+/*
+ * Measure Hall sensor intervals with microsecond resolution by timestamping every edge of both sensors with
+ * free running HALL_TIMER (TIM14). RPM is then calculated over the last full motor revolution (4 edges) instead of
+ * counting milliseconds between HALL #1 interrupts. If disabled (or when the motor is turning so slowly that the
+ * 16-bit timer would overflow between edges), the millisecond counter is used instead.
+ */
+#define HALL_TIMESTAMPS_ENABLED
+
+#define HALL_STATE_SENSOR_1 2
+#define HALL_STATE_SENSOR_2 1
+#define HALL_STEP_INVALID 2	// marks a transition where both sensors changed state at once
+
+/*
+ * Account for missed Hall sensor edges and for location drift caused by direction reversals:
+ * - When both sensors change at once (an edge was missed) while the motor is driven, the location is advanced by
+ *   two steps in the motor direction instead of being left unchanged.
+ * - Direction reversals are counted between endpoint calibrations. When the top position is calibrated again,
+ *   the location error found there is divided by the number of downward reversals and merged into a correction
+ *   (weight 1/2^BACKLASH_SMOOTHING_SHIFT) that is subtracted from the location at every reversal to Down.
+ * Correction is in Hall sensor ticks with BACKLASH_DECIMAL_BITS of precision and it's kept in RAM only.
+ */
+#define BACKLASH_COMPENSATION_ENABLED
+#define BACKLASH_DECIMAL_BITS 4
+#define BACKLASH_SMOOTHING_SHIFT 1
+#define MAX_BACKLASH_CORRECTION (4 << BACKLASH_DECIMAL_BITS)
+#define MAX_CALIBRATION_DRIFT 64	// Ticks. Larger errors are assumed to be caused by something else than reversals
+
+#define HALL_EDGES_PER_REVOLUTION 4	// both sensors, rising and falling edges
+#define HALL_TIMER_MAX_INTERVAL 60	// Milliseconds. Longer intervals between edges can't be measured with 16-bit microsecond timer
+
+/*
+ * Hall sensor health monitoring: while the motor is driven, the edges of the two sensors must alternate. If one sensor
+ * changes HALL_HEALTH_MAX_SINGLE_EDGES times in a row without an edge from the other, the other sensor has failed (its
+ * edges alone would only step the location back and forth). The firmware then switches to a degraded single-sensor mode
+ * until reset: every edge of the working sensor moves the location by two ticks in the motor direction (or in the
+ * direction of the latest move while the rod coasts) and the speed is measured from its edges. The edges missed before
+ * the failure was detected are counted again. The failure is logged (EVENTLOG_HALL_SENSOR_FAILED) and can be read with
+ * protocol v2 parameter ParamHallSensorFailed.
+ */
+#define HALL_HEALTH_MONITORING_ENABLED
+#define HALL_HEALTH_MAX_SINGLE_EDGES 8
+
+/*
+ * When changing direction, the motor is first braked by shorting the windings via both low-side mosfets for MOTOR_BRAKE_TIME.
+ * Then (also when starting from standstill) we wait until there has been no Hall sensor ticks for MOTOR_SETTLE_QUIET_TIME,
+ * but at least MOTOR_SETTLE_MIN_TIME and at most MOTOR_SETTLE_MAX_TIME, before the motor is energized again.
+ */
+#define MOTOR_ACTIVE_BRAKING_ENABLED
+#define MOTOR_BRAKE_TIME 50	// Milliseconds
+#define MOTOR_SETTLE_MIN_TIME 10	// Milliseconds
+#define MOTOR_SETTLE_QUIET_TIME 50	// Milliseconds
+#define MOTOR_SETTLE_MAX_TIME 500	// Milliseconds
+
+/*
+ * Predict how many Hall sensor ticks the curtain rod coasts after the motor is de-energized and cut the power that much
+ * earlier so that the movement ends at target_location. Coast distance is modelled as proportional to the speed at
+ * the moment of stopping and the gain (ticks per RPM with COAST_GAIN_DECIMAL_BITS of precision) is learned separately
+ * for both directions from the ticks received until the rod has been still for COAST_SETTLE_TIME.
+ * New samples have weight 1/2^COAST_GAIN_SMOOTHING_SHIFT. Learned gains are kept in RAM only.
+ */
+#define COAST_PREDICTION_ENABLED
+#define COAST_GAIN_DECIMAL_BITS 8
+#define COAST_GAIN_SMOOTHING_SHIFT 2
+#define COAST_SETTLE_TIME 200	// Milliseconds
+#define MAX_COAST_TICKS 16
+
+/*
+ * Interpolate the location between Hall sensor edges from the time since the latest edge and the average edge interval
+ * (see get_interpolated_location). The control tick then stops the motor as soon as the interpolated location reaches
+ * the stop point instead of waiting for the next edge, which at 3 RPM is about 30 milliseconds away.
+ * Requires HALL_TIMESTAMPS_ENABLED
+ */
+#define SUBTICK_INTERPOLATION_ENABLED
+#define LOCATION_FRACTION_BITS 8
+
+#if defined(SUBTICK_INTERPOLATION_ENABLED) && !defined(HALL_TIMESTAMPS_ENABLED)
+#error "SUBTICK_INTERPOLATION_ENABLED requires HALL_TIMESTAMPS_ENABLED"
+#endif
+
+/*
+ * Speed observer for the speed controller. On every control tick the estimate follows the back-EMF speed
+ * (supply voltage * duty cycle - current * MOTOR_RESISTANCE) / MOTOR_KE plus a learned offset, and every new Hall sensor
+ * edge corrects it towards the measured speed (weight 1/2^OBSERVER_ALPHA_SHIFT) and updates the offset between the
+ * model and the measurement (weight 1/2^OBSERVER_BETA_SHIFT). This way the controller sees the motor bogging down before
+ * the next edge arrives. The estimate is used only once the Hall sensor speed is known, and it's never above the speed
+ * allowed by the time since the latest edge (see get_controller_rpm)
+ */
+#define SPEED_OBSERVER_ENABLED
+#define MOTOR_RESISTANCE 4000	// armature resistance in milliohms
+#define MOTOR_KE 188	// back-EMF in millivolts per curtain rod RPM
+#define OBSERVER_EXTRA_BITS 4	// precision on top of RPM_DECIMAL_BITS
+#define OBSERVER_MODEL_SHIFT 1
+#define OBSERVER_ALPHA_SHIFT 1
+#define OBSERVER_BETA_SHIFT 3
 
 /* If motor has been just energized, we will allow longer timeout period before stall detection is applied */
 #define HALL_SENSOR_TIMEOUT_WHILE_STARTING 1000 // Milliseconds
@@ -63,6 +183,27 @@ at the top position. Note that this is upper limit is not enforced when starting
  */
 #define ENDPOINT_CALIBRATION_PERIOD 400 // Milliseconds
 
+/*
+ * Endpoint calibration is finished early if there hasn't been any Hall sensor ticks (the rod has stopped rotating backwards)
+ * during this time period
+ */
+#define ENDPOINT_SETTLE_TIME 100 // Milliseconds
+
+/*
+ * Detect hitting the top position early (instead of waiting for the stall detection timeout) when motor current has risen
+ * more than ENDPOINT_CURRENT_RISE during the last ENDPOINT_SLOPE_SAMPLES * ENDPOINT_SLOPE_SAMPLE_PERIOD milliseconds
+ * and Hall sensor #1 interval has at least doubled (and is longer than ENDPOINT_MINIMUM_IDLE_TIME).
+ * Current must also exceed MINIMUM_CALIBRATION_CURRENT. A stiff spot in the curtain looks the same, so the detection is
+ * used only while calibrating (location unknown) or within ENDPOINT_DETECTION_MARGIN of the top position.
+ */
+#define EARLY_ENDPOINT_DETECTION_ENABLED
+#define ENDPOINT_SLOPE_SAMPLES 8	// Must be power of 2
+#define ENDPOINT_SLOPE_SAMPLE_PERIOD 4	// Milliseconds
+#define ENDPOINT_CURRENT_RISE 200	// mA
+#define ENDPOINT_MINIMUM_IDLE_TIME 20	// Milliseconds
+#define ENDPOINT_DETECTION_GRACE_PERIOD 200	// Milliseconds. Inrush current is ignored right after starting
+#define ENDPOINT_DETECTION_MARGIN DEG_TO_LOCATION(360)	// Hall sensor ticks. Allows for the drift of the location
+
 /* 
  * The minimum motor current (high enough resistance) which is needed to signal that the motor has indeed stalled
  * at the upmost position. If motor has stalled with a current below this value, it would suggest that during low speed 
@@ -84,9 +225,253 @@ at the top position. Note that this is upper limit is not enforced when starting
 #define DEFAULT_MINIMUM_SLOWDOWN_SPEED 5
 #define DEFAULT_SLOWDOWN_FACTOR 48
 
-/* the motor driver gate PWM duty cycle is initially 60/255 when first energized and then adjusted according to target_speed */
-#define INITIAL_PWM 60
-#define INITIAL_PWM_FOR_DANCE_STEP 100
+/*
+ * Separate tuning for moving down, which the curtain weight helps: slowdown factor, minimum slowdown speed and initial PWM
+ * (the Up values are the ones above). The 0.25 RPM speed bump after a low-current stall is also learned per direction
+ * on top of the default speed instead of raising the default speed itself. Learned bumps are kept in RAM only.
+ */
+#define DIRECTIONAL_TUNING_ENABLED
+#define DEFAULT_MINIMUM_SLOWDOWN_SPEED_DOWN 5
+#define DEFAULT_SLOWDOWN_FACTOR_DOWN 48
+#define MAX_SPEED_BUMP (4 << RPM_DECIMAL_BITS)	// at most 4 RPM above the default speed
+
+/*
+ * Stall recovery: a move interrupted by a low-current stall is retried with the start PWM STALL_RETRY_PWM_BOOST above
+ * the PWM at the moment of stalling. Stalls are counted per direction in STALL_RECOVERY_BINS location bins and the
+ * speed of that direction is bumped by 0.25 RPM only after STALL_ESCALATION_COUNT stalls in the same bin.
+ * Every SPEED_BUMP_DECAY_MOVES moves reaching their target the bump of that direction is decreased by 0.25 RPM and
+ * the stall counts are halved. Requires DIRECTIONAL_TUNING_ENABLED
+ */
+#define STALL_RECOVERY_ENABLED
+#define STALL_RECOVERY_BINS 16
+#define STALL_ESCALATION_COUNT 2
+#define STALL_RETRY_PWM_BOOST PWM_DUTY(20)
+#define SPEED_BUMP_DECAY_MOVES 32
+
+#if defined(STALL_RECOVERY_ENABLED) && !defined(DIRECTIONAL_TUNING_ENABLED)
+#error "STALL_RECOVERY_ENABLED requires DIRECTIONAL_TUNING_ENABLED"
+#endif
+
+/* Number of entries in the precomputed slowdown (speed vs. distance to target) profile */
+#define MOTION_PROFILE_BINS 32
+
+/* Resolution of the estimated time to target reported in CMD_EXT_GET_STATUS (0xff = ETA_UNIT * 255 or more) */
+#define ETA_UNIT 250	// Milliseconds
+
+/*
+ * When a new target in the same direction is received during movement, keep moving and just rebuild the slowdown
+ * profile instead of stopping and restarting the motor. Cruise speed changes during movement (new target or
+ * CMD_EXT_SET_SPEED) are ramped by 0.25 RPM every SPEED_RAMP_INTERVAL milliseconds.
+ */
+#define LIVE_RETARGETING_ENABLED
+#define SPEED_RAMP_INTERVAL 4	// Milliseconds
+
+/*
+ * Move commands received while slowing down or calibrating the end point are staged instead of deferring them (which
+ * would hold up the command queue): the current move finishes at its own target and the staged move (its target, the
+ * direction is chosen when it starts) is taken over as soon as the motor has stopped. A newer move replaces the staged
+ * one and any other motor command (e.g. CMD_STOP) cancels it. Go-to commands received during calibration are staged too
+ * and started after the calibration (instead of being ignored). Staged moves run at the default speed.
+ */
+#define MOVE_PIPELINING_ENABLED
+
+/*
+ * Speed zones along the travel, e.g. fast through the middle, slow for the last 5% near the window sill and a gentle
+ * approach to the top stall. Zone N is set with parameter ParamSpeedZone0+N as (END << 8) | SPEED: it starts where the
+ * previous zone ends and covers positions below END (percent of max curtain length) at SPEED (RPM with RPM_DECIMAL_BITS,
+ * 0 = default speed). END 0 disables the zone and positions after the last zone are travelled at default speed.
+ * Zones are used by moves started with the up/down/go-to commands (not while calibrating or after the speed has been
+ * changed during the move) and speed changes at the zone boundaries are ramped (see LIVE_RETARGETING_ENABLED).
+ * The slowdown profile is built for the speed of the zone of the target. Not stored to flash memory.
+ */
+#define SPEED_ZONES_ENABLED
+#define SPEED_ZONE_COUNT 4
+
+#if SPEED_ZONE_COUNT > 4
+#error "warmstate_t holds at most 4 speed zones"
+#endif
+
+/*
+ * the motor driver gate PWM duty cycle is initially 60/255 when first energized and then adjusted according to target_speed.
+ * PWM values are in TIM1 compare units (see PWM_DUTY and PWM_EXTRA_BITS in main.h)
+ */
+#define INITIAL_PWM PWM_DUTY(60)
+#define INITIAL_PWM_DOWN PWM_DUTY(50)	// see DIRECTIONAL_TUNING_ENABLED
+#define INITIAL_PWM_FOR_DANCE_STEP PWM_DUTY(100)
+
+/*
+ * Soft start: while accelerating, the speed controller output is limited by a PWM ceiling that is regulated by the motor
+ * current. The ceiling starts from the initial PWM and is changed every control period by the difference between
+ * start current limit and motor current (in mA) divided by 2^SOFT_START_GAIN_SHIFT (in TIM1 compare units, scaled by
+ * the control period). This avoids inrush current that could brown out a weak power supply, while a strong supply
+ * still gets the full acceleration of the speed controller. When target_speed is reached, the speed controller takes
+ * over. The limit can be changed with protocol v2 parameter ParamStartCurrentLimit (0 = disabled). Dance steps aren't
+ * limited.
+ */
+#define SOFT_START_ENABLED
+#define DEFAULT_START_CURRENT_LIMIT 1000	// mA
+#define SOFT_START_GAIN_SHIFT 2
+
+/*
+ * Brown-out ride-through: when the supply voltage sags below BROWNOUT_LIMIT_VOLTAGE while the motor is energized (e.g.
+ * a weak adapter during a high-current phase), the speed controller output is limited so that the MCU isn't reset in
+ * the middle of the move. The limit starts from the current PWM and it's lowered every control period by the voltage
+ * deficit divided by 2^BROWNOUT_GAIN_SHIFT (in TIM1 compare units, scaled by the control period). When the voltage has
+ * recovered above BROWNOUT_RECOVERY_VOLTAGE the limit is raised by BROWNOUT_RECOVERY_STEP per control period until it's
+ * released. The move continues more slowly instead of failing. Each sag is logged (EVENTLOG_BROWNOUT).
+ * The lowest limit is remembered and the following moves start with at most that PWM (the voltage reading is too slow
+ * to catch the inrush of the first control period). The start limit is relaxed by BROWNOUT_START_RELAX_STEP per move.
+ * Voltages are in get_voltage() units (Volts * 30 * 16).
+ */
+#define BROWNOUT_RIDE_THROUGH_ENABLED
+#define BROWNOUT_LIMIT_VOLTAGE (uint16_t)(4.5*30*16)
+#define BROWNOUT_RECOVERY_VOLTAGE (uint16_t)(4.8*30*16)
+#define BROWNOUT_GAIN_SHIFT 0
+#define BROWNOUT_RECOVERY_STEP PWM_DUTY(2)
+#define BROWNOUT_START_RELAX_STEP PWM_DUTY(4)
+
+/*
+ * Thermal protection: the temperature rise of the motor is estimated from the motor current (see thermal.h). Above
+ * THERMAL_DERATE_RISE the cruise speed is scaled down linearly to THERMAL_MIN_SPEED_SCALE / 256 at THERMAL_LIMIT_RISE
+ * and dance steps are started with soft start, which reduces the friction losses and the start inrush. At
+ * THERMAL_LIMIT_RISE the move in progress is finished, but new moves wait until the estimate has cooled down to
+ * THERMAL_RESUME_RISE (logged as EVENTLOG_OVERHEAT). Normal use doesn't come near the limits, so only sustained duty
+ * (e.g. a controller repeating moves in a loop or long dance sequences) is affected. The estimate can be read with
+ * protocol v2 parameter ParamMotorTemperatureRise. Temperatures are in °C above ambient.
+ */
+#define THERMAL_PROTECTION_ENABLED
+#define THERMAL_DERATE_RISE 50
+#define THERMAL_LIMIT_RISE 70
+#define THERMAL_RESUME_RISE 60
+#define THERMAL_MIN_SPEED_SCALE 128
+
+/* PWM duty cycle limits used by the speed controller */
+#define MIN_PWM 1
+#define MAX_PWM PWM_DUTY(254)
+
+/*
+ * Dynamic braking: when the speed controller output drops below zero (the curtain drives the motor faster than
+ * target_speed, e.g. when lowering a heavy curtain) the high-side mosfet is turned off and both low-side mosfets are
+ * switched with the negated output, up to MAX_BRAKE_PWM. Between 0 and MIN_PWM the motor is driven with MIN_PWM.
+ * When the target is reached the windings are shorted for STOP_BRAKE_TIME instead of letting the rod coast freely.
+ */
+#define DYNAMIC_BRAKING_ENABLED
+#define MAX_BRAKE_PWM PWM_DUTY(128)
+#define STOP_BRAKE_TIME 50	// Milliseconds
+
+/*
+ * Speed controller output has PWM_DITHER_BITS of fractional precision which are spread across PWM periods by
+ * first-order sigma-delta modulation in TIM1 update interrupt. This gives finer effective duty cycle at very low speeds
+ * without changing the PWM frequency, at the cost of one interrupt per PWM period while moving.
+ */
+//#define PWM_DITHERING_ENABLED
+
+#ifdef PWM_DITHERING_ENABLED
+#define PWM_DITHER_BITS 4
+#else
+#define PWM_DITHER_BITS 0
+#endif
+
+/*
+ * Speed controller parameters. The controller is a PI controller with feed-forward from target speed and it's
+ * run every control_period milliseconds by TIM3. Gains are stored with PI_GAIN_DECIMAL_BITS of decimal precision and they
+ * are applied to speed error (RPM with RPM_DECIMAL_BITS of decimal precision) in order to get PWM duty cycle.
+ * Integral gain is given per CONTROL_REFERENCE_PERIOD and it's scaled according to the actual control period.
+ *
+ * Feed-forward PWM is PWM_FF_OFFSET + target_speed * pwm_ff_gain, so that the integral term needs to cover only
+ * the difference caused by friction and the load. Gains can be tuned via UART (CMD_EXT_SET_PI_KP, CMD_EXT_SET_PI_KI
+ * and CMD_EXT_SET_PWM_FF_GAIN) but they are not stored to flash memory.
+ */
+#define PI_GAIN_DECIMAL_BITS 4
+#define DEFAULT_PI_KP PWM_DUTY(24)	// 1.5 (8-bit) PWM steps per 0.25 RPM error
+#define DEFAULT_PI_KI PWM_DUTY(3)		// 0.19 (8-bit) PWM steps per 0.25 RPM error per 10ms
+#define DEFAULT_CONTROL_PERIOD 10	// Milliseconds
+#define MIN_CONTROL_PERIOD 1
+#define MAX_CONTROL_PERIOD 20
+#define CONTROL_REFERENCE_PERIOD 10
+#define CONTROL_SAMPLE_PERIOD 10	// Controller state is sampled for telemetry at this interval (milliseconds) regardless of the control period
+#define DEFAULT_PWM_FF_GAIN PWM_DUTY(16)	// 1 (8-bit) PWM step per 0.25 RPM
+#define PWM_FF_OFFSET PWM_DUTY(40)
+
+/*
+ * Feed-forward and initial PWM are given for PWM_FF_REFERENCE_VOLTAGE and scaled by the measured supply voltage, so that
+ * a target speed maps to roughly the same average motor voltage on any supply (e.g. 5V adapter vs. 8.4V battery).
+ * Voltage readings below PWM_FF_MINIMUM_VOLTAGE are clamped. Both are in get_voltage() units (Volts * 30 * 16).
+ */
+#define VOLTAGE_FEED_FORWARD_ENABLED
+#define PWM_FF_REFERENCE_VOLTAGE (uint16_t)(8.4*30*16)
+#define PWM_FF_MINIMUM_VOLTAGE (uint16_t)(4.0*30*16)
+
+/*
+ * Learn the PWM duty cycle at which the first Hall sensor tick arrives after starting (breakaway PWM) separately for
+ * both directions. Samples are normalized to PWM_FF_REFERENCE_VOLTAGE, smoothed (new sample has weight
+ * 1/2^BREAKAWAY_PWM_SMOOTHING_SHIFT) and stored to EEPROM. The next movement then starts BREAKAWAY_PWM_MARGIN below
+ * the estimate instead of INITIAL_PWM. Estimate is in 8-bit PWM steps with BREAKAWAY_PWM_DECIMAL_BITS of precision and
+ * it's written to EEPROM only when it has changed by at least BREAKAWAY_PWM_WRITE_THRESHOLD steps (to save flash wear).
+ */
+#define BREAKAWAY_PWM_LEARNING_ENABLED
+#define BREAKAWAY_PWM_DECIMAL_BITS 4
+#define BREAKAWAY_PWM_SMOOTHING_SHIFT 2
+#define BREAKAWAY_PWM_MARGIN 4
+#define BREAKAWAY_PWM_WRITE_THRESHOLD 2
+#define MIN_BREAKAWAY_PWM 10	// samples outside this range (8-bit PWM steps) are ignored
+#define MAX_BREAKAWAY_PWM 200
+
+/*
+ * Position-indexed load map: the PWM needed on top of the feed-forward estimate is learned for each of LOAD_MAP_BINS
+ * bins over max_curtain_length, separately for both directions, and fed forward by the speed controller so that it
+ * anticipates load changes along the travel (curtain mass on the rod, bottom bar, friction spots).
+ * During a movement the integral term is averaged per bin (excluding LOAD_MAP_SETTLE_TIME after start, slowing down
+ * and saturated output) and merged into the map with weight 1/2^LOAD_MAP_SMOOTHING_SHIFT only after the movement
+ * has reached its target. Values are 8-bit PWM steps at PWM_FF_REFERENCE_VOLTAGE and they are kept in RAM only.
+ */
+#define LOAD_MAP_ENABLED
+#define LOAD_MAP_BINS 32	// max 32
+#define LOAD_MAP_SMOOTHING_SHIFT 1
+#define LOAD_MAP_SETTLE_TIME 500	// milliseconds
+
+/*
+ * On-device tuning (CMD_EXT_AUTOTUNE): the motor is driven open loop with AUTOTUNE_PWM_LOW for AUTOTUNE_STEP_TIME and
+ * then stepped to AUTOTUNE_PWM_HIGH for another AUTOTUNE_STEP_TIME (both at PWM_FF_REFERENCE_VOLTAGE). The motor gain
+ * (RPM per PWM step) is the change of the speeds averaged over the last AUTOTUNE_AVERAGE_TIME of the steps, and the time
+ * constant is the time the speed takes to cover 63% of the change (minus the delay of the revolution averaging).
+ * From these:
+ * - PI gains by lambda tuning with the closed loop time constant AUTOTUNE_LAMBDA_RATIO times the motor time constant
+ * - feed-forward gain so that the feed-forward PWM matches the high step
+ * - slowdown factor so that slowing down from any speed takes AUTOTUNE_SLOWDOWN_TAUS time constants
+ * - minimum approach speed from the speed of the low step, which the motor has been seen to sustain
+ * Slowdown parameters are set for the direction of the tuning move (away from the nearer end of the curtain), and all
+ * results are stored to flash memory. The move is aborted by any other movement command.
+ */
+#define AUTOTUNE_ENABLED
+#define AUTOTUNE_PWM_LOW PWM_DUTY(60)
+#define AUTOTUNE_PWM_HIGH PWM_DUTY(100)
+#define AUTOTUNE_SPEED 5	// RPM. Only used for the stall detection timeout
+#define AUTOTUNE_STEP_TIME 1500	// Milliseconds
+#define AUTOTUNE_AVERAGE_TIME 500	// Milliseconds
+#define AUTOTUNE_MAX_TRAVEL DEG_TO_LOCATION(360*2)
+#define AUTOTUNE_LAMBDA_RATIO 1
+#define AUTOTUNE_SLOWDOWN_TAUS 4
+#define AUTOTUNE_MIN_SLOWDOWN_FACTOR 16
+
+typedef enum autotune_result_t {
+	AutotuneNone,
+	AutotuneRunning,
+	AutotuneDone,
+	AutotuneAborted,	// motor was stopped (or stalled) during the tuning move, or the location wasn't known
+	AutotuneFailed		// motor didn't turn or speed didn't increase with the PWM step
+} autotune_result_t;
+
+typedef enum autotune_phase_t {
+	AutotuneIdle,
+	AutotuneLowStep,
+	AutotuneHighStep,
+	AutotuneMeasured	// motor has been stopped and the results are computed in the main loop
+} autotune_phase_t;
+
+#if PWM_DITHER_BITS > PI_GAIN_DECIMAL_BITS
+#error "PWM_DITHER_BITS cannot exceed PI_GAIN_DECIMAL_BITS"
+#endif
 
 /*
  * "Dance" is a series of movement steps (up or down) that the firmware uses to signal the user that it has acknowleged
@@ -94,19 +479,151 @@ at the top position. Note that this is upper limit is not enforced when starting
  */
 #define DANCE_STEP_SPEED 25
 
+/*
+ * Motion script is a ring buffer of move steps executed one after another from motor_process(). Each step moves
+ * to the target location (Hall sensor ticks) with the given speed (RPM with 2 decimal bits, 0 = default speed) and
+ * then waits for the dwell time (x100 ms) before the next step. Dance steps are relative 90 degree moves.
+ * A script can be loaded over UART in one batch (see V2_OP_LOAD_SCRIPT). Any other movement command aborts it.
+ */
+#define MOTION_SCRIPT_SIZE 8	// must be a power of 2. One slot is kept free
+
+#define MOTION_STEP_RELATIVE_UP		0x01
+#define MOTION_STEP_RELATIVE_DOWN	0x02
+#define MOTION_STEP_FAST			0x04	// use DANCE_STEP_SPEED without slowdown
+
+typedef struct motion_step_t {
+	int16_t location;
+	uint8_t speed;
+	uint8_t dwell;
+	uint8_t flags;
+} motion_step_t;
+
+/*
+ * Sunrise mode: the motor can't sustain very low speeds continuously, so a slow move is split into short bursts of
+ * SUNRISE_BURST_LENGTH Hall sensor ticks driven at SUNRISE_BURST_SPEED and spread evenly over the requested duration.
+ * Duration (in minutes) is set with CMD_EXT_SET_SUNRISE_DURATION and applied to the next go-to command.
+ * The module doesn't enter sleep mode during the pauses.
+ */
+#define SUNRISE_BURST_SPEED 5	// RPM
+#define SUNRISE_BURST_LENGTH 32	// Hall sensor ticks
+
+/*
+ * Group move: after CMD_EXT_ARM_GROUP_MOVE the next go-to command only arms the target. The move is started by
+ * CMD_EXT_GROUP_GO (usually broadcast to all modules on a multi-drop bus), which energizes the motor exactly
+ * GROUP_START_DELAY after the command was received, independent of main loop latency. If travel time is given,
+ * speed is chosen from the distance to target so that all modules arrive at the same time (within speed limits).
+ * The module stays awake while armed, at most GROUP_ARM_TIMEOUT.
+ */
+#define GROUP_START_DELAY 20	// Milliseconds. Must be more than MOTOR_SETTLE_MIN_TIME
+#define GROUP_ARM_TIMEOUT 60000	// Milliseconds
+
+/*
+ * Move metering: energy (voltage * motor current, sampled every millisecond), energized time, peak current and
+ * Hall sensor ticks of the last MOVE_LOG_SIZE moves are kept in RAM and returned by CMD_EXT_GET_MOVE_LOG
+ */
+#define MOVE_LOG_SIZE 4	// must be a power of 2. All records must fit in one reply (UART_MAX_PACKET_SIZE)
+
+/*
+ * Motion trace for offline tuning: every control period (see CMD_EXT_SET_CONTROL_PERIOD) of a move the time since
+ * start, location, Hall sensor interval, PWM, current and voltage are recorded to a RAM buffer of MOTION_TRACE_SIZE
+ * samples. When the buffer gets full, every other sample is dropped and the sample interval is doubled, so the buffer
+ * always covers the whole move. The trace of the latest move is downloaded with CMD_EXT_GET_TRACE.
+ * Each sample takes 10 bytes of RAM so the feature is disabled by default.
+ */
+#define MOTION_TRACE_SIZE 32	// must be even
+#define MOTION_TRACE_SAMPLES_PER_CHUNK 3	// samples per CMD_EXT_GET_TRACE reply
+
+typedef struct trace_sample_t {
+	uint16_t time;			// milliseconds since the motor was started
+	int16_t location;
+	uint16_t hall_interval;	// milliseconds between Hall sensor #1 ticks
+	uint16_t pwm;
+	uint8_t current;		// mA / 16
+	uint8_t voltage;		// Volts * 30
+} trace_sample_t;
+
+#define MOVE_RECORD_DOWN		0x01	// direction of the move. Upper nibble of the flags is the status after the move
+
+typedef struct move_record_t {
+	uint16_t energy;		// x10 mJ
+	uint16_t duration;		// x10 ms
+	uint16_t ticks;			// Hall sensor #1 ticks
+	uint8_t peak_current;	// mA / 16
+	uint8_t speed;			// target RPM with 2 bits of decimal precision
+	uint8_t flags;
+} move_record_t;
+
+/*
+ * Snapshot of the motor state returned by the status queries. Published by the main loop (motor_publish_state) and
+ * read from UART interrupt (motor_read_state, motor_read_reply), so that a reply never mixes values from before and
+ * after a Hall tick. The status replies are kept ready-made (command byte and payload) so that the interrupt only
+ * has to copy them; device address and checksum are added by uart_finish_reply as for every other reply
+ */
+#define STATUS_REPLY_SIZE 5
+#define EXT_STATUS_REPLY_SIZE 8
+
+typedef struct motor_state_t {
+	int32_t location;
+	int32_t target_location;
+	uint32_t hall_sensor_1_ticks;
+	uint32_t hall_sensor_2_ticks;
+	uint8_t status_reply[STATUS_REPLY_SIZE];			// CMD_GET_STATUS: 0xd8, battery, voltage, speed, position
+	uint8_t ext_status_reply[EXT_STATUS_REPLY_SIZE];	// CMD_EXT_GET_STATUS: 0xda followed by query_ext_status payload
+} motor_state_t;
+
 /*
  * Flexi-speed is a mechanism to change the motor speed setting even when using the custom firmware 
  * with original Ikea Fyrtur Zigbee module. There are 4 different speed settings (3, 5, 15 and 25 RPM). User can
  * cycle between them by repeatedly rolling the blinds up (CMD_UP command) 3 times. Firmware then selects the next speed 
  * in the preset list and will signal the user by doing a little "down/up dance" curtain movement.
  */
-#define FLEXISPEED_ENABLED
-
 /*
  * The number of repeated CMD_UP commands before we cycle to next speed preset setting
  */
 #define FLEXISPEED_TRIGGER_LIMIT 3
 
+/*
+ * Changed non-volatile settings are committed to flash memory after the motor has been idle for this period
+ */
+#define EEPROM_COMMIT_DELAY 1000 // Milliseconds
+
+/*
+ * Journal the curtain location and orientation (as well as stall counters and lowest voltage) to the flash log (see
+ * flashlog.h) whenever the motor has stopped, so that the position can be restored after power loss. The record is
+ * invalidated before every movement and the location is restored on boot only if the record is valid and its orientation
+ * matches. If the record is missing or inconsistent, auto-calibration is done as usual (see CMD_EXT_SET_AUTO_CAL).
+ */
+#define LOCATION_JOURNAL_DELAY 500 // Location must be unchanged this long (milliseconds) after stopping before it's journaled
+
+/*
+ * Lifetime totals (curtain rod revolutions, motor-on time, endpoint calibrations, stalls per direction and flash page
+ * erases) for predictive maintenance. They are stored in the flash log records together with the location journal,
+ * or after LIFETIME_STATS_DELAY of idle time (and before entering sleep mode) when the journal is disabled.
+ * Returned by CMD_EXT_GET_LIFETIME_STATS and never cleared.
+ */
+#define LIFETIME_STATS_DELAY 10000 // Milliseconds
+
+#if defined(LOCATION_JOURNAL_ENABLED) || defined(LIFETIME_STATS_ENABLED)
+#define FLASHLOG_ENABLED
+#endif
+
+/*
+ * Telemetry frames are pushed at most every TELEMETRY_MIN_INTERVAL milliseconds (see CMD_EXT_SUBSCRIBE)
+ */
+#define TELEMETRY_MIN_INTERVAL 50
+
+/*
+ * Commands received via UART are queued and executed in the main loop. Must be power of 2
+ */
+#define COMMAND_QUEUE_SIZE 8
+
+/*
+ * CMD_STOP (also when wrapped in a protocol v2 frame) de-energizes the motor already in the UART interrupt, so that the
+ * stop latency doesn't depend on what the main loop is doing. The command is queued as usual and the rest of the
+ * book-keeping (aborting scripts, deferred commands etc.) is done when it's executed in the main loop
+ */
+#define FAST_STOP_ENABLED
+
 
 typedef enum motor_status_t {
 	Stopped,
@@ -120,7 +637,8 @@ typedef enum motor_status_t {
 
 typedef enum motor_error_t {
 	NoError = 0,
-	SensorError
+	SensorError,
+	OvercurrentError
 } motor_error_t;
 
 typedef enum motor_direction_t {
@@ -129,16 +647,87 @@ typedef enum motor_direction_t {
 	Down
 } motor_direction_t;
 
+typedef enum motor_start_phase_t {
+	StartIdle,
+	StartBraking,
+	StartSettling
+} motor_start_phase_t;
+
+/*
+ * Parameters which can be set and read with full resolution (see motor_set_parameter and protocol v2)
+ */
+typedef enum motor_parameter_t {
+	ParamSpeed = 1,				// RPM with RPM_DECIMAL_BITS of precision. Not stored to flash memory
+	ParamDefaultSpeed,			// RPM with RPM_DECIMAL_BITS of precision
+	ParamMinimumVoltage,		// Volts with MINIMUM_VOLTAGE_DECIMAL_BITS of precision
+	ParamMaxMotorCurrent,		// mA
+	ParamStallDetectionTimeout,	// Milliseconds
+	ParamSleepDelay,			// Milliseconds
+	ParamSlowdownFactor,
+	ParamMinSlowdownSpeed,		// RPM with RPM_DECIMAL_BITS of precision
+	ParamPiKp,
+	ParamPiKi,
+	ParamPwmFfGain,
+	ParamAutoCalibration,
+	ParamOrientation,
+	ParamLocation,				// Hall sensor ticks
+	ParamMaxCurtainLength,		// Hall sensor ticks
+	ParamFullCurtainLength,		// Hall sensor ticks
+	ParamControlPeriod,			// Milliseconds. Not stored to flash memory
+	ParamSleepTracking,			// See SLEEP_TRACKING_ENABLED. Not stored to flash memory
+	ParamSunriseDuration,		// Minutes. Applied to the next go-to command only. Not stored to flash memory
+	ParamDeviceAddress,			// See MULTIDROP_BUS_ENABLED in main.h
+	ParamEta,					// Estimated time to target (x100 ms). Read only
+	ParamSlowdownFactorDown,	// See DIRECTIONAL_TUNING_ENABLED. Not stored to flash memory
+	ParamMinSlowdownSpeedDown,	// RPM with RPM_DECIMAL_BITS of precision. Not stored to flash memory
+	ParamSpeedBumpUp,			// Learned speed bump, RPM with RPM_DECIMAL_BITS of precision. Not stored to flash memory
+	ParamSpeedBumpDown,
+	ParamSpeedZone0,			// See SPEED_ZONES_ENABLED. Not stored to flash memory
+	ParamSpeedZone1,
+	ParamSpeedZone2,
+	ParamSpeedZone3,
+	ParamMaxSleepDelay,			// Milliseconds. See ADAPTIVE_SLEEP_DELAY_ENABLED in main.h. Not stored to flash memory
+	ParamActiveSleepDelay,		// Milliseconds. Sleep delay currently in use. Read only
+	ParamStartCurrentLimit,		// mA. See SOFT_START_ENABLED. Not stored to flash memory
+	ParamHallSensorFailed,		// 0 = both Hall sensors working, 1 or 2 = failed sensor (see HALL_HEALTH_MONITORING_ENABLED). Read only
+	ParamMotorTemperatureRise	// °C * 10 above ambient, estimated (see THERMAL_PROTECTION_ENABLED). Read only
+} motor_parameter_t;
+
 typedef enum motor_command_t {
 	NoCommand,
 	MotorUp,
 	MotorDown,
 	Stop,
 	EnterBootloader,
+	EnterUpdater,	// see RESIDENT_UPDATER_ENABLED
 	Dance,
+	Autotune,		// see AUTOTUNE_ENABLED
 } motor_command_t;
 
-uint8_t handle_command(uint8_t * rx_buffer, uint8_t * tx_buffer, uint8_t * tx_bytes);
+uint8_t motor_set_parameter(uint8_t id, uint16_t value);
+uint8_t motor_get_parameter(uint8_t id, uint16_t * value);
+
+/*
+ * Settings block for provisioning several units with the same configuration in one transfer (see V2_OP_GET_SETTINGS
+ * in protocol_v2.h): SETTINGS_BLOCK_VERSION, the values of the SETTINGS_BLOCK_COUNT settings listed in
+ * settings_block_params (high byte first) and CRC-8 over the preceding bytes. Curtain lengths and the device address
+ * are specific to the unit and they are not included. An imported block is applied either completely or not at all
+ * and the settings are written to flash in one batch
+ */
+#define SETTINGS_BLOCK_VERSION	1
+#define SETTINGS_BLOCK_COUNT	14
+#define SETTINGS_BLOCK_SIZE		(2 + 2*SETTINGS_BLOCK_COUNT)
+uint8_t motor_export_settings(uint8_t * block);	// returns SETTINGS_BLOCK_SIZE
+uint8_t motor_import_settings(const uint8_t * block, uint8_t len);	// returns 0 if the block is invalid
+uint8_t handle_query(uint16_t cmd, uint8_t * tx_buffer, uint8_t * tx_bytes);
+void motor_execute_command(uint8_t cmd1, uint8_t cmd2);
+void motor_script_clear();
+uint8_t motor_script_add(int16_t loc, uint8_t speed, uint8_t dwell, uint8_t flags);
+void motor_script_start();
+uint8_t handle_command(uint8_t addr, uint8_t cmd1, uint8_t cmd2, uint8_t * tx_buffer, uint8_t * tx_bytes);
+#ifdef FAST_STOP_ENABLED
+void motor_fast_stop(uint8_t cmd1, uint8_t cmd2);
+#endif
 
 void motor_init();
 void motor_load_settings();
@@ -147,5 +736,12 @@ void motor_stop();
 void motor_adjust_rpm();
 void motor_stall_check();
 void motor_process();
+void motor_pwm_dither();
+void motor_overcurrent_trip();
+uint8_t motor_hall_poll();
+uint32_t motor_estimate_eta();
+void motor_publish_state();
+void motor_read_state(motor_state_t * state);
+void motor_read_reply(uint8_t offset, uint8_t len, uint8_t * buf);
 
 #endif /* SRC_MOTOR_H_ */
@@ -0,0 +1,34 @@
+#include "main.h"
+
+/*
+ * Interrupt and main loop profiler (see ISR_PROFILER_ENABLED in main.h). Cortex-M0 has no cycle counter, so the
+ * durations are measured with the free running 1 us HALL_TIMER. Minimum, maximum and average duration and maximum
+ * entry latency are kept per handler. The main loop iteration is measured from wake-up (wait_for_events) to the end
+ * of the iteration.
+ *
+ * Entry latency is exact for SysTick (calculated from the SysTick counter). For the other interrupts it's estimated
+ * from the NVIC pending bits: an interrupt that is pending when another handler is entered is assumed to have waited
+ * since then, and one that became pending during a handler is assumed to have waited since the start of that handler
+ * (upper bound). Time spent with interrupts disabled in the main loop is not seen.
+ */
+typedef enum profile_slot_t {
+    PROFILE_SYSTICK = 0,    // includes motor_stall_check and software timers
+    PROFILE_HALL_1,         // EXTI4_15 (hall_sensor_callback)
+    PROFILE_HALL_2,         // EXTI0_1 (hall_sensor_callback)
+    PROFILE_ADC,            // DMA1 channel 1 (ADC callbacks)
+    PROFILE_UART_DMA,       // DMA1 channels 2 and 3 (HAL_UART_RxCpltCallback and handle_command)
+    PROFILE_CONTROL,        // TIM3 (motor_adjust_rpm)
+    PROFILE_UART,           // USART1 (errors and IDLE line detection)
+    PROFILE_MAIN_LOOP,
+    PROFILE_SLOT_COUNT
+} profile_slot_t;
+
+#define PROFILE_SLOTS_PER_CHUNK 4   // slots per CMD_EXT_GET_PROFILE reply
+
+// Called at the start of the handler. Returns the start timestamp to be passed to profile_exit
+uint16_t profile_enter(profile_slot_t slot);
+void profile_exit(profile_slot_t slot, uint16_t start);
+
+// Durations and latency in microseconds. Returns the number of samples (0 = no samples, all values are 0)
+uint16_t profile_get(profile_slot_t slot, uint16_t * min, uint16_t * max, uint16_t * avg, uint16_t * max_latency);
+void profile_reset();
@@ -0,0 +1,41 @@
+#include "main.h"
+
+/*
+ * Protocol v2 (opt-in) frame structure:
+ *
+ *   0x00 0xff 0x9b LEN SEQ PAYLOAD CRC
+ *
+ * LEN is the payload length (1 - V2_MAX_PAYLOAD), SEQ is a sequence number chosen by the sender and
+ * CRC is CRC-8 (polynomial 0x07) calculated over LEN, SEQ and PAYLOAD. The first payload byte is the opcode.
+ * Each request is answered with a frame having the same SEQ and opcode | V2_REPLY_FLAG. If the request
+ * is rejected (e.g. CRC mismatch), V2_OP_NAK is sent instead and the request should be retransmitted.
+ * A retransmitted request (same SEQ as the previous one) is not executed again, only the reply is resent.
+ * The first header byte is the device address like in legacy frames (see MULTIDROP_BUS_ENABLED).
+ */
+#define V2_HEADER_BYTE		0x9b
+#define V2_MAX_PAYLOAD		32
+#define V2_FRAME_OVERHEAD	6	// header (3 bytes), LEN, SEQ and CRC
+
+#define V2_OP_COMMAND		0x01	// Legacy command (2 bytes). Reply contains the legacy reply data (if any)
+#define V2_OP_SET_PARAMS	0x02	// (PARAM_ID, VALUE_HI, VALUE_LO) triplets. Reply contains the number of parameters set
+#define V2_OP_GET_PARAMS	0x03	// PARAM_IDs. Reply contains (PARAM_ID, VALUE_HI, VALUE_LO) triplets of valid parameters
+#define V2_OP_LOAD_SCRIPT	0x04	// (LOC_HI, LOC_LO, SPEED, DWELL) quads replacing the motion script. Reply contains the number of steps loaded
+#define V2_OP_GET_SETTINGS	0x05	// No payload. Reply contains the settings block (see SETTINGS_BLOCK_VERSION in motor.h)
+#define V2_OP_SET_SETTINGS	0x06	// Settings block. Reply is empty. Rejected with V2_NAK_INVALID if the version or CRC doesn't match
+#define V2_OP_NAK			0x7f	// Sent by the motor module. Payload contains the reason
+#define V2_REPLY_FLAG		0x80
+
+#define V2_NAK_CRC			0x01
+#define V2_NAK_BUSY			0x02	// previous request is still being processed
+#define V2_NAK_INVALID		0x03	// unknown opcode or malformed payload
+
+uint8_t v2_crc8(uint8_t crc, uint8_t data);
+
+// Called from UART interrupt when a frame has been received (CRC is already checked)
+void v2_receive_frame(uint8_t addr, uint8_t seq, uint8_t * payload, uint8_t len);
+
+// addr is the address of the rejected request
+void v2_send_nak(uint8_t addr, uint8_t seq, uint8_t reason);
+
+// Called from the main loop. Executes the received request and sends the reply
+void v2_process();
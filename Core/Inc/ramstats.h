@@ -0,0 +1,28 @@
+#include "main.h"
+
+/*
+ * RAM usage statistics (see RAM_STATS_ENABLED in main.h). Reset_Handler paints the area between the end of static
+ * data (_end) and the top of the stack with STACK_PAINT_PATTERN before anything is pushed, so the peak stack depth
+ * since reset is found by looking for the lowest overwritten word. The area includes the heap, which isn't used.
+ *
+ * Static RAM usage is reported per subsystem from the .bss boundaries placed by the linker script
+ * (STM32F030K6TX_FLASH.ld). Read over UART with CMD_EXT_GET_RAM_STATS.
+ */
+#define STACK_PAINT_PATTERN 0xa5a5a5a5  // must match startup_stm32f030x6.s
+
+typedef enum ramstats_region_t {
+    RAMSTATS_BSS_MAIN = 0,      // UART and ADC buffers
+    RAMSTATS_BSS_MOTOR,         // motor control, motion script, trace and metering
+    RAMSTATS_BSS_PROTOCOL_V2,
+    RAMSTATS_BSS_EVENTLOG,      // empty with EVENTLOG_RETAIN_OVER_RESET (the log is in .noinit)
+    RAMSTATS_BSS_PROFILER,
+    RAMSTATS_BSS_OTHER,         // the rest of the modules, HAL and C library
+    RAMSTATS_DATA,
+    RAMSTATS_NOINIT,
+    RAMSTATS_STACK_PEAK,        // deepest stack usage since reset
+    RAMSTATS_STACK_HEADROOM,    // never touched RAM between the static data and the deepest stack usage
+    RAMSTATS_REGION_COUNT
+} ramstats_region_t;
+
+// Returns the size in bytes
+uint16_t ramstats_get(ramstats_region_t region);
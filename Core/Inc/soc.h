@@ -0,0 +1,27 @@
+#include "main.h"
+
+/*
+ * Battery state of charge estimation. Voltage sags under motor load and recovers afterwards, so the charge drawn from
+ * the battery is integrated instead: measured motor current while moving plus modelled idle draw while awake
+ * (SOC_AWAKE_CURRENT) and in sleep mode (SOC_SLEEP_CURRENT, sleep duration is measured with RTC).
+ * The estimate is anchored to the voltage curve (get_battery_level) only when the battery has rested for
+ * SOC_REST_TIME, when the voltage is a reliable indicator of the charge. The correction is filtered so that the
+ * reported level doesn't jump, except when the battery has obviously been charged or replaced.
+ */
+#define SOC_BATTERY_CAPACITY    2500    // Nominal battery pack capacity (mAh)
+#define SOC_AWAKE_CURRENT       13000   // Microamps. Motor idle, MCU running (see enter_sleep_mode measurements)
+#define SOC_SLEEP_CURRENT       340     // Microamps. Stop mode
+#define SOC_REST_TIME           (10UL*60*1000)  // Milliseconds without movement before the voltage is trusted
+#define SOC_VOLTAGE_SETTLE_TIME 500     // Milliseconds after waking up before the voltage reading is used
+#define SOC_ANCHOR_SHIFT        2       // Move 1/4 of the way towards the resting voltage level at each anchoring
+#define SOC_RESYNC_MARGIN       25      // Percent. Larger difference to the resting voltage level is taken as is
+
+// Called from the main loop. moving is set while the motor is energized
+void soc_update(uint16_t motor_current, uint8_t moving);
+
+// Called after waking up from sleep mode
+void soc_add_sleep(uint32_t ms);
+
+uint8_t soc_get_level();            // 0 - 100 %
+uint16_t soc_get_consumed_mah();    // charge consumed since power-up (or since soc_reset_consumed)
+void soc_reset_consumed();
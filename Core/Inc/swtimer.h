@@ -0,0 +1,31 @@
+#include "main.h"
+
+/*
+ * Software timers driven by SysTick. The SysTick handler only compares the tick counter against the nearest expiry
+ * time and posts EVENT_TIMER. Expired timers are then handled in the main loop by swtimer_process(), which also
+ * runs the callbacks (so callbacks are never executed in interrupt context).
+ *
+ * A one-shot timer without a callback stays in expired state until it's restarted or stopped (see swtimer_expired).
+ */
+typedef enum swtimer_id_t {
+    SWTIMER_UART_RX = 0,    // Wait for the rest of an incomplete UART packet
+    SWTIMER_SLEEP,          // Idle time before entering sleep mode
+    SWTIMER_LED,            // LED blinking
+    SWTIMER_UART_TX,        // Delayed reply to a broadcast frame (see MULTIDROP_BUS_ENABLED)
+    SWTIMER_COUNT
+} swtimer_id_t;
+
+typedef void (*swtimer_callback_t)(void);
+
+// Start (or restart) a timer. If period is non-zero, the timer is restarted automatically after expiring.
+// May be called also from interrupt context
+void swtimer_start(swtimer_id_t id, uint32_t delay, uint32_t period, swtimer_callback_t callback);
+void swtimer_stop(swtimer_id_t id);
+uint8_t swtimer_running(swtimer_id_t id);     // timer is started and not yet stopped (running or expired)
+uint8_t swtimer_expired(swtimer_id_t id);
+
+// Called from SysTick interrupt
+void swtimer_tick();
+
+// Called from the main loop when EVENT_TIMER has been posted
+void swtimer_process();
@@ -0,0 +1,22 @@
+#include "main.h"
+
+/*
+ * Thermal model of the motor (see THERMAL_PROTECTION_ENABLED in motor.h). There's no temperature sensor near the
+ * motor, so the temperature rise of the winding above ambient is estimated from the measured current (I²t): heat is
+ * I² * MOTOR_RESISTANCE and the motor is modelled as a single thermal mass with THERMAL_RESISTANCE to the ambient, so
+ * the rise approaches heat * THERMAL_RESISTANCE with THERMAL_TIME_CONSTANT. The mosfets of the H-bridge carry the same
+ * current with a much smaller resistance, so the winding is the part that limits the duty.
+ * The model keeps cooling in sleep mode (sleep duration is measured with RTC). After a reset it starts from ambient.
+ */
+#define THERMAL_RESISTANCE      15      // °C/W, winding to ambient
+#define THERMAL_TIME_CONSTANT   (5L*60*1000)    // Milliseconds
+#define THERMAL_MAX_RISE        200     // °C. Stall current would give more, but the estimate is clamped to keep the math in 32 bits
+#define THERMAL_CHUNK           1000    // Milliseconds. Longer periods are integrated in parts
+
+// Called from the main loop with the motor current in mA
+void thermal_update(uint16_t motor_current);
+
+// Called after waking up from sleep mode
+void thermal_add_sleep(uint32_t ms);
+
+int32_t thermal_get_rise();         // estimated temperature rise above ambient in milli-°C
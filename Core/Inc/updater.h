@@ -0,0 +1,60 @@
+#include "main.h"
+
+/*
+ * Resident updater: a small program in the first flash pages which starts the application and updates it over
+ * UART without the ST system bootloader (see "Firmware update" in README). The application is linked after it (at
+ * APP_ADDRESS). Cortex-M0 has no VTOR, so the updater copies the vector table of the application to the beginning of
+ * SRAM and remaps SRAM to address 0 before jumping to it. Build with `make -f STM32Make.make RESIDENT_UPDATER=1`.
+ *
+ * The updater is entered when the application requests it (CMD_EXT_ENTER_UPDATER) or when there's no valid
+ * application. The first word of the application (initial stack pointer) is kept erased until the whole image has
+ * been written and its CRC verified, so an interrupted update (also by power loss) resumes in the updater.
+ *
+ * Frames (both directions): UPDATER_SYNC CMD LEN_1 LEN_2 PAYLOAD.. CRC_4 where CRC is CRC-32/MPEG-2 (the STM32 CRC
+ * unit: polynomial 0x04c11db7, initial value 0xffffffff, no reflection) of CMD, LEN and PAYLOAD. Multi-byte fields
+ * are little endian. Reply has the CMD with UPDATER_REPLY set and the status as the first payload byte.
+ */
+#ifndef UPDATER_SIZE
+#define UPDATER_SIZE            0x800   // two flash pages. Must match UPDATER_SIZE in STM32Make.make
+#endif
+#define UPDATER_PAGE_SIZE       0x400   // flash page
+#define APP_ADDRESS             (0x08000000 + UPDATER_SIZE)
+#define APP_END_ADDRESS         0x08007400  // page 29 is used by flash log, pages 30-31 by EEPROM emulation
+#define APP_PAGES               ((APP_END_ADDRESS - APP_ADDRESS) / UPDATER_PAGE_SIZE)
+#define APP_VECTOR_COUNT        48          // 16 system exceptions and 32 interrupts
+#define UPDATER_RAM_RESERVED    0x100       // vector table copy and handoff. Must match STM32Make.make
+
+#define UPDATER_VERSION         1
+#define UPDATER_DEFAULT_BAUD    115200      // when the updater is entered without a request (no valid application)
+#define UPDATER_IDLE_TIMEOUT    10000       // Milliseconds. Restart the application if there are no frames
+#define UPDATER_SYSCLK          48000000
+
+// Request from the application (see reset_to_updater), placed right after the vector table copy
+#define UPDATER_HANDOFF_ADDRESS (0x20000000 + APP_VECTOR_COUNT * 4)
+#define UPDATER_HANDOFF_MAGIC   0x55504454
+
+typedef struct updater_handoff_t {
+    uint32_t magic;
+    uint32_t baud;
+} updater_handoff_t;
+
+#define UPDATER_SYNC            0x7e
+#define UPDATER_REPLY           0x80
+#define UPDATER_MAX_PAYLOAD     (1 + UPDATER_PAGE_SIZE)
+
+typedef enum updater_cmd_t {
+    UPDATER_CMD_INFO = 1,       // reply: STATUS VERSION APP_PAGES PAGE_SIZE_2 APP_VALID
+    UPDATER_CMD_SET_BAUD,       // BAUD_4. Replied with the old baud rate
+    UPDATER_CMD_PAGE_CRC,       // PAGE. Reply: STATUS CRC_4 (CRC of the page as it is in flash)
+    UPDATER_CMD_WRITE,          // PAGE DATA[UPDATER_PAGE_SIZE]. The first word of page 0 is left erased
+    UPDATER_CMD_COMMIT,         // LENGTH_4 CRC_4 STACK_POINTER_4. CRC of the first LENGTH bytes of the image
+    UPDATER_CMD_BOOT            // restart to the application
+} updater_cmd_t;
+
+typedef enum updater_status_t {
+    UPDATER_OK = 0,
+    UPDATER_ERROR_FRAME,        // unknown command or wrong length
+    UPDATER_ERROR_ARGUMENT,
+    UPDATER_ERROR_FLASH,        // erase or programming failed
+    UPDATER_ERROR_VERIFY        // image CRC doesn't match
+} updater_status_t;
@@ -0,0 +1,35 @@
+#include "main.h"
+
+/*
+ * Warm restart state (see WARM_RESTART_ENABLED in main.h): a checksummed copy of the curtain location and the RAM-only
+ * tuning values in .noinit RAM section. It's refreshed from the main loop, so after a reset that doesn't lose the RAM
+ * contents (NVIC_SystemReset, HardFault recovery, reset pin) the state is restored by motor_init() and the
+ * calibration roll-up is skipped. After power loss the RAM contents are random and the checksum doesn't match.
+ */
+#define WARMSTATE_MAGIC 0x57524d53
+
+typedef struct warmstate_t {
+    int32_t location;
+    int32_t target_location;
+    uint16_t coast_gain[2];         // Up, Down
+    uint8_t orientation;
+    uint8_t calibrating;            // location isn't known yet
+    uint8_t moving;                 // motor was energized: the ticks coasted during the reset are lost
+    uint8_t default_speed;
+    uint8_t slowdown_factor[2];     // Up, Down
+    uint8_t min_slowdown_speed[2];
+    uint8_t speed_bump[2];
+    uint8_t pi_kp;
+    uint8_t pi_ki;
+    uint8_t pwm_ff_gain;
+    uint8_t control_period;
+    uint16_t speed_zones[4];        // see SPEED_ZONES_ENABLED in motor.h
+} warmstate_t;
+
+void warmstate_store(const warmstate_t * state);
+
+// Returns 1 and copies the state if a valid one was retained over reset
+uint8_t warmstate_load(warmstate_t * state);
+
+// Called before entering the system bootloader: new firmware may have a different layout
+void warmstate_invalidate();
@@ -1,4 +1,5 @@
 #include "bootloader.h"
+#include "updater.h"
 
 #define SYSMEM_RESET_VECTOR             0x1FFFEC00
 #define JUMP_TO_BOOTLOADER_MAGIC_CODE   0xDEADBEEF
@@ -21,3 +22,12 @@ void reset_to_bootloader() {
     // Warning! If RESET PIN is connected with pull-up, hardware reset is needed because NVIC_SystemReset() will hang!
     NVIC_SystemReset();	
 }
+
+#ifdef RESIDENT_UPDATER_ENABLED
+void reset_to_updater(uint32_t baud) {
+    volatile updater_handoff_t * handoff = (volatile updater_handoff_t *) UPDATER_HANDOFF_ADDRESS;
+    handoff->baud = baud;
+    handoff->magic = UPDATER_HANDOFF_MAGIC;
+    NVIC_SystemReset();
+}
+#endif
@@ -32,9 +32,19 @@
 /* Global variable used to store variable value in read sequence */
 uint16_t DataVar = 0;
 
+/* Statistics (since boot) for flash wear accounting */
+uint16_t EE_PageTransferCount = 0;
+uint16_t EE_WriteCount = 0;
+
 /* Virtual address defined by the user: 0xFFFF value is prohibited */
 extern uint16_t VirtAddVarTab[NB_OF_VAR];
 
+/* RAM shadow of the variables in the valid page. Filled at the end of EE_Init() */
+static uint16_t EE_Cache[NB_OF_VAR];
+static uint16_t EE_CacheValid = 0;  /* Bit N is set if variable N is found */
+static uint8_t EE_CacheReady = 0;  /* Until set, variables are read from flash */
+static uint8_t EE_RepairPendingFlag = 0;  /* Set by EE_FastInit() when EE_Init() still has to be run */
+
 /* Private function prototypes -----------------------------------------------*/
 /* Private functions ---------------------------------------------------------*/
 static HAL_StatusTypeDef EE_Format(void);
@@ -42,6 +52,9 @@ static uint16_t EE_FindValidPage(uint8_t Operation);
 static uint16_t EE_VerifyPageFullWriteVariable(uint16_t VirtAddress, uint16_t Data);
 static uint16_t EE_PageTransfer(uint16_t VirtAddress, uint16_t Data);
 static uint16_t EE_VerifyPageFullyErased(uint32_t Address);
+static uint16_t EE_FindVarIndex(uint16_t VirtAddress);
+static void EE_CacheFill(void);
+static void EE_CacheReadPage(uint32_t PageStartAddress);
 
 /**
   * @brief  Restore the pages to a known good state in case of page's status
@@ -58,6 +71,9 @@ uint16_t EE_Init(void)
   int16_t x = -1;
   HAL_StatusTypeDef  flashstatus;
   uint32_t page_error = 0;
+
+  /* Page recovery below has to read the variables from flash */
+  EE_CacheReady = 0;
   FLASH_EraseInitTypeDef s_eraseinit;
 
 
@@ -290,9 +306,150 @@ uint16_t EE_Init(void)
       break;
   }
 
+  EE_CacheFill();
+
+  return HAL_OK;
+}
+
+/**
+  * @brief  Fast boot: only the page headers are checked and the RAM cache is filled
+  *   from the valid page without any flash operations. In the steady state (one
+  *   page valid, the other erased) and after an interrupted page transfer (one page
+  *   valid, the other receiving) the full check of EE_Init() (erase verification of
+  *   the spare page, completing the transfer) is postponed to EE_Repair(). Any other
+  *   state is repaired (or the EEPROM formatted) right away by EE_Init().
+  * @param  None.
+  * @retval - Flash error code: on write Flash error
+  *         - HAL_OK: on success
+  */
+uint16_t EE_FastInit(void)
+{
+  uint16_t pagestatus0 = (*(__IO uint16_t*)PAGE0_BASE_ADDRESS);
+  uint16_t pagestatus1 = (*(__IO uint16_t*)PAGE1_BASE_ADDRESS);
+
+  if ((pagestatus0 == VALID_PAGE) && ((pagestatus1 == ERASED) || (pagestatus1 == RECEIVE_DATA)))
+  {
+    EE_CacheFill();
+    if (pagestatus1 == RECEIVE_DATA)
+    {
+      /* The variable that triggered the transfer was written to the receiving page first */
+      EE_CacheReadPage(PAGE1_BASE_ADDRESS);
+    }
+  }
+  else if ((pagestatus1 == VALID_PAGE) && ((pagestatus0 == ERASED) || (pagestatus0 == RECEIVE_DATA)))
+  {
+    EE_CacheFill();
+    if (pagestatus0 == RECEIVE_DATA)
+    {
+      EE_CacheReadPage(PAGE0_BASE_ADDRESS);
+    }
+  }
+  else
+  {
+    return EE_Init();
+  }
+  EE_RepairPendingFlag = 1;
   return HAL_OK;
 }
 
+/**
+  * @brief  Run the checks and repairs postponed by EE_FastInit(). Called when the
+  *   motor is idle, or before the next write at the latest.
+  * @param  None.
+  * @retval - Flash error code: on write Flash error
+  *         - HAL_OK: on success or if nothing was pending
+  */
+uint16_t EE_Repair(void)
+{
+  if (!EE_RepairPendingFlag)
+  {
+    return HAL_OK;
+  }
+  EE_RepairPendingFlag = 0;
+  return EE_Init();
+}
+
+/**
+  * @brief  Returns 1 if EE_Repair() has work to do
+  */
+uint8_t EE_RepairPending(void)
+{
+  return EE_RepairPendingFlag;
+}
+
+/**
+  * @brief  Find the index of the variable in VirtAddVarTab
+  * @param  VirtAddress: Variable virtual address
+  * @retval Index of the variable or NB_OF_VAR if not found
+  */
+static uint16_t EE_FindVarIndex(uint16_t VirtAddress)
+{
+  uint16_t varidx;
+
+  for (varidx = 0; varidx < NB_OF_VAR; varidx++)
+  {
+    if (VirtAddVarTab[varidx] == VirtAddress)
+    {
+      break;
+    }
+  }
+  return varidx;
+}
+
+/**
+  * @brief  Read all the variables from the valid page into RAM cache
+  * @param  None
+  * @retval None
+  */
+static void EE_CacheFill(void)
+{
+  uint16_t validpage = PAGE0;
+
+  EE_CacheValid = 0;
+
+  /* Get active Page for read operation */
+  validpage = EE_FindValidPage(READ_FROM_VALID_PAGE);
+
+  if (validpage != NO_VALID_PAGE)
+  {
+    EE_CacheReadPage((uint32_t)(EEPROM_START_ADDRESS + (uint32_t)(validpage * PAGE_SIZE)));
+  }
+
+  EE_CacheReady = 1;
+}
+
+/**
+  * @brief  Read the variables of a page into RAM cache with a single forward pass.
+  *   Variables are written in order, so a later value replaces an earlier one, and
+  *   the pass ends at the first erased record. A record whose virtual address
+  *   wasn't written (write interrupted by power loss) is skipped.
+  * @param  PageStartAddress: PAGE0_BASE_ADDRESS or PAGE1_BASE_ADDRESS
+  * @retval None
+  */
+static void EE_CacheReadPage(uint32_t PageStartAddress)
+{
+  uint16_t varidx = 0;
+  uint32_t record = 0;
+  uint32_t address = PageStartAddress + 4;  /* first record follows the page header */
+
+  while (address < PageStartAddress + PAGE_SIZE)
+  {
+    record = (*(__IO uint32_t*)address);
+    if (record == 0xFFFFFFFF)
+    {
+      break;
+    }
+    /* Variable value is in the lower and virtual address in the upper halfword */
+    varidx = EE_FindVarIndex(record >> 16);
+    if (varidx < NB_OF_VAR)
+    {
+      EE_Cache[varidx] = record & 0xFFFF;
+      EE_CacheValid |= (1 << varidx);
+    }
+    address = address + 4;
+  }
+}
+
 /**
   * @brief  Verify if specified page is fully erased.
   * @param  Address: page address
@@ -307,9 +464,10 @@ uint16_t EE_VerifyPageFullyErased(uint32_t Address)
 {
   uint32_t readstatus = 1;
   uint16_t addressvalue = 0x5555;
+  uint32_t pageendaddress = Address + PAGE_SIZE - 1;
     
   /* Check each active page address starting from end */
-  while (Address <= PAGE0_END_ADDRESS)
+  while (Address <= pageendaddress)
   {
     /* Get the current location content to be compared with virtual address */
     addressvalue = (*(__IO uint16_t*)Address);
@@ -347,6 +505,17 @@ uint16_t EE_ReadVariable(uint16_t VirtAddress, uint16_t* Data)
   uint16_t addressvalue = 0x5555, readstatus = 1;
   uint32_t address = EEPROM_START_ADDRESS, PageStartAddress = EEPROM_START_ADDRESS;
 
+  if (EE_CacheReady)
+  {
+    uint16_t varidx = EE_FindVarIndex(VirtAddress);
+    if ((varidx < NB_OF_VAR) && (EE_CacheValid & (1 << varidx)))
+    {
+      *Data = EE_Cache[varidx];
+      return 0;
+    }
+    return 1;
+  }
+
   /* Get active Page for read operation */
   validpage = EE_FindValidPage(READ_FROM_VALID_PAGE);
 
@@ -403,6 +572,20 @@ uint16_t EE_ReadVariable(uint16_t VirtAddress, uint16_t* Data)
 uint16_t EE_WriteVariable(uint16_t VirtAddress, uint16_t Data)
 {
   uint16_t Status = 0;
+  uint16_t varidx = EE_FindVarIndex(VirtAddress);
+
+  /* Skip the write if the value is unchanged */
+  if (EE_CacheReady && (varidx < NB_OF_VAR) && (EE_CacheValid & (1 << varidx)) && (EE_Cache[varidx] == Data))
+  {
+    return HAL_OK;
+  }
+
+  /* Pages have to be in a known good state before writing */
+  Status = EE_Repair();
+  if (Status != HAL_OK)
+  {
+    return Status;
+  }
 
   /* Write the variable virtual address and value in the EEPROM */
   Status = EE_VerifyPageFullWriteVariable(VirtAddress, Data);
@@ -414,6 +597,14 @@ uint16_t EE_WriteVariable(uint16_t VirtAddress, uint16_t Data)
     Status = EE_PageTransfer(VirtAddress, Data);
   }
 
+  EE_WriteCount++;
+
+  if ((Status == HAL_OK) && (varidx < NB_OF_VAR))
+  {
+    EE_Cache[varidx] = Data;
+    EE_CacheValid |= (1 << varidx);
+  }
+
   /* Return last operation status */
   return Status;
 }
@@ -618,6 +809,8 @@ static uint16_t EE_PageTransfer(uint16_t VirtAddress, uint16_t Data)
   uint32_t page_error = 0;
   FLASH_EraseInitTypeDef s_eraseinit;
 
+  EE_PageTransferCount++;
+
   /* Get active Page for read operation */
   validpage = EE_FindValidPage(READ_FROM_VALID_PAGE);
 
@@ -0,0 +1,48 @@
+#include "eventlog.h"
+
+#ifdef EVENTLOG_ENABLED
+
+#ifdef EVENTLOG_RETAIN_OVER_RESET
+#define EVENTLOG_SECTION __attribute__((section(".noinit")))
+#else
+#define EVENTLOG_SECTION
+#endif
+
+EVENTLOG_SECTION uint32_t eventlog_magic;
+EVENTLOG_SECTION eventlog_record_t eventlog[EVENTLOG_SIZE];
+EVENTLOG_SECTION uint8_t eventlog_head;     // next record to be written
+EVENTLOG_SECTION uint8_t eventlog_records;  // number of valid records
+
+void eventlog_init(uint8_t reset_flags) {
+    if ( (eventlog_magic != EVENTLOG_MAGIC) || (eventlog_head >= EVENTLOG_SIZE) || (eventlog_records > EVENTLOG_SIZE) ) {
+        // Power-on (RAM contents are random) or retaining is disabled
+        eventlog_head = 0;
+        eventlog_records = 0;
+        eventlog_magic = EVENTLOG_MAGIC;
+    }
+    eventlog_add(EVENTLOG_BOOT, reset_flags);
+}
+
+void eventlog_add(eventlog_id_t id, uint8_t arg) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    eventlog_record_t * record = &eventlog[eventlog_head];
+    record->time = HAL_GetTick() >> EVENTLOG_TIME_SHIFT;
+    record->id = id;
+    record->arg = arg;
+    eventlog_head = (eventlog_head + 1) & (EVENTLOG_SIZE-1);
+    if (eventlog_records < EVENTLOG_SIZE) {
+        eventlog_records++;
+    }
+    __set_PRIMASK(primask);
+}
+
+uint8_t eventlog_count() {
+    return eventlog_records;
+}
+
+eventlog_record_t eventlog_get(uint8_t index) {
+    return eventlog[(eventlog_head - 1 - index) & (EVENTLOG_SIZE-1)];
+}
+
+#endif
@@ -0,0 +1,103 @@
+#include "flashlog.h"
+#include "motor.h"
+#include "protocol_v2.h"
+#include <stddef.h>
+
+#ifdef FLASHLOG_ENABLED
+
+uint16_t flashlog_next_slot = 0;    // first empty slot
+uint16_t flashlog_seq = 0;          // sequence number of the latest record
+uint16_t flashlog_erase_count = 0;
+
+static uint32_t flashlog_slot_address(uint16_t slot) {
+    return FLASHLOG_PAGE_ADDRESS + slot * sizeof(flashlog_record_t);
+}
+
+static flashlog_record_t * flashlog_slot(uint16_t slot) {
+    return (flashlog_record_t *)flashlog_slot_address(slot);
+}
+
+static uint8_t flashlog_crc(flashlog_record_t * record) {
+    uint8_t crc = 0;
+    uint8_t * data = (uint8_t *)record;
+    for (int i=0; i<offsetof(flashlog_record_t, crc); i++) {
+        crc = v2_crc8(crc, data[i]);
+    }
+    return crc;
+}
+
+static uint16_t flashlog_erase() {
+    FLASH_EraseInitTypeDef s_eraseinit;
+    uint32_t page_error = 0;
+    s_eraseinit.TypeErase   = FLASH_TYPEERASE_PAGES;
+    s_eraseinit.PageAddress = FLASHLOG_PAGE_ADDRESS;
+    s_eraseinit.NbPages     = 1;
+    flashlog_next_slot = 0;
+    flashlog_erase_count++;
+    return HAL_FLASHEx_Erase(&s_eraseinit, &page_error);
+}
+
+uint16_t flashlog_init(flashlog_record_t * record) {
+    // Binary search for the first empty slot. The sequence number is written first so an empty slot is fully erased
+    uint16_t lo = 0, hi = FLASHLOG_RECORD_COUNT;
+    while (lo < hi) {
+        uint16_t mid = (lo + hi) / 2;
+        if (flashlog_slot(mid)->seq == FLASHLOG_EMPTY) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    flashlog_next_slot = lo;
+
+    // Use the latest record with a valid CRC (skip a record torn by power loss)
+    while (lo > 0) {
+        lo--;
+        flashlog_record_t * r = flashlog_slot(lo);
+        if (r->crc == flashlog_crc(r)) {
+            *record = *r;
+            flashlog_seq = r->seq;
+            return HAL_OK;
+        }
+    }
+    return HAL_ERROR;
+}
+
+uint16_t flashlog_append(flashlog_record_t * record) {
+    uint16_t status;
+    if (flashlog_next_slot >= FLASHLOG_RECORD_COUNT) {
+        if ((status = flashlog_erase()) != HAL_OK) {
+            return status;
+        }
+    }
+    if (++flashlog_seq == FLASHLOG_EMPTY) {
+        flashlog_seq = 0;
+    }
+    record->seq = flashlog_seq;
+    record->crc = flashlog_crc(record);
+    record->valid = FLASHLOG_VALID;
+
+    // Program halfwords in order so that 'valid' is written last
+    uint32_t address = flashlog_slot_address(flashlog_next_slot++);
+    uint16_t * data = (uint16_t *)record;
+    for (int i=0; i<sizeof(flashlog_record_t)/2; i++) {
+        if ((status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, address + i*2, data[i])) != HAL_OK) {
+            return status;
+        }
+    }
+    return HAL_OK;
+}
+
+uint16_t flashlog_invalidate() {
+    if (flashlog_next_slot == 0) {
+        return HAL_OK;  // log is empty
+    }
+    if (flashlog_slot(flashlog_next_slot - 1)->valid == FLASHLOG_INVALID) {
+        return HAL_OK;
+    }
+    // Programming 0x0000 is allowed also on a halfword that has already been programmed
+    return HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD,
+            flashlog_slot_address(flashlog_next_slot - 1) + offsetof(flashlog_record_t, valid), FLASHLOG_INVALID);
+}
+
+#endif
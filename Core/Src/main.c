@@ -23,7 +23,14 @@
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
 #include "motor.h"
+#include "protocol_v2.h"
 #include "eeprom.h"
+#include "swtimer.h"
+#include "soc.h"
+#include "thermal.h"
+#include "eventlog.h"
+#include "profiler.h"
+#include <string.h>
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -33,8 +40,69 @@
 
 /* Private define ------------------------------------------------------------*/
 /* USER CODE BEGIN PD */
-#define ADC_BUF_LEN 2*32
+/*
+ * ADC converts voltage and motor current channels continuously into circular DMA buffer. Each half of the buffer
+ * (ADC_PAIRS_PER_HALF voltage/current sample pairs, about 0.5ms) is processed as soon as it's filled and the readings
+ * are averaged over the last ADC_FILTER_WINDOW (current) and ADC_VOLTAGE_WINDOW (voltage) halves with a running sum.
+ *
+ * With ADC_MULTIRATE_ENABLED most halves hold twice as many current samples instead of the pairs (see adc_schedule).
+ * Converting continuously this doubles the current sample rate at the same conversion and DMA interrupt rate, so the
+ * current window is halved in length. With PWM synchronized conversions current is already sampled once per PWM
+ * period, so a current-only half just lasts twice as long and the conversion and interrupt load is halved instead.
+ */
+#define ADC_CHANNELS 2
+#ifdef ADC_PWM_SYNC_ENABLED
+/*
+ * Conversions are triggered by TIM1 at the centre of the PWM on-time (about 10 kHz). Channels are converted
+ * in backward order so that motor current is sampled right after the trigger.
+ */
+#define ADC_CURRENT_INDEX 0
+#define ADC_VOLTAGE_INDEX 1
+#define ADC_PAIRS_PER_HALF 8
+#ifdef ADC_MULTIRATE_ENABLED
+#define ADC_FILTER_WINDOW 1 // in buffer halves. Must be power of 2
+#define ADC_VOLTAGE_WINDOW 2
+#else
+#define ADC_FILTER_WINDOW 2 // in buffer halves. Must be power of 2
+#endif
+#ifndef ADC_VOLTAGE_SAMPLETIME
+#define ADC_VOLTAGE_SAMPLETIME ADC_SAMPLETIME_28CYCLES_5
+#endif
+#ifndef ADC_CURRENT_SAMPLETIME
+#define ADC_CURRENT_SAMPLETIME ADC_SAMPLETIME_28CYCLES_5
+#endif
+#else
+#define ADC_VOLTAGE_INDEX 0
+#define ADC_CURRENT_INDEX 1
+#define ADC_PAIRS_PER_HALF 2
+#ifdef ADC_MULTIRATE_ENABLED
+#define ADC_FILTER_WINDOW 4 // in buffer halves. Must be power of 2
+#else
+#define ADC_FILTER_WINDOW 8 // in buffer halves. Must be power of 2
+#endif
+#ifndef ADC_VOLTAGE_SAMPLETIME
+#define ADC_VOLTAGE_SAMPLETIME ADC_SAMPLETIME_239CYCLES_5
+#endif
+#ifndef ADC_CURRENT_SAMPLETIME
+#define ADC_CURRENT_SAMPLETIME ADC_SAMPLETIME_239CYCLES_5	// shorter one raises the conversion rate as well
+#endif
+#endif
+#ifndef ADC_VOLTAGE_WINDOW
+#define ADC_VOLTAGE_WINDOW ADC_FILTER_WINDOW // in halves with voltage samples. Must be power of 2
+#endif
+#if ADC_VOLTAGE_WINDOW < ADC_FILTER_WINDOW
+#error "Voltage window must not be shorter than the current window (see adc_readings_valid)"
+#endif
+#define ADC_BUF_LEN (2*ADC_CHANNELS*ADC_PAIRS_PER_HALF)
 
+// Received packets are parsed directly from the circular DMA rx buffer
+#define UART_RX_INDEX_MASK  (UART_DMA_BUF_SIZE-1)
+#define UART_RX_BYTE(offset) uart_dma_rx_buffer[(uart_rx_tail + (offset)) & UART_RX_INDEX_MASK]
+#ifdef MULTIDROP_BUS_ENABLED
+#define UART_RX_HEADER_START_OK() 1 // first header byte is the device address
+#else
+#define UART_RX_HEADER_START_OK() (UART_RX_BYTE(0) == 0x00)
+#endif
 
 /* USER CODE END PD */
 
@@ -49,42 +117,103 @@ DMA_HandleTypeDef hdma_adc;
 
 TIM_HandleTypeDef htim1;
 TIM_HandleTypeDef htim3;
+TIM_HandleTypeDef htim14;
 
 UART_HandleTypeDef huart1;
 DMA_HandleTypeDef hdma_usart1_rx;
 DMA_HandleTypeDef hdma_usart1_tx;
 
 extern uint32_t idle_mode_sleep_delay;
+#ifdef ADAPTIVE_SLEEP_DELAY_ENABLED
+extern uint16_t max_sleep_delay;
+#endif
+extern uint8_t sleep_tracking;
+extern uint8_t device_address;
 
 /* USER CODE BEGIN PV */
 
 // UART RX buffers
-DMA_Event_t dma_uart_rx = {0,0,UART_DMA_BUF_SIZE};
+DMA_Event_t dma_uart_rx = {0};
 uint8_t uart_dma_rx_buffer[UART_DMA_BUF_SIZE]; // circular DMA rx buffer
-uint8_t uart_rx_buffer[UART_DMA_BUF_SIZE]; // contains newly received data
-uint16_t uart_rx_buffer_len = 0;
+uint16_t uart_rx_tail = 0; // index of the first unprocessed byte in DMA rx buffer
+uint16_t uart_rx_timer_head; // DMA write position when the DMA timer was started
 
 // UART TX buffers
-uint8_t uart_dma_tx_buffer[UART_DMA_BUF_SIZE]; // circular DMA tx buffer
+uint8_t uart_dma_tx_buffer[UART_TX_BUF_SIZE]; // circular DMA tx buffer
 uint8_t uart_dma_tx_size = 0;  // the chunk size which is being transferred currently
 uint16_t uart_dma_tx_buffer_len = 0;  // bytes in the circular buffer 
 uint16_t uart_dma_tx_buffer_high_ptr = 0; // pointer for writing new data
 uint16_t uart_dma_tx_buffer_low_ptr = 0; // pointer for reading data to DMA
-uint8_t uart_tx_buffer[16]; // contains newly assembled packet to be transferred to DMA buffer
+uint16_t uart_tx_dropped = 0; // number of packets dropped because tx buffer was full
+uint16_t uart_tx_max_len = 0; // highest tx buffer usage
+uint16_t uart_rx_errors = 0; // number of rejected (checksum error or incomplete) packets
+uint8_t uart_tx_buffer[UART_MAX_PACKET_SIZE]; // contains newly assembled packet to be transferred to DMA buffer
+
+// UART baud rate negotiation (see uart_request_baud_rate)
+const uint32_t uart_baud_rates[UART_BAUD_RATE_COUNT] = { 2400, 19200, 57600, 115200 };
+uint8_t uart_baud_rate_sel = 0; // currently used baud rate (index to uart_baud_rates)
+int8_t uart_baud_rate_pending = -1; // baud rate to switch to after the reply has been transmitted
+uint8_t uart_baud_rate_confirmed = 1; // set when a valid packet has been received using the new baud rate
+uint32_t uart_baud_rate_timestamp;
+uint8_t uart_framing_errors = 0;
+
+#ifdef MULTIDROP_BUS_ENABLED
+// Reply to a broadcast frame waiting for our time slot (see uart_send_slotted)
+uint8_t uart_slot_buffer[UART_MAX_PACKET_SIZE];
+uint8_t uart_slot_len = 0;
+#endif
 
 uint8_t blink;
 
+volatile uint8_t main_events = 0;	// EVENT_* flags waiting to be dispatched by the main loop
+
+#ifdef LED_BLINK_ENABLED
+// Non-blocking LED pattern sequencer (see led_blink and led_step)
+typedef struct led_pattern_t {
+	uint16_t on_time;	// Milliseconds
+	uint16_t off_time;	// Milliseconds
+	uint8_t count;
+} led_pattern_t;
+
+led_pattern_t led_patterns[LED_PATTERN_QUEUE_SIZE];
+uint8_t led_pattern_head = 0;
+uint8_t led_pattern_tail = 0;	// pattern being shown
+uint8_t led_blinks_left = 0;	// blinks left in the pattern being shown (0 = none started)
+uint8_t led_on = 0;
+#endif
+#ifdef BLINK_LEDS_WHEN_SLEEP_MODE_CHANGES
+uint8_t sleep_blink_queued = 0;
+#endif
+#ifdef ADAPTIVE_SLEEP_DELAY_ENABLED
+// See ADAPTIVE_SLEEP_DELAY_ENABLED. Times are milliseconds of uptime including the time spent in Stop mode
+uint32_t sleep_time_total = 0;
+uint32_t last_frame_time = 0;
+uint32_t frame_interval_avg = 0;
+#endif
+
 uint16_t adc_buf[ADC_BUF_LEN];
 
+// Running sums of the filter window
+uint16_t adc_voltage_window[ADC_VOLTAGE_WINDOW];
+uint16_t adc_current_window[ADC_FILTER_WINDOW];
+uint32_t adc_voltage_sum;
+uint32_t adc_current_sum;
+uint8_t adc_window_pos;
+uint8_t adc_voltage_pos;
+uint8_t adc_window_filled;	// averages are valid after the whole window has been filled once
+uint8_t adc_skip_half;	// discard the half being converted (see adc_reset_filter)
+#ifdef ADC_MULTIRATE_ENABLED
+uint8_t adc_scan_pairs = 1;	// ADC is configured to convert voltage/current pairs (see MX_ADC_Init) or current only
+uint8_t adc_half_pairs[2];	// scan sequence each buffer half was converted with
+uint8_t adc_current_halves;	// current-only halves since the last one with voltage samples
+#endif
+#ifdef SENSOR_POWER_GATING_ENABLED
+uint8_t adc_voltage_hold = 0;	// voltage sensor is unpowered: keep the last voltage reading
+#endif
+
 uint16_t motor_current;
 uint16_t voltage;
 
-/* 
- * Used to track when motor is idle and no commands have been issued. 
- * After IDLE_MODE_SLEEP_DELAY milliseconds sleep mode is entered.
- * If set to 0 then sleep mode is disabled temporarily (e.g. during movement and calibration)
- */
-uint32_t idle_timestamp;
 
 
 /* USER CODE END PV */
@@ -97,6 +226,7 @@ static void MX_ADC_Init(void);
 static void MX_USART1_UART_Init(void);
 static void MX_TIM1_Init(void);
 static void MX_TIM3_Init(void);
+static void MX_TIM14_Init(void);
 /* USER CODE BEGIN PFP */
 
 /* USER CODE END PFP */
@@ -105,20 +235,254 @@ static void MX_TIM3_Init(void);
 /* USER CODE BEGIN 0 */
 uint16_t lowest_voltage = 8.4*16*30;
 
-// Calculate the average voltage and current of 32 previous measurements
-void HAL_ADC_ConvCpltCallback(ADC_HandleTypeDef* hadc) {
-	uint32_t avg_curr = 0, avg_voltage = 0;
-	for (int i=0;i<ADC_BUF_LEN/2;i++) {
-		avg_curr += adc_buf[i*2+1] * 2;	// current in mA
-		avg_voltage += adc_buf[i*2+0];	// values are Volts * 30 * 16
+// Add the sum of ADC_PAIRS_PER_HALF current samples to the running sum
+static void adc_add_current(uint16_t sum_curr) {
+	adc_current_sum += sum_curr - adc_current_window[adc_window_pos];
+	adc_current_window[adc_window_pos] = sum_curr;
+	adc_window_pos = (adc_window_pos + 1) & (ADC_FILTER_WINDOW-1);
+	motor_current = adc_current_sum * 2 / (ADC_FILTER_WINDOW*ADC_PAIRS_PER_HALF);	// current in mA
+}
+
+// Add the sum of ADC_PAIRS_PER_HALF voltage samples to the running sum
+static void adc_add_voltage(uint16_t sum_voltage) {
+	adc_voltage_sum += sum_voltage - adc_voltage_window[adc_voltage_pos];
+	adc_voltage_window[adc_voltage_pos] = sum_voltage;
+	adc_voltage_pos = (adc_voltage_pos + 1) & (ADC_VOLTAGE_WINDOW-1);
+	if (adc_voltage_pos == 0) {
+		adc_window_filled = 1;
 	}
-	motor_current = avg_curr / (ADC_BUF_LEN/2);
-	voltage = avg_voltage / (ADC_BUF_LEN/2);
-  if (voltage < lowest_voltage) {
+	voltage = adc_voltage_sum / (ADC_VOLTAGE_WINDOW*ADC_PAIRS_PER_HALF);	// values are Volts * 30 * 16
+  if ( (voltage < lowest_voltage) && adc_window_filled ) {
     lowest_voltage = voltage;
   }
 }
 
+// Add new half of the DMA buffer to the running sums and update the average voltage and current
+void adc_process_half(uint16_t * buf) {
+	uint16_t sum_curr = 0, sum_voltage = 0;
+	if (adc_skip_half) {
+		adc_skip_half = 0;
+		return;
+	}
+#ifdef ADC_MULTIRATE_ENABLED
+	if (!adc_half_pairs[buf != adc_buf]) {
+		for (int i=0;i<ADC_CHANNELS*ADC_PAIRS_PER_HALF;i++) {
+			sum_curr += buf[i];
+		}
+		adc_add_current(sum_curr / ADC_CHANNELS);	// averaged to the sample count of a pair half
+		return;
+	}
+#endif
+	for (int i=0;i<ADC_PAIRS_PER_HALF;i++) {
+		sum_voltage += buf[i*ADC_CHANNELS+ADC_VOLTAGE_INDEX];
+		sum_curr += buf[i*ADC_CHANNELS+ADC_CURRENT_INDEX];
+	}
+	adc_add_current(sum_curr);
+#ifdef SENSOR_POWER_GATING_ENABLED
+	if (adc_voltage_hold) {
+		return;
+	}
+#endif
+	adc_add_voltage(sum_voltage);
+}
+
+#ifdef ADC_MULTIRATE_ENABLED
+/*
+ * Choose the scan sequence for the buffer half that DMA has just started to fill. Called from the DMA interrupt right
+ * after the other half has been completed. The sequence and sampling time can be changed only while the ADC is stopped,
+ * which is done only if no conversion has been stored to the new half yet. Otherwise the half keeps the old sequence
+ * and the switch is tried again at the next half.
+ */
+static void adc_schedule(uint8_t half) {
+	uint8_t pairs = (!adc_window_filled) || (adc_current_halves >= ADC_VOLTAGE_INTERVAL-1);
+	if (pairs != adc_scan_pairs) {
+		__disable_irq();
+		if (hdma_adc.Instance->CNDTR == (half ? ADC_BUF_LEN/2 : ADC_BUF_LEN)) {
+			ADC1->CR |= ADC_CR_ADSTP;	// also aborts a conversion in progress
+			while (ADC1->CR & ADC_CR_ADSTP) {
+			}
+			ADC1->CHSELR = pairs ? (ADC_CHSELR_CHSEL6 | ADC_CHSELR_CHSEL9) : ADC_CHSELR_CHSEL9;
+			ADC1->SMPR = pairs ? ADC_VOLTAGE_SAMPLETIME : ADC_CURRENT_SAMPLETIME;
+			ADC1->CR |= ADC_CR_ADSTART;
+			adc_scan_pairs = pairs;
+		}
+		__enable_irq();
+	}
+	adc_half_pairs[half] = adc_scan_pairs;
+	adc_current_halves = adc_scan_pairs ? 0 : adc_current_halves + 1;
+}
+#endif
+
+// Start the conversions into the DMA buffer
+static void adc_start() {
+#ifdef ADC_MULTIRATE_ENABLED
+	adc_half_pairs[0] = adc_scan_pairs;	// the second half is chosen when the first one is complete
+#endif
+	HAL_ADC_Start_DMA(&hadc, (uint32_t*)adc_buf, ADC_BUF_LEN);
+}
+
+// Restart the filter window, e.g. to drop readings taken while the voltage sensor was unpowered. The half that is
+// currently being converted is discarded too, because it may also contain some of them
+static void adc_reset_filter() {
+	__disable_irq();
+	memset(adc_voltage_window, 0, sizeof(adc_voltage_window));
+	memset(adc_current_window, 0, sizeof(adc_current_window));
+	adc_voltage_sum = adc_current_sum = 0;
+	adc_window_pos = adc_voltage_pos = 0;
+	adc_window_filled = 0;
+	adc_skip_half = 1;
+	__enable_irq();
+}
+
+#ifdef MICROBENCH_ENABLED
+// Filter state over a benchmark run of adc_process_half (see microbench.h). Called with interrupts disabled
+static struct {
+	uint16_t voltage_window[ADC_VOLTAGE_WINDOW];
+	uint16_t current_window[ADC_FILTER_WINDOW];
+	uint32_t voltage_sum, current_sum;
+	uint8_t window_pos, voltage_pos, window_filled, skip_half;
+	uint16_t motor_current, voltage, lowest_voltage;
+} adc_filter_saved;
+
+void adc_filter_save() {
+	memcpy(adc_filter_saved.voltage_window, adc_voltage_window, sizeof(adc_voltage_window));
+	memcpy(adc_filter_saved.current_window, adc_current_window, sizeof(adc_current_window));
+	adc_filter_saved.voltage_sum = adc_voltage_sum;
+	adc_filter_saved.current_sum = adc_current_sum;
+	adc_filter_saved.window_pos = adc_window_pos;
+	adc_filter_saved.voltage_pos = adc_voltage_pos;
+	adc_filter_saved.window_filled = adc_window_filled;
+	adc_filter_saved.skip_half = adc_skip_half;
+	adc_filter_saved.motor_current = motor_current;
+	adc_filter_saved.voltage = voltage;
+	adc_filter_saved.lowest_voltage = lowest_voltage;
+	adc_skip_half = 0;
+}
+
+void adc_filter_restore() {
+	memcpy(adc_voltage_window, adc_filter_saved.voltage_window, sizeof(adc_voltage_window));
+	memcpy(adc_current_window, adc_filter_saved.current_window, sizeof(adc_current_window));
+	adc_voltage_sum = adc_filter_saved.voltage_sum;
+	adc_current_sum = adc_filter_saved.current_sum;
+	adc_window_pos = adc_filter_saved.window_pos;
+	adc_voltage_pos = adc_filter_saved.voltage_pos;
+	adc_window_filled = adc_filter_saved.window_filled;
+	adc_skip_half = adc_filter_saved.skip_half;
+	motor_current = adc_filter_saved.motor_current;
+	voltage = adc_filter_saved.voltage;
+	lowest_voltage = adc_filter_saved.lowest_voltage;
+}
+#endif
+
+void HAL_ADC_ConvHalfCpltCallback(ADC_HandleTypeDef* hadc) {
+#ifdef ADC_MULTIRATE_ENABLED
+	adc_schedule(1);
+#endif
+	adc_process_half(&adc_buf[0]);
+	post_event(EVENT_ADC);
+}
+
+void HAL_ADC_ConvCpltCallback(ADC_HandleTypeDef* hadc) {
+#ifdef ADC_MULTIRATE_ENABLED
+	adc_schedule(0);
+#endif
+	adc_process_half(&adc_buf[ADC_BUF_LEN/2]);
+	post_event(EVENT_ADC);
+}
+
+#ifdef DYNAMIC_CLOCK_ENABLED
+uint8_t system_clock_is_fast = 0;
+
+// Change the prescaler immediately (by generating an update event) without triggering the update interrupt
+static void timer_set_prescaler(TIM_TypeDef * tim, uint16_t prescaler) {
+	tim->PSC = prescaler;
+	tim->CR1 |= TIM_CR1_URS;
+	tim->EGR = TIM_EGR_UG;
+	tim->CR1 &= ~TIM_CR1_URS;
+}
+#endif
+
+/*
+ * Switch the core clock between 48 MHz (PLL) and 8 MHz (HSI). Called from the main loop before the motor is
+ * energized and after it has been stopped. Timer prescalers are adjusted so that the timers keep their tick rates
+ * (except TIM1 which runs the PWM at higher frequency when the clock is fast)
+ */
+void system_clock_fast(uint8_t fast) {
+#ifdef DYNAMIC_CLOCK_ENABLED
+	RCC_OscInitTypeDef RCC_OscInitStruct = {0};
+	RCC_ClkInitTypeDef RCC_ClkInitStruct = {0};
+
+	if (fast == system_clock_is_fast)
+		return;
+
+	RCC_ClkInitStruct.ClockType = RCC_CLOCKTYPE_HCLK|RCC_CLOCKTYPE_SYSCLK|RCC_CLOCKTYPE_PCLK1;
+	RCC_ClkInitStruct.AHBCLKDivider = RCC_SYSCLK_DIV1;
+	RCC_ClkInitStruct.APB1CLKDivider = RCC_HCLK_DIV1;
+	if (fast) {
+		RCC_OscInitStruct.OscillatorType = RCC_OSCILLATORTYPE_NONE;
+		RCC_OscInitStruct.PLL.PLLState = RCC_PLL_ON;
+		RCC_OscInitStruct.PLL.PLLSource = RCC_PLLSOURCE_HSI;
+		RCC_OscInitStruct.PLL.PLLMUL = RCC_PLL_MUL12;
+		RCC_OscInitStruct.PLL.PREDIV = RCC_PREDIV_DIV1;
+		if (HAL_RCC_OscConfig(&RCC_OscInitStruct) != HAL_OK)
+			return;	// keep running at 8 MHz
+		RCC_ClkInitStruct.SYSCLKSource = RCC_SYSCLKSOURCE_PLLCLK;
+		if (HAL_RCC_ClockConfig(&RCC_ClkInitStruct, FLASH_LATENCY_1) != HAL_OK)
+			return;
+	} else {
+		RCC_ClkInitStruct.SYSCLKSource = RCC_SYSCLKSOURCE_HSI;
+		if (HAL_RCC_ClockConfig(&RCC_ClkInitStruct, FLASH_LATENCY_0) != HAL_OK)
+			return;
+		RCC_OscInitStruct.OscillatorType = RCC_OSCILLATORTYPE_NONE;
+		RCC_OscInitStruct.PLL.PLLState = RCC_PLL_OFF;
+		HAL_RCC_OscConfig(&RCC_OscInitStruct);
+	}
+	system_clock_is_fast = fast;
+
+	// SysTick has already been reconfigured by HAL_RCC_ClockConfig
+	timer_set_prescaler(TIM1, fast ? PWM_PRESCALER_48MHZ : PWM_PRESCALER_8MHZ);
+	timer_set_prescaler(TIM3, SystemCoreClock / 10000 - 1);
+	timer_set_prescaler(HALL_TIMER, SystemCoreClock / 1000000 - 1);
+#endif
+}
+
+/*
+ * Change the speed controller period (milliseconds)
+ */
+void set_control_period(uint8_t period) {
+	__HAL_TIM_SET_AUTORELOAD(&htim3, period * 10 - 1);
+	if (__HAL_TIM_GET_COUNTER(&htim3) >= period * 10) {
+		__HAL_TIM_SET_COUNTER(&htim3, 0);
+	}
+}
+
+/*
+ * Called from interrupt handlers. Handlers of different priority can preempt each other, so the update must be atomic
+ */
+void post_event(uint8_t event) {
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	main_events |= event;
+	__set_PRIMASK(primask);
+}
+
+/*
+ * Sleep until an interrupt handler has posted an event. Returns and clears the pending events
+ */
+uint8_t wait_for_events() {
+	uint8_t events;
+	__disable_irq();
+	while ((events = main_events) == 0) {
+		// WFI wakes up on a pending interrupt even when interrupts are masked. Interrupt is handled after re-enabling
+		__WFI();
+		__enable_irq();
+		__disable_irq();
+	}
+	main_events = 0;
+	__enable_irq();
+	return events;
+}
+
 uint16_t get_voltage() {
   return voltage;
 }
@@ -127,50 +491,124 @@ uint16_t get_motor_current() {
 	return motor_current;
 }
 
-// S-shaped battery/voltage curve mimicking the values reported by original Fyrtur module
+// Returns 1 once the ADC filter window has been filled and get_voltage() / get_motor_current() are valid
+uint8_t adc_readings_valid() {
+	return adc_window_filled;
+}
+
+/*
+ * Battery level (0-100%) as a function of voltage byte (Volts * 30, as reported by the original Fyrtur module).
+ * Entry i is the level at BATTERY_CURVE_BASE + i. Below the table the level is 0, above it the last entry is used.
+ */
+#ifdef BATTERY_CURVE_DC_ADAPTER
+// Full level as long as the adapter voltage is sufficient: 6.0 V = 0% .. 6.5 V = 100%
+#define BATTERY_CURVE_BASE 180
+static const uint8_t battery_curve[] = {
+	  0,   6,  13,  20,  26,  33,  40,  46,  53,  60,  66,  73,  80,  86,  93, 100,
+};
+#else
+// Li-ion battery pack. Piecewise linear between (200,0) (215,16) (218,27) (221,43) (228,62) (246,91) (255,100)
+#define BATTERY_CURVE_BASE 200
+static const uint8_t battery_curve[] = {
+	  0,   1,   2,   3,   4,   5,   6,   7,   8,   9,  10,  11,  12,  13,  14,  16,
+	 19,  23,  27,  32,  37,  43,  45,  48,  51,  53,  56,  59,  62,  63,  65,  66,
+	 68,  70,  71,  73,  74,  76,  78,  79,  81,  82,  84,  86,  87,  89,  91,  92,
+	 93,  94,  95,  96,  97,  98,  99, 100,
+};
+#endif
+#define BATTERY_CURVE_LEN (sizeof(battery_curve)/sizeof(battery_curve[0]))
+
 uint8_t get_battery_level() {
 	uint16_t v = get_voltage() / 16; // For easier calculation use the values reported by original Fyrtur module
-	if (v < 200)
+	if (v < BATTERY_CURVE_BASE)
 		return 0;
-	if (v <= 215)
-		return 0 + (v - 200) * (16-0) / (215-200);
-	if (v <= 218)
-		return 16 + (v - 215) * (27-16) / (218-215);
-	if (v <= 221)
-		return 27 + (v - 218) * (43-27) / (221-218);
-	if (v <= 228)
-		return 43 + (v - 221) * (62-43) / (228-221);
-	if (v <= 246)
-		return 62 + (v - 228) * (91-62) / (246-228);
-	return 91 + (v - 246) * (100-91) / (255-246);
+	v -= BATTERY_CURVE_BASE;
+	if (v >= BATTERY_CURVE_LEN)
+		v = BATTERY_CURVE_LEN - 1;
+	return battery_curve[v];
 }
 
+/*
+ * Enable/disable a TIM1 PWM output. Same register writes as HAL_TIM_PWM_Start/Stop, but without the channel state
+ * bookkeeping: the main output and the counter are kept enabled as long as some channel is enabled
+ */
 void pwm_start( uint32_t channel ) {
-	if (htim1.Instance != NULL)
-		HAL_TIM_PWM_Start(&htim1, channel);
-
+	TIM1->CCER |= (TIM_CCER_CC1E << channel);
+	TIM1->BDTR |= TIM_BDTR_MOE;
+	TIM1->CR1 |= TIM_CR1_CEN;
 }
 
 void pwm_stop( uint32_t channel ) {
-	if (htim1.Instance != NULL)
-		HAL_TIM_PWM_Stop(&htim1, channel);
+	TIM1->CCER &= ~(TIM_CCER_CC1E << channel);
+	if ( (TIM1->CCER & (TIM_CCER_CC1E | TIM_CCER_CC2E | TIM_CCER_CC3E | TIM_CCER_CC4E)) == 0 ) {
+		TIM1->BDTR &= ~TIM_BDTR_MOE;
+		TIM1->CR1 &= ~TIM_CR1_CEN;
+	}
+}
+
+#ifdef LED_BLINK_ENABLED
+uint8_t led_blinking() {
+	return swtimer_running(SWTIMER_LED);
 }
 
-#ifndef SLIM_BINARY
-void blink_led(int duration, int count) {
-	for (int i=0;i<count;i++) {
-		HAL_GPIO_WritePin(LED_GPIO_Port, LED_Pin, GPIO_PIN_SET);
-		HAL_Delay(duration);
+/*
+ * Called by LED software timer (and by led_blink when idle): end the current on or off phase and start the next one.
+ * The queued patterns are shown one after another and the timer is left stopped when the queue is empty
+ */
+void led_step() {
+	led_pattern_t * pattern = &led_patterns[led_pattern_tail];
+	if (led_on) {
 		HAL_GPIO_WritePin(LED_GPIO_Port, LED_Pin, GPIO_PIN_RESET);
-		HAL_Delay(duration);
+		led_on = 0;
+		if (--led_blinks_left == 0) {
+			// Pattern done. The next one is started after the off phase
+			led_pattern_tail = (led_pattern_tail + 1) & (LED_PATTERN_QUEUE_SIZE-1);
+		}
+		swtimer_start(SWTIMER_LED, pattern->off_time, 0, led_step);
+		return;
+	}
+	if (led_blinks_left == 0) {
+		if (led_pattern_tail == led_pattern_head) {
+			return;
+		}
+		led_blinks_left = pattern->count;
 	}
+	HAL_GPIO_WritePin(LED_GPIO_Port, LED_Pin, GPIO_PIN_SET);
+	led_on = 1;
+	swtimer_start(SWTIMER_LED, pattern->on_time, 0, led_step);
+}
+
+// Queue a pattern of count blinks without blocking. Returns 0 if the queue is full. Called from the main loop only
+uint8_t led_blink(uint16_t on_time, uint16_t off_time, uint8_t count) {
+	uint8_t next = (led_pattern_head + 1) & (LED_PATTERN_QUEUE_SIZE-1);
+	if ( (count == 0) || (next == led_pattern_tail) ) {
+		return 0;
+	}
+	led_patterns[led_pattern_head].on_time = on_time;
+	led_patterns[led_pattern_head].off_time = off_time;
+	led_patterns[led_pattern_head].count = count;
+	led_pattern_head = next;
+	if (!led_blinking()) {
+		led_step();
+	}
+	return 1;
+}
+
+// Cancel the current and queued patterns
+void led_stop() {
+	swtimer_stop(SWTIMER_LED);
+	HAL_GPIO_WritePin(LED_GPIO_Port, LED_Pin, GPIO_PIN_RESET);
+	led_on = 0;
+	led_blinks_left = 0;
+	led_pattern_tail = led_pattern_head;
 }
 #endif
 
-/* Called every 10ms by TIM3 */
+/* Called every control period (10ms by default) by TIM3 */
 void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef* htim)
 {
 	motor_adjust_rpm();
+	post_event(EVENT_CONTROL);
 }
 
 uint8_t uart_tx_done() {
@@ -182,174 +620,325 @@ void uart_start_rx_DMA() {
       {
           Error_Handler();
       }
-  __HAL_DMA_DISABLE_IT(huart1.hdmarx, DMA_IT_HT);  // disable half-transfer interrupt
   // Reset also the buffer pointer
-  dma_uart_rx.prevCNDTR = UART_DMA_BUF_SIZE;
+  uart_rx_tail = 0;
 }
 
 void uart_do_transmit_msg() {
-    if (uart_dma_tx_buffer_low_ptr + uart_dma_tx_buffer_len < UART_DMA_BUF_SIZE) {
+    if (uart_dma_tx_buffer_low_ptr + uart_dma_tx_buffer_len <= UART_TX_BUF_SIZE) {
       // we can transfer the whole tx buffer right away
       uart_dma_tx_size = uart_dma_tx_buffer_len;
     } else {
-      // we can transfer bytes only up to the end of circular buffer
-      uart_dma_tx_size = UART_DMA_BUF_SIZE - uart_dma_tx_buffer_low_ptr;
+      // we can transfer bytes only up to the end of circular buffer. The rest is chained in HAL_UART_TxCpltCallback
+      uart_dma_tx_size = UART_TX_BUF_SIZE - uart_dma_tx_buffer_low_ptr;
     }
     HAL_UART_Transmit_DMA(&huart1, &uart_dma_tx_buffer[uart_dma_tx_buffer_low_ptr], uart_dma_tx_size);
 }
 
 void uart_send_msg(uint8_t * data, int tx_bytes) {
-
-  if (uart_dma_tx_buffer_len + tx_bytes > UART_DMA_BUF_SIZE) {
-    // Buffer overrun shouldn't happen in normal use! Should this occur when debugging/testing, skip sending this message
-    // so that previous data in tx buffer is not overwritten
-    blink += 5;
+  // This can be called both from the main loop and from interrupts, so protect the circular tx buffer
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+
+  if (uart_dma_tx_buffer_len + tx_bytes > UART_TX_BUF_SIZE) {
+    // Buffer overrun shouldn't happen in normal use! Skip sending this message so that previous data in tx buffer
+    // is not overwritten
+    uart_tx_dropped++;
+#ifdef EVENTLOG_ENABLED
+    eventlog_add(EVENTLOG_UART_TX_DROP, tx_bytes);
+#endif
+    __set_PRIMASK(primask);
     return;
   }
-  // transfer the packet to circular tx buffer  
-  for (int i=0;i<tx_bytes;i++) {
-    uart_dma_tx_buffer[ uart_dma_tx_buffer_high_ptr++ ] = data[i];
-    if (uart_dma_tx_buffer_high_ptr >= UART_DMA_BUF_SIZE) {
-      uart_dma_tx_buffer_high_ptr = 0;
-    }
-    uart_dma_tx_buffer_len++;
+  // transfer the packet to circular tx buffer (in two blocks if it wraps around)
+  uint16_t chunk = UART_TX_BUF_SIZE - uart_dma_tx_buffer_high_ptr;
+  if (chunk > tx_bytes) {
+    chunk = tx_bytes;
+  }
+  memcpy(&uart_dma_tx_buffer[uart_dma_tx_buffer_high_ptr], data, chunk);
+  memcpy(uart_dma_tx_buffer, &data[chunk], tx_bytes - chunk);
+  uart_dma_tx_buffer_high_ptr = (uart_dma_tx_buffer_high_ptr + tx_bytes) & (UART_TX_BUF_SIZE-1);
+  uart_dma_tx_buffer_len += tx_bytes;
+  if (uart_dma_tx_buffer_len > uart_tx_max_len) {
+    uart_tx_max_len = uart_dma_tx_buffer_len;
   }
   // if DMA tx is not busy we can send the packet right away. Otherwise continue sending in HAL_UART_TxCpltCallback
   if (uart_dma_tx_size == 0) {
     uart_do_transmit_msg();
   }
+  __set_PRIMASK(primask);
+}
+
+/*
+ * Add the header and checksum to the packet assembled in tx_buffer[2 .. tx_bytes-2]
+ */
+void uart_finish_reply(uint8_t * tx_buffer, uint8_t tx_bytes) {
+  uint8_t i;
+  tx_buffer[0] = device_address;
+  tx_buffer[1] = 0xff;
+  // calculate checksum
+  uint8_t checksum = 0;
+  for (i=3; i<tx_bytes-1; i++) {
+    checksum = checksum ^ tx_buffer[i];
+  }
+  tx_buffer[tx_bytes-1] = checksum;
+}
+
+void uart_send_reply(uint8_t * tx_buffer, uint8_t tx_bytes) {
+  uart_finish_reply(tx_buffer, tx_bytes);
+  uart_send_msg(tx_buffer, tx_bytes);
+}
+
+#ifdef MULTIDROP_BUS_ENABLED
+void uart_send_slot() {
+  uart_send_msg(uart_slot_buffer, uart_slot_len);
+  uart_slot_len = 0;
+}
+
+/*
+ * Send a reply to a frame received with address addr. Replies to broadcast frames are sent in our own time slot
+ */
+void uart_send_slotted(uint8_t * data, uint8_t tx_bytes, uint8_t addr) {
+  if ( (addr != UART_BROADCAST_ADDRESS) || (device_address == UART_BROADCAST_ADDRESS) ) {
+    uart_send_msg(data, tx_bytes);
+    return;
+  }
+  if (uart_slot_len > 0) {
+    // Only one reply can wait for the time slot
+    uart_tx_dropped++;
+#ifdef EVENTLOG_ENABLED
+    eventlog_add(EVENTLOG_UART_TX_DROP, tx_bytes);
+#endif
+    return;
+  }
+  memcpy(uart_slot_buffer, data, tx_bytes);
+  uart_slot_len = tx_bytes;
+  uint32_t baud = uart_baud_rates[uart_baud_rate_sel];
+  uint32_t slot = (UART_REPLY_SLOT_BYTES * 10 * 1000 + baud - 1) / baud;
+  swtimer_start(SWTIMER_UART_TX, device_address * slot, 0, uart_send_slot);
 }
 
-void send_error_msg() {
+/*
+ * TX pin is push-pull when we are the only module on the bus, otherwise open-drain with pull-up.
+ * Called after UART (re)initialization and when the device address is changed
+ */
+void uart_apply_bus_mode() {
+  if (device_address != UART_BROADCAST_ADDRESS) {
+    GPIOA->OTYPER |= GPIO_PIN_9;
+    MODIFY_REG(GPIOA->PUPDR, GPIO_PUPDR_PUPDR9, GPIO_PUPDR_PUPDR9_0);
+  } else {
+    GPIOA->OTYPER &= ~GPIO_PIN_9;
+    CLEAR_BIT(GPIOA->PUPDR, GPIO_PUPDR_PUPDR9);
+  }
+}
+#else
+void uart_send_slotted(uint8_t * data, uint8_t tx_bytes, uint8_t addr) {
+  uart_send_msg(data, tx_bytes);
+}
+
+void uart_apply_bus_mode() {
+}
+#endif
+
+void send_error_msg(uint16_t len) {
+#ifdef MULTIDROP_BUS_ENABLED
+    if ( (device_address != UART_BROADCAST_ADDRESS) && (UART_RX_BYTE(0) != device_address) ) {
+      // Not necessarily meant for us. Stay silent so that we don't collide with other modules
+      uart_rx_errors++;
+      return;
+    }
+#endif
     // Send ERROR MSG: Send back the number of bytes received and 
     // 1) first four received bytes if we received less bytes than anticipated (6 bytes)
     // 2) the 2 command bytes and checksum (because we received 6 bytes but there was checksum mismatch)
     uart_tx_buffer[0] = 0xde;
     uart_tx_buffer[1] = 0xad;
-    uart_tx_buffer[2] = uart_rx_buffer_len;
-    if (uart_rx_buffer_len<6) {
-      uart_tx_buffer[3] = uart_rx_buffer[0];
-      uart_tx_buffer[4] = uart_rx_buffer[1];
-      uart_tx_buffer[5] = uart_rx_buffer[2];
-      uart_tx_buffer[6] = uart_rx_buffer[3];
+    uart_tx_buffer[2] = len;
+    if (len<6) {
+      uart_tx_buffer[3] = UART_RX_BYTE(0);
+      uart_tx_buffer[4] = UART_RX_BYTE(1);
+      uart_tx_buffer[5] = UART_RX_BYTE(2);
+      uart_tx_buffer[6] = UART_RX_BYTE(3);
     } else {
-      uart_tx_buffer[3] = uart_rx_buffer[3];
-      uart_tx_buffer[4] = uart_rx_buffer[4];
-      uart_tx_buffer[5] = uart_rx_buffer[5];
+      uart_tx_buffer[3] = UART_RX_BYTE(3);
+      uart_tx_buffer[4] = UART_RX_BYTE(4);
+      uart_tx_buffer[5] = UART_RX_BYTE(5);
       uart_tx_buffer[6] = 0;
     }
     uart_tx_buffer[7] = uart_tx_buffer[3] ^ uart_tx_buffer[4] ^ uart_tx_buffer[5] ^ uart_tx_buffer[6];
+    uart_rx_errors++;
     uart_send_msg(uart_tx_buffer, 8);
 }
 
-void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart)
-{
-	uint16_t i, pos, start, length;
-	uint16_t currCNDTR = __HAL_DMA_GET_COUNTER(huart->hdmarx);
+void uart_process_command(uint8_t addr, uint8_t cmd1, uint8_t cmd2) {
+  uint8_t tx_bytes=0;
+#ifdef ADAPTIVE_SLEEP_DELAY_ENABLED
+  sleep_frame_received();
+#endif
+  if (handle_command(addr, cmd1, cmd2, uart_tx_buffer, &tx_bytes)) {
+    if (tx_bytes) {
+      uart_finish_reply(uart_tx_buffer, tx_bytes);
+      uart_send_slotted(uart_tx_buffer, tx_bytes, addr);
+    }
+  }
+}
 
-	/* Ignore IDLE Timeout when the received characters exactly filled up the DMA buffer and DMA Rx Complete IT is generated, but there is no new character during timeout */
-	if(dma_uart_rx.flag && currCNDTR == UART_DMA_BUF_SIZE)
-	{
-		dma_uart_rx.flag = 0;
-		return;
-	}
+#ifdef PROTOCOL_V2_ENABLED
+/*
+ * Check the CRC of protocol v2 frame at uart_rx_tail and pass the payload on
+ */
+void uart_rx_v2_frame(uint8_t frame_len) {
+  uint8_t i, crc = 0;
+  uint8_t payload[V2_MAX_PAYLOAD];
+  for (i=0; i<frame_len+2; i++) {
+    crc = v2_crc8(crc, UART_RX_BYTE(3+i));
+  }
+  uint8_t addr = UART_RX_BYTE(0);
+  uint8_t seq = UART_RX_BYTE(4);
+#ifdef ADAPTIVE_SLEEP_DELAY_ENABLED
+  sleep_frame_received();
+#endif
+#ifdef MULTIDROP_BUS_ENABLED
+  if ( (addr != UART_BROADCAST_ADDRESS) && (addr != device_address) ) {
+    return; // frame is meant for another module
+  }
+#endif
+  if (crc != UART_RX_BYTE(5+frame_len)) {
+    uart_rx_errors++;
+    v2_send_nak(addr, seq, V2_NAK_CRC);
+    return;
+  }
+  uart_baud_rate_confirmed = 1;
+  uart_framing_errors = 0;
+  for (i=0; i<frame_len; i++) {
+    payload[i] = UART_RX_BYTE(5+i);
+  }
+  v2_receive_frame(addr, seq, payload, frame_len);
+}
+#endif
 
-	/* Determine start position in DMA buffer based on previous CNDTR value */
-	start = (dma_uart_rx.prevCNDTR < UART_DMA_BUF_SIZE) ? (UART_DMA_BUF_SIZE - dma_uart_rx.prevCNDTR) : 0;
+// DMA write position in the rx buffer
+static uint16_t uart_rx_head() {
+  return (UART_DMA_BUF_SIZE - __HAL_DMA_GET_COUNTER(huart1.hdmarx)) & UART_RX_INDEX_MASK;
+}
 
+/*
+ * Parse the packets directly from the circular DMA buffer. Bytes between uart_rx_tail (first unprocessed byte)
+ * and the DMA write position are unprocessed. Garbage before the packet header is skipped.
+ * Returns the number of bytes left unprocessed (incomplete packet)
+ */
+uint16_t uart_rx_parse() {
+  uint16_t head = uart_rx_head();
+  uint16_t len = (head - uart_rx_tail) & UART_RX_INDEX_MASK;
+
+  while (len >= 6) {
+#ifdef PROTOCOL_V2_ENABLED
+    if ( (UART_RX_HEADER_START_OK()) && (UART_RX_BYTE(1) == 0xff) && (UART_RX_BYTE(2) == V2_HEADER_BYTE) ) {
+      uint8_t frame_len = UART_RX_BYTE(3);
+      if ( (frame_len > 0) && (frame_len <= V2_MAX_PAYLOAD) ) {
+        if (len < frame_len + V2_FRAME_OVERHEAD) {
+          break;  // wait for the rest of the frame
+        }
+        uart_rx_v2_frame(frame_len);
+        uart_rx_tail = (uart_rx_tail + frame_len + V2_FRAME_OVERHEAD) & UART_RX_INDEX_MASK;
+        len -= frame_len + V2_FRAME_OVERHEAD;
+        continue;
+      }
+    }
+#endif
+    if ( (!UART_RX_HEADER_START_OK()) || (UART_RX_BYTE(1) != 0xff) || (UART_RX_BYTE(2) != 0x9a) ) {
+      // Resynchronize to the next header
+      uart_rx_tail = (uart_rx_tail + 1) & UART_RX_INDEX_MASK;
+      len--;
+      continue;
+    }
+    uint8_t cmd1 = UART_RX_BYTE(3);
+    uint8_t cmd2 = UART_RX_BYTE(4);
+    if ( (cmd1 ^ cmd2) == UART_RX_BYTE(5) ) {
+      uart_baud_rate_confirmed = 1;
+      uart_framing_errors = 0;
+      uart_process_command(UART_RX_BYTE(0), cmd1, cmd2);
+    } else {
+      send_error_msg(6);
+    }
+    uart_rx_tail = (uart_rx_tail + 6) & UART_RX_INDEX_MASK;
+    len -= 6;
+  }
+  return len;
+}
+
+/*
+ * Called by DMA timer (in main loop) when the rest of an incomplete packet hasn't been received in time
+ */
+void uart_rx_timeout() {
+  __disable_irq();
+  if (uart_rx_head() != uart_rx_timer_head) {
+    // More data has arrived since (e.g. a sender pausing within a packet). The IDLE interrupt after it restarts the timer
+  } else if (hdma_usart1_rx.XferCpltCallback) {
+    /* DMA Timeout event: set Timeout Flag and call DMA Rx Complete Callback */
+    dma_uart_rx.flag = 1;
+    hdma_usart1_rx.XferCpltCallback(&hdma_usart1_rx);
+  }
+  __enable_irq();
+}
+
+/*
+ * Called from USART1 receiver timeout and IDLE interrupts (line_idle = 1) and from DMA half-transfer and transfer
+ * complete interrupts.
+ * If there's an incomplete packet left after the line has gone idle, we start the DMA timer and wait for the rest of
+ * the data. DMA events come in the middle of a packet when it straddles the buffer halves, and the rest of it may take
+ * longer than DMA_TIMEOUT_MS at low baud rates, so the timer is stopped until the next IDLE interrupt.
+ */
+void uart_rx_event(uint8_t line_idle) {
+  post_event(EVENT_UART);
+  if (uart_rx_parse()) {
+    if (line_idle) {
+      /* Start DMA timer */
+      uart_rx_timer_head = uart_rx_head();
+      swtimer_start(SWTIMER_UART_RX, DMA_TIMEOUT_MS, 0, uart_rx_timeout);
+    } else {
+      swtimer_stop(SWTIMER_UART_RX);
+    }
+  }
+}
+
+void HAL_UART_RxHalfCpltCallback(UART_HandleTypeDef *huart)
+{
+  uart_rx_event(0);
+}
+
+void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart)
+{
 	if(dma_uart_rx.flag)    /* Timeout event */
 	{
-		/* Determine new data length based on previous DMA_CNDTR value:
-		 *  If previous CNDTR is less than DMA buffer size: there is old data in DMA buffer (from previous timeout) that has to be ignored.
-		 *  If CNDTR == DMA buffer size: entire buffer content is new and has to be processed.
-		*/
-		length = (dma_uart_rx.prevCNDTR < UART_DMA_BUF_SIZE) ? (dma_uart_rx.prevCNDTR - currCNDTR) : (UART_DMA_BUF_SIZE - currCNDTR);
-		dma_uart_rx.prevCNDTR = currCNDTR;
 		dma_uart_rx.flag = 0;
-
-		if ( (length==0) && (uart_rx_buffer_len>0) ) {
+		uint16_t len = uart_rx_parse();
+		if (len > 0) {
 			// There was incomplete packet waiting for the rest of the data which never came..
-      if ( (uart_rx_buffer_len >= 5) && (uart_rx_buffer[0]==0xff) && (uart_rx_buffer[1]==0x9a) ) {
-        // After waking up we lost the first byte (0x00) but the two other bytes match, so let's try to process this
-
-        // shift buffer 1 byte forward..
-        for(i=0; i<uart_rx_buffer_len; i++)
-        {
-          uart_rx_buffer[i+1] = uart_dma_rx_buffer[i];
-        }
-        // and add the missing first byte
-        uart_rx_buffer[0] = 0x00;
-        uart_rx_buffer_len++;
-        // .. processing continues below..
-
-      } else {
-        send_error_msg();
-        uart_rx_buffer_len = 0;
-      }
+			if ( (len == 5) && (UART_RX_BYTE(0)==0xff) && (UART_RX_BYTE(1)==0x9a) && ((UART_RX_BYTE(2) ^ UART_RX_BYTE(3)) == UART_RX_BYTE(4)) &&
+					(device_address == UART_BROADCAST_ADDRESS) ) {
+				// After waking up we lost the first byte (0x00) but the two other bytes match, so let's try to process this.
+				// (Not on a multi-drop bus where the lost byte was the address)
+				uart_process_command(UART_BROADCAST_ADDRESS, UART_RX_BYTE(2), UART_RX_BYTE(3));
+			} else {
+				send_error_msg(len);
+			}
+			uart_rx_tail = (uart_rx_tail + len) & UART_RX_INDEX_MASK;
 		}
 	}
 	else                /* DMA Rx Complete event */
 	{
-		length = UART_DMA_BUF_SIZE - start;
-		dma_uart_rx.prevCNDTR = UART_DMA_BUF_SIZE;
-	}
-
-	/* Copy and Process new data */
-	// Acknowledge also the possible previously received (incomplete) packet
-	for(i=0,pos=start; i<length; ++i,++pos)
-	{
-		uart_rx_buffer[uart_rx_buffer_len + i] = uart_dma_rx_buffer[pos];
-	}
-	length += uart_rx_buffer_len;
-
-	// handle the packet(s)
-	pos=0;
-	uint16_t len = length;
-	while (len>=6) {
-		uint8_t tx_bytes=0;
-		if (handle_command(&uart_rx_buffer[pos], uart_tx_buffer, &tx_bytes )) {
-			if (tx_bytes) {
-				uart_tx_buffer[0] = 0x00;
-				uart_tx_buffer[1] = 0xff;
-        // calculate checksum
-        uint8_t checksum = 0;
-        for (i=3; i<tx_bytes-1; i++) {
-          checksum = checksum ^ uart_tx_buffer[i];
-        }
-        uart_tx_buffer[tx_bytes-1] = checksum;
-        uart_send_msg(uart_tx_buffer, tx_bytes);
-			}
-//      blink += 1;
-			pos += 6;
-			len -= 6;
-		}
-	}
-	if (pos < length) {
-		// Incomplete packet (either true loss of data or we are waiting
-		// for more data from DMA but arrived at the end of the cyclic DMA buffer
-		// while mid-packet, and must wait for the next DMA interrupt for the rest of the data
-
-		// lets save the first chunk
-		len = length - pos;
-		if (pos != 0) {
-			for (int i=0;i<len;i++)
-				uart_rx_buffer[i] = uart_rx_buffer[pos+i];
-		}
-		uart_rx_buffer_len = len;
-
-		/* Start DMA timer */
-		dma_uart_rx.timer = DMA_TIMEOUT_MS;
-	} else {
-		uart_rx_buffer_len = 0;
+		uart_rx_event(0);
 	}
 }
 
 void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart) {
+  post_event(EVENT_UART);
   // UART DMA TX is complete. Adjust buffer size and low pointer (read pointer)
   uart_dma_tx_buffer_len -= uart_dma_tx_size;
   uart_dma_tx_buffer_low_ptr += uart_dma_tx_size;
-  if (uart_dma_tx_buffer_low_ptr >= UART_DMA_BUF_SIZE) {
-    uart_dma_tx_buffer_low_ptr -= UART_DMA_BUF_SIZE;
+  if (uart_dma_tx_buffer_low_ptr >= UART_TX_BUF_SIZE) {
+    uart_dma_tx_buffer_low_ptr -= UART_TX_BUF_SIZE;
   }
   if (uart_dma_tx_buffer_len > 0) {
     // transfer more data
@@ -371,37 +960,141 @@ void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart) {
   __HAL_UART_DISABLE_IT(huart, UART_IT_ERR);
 
   if(huart->Instance == USART1) {
+#ifdef EVENTLOG_ENABLED
+    eventlog_add(EVENTLOG_UART_ERROR, huart->ErrorCode);
+#endif
+    if ( (huart->ErrorCode & HAL_UART_ERROR_FE) && (uart_baud_rate_sel != 0) ) {
+      // Too many framing errors suggests that the other end is still (or again) using 2400 baud
+      if (++uart_framing_errors >= UART_MAX_FRAMING_ERRORS) {
+        uart_baud_rate_pending = 0;
+      }
+    }
     // Restart the RX DMA
     uart_start_rx_DMA();
   }
 }
 
-void HAL_GPIO_EXTI_Callback(uint16_t GPIO_Pin) {
-	if (GPIO_Pin == HALL_1_OUT_Pin) {
-		  hall_sensor_callback(HALL_1_SENSOR, HAL_GPIO_ReadPin( HALL_1_OUT_GPIO_Port, HALL_1_OUT_Pin));
-	} else if (GPIO_Pin == HALL_2_OUT_Pin) {
-		  hall_sensor_callback(HALL_2_SENSOR, HAL_GPIO_ReadPin( HALL_2_OUT_GPIO_Port, HALL_2_OUT_Pin));
-	}
+/*
+ * Request switching to a higher baud rate (index to uart_baud_rates). The baud rate is changed after the reply has been
+ * transmitted using the current baud rate. Then a valid packet has to be received using the new baud rate during 
+ * UART_BAUD_RATE_CONFIRM_TIMEOUT, otherwise we fall back to 2400 baud. 
+ * Returns 1 if baud rate is valid
+ */
+uint8_t uart_request_baud_rate(uint8_t sel) {
+  if (sel >= UART_BAUD_RATE_COUNT) {
+    return 0;
+  }
+  uart_baud_rate_pending = sel;
+  return 1;
+}
+
+void uart_set_baud_rate(uint8_t sel) {
+  HAL_UART_DeInit(&huart1);
+  uart_baud_rate_sel = sel;
+  MX_USART1_UART_Init();
+  uart_apply_bus_mode();
+  uart_start_rx_DMA();
+  uart_framing_errors = 0;
+  uart_baud_rate_confirmed = (sel == 0);
+  uart_baud_rate_timestamp = HAL_GetTick();
+}
+
+/*
+ * Called from the main loop
+ */
+void uart_process() {
+  if ( (uart_baud_rate_pending >= 0) && uart_tx_done() ) {
+    uint8_t sel = uart_baud_rate_pending;
+    uart_baud_rate_pending = -1;
+    if (sel != uart_baud_rate_sel) {
+      uart_set_baud_rate(sel);
+    }
+  }
+  if ( (!uart_baud_rate_confirmed) && (HAL_GetTick() - uart_baud_rate_timestamp > UART_BAUD_RATE_CONFIRM_TIMEOUT) ) {
+    // No valid packets received using the new baud rate -> fall back to 2400 baud
+    uart_set_baud_rate(0);
+  }
 }
 
+// Called from the EXTI handlers of both Hall sensors after the pending bit has been cleared
+void hall_edge_callback() {
+	hall_sensor_callback();
+	post_event(EVENT_HALL);
+}
+
+/* 
+ * Sleep timer is used to track when motor is idle and no commands have been issued. 
+ * After idle_mode_sleep_delay milliseconds sleep mode is entered.
+ * If disabled then sleep mode is disabled temporarily (e.g. during movement and calibration)
+ */
 uint8_t sleep_timer_enabled() {
-	return (idle_timestamp != 0);
+	return swtimer_running(SWTIMER_SLEEP);
 }
 
 void disable_sleep_timer() {
-	idle_timestamp = 0; // disable sleep mode timer
+	swtimer_stop(SWTIMER_SLEEP);
+}
+
+#ifdef ADAPTIVE_SLEEP_DELAY_ENABLED
+// Called from UART interrupt for every received frame (also frames meant for other modules, since they wake us up too)
+void sleep_frame_received() {
+	uint32_t now = HAL_GetTick() + sleep_time_total;
+	uint32_t interval = now - last_frame_time;
+	last_frame_time = now;
+	if (interval < idle_mode_sleep_delay) {
+		return;	// bursts of frames don't make us sleep anyway
+	}
+	if (interval > 2UL * max_sleep_delay) {
+		interval = 2UL * max_sleep_delay;
+	}
+	frame_interval_avg = frame_interval_avg + (int32_t)(interval - frame_interval_avg) / (1 << ADAPTIVE_SLEEP_SMOOTHING_SHIFT);
+}
+#endif
+
+// Idle time before entering sleep mode (see ADAPTIVE_SLEEP_DELAY_ENABLED)
+uint32_t get_sleep_delay() {
+#ifdef ADAPTIVE_SLEEP_DELAY_ENABLED
+	if ( (frame_interval_avg > 0) && (frame_interval_avg <= max_sleep_delay) ) {
+		uint32_t delay = frame_interval_avg + frame_interval_avg / 4;
+		if (delay > max_sleep_delay) {
+			delay = max_sleep_delay;
+		}
+		if (delay > idle_mode_sleep_delay) {
+			return delay;
+		}
+	}
+#endif
+	return idle_mode_sleep_delay;
 }
 
 void reset_sleep_timer() {
-	idle_timestamp = HAL_GetTick();
+	swtimer_start(SWTIMER_SLEEP, get_sleep_delay(), 0, NULL);
+#ifdef BLINK_LEDS_WHEN_SLEEP_MODE_CHANGES
+	sleep_blink_queued = 0;
+#endif
+}
+
+/*
+ * Called after the sleep timer has expired. The LED patterns (and the blink announcing sleep mode) are shown before
+ * entering sleep mode, since the LED timer doesn't run in Stop mode. Returns 1 when sleep mode can be entered
+ */
+uint8_t sleep_mode_ready() {
+#ifdef BLINK_LEDS_WHEN_SLEEP_MODE_CHANGES
+	if (!sleep_blink_queued) {
+		sleep_blink_queued = led_blink(100,100,1);
+	}
+#endif
+#ifdef LED_BLINK_ENABLED
+	if (led_blinking()) {
+		return 0;
+	}
+#endif
+	return 1;
 }
 
 uint8_t sleep_timer_timeout() {
   if (idle_mode_sleep_delay > 0) {
-    if (idle_timestamp == 0)
-      return 0;
-    if (HAL_GetTick() - idle_timestamp > idle_mode_sleep_delay) 
-      return 1;
+    return swtimer_expired(SWTIMER_SLEEP);
   }
   return 0;
 }
@@ -414,33 +1107,233 @@ uint8_t sleep_timer_timeout() {
  *  sleep mode: 1.7 mA (not used currently)
  *  stop mode: 0.337 mA (ST-Link connected)
  */
+#if defined(SLEEP_TRACKING_ENABLED) || defined(BATTERY_SOC_ENABLED) || defined(ADAPTIVE_SLEEP_DELAY_ENABLED)
+static uint8_t rtc_running = 0;
+
+// Start RTC (clocked by LSI) with 1 Hz calendar and 320 Hz sub-second counter. Leaves RTC write access enabled
+static void rtc_start() {
+  __HAL_RCC_PWR_CLK_ENABLE();
+  PWR->CR |= PWR_CR_DBP;	// allow access to RTC domain
+  if (!rtc_running) {
+    RCC->CSR |= RCC_CSR_LSION;
+    while (!(RCC->CSR & RCC_CSR_LSIRDY)) {
+    }
+    RCC->BDCR = (RCC->BDCR & ~RCC_BDCR_RTCSEL) | RCC_BDCR_RTCSEL_LSI | RCC_BDCR_RTCEN;
+  }
+  RTC->WPR = 0xCA;
+  RTC->WPR = 0x53;
+  if (!rtc_running) {
+    RTC->ISR |= RTC_ISR_INIT;
+    while (!(RTC->ISR & RTC_ISR_INITF)) {
+    }
+    RTC->PRER = (124 << 16) | 319;	// 40 kHz / 125 = 320 Hz, / 320 = 1 Hz
+    RTC->ISR &= ~RTC_ISR_INIT;
+    rtc_running = 1;
+  }
+}
+#endif
+
+#ifdef SLEEP_TRACKING_ENABLED
+volatile uint8_t rtc_alarm_flag = 0;	// set by RTC_IRQHandler
+
+/*
+ * Configure RTC alarm A to fire every 2^shift / 320 seconds (only the lowest bits of sub-second counter are compared).
+ * RTC is clocked by LSI (~40 kHz) divided to 320 Hz sub-second counter. shift = 0 disables the alarm.
+ */
+static void rtc_set_periodic_alarm(uint8_t shift) {
+  if ( (!rtc_running) && (shift == 0) )
+    return;
+
+  rtc_start();
+  RTC->CR &= ~(RTC_CR_ALRAE | RTC_CR_ALRAIE);
+  while (!(RTC->ISR & RTC_ISR_ALRAWF)) {
+  }
+  if (shift != 0) {
+    RTC->ALRMAR = RTC_ALRMAR_MSK4 | RTC_ALRMAR_MSK3 | RTC_ALRMAR_MSK2 | RTC_ALRMAR_MSK1;
+    RTC->ALRMASSR = (uint32_t)shift << RTC_ALRMASSR_MASKSS_Pos;	// SS[shift-1:0] == 0
+    RTC->ISR &= ~RTC_ISR_ALRAF;
+    RTC->CR |= RTC_CR_ALRAE | RTC_CR_ALRAIE;
+  }
+  RTC->WPR = 0xFF;
+
+  // RTC alarm is connected to EXTI line 17
+  EXTI->PR = EXTI_PR_PR17;
+  if (shift != 0) {
+    EXTI->RTSR |= EXTI_RTSR_TR17;
+    EXTI->IMR |= EXTI_IMR_MR17;
+    HAL_NVIC_SetPriority(RTC_IRQn, IRQ_PRIORITY_HOUSEKEEPING, 0);
+    HAL_NVIC_EnableIRQ(RTC_IRQn);
+  } else {
+    EXTI->IMR &= ~EXTI_IMR_MR17;
+  }
+}
+
+#endif
+
+static void sleep_tracking_power_up() {
+  HAL_GPIO_WritePin(PWR_EN_GPIO_Port, PWR_EN_Pin, GPIO_PIN_SET);
+  // SysTick is suspended (or too coarse) so busy-wait instead (the loop takes at least 4 cycles per iteration)
+  for (volatile uint32_t i = 0; i < SystemCoreClock / 4000000 * SLEEP_TRACKING_POWER_UP_TIME; i++) {
+  }
+}
+
+#ifdef SENSOR_POWER_GATING_ENABLED
+uint8_t sensor_powered = 1;
+uint32_t sensor_power_off_time;	// HAL_GetTick() value when the sensors are powered off if not busy
+uint32_t sensor_poll_timestamp;
+uint32_t sensor_voltage_timestamp;
+
+/*
+ * Power the sensors up and resume counting the Hall sensor edges (and updating the voltage reading if refresh_voltage
+ * is set).
+ * Returns 1 if the rod was turned while the sensors were unpowered
+ */
+static uint8_t sensor_power_up(uint8_t refresh_voltage) {
+  uint8_t changed = 0;
+  if (!sensor_powered) {
+    sleep_tracking_power_up();
+    changed = motor_hall_poll();
+    EXTI->PR = HALL_1_OUT_Pin | HALL_2_OUT_Pin;
+    EXTI->IMR |= HALL_1_OUT_Pin | HALL_2_OUT_Pin;
+    sensor_powered = 1;
+  }
+  if (refresh_voltage && adc_voltage_hold) {
+    __disable_irq();
+    adc_voltage_hold = 0;
+    adc_skip_half = 1;	// the half being converted may have samples from before the sensor had settled
+    __enable_irq();
+  }
+  return changed;
+}
+
+static void sensor_power_down() {
+  // Hall sensor edges caused by powering the sensors off are ignored (like in sleep tracking)
+  EXTI->IMR &= ~(HALL_1_OUT_Pin | HALL_2_OUT_Pin);
+  adc_voltage_hold = 1;
+  HAL_GPIO_WritePin(PWR_EN_GPIO_Port, PWR_EN_Pin, GPIO_PIN_RESET);
+  sensor_powered = 0;
+}
+
+/*
+ * Power the sensors on demand while awake (see SENSOR_POWER_GATING_ENABLED). busy is set by the motor state machine
+ * while the sensors are needed. Called from the main loop
+ */
+void sensor_power_process(uint8_t busy) {
+  uint32_t now = HAL_GetTick();
+#ifdef SLEEP_TRACKING_ENABLED
+  if (sleep_tracking == SLEEP_TRACKING_CONTINUOUS) {
+    busy = 1;
+  }
+#endif
+  if (busy) {
+    sensor_power_up(1);
+    sensor_power_off_time = now + SENSOR_POWER_IDLE_DELAY;
+  } else if (sensor_powered) {
+    // Voltage must be known before the first move after boot (see adc_readings_valid)
+    if ( ((int32_t)(now - sensor_power_off_time) >= 0) && adc_readings_valid() ) {
+      sensor_power_down();
+      sensor_poll_timestamp = now;
+    }
+  } else if (now - sensor_voltage_timestamp >= SENSOR_POWER_VOLTAGE_INTERVAL) {
+    sensor_voltage_timestamp = sensor_poll_timestamp = now;
+    sensor_power_up(1);
+    sensor_power_off_time = now + SENSOR_POWER_VOLTAGE_TIME;
+  } else if (now - sensor_poll_timestamp >= SENSOR_POWER_POLL_INTERVAL) {
+    sensor_poll_timestamp = now;
+    if (sensor_power_up(0)) {
+      sensor_power_off_time = now + SENSOR_POWER_IDLE_DELAY;	// passive movement: keep tracking it
+    } else {
+      sensor_power_down();
+    }
+  }
+}
+#endif
+
+#if defined(BATTERY_SOC_ENABLED) || defined(ADAPTIVE_SLEEP_DELAY_ENABLED)
+#define BCD(x) (((x) >> 4) * 10 + ((x) & 0x0f))
+
+// Milliseconds since midnight from RTC calendar. Accuracy depends on LSI frequency
+static uint32_t rtc_get_time_ms() {
+  rtc_start();
+  // Shadow registers have to be resynchronized after waking up from Stop mode
+  RTC->ISR &= ~RTC_ISR_RSF;
+  while (!(RTC->ISR & RTC_ISR_RSF)) {
+  }
+  RTC->WPR = 0xFF;
+  uint32_t ssr = RTC->SSR;
+  uint32_t tr = RTC->TR;
+  (void)RTC->DR;	// unlock the shadow registers
+  uint32_t seconds = BCD((tr >> 16) & 0x3f) * 3600 + BCD((tr >> 8) & 0x7f) * 60 + BCD(tr & 0x7f);
+  return seconds * 1000 + (319 - ssr) * 1000 / 320;
+}
+#endif
+
 void enter_sleep_mode() {
+#ifdef SLEEP_TRACKING_ENABLED
+  uint8_t tracking = sleep_tracking;
+#endif
+#ifdef SENSOR_POWER_GATING_ENABLED
+  // Sleep mode handles the sensor power by itself and leaves them powered when waking up
+  sensor_power_up(1);
+#endif
+
+  // Stop mode is always entered (and exited) using HSI clock
+  system_clock_fast(0);
 
   // Stop TIM3 (motor RPM adjust timer) and ADC
   HAL_TIM_Base_Stop_IT(&htim3);
   HAL_ADC_Stop_DMA(&hadc);
 
+#ifdef SLEEP_TRACKING_ENABLED
+  if (tracking != SLEEP_TRACKING_CONTINUOUS) {
+    // Hall sensor edges caused by powering the sensors on and off are ignored. Changes are polled instead
+    EXTI->IMR &= ~(HALL_1_OUT_Pin | HALL_2_OUT_Pin);
+    // Disable HALL sensors and voltage sensor (LM321 op amp)
+    HAL_GPIO_WritePin(PWR_EN_GPIO_Port, PWR_EN_Pin, GPIO_PIN_RESET);
+  }
+  rtc_set_periodic_alarm( (tracking <= SLEEP_TRACKING_MAX_SHIFT) ? tracking : 0 );
+#else
+  // Hall sensor edges caused by powering the sensors off would wake up the MCU right away and count as movement
+  EXTI->IMR &= ~(HALL_1_OUT_Pin | HALL_2_OUT_Pin);
   // Disable HALL sensors and voltage sensor (LM321 op amp)
   HAL_GPIO_WritePin(PWR_EN_GPIO_Port, PWR_EN_Pin, GPIO_PIN_RESET);
+#endif
 
-#ifdef BLINK_LEDS_WHEN_SLEEP_MODE_CHANGES
-  blink_led(100,1);
+#ifdef LED_BLINK_ENABLED
+  // Cancel pending blinking so that LED isn't left on during sleep
+  led_stop();
+#endif
+
+#ifdef EVENTLOG_ENABLED
+#ifdef SLEEP_TRACKING_ENABLED
+  eventlog_add(EVENTLOG_SLEEP, tracking);
+#else
+  eventlog_add(EVENTLOG_SLEEP, 0);
+#endif
 #endif
 
+  // Always wake up using 2400 baud so that the original Zigbee module keeps working.
+  // Baud rate is switched already now so that nothing has to be re-initialized after waking up
+  if (uart_baud_rate_sel != 0) {
+    uart_set_baud_rate(0);
+  }
+  uart_baud_rate_pending = -1;
+  uart_baud_rate_confirmed = 1;
+
   // stop SysTick
   HAL_SuspendTick();
 
-  // Deinitialize UART and use UART1_RX only for wake-up interrupt
-  HAL_UART_DeInit(&huart1);
-
-  GPIO_InitTypeDef GPIO_InitStruct = {0};
-  GPIO_InitStruct.Pin = GPIO_PIN_10;  // UART1_RX
-  GPIO_InitStruct.Mode = GPIO_MODE_IT_FALLING;
-  GPIO_InitStruct.Pull = GPIO_NOPULL;
-  HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
+  // UART and its RX DMA channel are kept configured during Stop mode (register contents are retained) so that the
+  // receiver is armed as soon as the clock is running again. UART1_RX (PA10) stays in alternate function mode and
+  // its falling edge is routed to EXTI line 10 only for waking up the CPU.
+  SYSCFG->EXTICR[2] &= ~SYSCFG_EXTICR3_EXTI10;	// port A
+  EXTI->FTSR |= EXTI_FTSR_TR10;
+  EXTI->PR = EXTI_PR_PR10;
+  EXTI->IMR |= EXTI_IMR_MR10;
 
 #ifdef WAKE_UP_USING_BUTTON
   // Allow waking up with the debug button
+  GPIO_InitTypeDef GPIO_InitStruct = {0};
   GPIO_InitStruct.Pin = BUT_Pin;
   GPIO_InitStruct.Mode = GPIO_MODE_IT_FALLING;
   GPIO_InitStruct.Pull = GPIO_PULLUP;
@@ -450,24 +1343,74 @@ void enter_sleep_mode() {
   // APB peripheral power interface clock needs to be enabled
   __HAL_RCC_PWR_CLK_ENABLE();
 
+#if defined(BATTERY_SOC_ENABLED) || defined(ADAPTIVE_SLEEP_DELAY_ENABLED)
+  uint32_t sleep_started = rtc_get_time_ms();
+#endif
+
   // --- Go to sleep (Stop mode) ------
   //HAL_PWR_EnterSLEEPMode(PWR_MAINREGULATOR_ON, PWR_SLEEPENTRY_WFE);
+#ifdef SLEEP_TRACKING_ENABLED
+  while (1) {
+    rtc_alarm_flag = 0;
+    HAL_PWR_EnterSTOPMode(PWR_LOWPOWERREGULATOR_ON, PWR_STOPENTRY_WFI);
+    if ( (!rtc_alarm_flag) || (main_events != 0) || (tracking == SLEEP_TRACKING_CONTINUOUS) ) {
+      break;	// woken up by UART, button or Hall sensor edge
+    }
+    // Periodic check: has the curtain rod been turned since the previous check?
+    sleep_tracking_power_up();
+    if (motor_hall_poll()) {
+      break;	// keep the sensors on and track the movement
+    }
+    HAL_GPIO_WritePin(PWR_EN_GPIO_Port, PWR_EN_Pin, GPIO_PIN_RESET);
+  }
+  rtc_set_periodic_alarm(0);
+  if (tracking != SLEEP_TRACKING_CONTINUOUS) {
+    // Make sure sensors are stable before edges are processed again
+    sleep_tracking_power_up();
+    motor_hall_poll();
+    EXTI->PR = HALL_1_OUT_Pin | HALL_2_OUT_Pin;
+    EXTI->IMR |= HALL_1_OUT_Pin | HALL_2_OUT_Pin;
+  }
+#else
   HAL_PWR_EnterSTOPMode(PWR_LOWPOWERREGULATOR_ON, PWR_STOPENTRY_WFI);
+  // Make sure sensors are stable before edges are processed again
+  sleep_tracking_power_up();
+  motor_hall_poll();
+  EXTI->PR = HALL_1_OUT_Pin | HALL_2_OUT_Pin;
+  EXTI->IMR |= HALL_1_OUT_Pin | HALL_2_OUT_Pin;
+#endif
 
   // ---- Now we are awake ---
 
+  // UART is already receiving. Stop generating interrupts from UART1_RX edges
+  EXTI->IMR &= ~EXTI_IMR_MR10;
+
   // Is this needed?
   // SystemClock_Config();
 
   // Restart SysTick
   HAL_ResumeTick();
- 
-  MX_USART1_UART_Init();
 
-  uart_start_rx_DMA();
+#ifdef EVENTLOG_ENABLED
+  eventlog_add(EVENTLOG_WAKE_UP, 0);
+#endif
+
+#if defined(BATTERY_SOC_ENABLED) || defined(ADAPTIVE_SLEEP_DELAY_ENABLED) || defined(THERMAL_PROTECTION_ENABLED)
+  // Sleep duration (sleeping over 24 hours at once is undercounted)
+  uint32_t slept = (rtc_get_time_ms() + 24UL*3600*1000 - sleep_started) % (24UL*3600*1000);
+#endif
+#ifdef BATTERY_SOC_ENABLED
+  soc_add_sleep(slept);
+#endif
+#ifdef THERMAL_PROTECTION_ENABLED
+  thermal_add_sleep(slept);
+#endif
+#ifdef ADAPTIVE_SLEEP_DELAY_ENABLED
+  sleep_time_total += slept;
+#endif
 
 #ifdef BLINK_LEDS_WHEN_SLEEP_MODE_CHANGES
-  blink_led(100,1);
+  led_blink(100,100,1);
 #endif
 
 #ifdef WAKE_UP_USING_BUTTON
@@ -484,14 +1427,18 @@ void enter_sleep_mode() {
   HAL_GPIO_Init(HALL_1_OUT_GPIO_Port, &GPIO_InitStruct);
 #endif
 
-  HAL_ADC_Start_DMA(&hadc, (uint32_t*)adc_buf, ADC_BUF_LEN);
-  __HAL_DMA_DISABLE_IT(hadc.DMA_Handle, DMA_IT_HT);  // disable half-transfer interrupt
+  adc_start();
 
   HAL_TIM_Base_Start_IT(&htim3);
 
   // Enable HALL sensors and voltage sensor (LM321 op amp)
   HAL_GPIO_WritePin(PWR_EN_GPIO_Port, PWR_EN_Pin, GPIO_PIN_SET);
 
+#ifdef SENSOR_POWER_GATING_ENABLED
+  // Refresh the voltage reading before the sensors are powered off again
+  sensor_voltage_timestamp = sensor_poll_timestamp = HAL_GetTick();
+  sensor_power_off_time = sensor_voltage_timestamp + SENSOR_POWER_VOLTAGE_TIME;
+#endif
 }
 
 
@@ -513,14 +1460,21 @@ int main(void)
   HAL_Init();
 
   /* USER CODE BEGIN Init */
-
+#ifdef EVENTLOG_ENABLED
+  // Reset flags tell why we (re)booted
+  eventlog_init(RCC->CSR >> 24);
+  RCC->CSR |= RCC_CSR_RMVF;
+#endif
   /* USER CODE END Init */
 
   /* Configure the system clock */
   SystemClock_Config();
 
   /* USER CODE BEGIN SysInit */
-
+#ifdef DYNAMIC_CLOCK_ENABLED
+  // Baud rate must not depend on the core clock (see system_clock_fast)
+  __HAL_RCC_USART1_CONFIG(RCC_USART1CLKSOURCE_HSI);
+#endif
   /* USER CODE END SysInit */
 
   /* Initialize all configured peripherals */
@@ -530,18 +1484,25 @@ int main(void)
   MX_USART1_UART_Init();
   MX_TIM1_Init();
   MX_TIM3_Init();
+  MX_TIM14_Init();
   /* USER CODE BEGIN 2 */
-  HAL_ADC_Start_DMA(&hadc, (uint32_t*)adc_buf, ADC_BUF_LEN);
-  __HAL_DMA_DISABLE_IT(hadc.DMA_Handle, DMA_IT_HT);  // disable half-transfer interrupt
+#ifdef ADC_PWM_SYNC_ENABLED
+  // Keep TIM1 running all the time so that ADC is triggered also when motor is stopped
+  HAL_TIM_PWM_Start(&htim1, ADC_TRIGGER_PWM_CHANNEL);
+#endif
+  // Free running timer for Hall sensor timestamps
+  HAL_TIM_Base_Start(&htim14);
+
+  adc_start();
 
   HAL_TIM_Base_Start_IT(&htim3);
 
   /* Unlock the Flash Program Erase controller */
   HAL_FLASH_Unlock();
 
-#ifndef SLIM_BINARY
-  /* EEPROM Init */
-  if (EE_Init() != HAL_OK) {
+#ifdef EEPROM_SETTINGS_ENABLED
+  /* EEPROM Init. Only the page headers are checked here, the rest is done when idle (see EE_FastInit) */
+  if (EE_FastInit() != HAL_OK) {
 	  // Initing FLASH failed! This should not happen! We will try to continue anyway by setting default values
 	  motor_set_default_settings();
   } else {
@@ -550,6 +1511,7 @@ int main(void)
 #else
   motor_set_default_settings();
 #endif
+  uart_apply_bus_mode();
 
   /* USER CODE END 2 */
 
@@ -558,14 +1520,16 @@ int main(void)
 
   // Enable HALL sensors and voltage sensor (LM321 op amp)
   HAL_GPIO_WritePin(PWR_EN_GPIO_Port, PWR_EN_Pin, GPIO_PIN_SET);
+  adc_reset_filter();
 
   // Start UART receiver in DMA mode
   uart_start_rx_DMA();
 
   motor_init();
 
-#ifndef SLIM_BINARY
-  blink_led(500,2);
+#ifdef LED_BLINK_ENABLED
+  // Blinking is done in the main loop so that commands are served right away after reset
+  led_blink(500,500,2);
 #endif
 
   while (1)
@@ -573,17 +1537,37 @@ int main(void)
     /* USER CODE END WHILE */
 
     /* USER CODE BEGIN 3 */
-	if (blink) {
-    uint8_t _blink = blink;
-    blink = 0;
-
-#ifndef SLIM_BINARY
-		blink_led(100,_blink);
+	uint8_t events = wait_for_events();
+#ifdef ISR_PROFILER_ENABLED
+	uint16_t profile_start = profile_enter(PROFILE_MAIN_LOOP);
 #endif
+
+	if (events & EVENT_TIMER) {
+		swtimer_process();
+	}
+
+#ifdef LED_BLINK_ENABLED
+	if (blink && led_blink(100,100,blink)) {
+		blink = 0;
 	}
+#else
+	blink = 0;
+#endif
 
+	// Motor state machine is run on every event (at least once per millisecond because of SysTick)
 	motor_process();
 
+	if (events & (EVENT_TICK | EVENT_UART)) {
+		uart_process();
+
+#ifdef PROTOCOL_V2_ENABLED
+		v2_process();
+#endif
+	}
+#ifdef ISR_PROFILER_ENABLED
+	profile_exit(PROFILE_MAIN_LOOP, profile_start);
+#endif
+
   }
   /* USER CODE END 3 */
 }
@@ -683,7 +1667,44 @@ static void MX_ADC_Init(void)
     Error_Handler();
   }
   /* USER CODE BEGIN ADC_Init 2 */
-
+#ifdef ADC_PWM_SYNC_ENABLED
+  // Convert both channels (current first) when triggered by TIM1 TRGO, with shorter sampling time
+#ifdef DYNAMIC_CLOCK_ENABLED
+  hadc.Init.ClockPrescaler = ADC_CLOCK_SYNC_PCLK_DIV4;	// max 14 MHz ADC clock also when PCLK is 48 MHz
+#else
+  hadc.Init.ClockPrescaler = ADC_CLOCK_SYNC_PCLK_DIV2;
+#endif
+  hadc.Init.ScanConvMode = ADC_SCAN_DIRECTION_BACKWARD;
+  hadc.Init.ContinuousConvMode = DISABLE;
+  hadc.Init.ExternalTrigConv = ADC_EXTERNALTRIGCONV_T1_TRGO;
+  hadc.Init.ExternalTrigConvEdge = ADC_EXTERNALTRIGCONVEDGE_RISING;
+  if (HAL_ADC_Init(&hadc) != HAL_OK)
+  {
+    Error_Handler();
+  }
+  sConfig.Channel = ADC_CHANNEL_9;
+  sConfig.Rank = ADC_RANK_CHANNEL_NUMBER;
+  sConfig.SamplingTime = ADC_VOLTAGE_SAMPLETIME;
+  if (HAL_ADC_ConfigChannel(&hadc, &sConfig) != HAL_OK)
+  {
+    Error_Handler();
+  }
+#endif
+#ifdef HW_OVERCURRENT_ENABLED
+  // Analog watchdog on the current channel (see motor_overcurrent_trip)
+  ADC_AnalogWDGConfTypeDef awd = {0};
+  awd.WatchdogMode = ADC_ANALOGWATCHDOG_SINGLE_REG;
+  awd.Channel = ADC_CHANNEL_9;
+  awd.ITMode = ENABLE;
+  awd.HighThreshold = OVERCURRENT_TRIP_CURRENT / 2;	// 2 mA per LSB (see adc_process_half)
+  awd.LowThreshold = 0;
+  if (HAL_ADC_AnalogWDGConfig(&hadc, &awd) != HAL_OK)
+  {
+    Error_Handler();
+  }
+  HAL_NVIC_SetPriority(ADC1_IRQn, IRQ_PRIORITY_HALL, 0);
+  HAL_NVIC_EnableIRQ(ADC1_IRQn);
+#endif
   /* USER CODE END ADC_Init 2 */
 
 }
@@ -751,7 +1772,33 @@ static void MX_TIM1_Init(void)
     Error_Handler();
   }
   /* USER CODE BEGIN TIM1_Init 2 */
-
+  // PWM resolution and frequency are configured in main.h
+  htim1.Instance->PSC = PWM_PRESCALER_8MHZ;
+  htim1.Instance->ARR = PWM_PERIOD;
+  htim1.Init.Prescaler = PWM_PRESCALER_8MHZ;
+  htim1.Init.Period = PWM_PERIOD;
+#ifdef PWM_DITHERING_ENABLED
+  // Update interrupt is enabled only while the motor is driven (see motor_pwm_dither)
+  HAL_NVIC_SetPriority(TIM1_BRK_UP_TRG_COM_IRQn, IRQ_PRIORITY_CONTROL, 0);
+  HAL_NVIC_EnableIRQ(TIM1_BRK_UP_TRG_COM_IRQn);
+#endif
+#ifdef ADC_PWM_SYNC_ENABLED
+  /*
+   * Channel 2 is not connected to any pin. It's used only to trigger ADC conversion: in PWM mode 2 the OC2REF rising edge
+   * occurs when the counter reaches CCR2, which is kept at the centre of the motor PWM on-time (see update_motor_pwm)
+   */
+  sConfigOC.OCMode = TIM_OCMODE_PWM2;
+  sConfigOC.Pulse = 1;
+  if (HAL_TIM_PWM_ConfigChannel(&htim1, &sConfigOC, ADC_TRIGGER_PWM_CHANNEL) != HAL_OK)
+  {
+    Error_Handler();
+  }
+  sMasterConfig.MasterOutputTrigger = TIM_TRGO_OC2REF;
+  if (HAL_TIMEx_MasterConfigSynchronization(&htim1, &sMasterConfig) != HAL_OK)
+  {
+    Error_Handler();
+  }
+#endif
   /* USER CODE END TIM1_Init 2 */
   HAL_TIM_MspPostInit(&htim1);
 
@@ -810,11 +1857,46 @@ static void MX_TIM3_Init(void)
     Error_Handler();
   }
   /* USER CODE BEGIN TIM3_Init 2 */
-
+  // Clock TIM3 at 10 kHz so that the period can be changed at runtime with 0.1 ms resolution (see set_control_period)
+  __HAL_TIM_SET_PRESCALER(&htim3, SystemCoreClock / 10000 - 1);
+  __HAL_TIM_SET_AUTORELOAD(&htim3, DEFAULT_CONTROL_PERIOD * 10 - 1);
+  htim3.Instance->EGR = TIM_EGR_UG;	// load the prescaler
+  __HAL_TIM_CLEAR_FLAG(&htim3, TIM_FLAG_UPDATE);
   /* USER CODE END TIM3_Init 2 */
 
 }
 
+/**
+  * @brief TIM14 Initialization Function
+  * @param None
+  * @retval None
+  */
+static void MX_TIM14_Init(void)
+{
+
+  /* USER CODE BEGIN TIM14_Init 0 */
+
+  /* USER CODE END TIM14_Init 0 */
+
+  /* USER CODE BEGIN TIM14_Init 1 */
+
+  /* USER CODE END TIM14_Init 1 */
+  htim14.Instance = TIM14;
+  htim14.Init.Prescaler = 7;
+  htim14.Init.CounterMode = TIM_COUNTERMODE_UP;
+  htim14.Init.Period = 65535;
+  htim14.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
+  htim14.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_DISABLE;
+  if (HAL_TIM_Base_Init(&htim14) != HAL_OK)
+  {
+    Error_Handler();
+  }
+  /* USER CODE BEGIN TIM14_Init 2 */
+
+  /* USER CODE END TIM14_Init 2 */
+
+}
+
 /**
   * @brief USART1 Initialization Function
   * @param None
@@ -846,9 +1928,25 @@ static void MX_USART1_UART_Init(void)
   }
   /* USER CODE BEGIN USART1_Init 2 */
 
+  if (uart_baud_rate_sel != 0) {
+    // Negotiated higher baud rate (USART has to be disabled while changing it)
+    __HAL_UART_DISABLE(&huart1);
+    huart1.Init.BaudRate = uart_baud_rates[uart_baud_rate_sel];
+    // USART1 may be clocked from HSI while the core runs from PLL (see DYNAMIC_CLOCK_ENABLED)
+    uint32_t clock = (__HAL_RCC_GET_USART1_SOURCE() == RCC_USART1CLKSOURCE_HSI) ? HSI_VALUE : HAL_RCC_GetPCLK1Freq();
+    USART1->BRR = UART_DIV_SAMPLING16(clock, huart1.Init.BaudRate);
+    __HAL_UART_ENABLE(&huart1);
+  }
+
   /* UART1 IDLE Interrupt Configuration */
   SET_BIT(USART1->CR1, USART_CR1_IDLEIE);
 
+#ifdef UART_RX_TIMEOUT_ENABLED
+  USART1->RTOR = UART_RX_TIMEOUT_BITS;
+  SET_BIT(USART1->CR2, USART_CR2_RTOEN);
+  SET_BIT(USART1->CR1, USART_CR1_RTOIE);
+#endif
+
   /* USER CODE END USART1_Init 2 */
 
 }
@@ -864,10 +1962,10 @@ static void MX_DMA_Init(void)
 
   /* DMA interrupt init */
   /* DMA1_Channel1_IRQn interrupt configuration */
-  HAL_NVIC_SetPriority(DMA1_Channel1_IRQn, 0, 0);
+  HAL_NVIC_SetPriority(DMA1_Channel1_IRQn, 2, 0);
   HAL_NVIC_EnableIRQ(DMA1_Channel1_IRQn);
   /* DMA1_Channel2_3_IRQn interrupt configuration */
-  HAL_NVIC_SetPriority(DMA1_Channel2_3_IRQn, 0, 0);
+  HAL_NVIC_SetPriority(DMA1_Channel2_3_IRQn, 3, 0);
   HAL_NVIC_EnableIRQ(DMA1_Channel2_3_IRQn);
 
 }
@@ -945,10 +2043,10 @@ static void MX_GPIO_Init(void)
   HAL_GPIO_Init(BUT_GPIO_Port, &GPIO_InitStruct);
 
   /* EXTI interrupt init*/
-  HAL_NVIC_SetPriority(EXTI0_1_IRQn, 0, 0);
+  HAL_NVIC_SetPriority(EXTI0_1_IRQn, IRQ_PRIORITY_HALL, 0);
   HAL_NVIC_EnableIRQ(EXTI0_1_IRQn);
 
-  HAL_NVIC_SetPriority(EXTI4_15_IRQn, 0, 0);
+  HAL_NVIC_SetPriority(EXTI4_15_IRQn, IRQ_PRIORITY_HALL, 0);
   HAL_NVIC_EnableIRQ(EXTI4_15_IRQn);
 
 }
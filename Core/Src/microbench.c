@@ -0,0 +1,96 @@
+#include "microbench.h"
+#include "motor.h"
+
+#ifdef MICROBENCH_ENABLED
+
+extern uint8_t device_address;
+extern uint16_t adc_buf[];
+extern uint8_t uart_dma_tx_size;
+extern uint16_t uart_dma_tx_buffer_len;
+extern uint16_t uart_dma_tx_buffer_high_ptr;
+extern uint16_t uart_tx_max_len;
+
+void adc_process_half(uint16_t * buf);
+void adc_filter_save();
+void adc_filter_restore();
+uint32_t location_to_position100fp();
+uint16_t get_rpm();
+
+volatile uint32_t microbench_sink;  // keeps the results of the kernels from being optimized away
+
+static void microbench_empty() {
+}
+
+static void microbench_get_rpm() {
+    microbench_sink = get_rpm();
+}
+
+static void microbench_position() {
+    microbench_sink = location_to_position100fp();
+}
+
+static void microbench_battery_level() {
+    microbench_sink = get_battery_level();
+}
+
+static void microbench_adc_filter() {
+    adc_process_half(adc_buf);
+}
+
+static void microbench_status_query() {
+    uint8_t buf[UART_MAX_PACKET_SIZE];
+    uint8_t tx_bytes = 0;
+    microbench_sink = handle_command(device_address, 0xcc, 0xcc, buf, &tx_bytes);
+}
+
+static void microbench_uart_send() {
+    static uint8_t msg[8];
+    uint16_t len = uart_dma_tx_buffer_len;
+    uint16_t high_ptr = uart_dma_tx_buffer_high_ptr;
+    uart_send_msg(msg, sizeof(msg));
+    uart_dma_tx_buffer_len = len;
+    uart_dma_tx_buffer_high_ptr = high_ptr;
+}
+
+static void (* const microbench_kernels[MICROBENCH_KERNEL_COUNT])() = {
+    microbench_empty,
+    microbench_get_rpm,
+    microbench_position,
+    microbench_battery_level,
+    microbench_adc_filter,
+    microbench_status_query,
+    microbench_uart_send,
+};
+
+uint32_t microbench_run(microbench_kernel_t kernel, uint16_t iterations) {
+    if (kernel >= MICROBENCH_KERNEL_COUNT) {
+        return 0;
+    }
+    void (* fn)() = microbench_kernels[kernel];
+    uint32_t elapsed = 0;
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    uint8_t tx_size = uart_dma_tx_size;
+    uint16_t tx_max_len = uart_tx_max_len;
+    adc_filter_save();
+    if (uart_dma_tx_size == 0) {
+        // pretend that a transfer is active so that uart_send_msg doesn't start one
+        uart_dma_tx_size = 1;
+    }
+    // The 16-bit timer would wrap around during a long run, so accumulate the time of each call
+    uint16_t prev = HALL_TIMER->CNT;
+    for (uint16_t i=0; i<iterations; i++) {
+        fn();
+        uint16_t now = HALL_TIMER->CNT;
+        elapsed += (uint16_t)(now - prev);
+        prev = now;
+    }
+    adc_filter_restore();
+    uart_dma_tx_size = tx_size;
+    uart_tx_max_len = tx_max_len;
+    __set_PRIMASK(primask);
+    return elapsed;
+}
+
+#endif
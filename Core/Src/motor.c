@@ -7,10 +7,24 @@
 #include "main.h"
 #include "motor.h"
 #include "eeprom.h"
+#include "flashlog.h"
 #include "bootloader.h"
+#include "soc.h"
+#include "thermal.h"
+#include "eventlog.h"
+#include "profiler.h"
+#include "microbench.h"
+#include "ramstats.h"
+#include "warmstate.h"
+#include "protocol_v2.h"
 #include "stdlib.h" // abs function
+#include "string.h"
+#include "stddef.h" // offsetof
 
 extern uint8_t blink;
+extern uint16_t uart_tx_dropped;
+extern uint16_t uart_tx_max_len;
+extern uint16_t uart_rx_errors;
 
 motor_status_t status;
 motor_direction_t direction;
@@ -33,21 +47,91 @@ int32_t location = 0;
 uint8_t orientation = DEFAULT_ORIENTATION;
 
 uint32_t full_curtain_length = DEFAULT_FULL_CURTAIN_LEN;
-uint32_t max_curtain_length;
+uint32_t max_curtain_length;	// change with set_max_curtain_length() so that the scale factors below are updated
+
+/*
+ * Cortex-M0 has no hardware divider, so position conversions use scale factors cached when max_curtain_length changes:
+ * position_scale = (100 << POSITION_DECIMAL_BITS << 16) / max_curtain_length and
+ * location_scale = (max_curtain_length << 12) / 100
+ */
+uint32_t position_scale;
+uint32_t location_scale;
+
+void set_max_curtain_length( uint32_t length ) {
+	max_curtain_length = length;
+	position_scale = (length > 0) ? (((100UL << POSITION_DECIMAL_BITS) << 16) + length - 1) / length : 0;
+	location_scale = (length << 12) / 100;
+}
 
 uint16_t minimum_voltage;	// value is minimum voltage (in Volts) * 16 (fixed point integer)
 uint32_t idle_mode_sleep_delay;
+#ifdef ADAPTIVE_SLEEP_DELAY_ENABLED
+uint16_t max_sleep_delay = DEFAULT_MAX_SLEEP_DELAY;	// see ADAPTIVE_SLEEP_DELAY_ENABLED in main.h
+#endif
+#ifdef SLEEP_TRACKING_ENABLED
+uint8_t sleep_tracking = DEFAULT_SLEEP_TRACKING;	// see SLEEP_TRACKING_ENABLED in main.h
+#endif
+uint8_t device_address = UART_BROADCAST_ADDRESS;	// see MULTIDROP_BUS_ENABLED in main.h
 
 uint8_t default_speed;	// with 2 bits of decimal precision
 uint8_t target_speed = 0; // target RPM (with 2 bits of decimal precision)
-uint8_t curr_pwm = 0;  // motor PWM duty cycle setting
+uint8_t cruise_speed = 0; // requested RPM of current movement before slowing down (with 2 bits of decimal precision)
+#ifdef LIVE_RETARGETING_ENABLED
+uint8_t ramp_speed = 0;	// cruise speed ramped towards cruise_speed after it has been changed during movement
+uint8_t ramp_time = 0;
+#endif
+#ifdef SPEED_ZONES_ENABLED
+uint16_t speed_zones[SPEED_ZONE_COUNT];	// (end position << 8) | speed, see SPEED_ZONES_ENABLED
+uint8_t zoned_move = 0;	// current move is travelled at the speeds of the zones
+#endif
+uint16_t curr_pwm = 0;  // motor PWM duty cycle setting (TIM1 compare value)
+#ifdef SOFT_START_ENABLED
+uint16_t start_current_limit = DEFAULT_START_CURRENT_LIMIT;	// mA, 0 = disabled
+uint8_t soft_start = 0;	// speed controller output is limited by soft_start_pwm
+int32_t soft_start_pwm;
+#endif
+#ifdef BROWNOUT_RIDE_THROUGH_ENABLED
+uint8_t brownout_limiting = 0;	// speed controller output is limited by brownout_pwm because of a supply sag
+int32_t brownout_pwm;
+uint16_t brownout_start_pwm = MAX_PWM;	// lowest limit during the latest sags, caps the PWM the next move starts with
+#endif
+#ifdef THERMAL_PROTECTION_ENABLED
+uint16_t thermal_speed_scale = 256;	// cruise speed multiplier (/256), updated from the main loop
+uint8_t thermal_overheated = 0;	// new moves wait until the motor has cooled down
+#endif
+#ifdef PWM_DITHERING_ENABLED
+volatile uint32_t * pwm_dither_ccr = 0;	// compare register of the active PWM channel, 0 when motor is not driven
+uint8_t pwm_dither_fraction = 0;	// fractional part of the duty cycle (PWM_DITHER_BITS)
+uint8_t pwm_dither_accumulator = 0;
+#endif
 
-/*
-* This flag is set when a new signal is received from Hall sensor and we can update the duty cycle.
-* Used only when slowing down
-* (speeding up must be done without waiting for this signal because otherwise we could end up stalling the motor prematurely)
-*/
-uint8_t rpm_updated = 0;
+// Speed controller gains (with PI_GAIN_DECIMAL_BITS of decimal precision)
+uint8_t pi_kp = DEFAULT_PI_KP;
+uint8_t pi_ki = DEFAULT_PI_KI;
+uint8_t pwm_ff_gain = DEFAULT_PWM_FF_GAIN;
+int32_t pi_integral = 0;	// integral term of the speed controller (PWM with PI_GAIN_DECIMAL_BITS of decimal precision, multiplied by CONTROL_REFERENCE_PERIOD)
+uint8_t control_period = DEFAULT_CONTROL_PERIOD;	// milliseconds
+
+#ifdef AUTOTUNE_ENABLED
+// See AUTOTUNE_ENABLED
+autotune_phase_t autotune_phase = AutotuneIdle;
+autotune_result_t autotune_result = AutotuneNone;
+motor_direction_t autotune_direction;
+uint32_t autotune_step_timestamp;
+uint16_t autotune_pwm[2];	// applied PWM of the low and high step (0 = step not started yet)
+uint16_t autotune_rpm[2];	// speed averaged over the end of the steps (RPM with RPM_DECIMAL_BITS)
+uint32_t autotune_rpm_sum;
+uint16_t autotune_rpm_count;
+uint32_t autotune_area_sum;	// sum of speed * control period since the start of the high step
+uint32_t autotune_area_time;	// milliseconds since the start of the high step
+uint16_t autotune_tau = 0;	// measured time constant in milliseconds
+void motor_autotune_start();
+#endif
+
+// Controller state sampled every CONTROL_SAMPLE_PERIOD (used by telemetry)
+uint8_t control_sample_time = 0;
+uint16_t control_sample_rpm;
+uint16_t control_sample_pwm;
 
 uint16_t max_motor_current = DEFAULT_MAX_MOTOR_CURRENT;
 
@@ -58,6 +142,14 @@ uint16_t max_motor_current = DEFAULT_MAX_MOTOR_CURRENT;
  */
 uint32_t endpoint_calibration_started_timestamp = 0;
 
+#ifdef EARLY_ENDPOINT_DETECTION_ENABLED
+// Motor current history for detecting the current rise when hitting the top position
+uint16_t endpoint_current_history[ENDPOINT_SLOPE_SAMPLES];
+uint8_t endpoint_current_pos = 0;
+uint8_t endpoint_current_samples = 0;
+uint8_t endpoint_sample_timer = 0;
+#endif
+
 /*
  * When calibrating (after CMD_RESET_CURTAIN_LENGTH) we allow unrestricted movement until calibration procedure is done
  */
@@ -76,6 +168,18 @@ uint32_t hall_sensor_2_ticks = 0;	// how many hall sensor #2 ticks(signals) afte
 
 uint32_t hall_sensor_1_interval = 0; // how many milliseconds between Hall sensor #1 ticks
 
+#ifdef HALL_TIMESTAMPS_ENABLED
+/*
+ * Timestamps (HALL_TIMER counter value in microseconds) of the Hall sensor edges. Intervals between the latest edges
+ * of both sensors are stored in a ring buffer and their sum gives the period of one motor revolution.
+ */
+uint16_t hall_edge_timestamp = 0;
+uint16_t hall_edge_intervals[HALL_EDGES_PER_REVOLUTION];
+uint8_t hall_edge_pos = 0;
+uint8_t hall_edge_count = 0;	// number of valid consecutive intervals in the ring buffer
+uint32_t hall_edge_idle_time = 0;	// how many milliseconds since previous edge of either sensor
+#endif
+
 /*
  * Used for stall detection grace period
  * Motor is given some time to gather speed by increasing PWM duty cycle before applying stall detection
@@ -83,13 +187,89 @@ uint32_t hall_sensor_1_interval = 0; // how many milliseconds between Hall senso
 uint32_t movement_started_timestamp = 0;
 
 uint16_t stall_detection_timeout = DEFAULT_STALL_DETECTION_TIMEOUT;
+#ifdef ADAPTIVE_STALL_DETECTION_ENABLED
+uint16_t adaptive_stall_timeout = MAX_STALL_DETECTION_TIMEOUT;	// updated by the speed controller
+#endif
 
-int rotor_position = -1;
+uint8_t hall_state = 0;	// previous state of the Hall sensors
+#ifdef HALL_HEALTH_MONITORING_ENABLED
+uint8_t hall_failed_sensor = 0;	// HALL_STATE_SENSOR_1 or HALL_STATE_SENSOR_2 in degraded single-sensor mode, otherwise 0
+uint8_t hall_single_sensor = 0;	// sensor that changed at the latest edge
+uint8_t hall_single_edges = 0;	// consecutive edges of hall_single_sensor
+int8_t hall_single_steps = 0;	// location change from those edges
+motor_direction_t hall_last_direction = None;	// direction of the latest move
+#endif
 
 uint8_t min_slowdown_speed = (DEFAULT_MINIMUM_SLOWDOWN_SPEED << RPM_DECIMAL_BITS);
 uint8_t	slowdown_factor = DEFAULT_SLOWDOWN_FACTOR;
+#ifdef DIRECTIONAL_TUNING_ENABLED
+uint8_t min_slowdown_speed_down = (DEFAULT_MINIMUM_SLOWDOWN_SPEED_DOWN << RPM_DECIMAL_BITS);
+uint8_t slowdown_factor_down = DEFAULT_SLOWDOWN_FACTOR_DOWN;
+uint8_t speed_bump[2];	// learned speed bumps for Up and Down, added to default_speed
+#endif
+#ifdef STALL_RECOVERY_ENABLED
+uint8_t stall_counts[2][STALL_RECOVERY_BINS];	// low-current stalls per location bin (Up, Down)
+uint8_t stall_free_moves[2];	// moves reaching target since the last decay step
+uint16_t stall_retry_pwm = 0;	// start PWM of the retry after a stall (0 = no retry pending)
+void stall_recovery_move_completed( motor_direction_t dir );
+#endif
+
+/*
+ * Motion profile for slowing down when approaching the target location. The table contains the target speed as a function
+ * of distance to target: entry i covers distances from (i << motion_profile_shift) to ((i+1) << motion_profile_shift) - 1.
+ * Slowdown starts when distance to target is less than motion_profile_length. The table is rebuilt in the main loop
+ * (motor_build_profile) when a movement starts or speed settings change, so that the control loop only needs to index it.
+ */
+uint8_t motion_profile[MOTION_PROFILE_BINS];
+uint8_t motion_profile_shift = 0;
+uint16_t motion_profile_length = 0;	// 0 = profile is disabled
+uint8_t motion_profile_dirty = 0;	// set when the profile needs to be rebuilt
+
+motor_command_t command; // for deferring execution to main loop
+#ifdef MOVE_PIPELINING_ENABLED
+uint8_t staged_move = 0;	// a move is waiting for the current phase to end (see MOVE_PIPELINING_ENABLED)
+int32_t staged_target;
+int32_t pipeline_target;	// target of the current move before the latest command was executed
+#endif
+#ifdef RESIDENT_UPDATER_ENABLED
+uint8_t updater_baud;	// see CMD_EXT_ENTER_UPDATER
+#endif
+
+/*
+ * Commands received via UART are pushed into this single-producer (UART interrupt), single-consumer (main loop) queue
+ */
+uint16_t command_queue[COMMAND_QUEUE_SIZE];
+volatile uint8_t command_queue_head = 0;	// written only by UART interrupt
+volatile uint8_t command_queue_tail = 0;	// written only by main loop
 
-motor_command_t command; // for deferring execution to main loop since we don't want to invoke HAL_Delay in UARTinterrupt handler
+// Telemetry push (see CMD_EXT_SUBSCRIBE)
+uint16_t telemetry_interval = 0;	// in milliseconds. 0 = disabled
+uint32_t telemetry_timestamp;
+motor_status_t telemetry_last_status;
+uint8_t telemetry_pending = 0;	// force sending the next frame
+uint8_t telemetry_buffer[10];
+
+/*
+ * Double-buffered state snapshot with a sequence counter (seqlock). The writer fills the inactive buffer and then
+ * increments state_seq. Reader retries if state_seq changed while copying
+ */
+motor_state_t motor_state[2];
+volatile uint8_t motor_state_seq = 0;
+
+// Pending start of the motor (see motor_request_start)
+motor_start_phase_t start_phase = StartIdle;
+motor_direction_t start_direction;
+uint8_t start_speed;
+uint32_t start_phase_timestamp;
+uint32_t start_settle_time;	// maximum time to wait for the curtain rod to settle
+uint32_t start_settle_min_time;	// minimum time to wait before energizing the motor
+uint32_t hall_last_edge_timestamp = 0;	// HAL_GetTick() value of the latest Hall sensor edge
+#ifdef DYNAMIC_BRAKING_ENABLED
+uint8_t dynamic_braking = 0;	// both low-side mosfets are switched by the speed controller
+uint8_t stop_braking = 0;	// windings are shorted after stopping at target (see motor_stop_braked)
+uint32_t stop_brake_timestamp;
+void motor_stop_braked();
+#endif
 motor_error_t last_error;
 
 // --- Flexi-speed parameters
@@ -101,11 +281,42 @@ uint16_t last_command; // the last command issued (except commands related to ge
 
 // statistics for debugging
 uint16_t dir_error = 0;
+uint16_t hall_invalid_transitions = 0;
+
+#ifdef BACKLASH_COMPENSATION_ENABLED
+int16_t backlash_correction = 0;	// ticks subtracted at each reversal to Down (BACKLASH_DECIMAL_BITS)
+int16_t backlash_remainder = 0;	// fractional ticks not yet applied
+motor_direction_t last_move_direction = None;
+uint16_t reversals_since_calibration = 0;	// reversals to Down since the latest endpoint calibration
+uint8_t backlash_tracking = 0;	// set after the first endpoint calibration
+int16_t location_drift = 0;	// location error found at the latest endpoint calibration (for debugging)
+#endif
 uint16_t sensor_ticks_while_stopped = 0;
 uint16_t sensor_ticks_while_calibrating_endpoint = 0;
 uint16_t last_stalling_current = 0;
 uint16_t highest_motor_current = 0;
-uint8_t pwm_when_stalled = 0;
+#ifdef MOVE_METERING_ENABLED
+/*
+ * Sum of get_voltage() * current (mA) samples taken every millisecond, >> MOVE_ENERGY_SHIFT.
+ * Doesn't overflow in 4 minutes even at maximum current.
+ */
+#define MOVE_ENERGY_SHIFT 10
+#define MOVE_ENERGY_DIVIDER 4688	// (30*16) * 10000 / (1 << MOVE_ENERGY_SHIFT) -> x10 mJ (1 V * 1 mA * 1 ms = 1 uJ)
+
+move_record_t move_log[MOVE_LOG_SIZE];
+uint8_t move_log_head = 0;	// next record to be written
+uint8_t move_metering = 0;	// set while a move is being metered
+uint32_t move_energy;
+uint32_t move_time;			// milliseconds while energized
+#endif
+
+#ifdef MOTION_TRACE_ENABLED
+trace_sample_t motion_trace[MOTION_TRACE_SIZE];
+uint8_t motion_trace_count = 0;
+uint8_t motion_trace_decimation;	// samples are recorded every Nth control period
+uint8_t motion_trace_phase;
+#endif
+uint16_t pwm_when_stalled = 0;
 uint16_t stalled_moving_up_counter = 0;
 uint16_t stalled_moving_down_counter = 0;
 extern uint16_t lowest_voltage;
@@ -151,6 +362,17 @@ extern uint16_t lowest_voltage;
 #define CMD_EXT_SET_MAX_MOTOR_CURRENT 	0x62	// Set max motor current (current is 2nd byte * 16, measured in mA. Maximum value is 0xff = 4A)
 #define CMD_EXT_SET_STALL_DETECTION_TIMEOUT 0x63	// Set hall sensor timeout (to detect motor stalling). (value is 2nd byte * 8, measured in milliseconds)
 #define CMD_EXT_SET_SLEEP_DELAY 		0x64	// The delay (in ms) after which sleep mode is entered when motor is idle. (value is 2nd byte * 256, measured in milliseconds. 0 = sleep mode is disabled)
+#define CMD_EXT_SET_PI_KP				0x65	// Set speed controller proportional gain (value has PI_GAIN_DECIMAL_BITS of decimal precision)
+#define CMD_EXT_SET_PI_KI				0x66	// Set speed controller integral gain (value has PI_GAIN_DECIMAL_BITS of decimal precision)
+#define CMD_EXT_SET_PWM_FF_GAIN			0x67	// Set speed controller feed-forward gain (value has PI_GAIN_DECIMAL_BITS of decimal precision)
+#define CMD_EXT_SET_BAUD_RATE			0x68	// Switch UART baud rate (0 = 2400, 1 = 19200, 2 = 57600, 3 = 115200). Not stored to flash memory
+#define CMD_EXT_SUBSCRIBE				0x69	// Push telemetry frames while moving and on status change (value is interval * 10 ms. 0 = unsubscribe)
+#define CMD_EXT_SET_CONTROL_PERIOD		0x6a	// Set speed controller period (1-20 ms). Not stored to flash memory
+#define CMD_EXT_SET_SLEEP_TRACKING		0x6b	// Hall sensor tracking during sleep (0 = off, N = check every 2^N/320 s, 0xff = continuous). Not stored to flash memory
+#define CMD_EXT_SET_SUNRISE_DURATION	0x6c	// Duration (in minutes) of the next go-to move, which is then done in short bursts (see SUNRISE_MODE_ENABLED)
+#define CMD_EXT_SET_DEVICE_ADDRESS		0x6d	// Device address on a multi-drop bus (0 = none, default). Will be stored to flash memory
+#define CMD_EXT_ARM_GROUP_MOVE			0x6e	// 1 = next go-to command only arms the target for CMD_EXT_GROUP_GO, 0 = disarm (see GROUP_MOVE_ENABLED)
+#define CMD_EXT_GROUP_GO				0x6f	// Start the armed move. Travel time in seconds (0 = use default speed)
 #define CMD_EXT_GO_TO_LOCATION			0x70	// Go to target location (measured in Hall sensor ticks). Location is the lower 4 bits of the 1st byte + 2nd byte
 #define CMD_EXT_SET_SLOWDOWN_FACTOR 	0x80	// Set slowdown factor
 #define CMD_EXT_SET_MIN_SLOWDOWN_SPEED	0x90	// Set minimum approach speed (value is RPM with 2 decimal bits)
@@ -158,6 +380,21 @@ extern uint16_t lowest_voltage;
 // Ping function for debugging/testing. If 1st parameter is 0 then blink internal LED (not the one on WiFi module!). 
 // Otherwise send back ping message with the 1st parameter incremented by 1.
 #define CMD_EXT_PING					0xa0	
+// Get the motion trace of the latest move. 2nd byte is the chunk number (see MOTION_TRACE_ENABLED)
+#define CMD_EXT_GET_TRACE				0xa1
+// Get the event log (see eventlog.h). 2nd byte is the chunk number (chunk 0 contains the newest records)
+#define CMD_EXT_GET_EVENTS				0xa2
+// Get the interrupt profiler figures (see profiler.h). 2nd byte is the chunk number, or 0xff to reset the figures
+#define CMD_EXT_GET_PROFILE				0xa3
+#define PROFILE_RESET					0xff
+// Run a microbenchmark (see microbench.h). Lower 4 bits of the 2nd byte select the kernel and upper 4 bits are
+// the base-2 logarithm of the iteration count
+#define CMD_EXT_MICROBENCH				0xa4
+// Restart to the resident updater (see updater.h). 2nd byte is the updater baud rate / 9600 (0 = UPDATER_DEFAULT_BAUD)
+#define CMD_EXT_ENTER_UPDATER			0xa5
+// Run the tuning move and store the computed speed controller gains and slowdown parameters (see AUTOTUNE_ENABLED).
+// 2nd byte is reserved (0)
+#define CMD_EXT_AUTOTUNE				0xa6
 
 // commands without parameter
 #define CMD_EXT_OVERRIDE_DOWN		0xfada	// Continous move down ignoring the max/full curtain length. Maximum movement of 5 revolutions per command
@@ -168,6 +405,14 @@ extern uint16_t lowest_voltage;
 #define CMD_EXT_GET_LIMITS 			0xccdf
 #define CMD_EXT_DEBUG	 			0xccd1
 #define CMD_EXT_SENSOR_DEBUG 		0xccd2
+#define CMD_EXT_UART_DEBUG			0xccd4
+#define CMD_EXT_EEPROM_DEBUG		0xccd5
+#define CMD_EXT_GET_BATTERY			0xccd7	// State of charge estimate, voltage based level and consumed charge
+#define CMD_EXT_GET_MOVE_LOG		0xccd9	// Energy and duration of the last MOVE_LOG_SIZE moves
+#define CMD_EXT_GET_LIFETIME_STATS	0xccd8
+#define CMD_EXT_GET_RAM_STATS		0xccda	// Peak stack depth and static RAM usage (see RAM_STATS_ENABLED)
+#define CMD_EXT_GET_AUTOTUNE		0xccdb	// Result and measurements of the latest tuning move (see AUTOTUNE_ENABLED)
+#define CMD_EXT_GET_MULTI			0xcce0	// Aggregate query. Lower 5 bits of the 2nd byte select the returned sections (see query_sections)
 #define CMD_EXT_ENTER_BOOTLOADER	0xff00
 #define CMD_EXT_FLEXISPEED_TRIGGER	0xff01 // force flexispeed triggering
 #define CMD_EXT_DANCE				0xff02 // test dance steps
@@ -175,23 +420,34 @@ extern uint16_t lowest_voltage;
 
 #define STATUS_CMD_BYTE 0xcc // all "get status" commands start with this byte.
 
-// Steps for "acknowledge dance"
-motor_command_t dance_steps_up_down[] = {
-	MotorUp,
-	Stop,
-	MotorDown,
-};
-
-motor_command_t dance_steps_down_up[] = {
-	MotorDown,
-	Stop,
-	MotorUp,
-};
+// Motion script (ring buffer of move steps). Also used for the "acknowledge dance" and 90 degree override moves
+motion_step_t motion_script[MOTION_SCRIPT_SIZE];
+uint8_t motion_script_head;		// next step to be executed
+uint8_t motion_script_tail;		// next free slot
+uint8_t motion_script_dwell;	// dwell time (x100 ms) after the step currently being executed
+uint8_t script_fast_step;		// currently executed step is a fast dance step (no slowdown)
+uint8_t script_dwell_pending;
+uint32_t script_dwell_timestamp;
+
+#ifdef SUNRISE_MODE_ENABLED
+uint8_t sunrise_duration;	// minutes. 0 = next go-to command is a normal move
+uint8_t sunrise_active;
+int16_t sunrise_start_location;
+int16_t sunrise_target;
+uint16_t sunrise_bursts;
+uint16_t sunrise_burst_pos;	// number of bursts started
+uint32_t sunrise_interval;	// milliseconds between the start of consecutive bursts
+uint32_t sunrise_start_timestamp;
+#endif
 
-#define MAX_DANCE_STEPS 8
-int dance_step_pos;
-int dance_steps_num = 0;
-motor_command_t dance_steps[MAX_DANCE_STEPS];
+#ifdef GROUP_MOVE_ENABLED
+uint8_t group_arm_next;		// next go-to command arms the target
+uint8_t group_armed;
+int16_t group_target;
+uint32_t group_armed_timestamp;
+volatile uint8_t group_go_received;	// set in UART interrupt when CMD_EXT_GROUP_GO is received
+volatile uint32_t group_go_timestamp;
+#endif
 
 
 /****************** EEPROM variables ********************/
@@ -205,15 +461,75 @@ typedef enum eeprom_var_t {
 	ORIENTATION_EEPROM = 5,
 	MAX_MOTOR_CURRENT_EEPROM = 6,
 	STALL_DETECTION_TIMEOUT_EEPROM = 7,
-	IDLE_MODE_SLEEP_DELAY_EEPROM = 8
+	IDLE_MODE_SLEEP_DELAY_EEPROM = 8,
+	BREAKAWAY_PWM_UP_EEPROM = 9,
+	BREAKAWAY_PWM_DOWN_EEPROM = 10,
+	DEVICE_ADDRESS_EEPROM = 11,
+	PI_GAINS_EEPROM = 12,			// pi_kp << 8 | pi_ki
+	PWM_FF_GAIN_EEPROM = 13,
+	SLOWDOWN_UP_EEPROM = 14,		// slowdown_factor << 8 | min_slowdown_speed
+	SLOWDOWN_DOWN_EEPROM = 15
 } eeprom_var_t;
 
 /* Virtual address defined by the user: 0xFFFF value is prohibited */
-uint16_t VirtAddVarTab[NB_OF_VAR] = {0x5555, 0x6666, 0x7770, 0x8880, 0x9999, 0xAAAA, 0xBBB1, 0xCCCC, 0xDDD0};
+uint16_t VirtAddVarTab[NB_OF_VAR] = {0x5555, 0x6666, 0x7770, 0x8880, 0x9999, 0xAAAA, 0xBBB1, 0xCCCC, 0xDDD0, 0xEEE0, 0xEEE1, 0xEEE2,
+	0xEEE3, 0xEEE4, 0xEEE5, 0xEEE6};
+
+// Settings waiting to be committed to flash memory (see motor_write_setting)
+uint16_t eeprom_pending_values[NB_OF_VAR];
+uint16_t eeprom_dirty = 0;	// bit N is set if variable N is pending
+uint32_t eeprom_dirty_timestamp;
+
+#ifdef LOCATION_JOURNAL_ENABLED
+int32_t journal_location = -1;	// location in the latest valid journal record (-1 = invalidated)
+uint8_t journal_orientation;
+int32_t journal_settling_location = -1;	// location is journaled when it hasn't changed for LOCATION_JOURNAL_DELAY
+uint32_t journal_settling_timestamp;
+#endif
+
+#ifdef FLASHLOG_ENABLED
+uint8_t lifetime_stats_dirty = 0;	// set when the lifetime totals have changed since the latest flash log record
+#endif
+#ifdef LIFETIME_STATS_ENABLED
+lifetime_stats_t lifetime_stats;	// flash_erases field holds the total stored before this power-up
+uint8_t lifetime_moving = 0;		// set while the move is being accounted
+int32_t lifetime_start_location;
+uint16_t lifetime_travel = 0;		// location change not yet added to revolutions
+uint16_t lifetime_motor_on_ms = 0;	// milliseconds not yet added to motor_on_time
+uint32_t lifetime_stats_timestamp;
+#endif
+
+#ifdef LOAD_MAP_ENABLED
+int8_t load_map[2][LOAD_MAP_BINS];	// [Up, Down]. See LOAD_MAP_ENABLED
+int8_t load_map_residual[LOAD_MAP_BINS];	// average integral term of each bin during the current movement
+uint32_t load_map_residual_valid = 0;	// bit N is set if bin N has been sampled during the current movement
+int8_t load_map_bin = -1;	// bin currently being sampled
+int16_t load_map_sum;
+uint8_t load_map_count;
+#endif
+
+#ifdef COAST_PREDICTION_ENABLED
+uint16_t coast_gain[2];	// [Up, Down]. See COAST_PREDICTION_ENABLED
+uint16_t coast_rpm = 0;	// latest speed seen by the speed controller
+int32_t coast_prediction = 0;	// predicted coast distance (ticks) if the motor was stopped now
+uint8_t coast_measuring = 0;	// set when the motor was stopped at target and coasting is being measured
+motor_direction_t coast_direction;
+uint16_t coast_stop_rpm;
+int32_t coast_stop_location;
+#endif
+
+#ifdef BREAKAWAY_PWM_LEARNING_ENABLED
+// Breakaway PWM estimates for Up and Down (0 = not learned yet). See BREAKAWAY_PWM_LEARNING_ENABLED
+uint16_t breakaway_pwm[2];
+uint16_t breakaway_pwm_stored[2];
+uint8_t breakaway_learning = 0;	// set when motor is started, cleared at first Hall sensor tick
+uint16_t breakaway_sample = 0;	// curr_pwm at first Hall sensor tick (0 = no sample pending)
+uint8_t breakaway_sample_direction;
+#endif
 
 
 void motor_set_default_settings() {
-	max_curtain_length = DEFAULT_FULL_CURTAIN_LEN; // by default, max_curtain_length is full_curtain_length
+	set_max_curtain_length(DEFAULT_FULL_CURTAIN_LEN); // by default, max_curtain_length is full_curtain_length
 	full_curtain_length = DEFAULT_FULL_CURTAIN_LEN;
 	minimum_voltage = DEFAULT_MINIMUM_VOLTAGE;
 	default_speed = DEFAULT_TARGET_SPEED << RPM_DECIMAL_BITS;
@@ -222,9 +538,13 @@ void motor_set_default_settings() {
 	max_motor_current = DEFAULT_MAX_MOTOR_CURRENT;
 	stall_detection_timeout = DEFAULT_STALL_DETECTION_TIMEOUT;
 	idle_mode_sleep_delay = DEFAULT_IDLE_MODE_SLEEP_DELAY;
+#ifdef BREAKAWAY_PWM_LEARNING_ENABLED
+	breakaway_pwm[0] = breakaway_pwm[1] = 0;
+	breakaway_pwm_stored[0] = breakaway_pwm_stored[1] = 0;
+#endif
 }
 
-#ifndef SLIM_BINARY
+#ifdef EEPROM_SETTINGS_ENABLED
 void motor_load_settings() {
 	uint16_t tmp;
 	if (EE_ReadVariable(VirtAddVarTab[FULL_CURTAIN_LEN_EEPROM], &tmp) != 0) {
@@ -247,6 +567,7 @@ void motor_load_settings() {
 			max_curtain_length = DEFAULT_FULL_CURTAIN_LEN;
 		}
 	}
+	set_max_curtain_length(max_curtain_length);
 #ifdef READ_DEFAULT_MINIMUM_VOLTAGE_FROM_EEPROM
 	if (EE_ReadVariable(VirtAddVarTab[MINIMUM_VOLTAGE_EEPROM], &tmp) != 0) {
 		tmp = minimum_voltage = DEFAULT_MINIMUM_VOLTAGE;
@@ -301,27 +622,210 @@ void motor_load_settings() {
 #else
 	idle_mode_sleep_delay = DEFAULT_IDLE_MODE_SLEEP_DELAY;
 #endif
+#ifdef MULTIDROP_BUS_ENABLED
+	// Address is not written until it's set
+	if ( (EE_ReadVariable(VirtAddVarTab[DEVICE_ADDRESS_EEPROM], &tmp) == 0) && (tmp <= 0xff) ) {
+		device_address = tmp;
+	}
+#endif
+#ifdef AUTOTUNE_ENABLED
+	// Tuned values are not written until the tuning move has been done
+	if (EE_ReadVariable(VirtAddVarTab[PI_GAINS_EEPROM], &tmp) == 0) {
+		pi_kp = tmp >> 8;
+		pi_ki = tmp & 0xff;
+	}
+	if (EE_ReadVariable(VirtAddVarTab[PWM_FF_GAIN_EEPROM], &tmp) == 0) {
+		pwm_ff_gain = tmp;
+	}
+	if (EE_ReadVariable(VirtAddVarTab[SLOWDOWN_UP_EEPROM], &tmp) == 0) {
+		slowdown_factor = tmp >> 8;
+		min_slowdown_speed = tmp & 0xff;
+	}
+#ifdef DIRECTIONAL_TUNING_ENABLED
+	if (EE_ReadVariable(VirtAddVarTab[SLOWDOWN_DOWN_EEPROM], &tmp) == 0) {
+		slowdown_factor_down = tmp >> 8;
+		min_slowdown_speed_down = tmp & 0xff;
+	}
+#endif
+#endif
+#ifdef BREAKAWAY_PWM_LEARNING_ENABLED
+	// Learned values are not written until there's a sample
+	for (int i=0; i<2; i++) {
+		if ( (EE_ReadVariable(VirtAddVarTab[BREAKAWAY_PWM_UP_EEPROM + i], &tmp) == 0) &&
+				(tmp <= (MAX_BREAKAWAY_PWM << BREAKAWAY_PWM_DECIMAL_BITS)) ) {
+			breakaway_pwm[i] = breakaway_pwm_stored[i] = tmp;
+		} else {
+			breakaway_pwm[i] = breakaway_pwm_stored[i] = 0;
+		}
+	}
+#endif
+#ifdef FLASHLOG_ENABLED
+	flashlog_record_t record;
+	if (flashlog_init(&record) == HAL_OK) {
+#ifdef LOCATION_JOURNAL_ENABLED
+		// Statistics are restored even if the location isn't
+		stalled_moving_up_counter = record.stalled_up_counter;
+		stalled_moving_down_counter = record.stalled_down_counter;
+		lowest_voltage = record.lowest_voltage;
+		if ( (record.valid == FLASHLOG_VALID) && (record.location <= full_curtain_length) &&
+				((record.flags & FLASHLOG_FLAG_ORIENTATION) == orientation) ) {
+			// Journal record is consistent. The location is restored in motor_init()
+			journal_location = journal_settling_location = record.location;
+			journal_orientation = orientation;
+		}
+#endif
+#ifdef LIFETIME_STATS_ENABLED
+		lifetime_stats = record.lifetime;
+#endif
+	}
+#endif
 }
 #endif
 
+/*
+ * Non-volatile settings are not written right away but marked dirty and then committed in one batch by
+ * motor_process_settings() when the motor has been idle for EEPROM_COMMIT_DELAY (or before entering sleep mode).
+ * This way consecutive changes of the same setting are coalesced to one write.
+ */
 void motor_write_setting( eeprom_var_t var, uint16_t value ) {
-#ifndef SLIM_BINARY
-	uint16_t tmp;
-	if ( (status == Stopped) || (status == Error) ) {
-		// motor has to be stopped to change non-volatile settings (writing to FLASH should occur uninterrupted)
-		EE_ReadVariable(VirtAddVarTab[var], &tmp);
-		if (tmp != value) {
-			EE_WriteVariable(VirtAddVarTab[var], value);
+#ifdef EEPROM_SETTINGS_ENABLED
+	eeprom_pending_values[var] = value;
+	eeprom_dirty |= (1 << var);
+	eeprom_dirty_timestamp = HAL_GetTick();
+#endif
+}
+
+void motor_commit_settings() {
+#ifdef EEPROM_SETTINGS_ENABLED
+	for (int i=0; i<NB_OF_VAR; i++) {
+		if (eeprom_dirty & (1 << i)) {
+			// Unchanged values are not written (EE_WriteVariable compares against RAM cache)
+			EE_WriteVariable(VirtAddVarTab[i], eeprom_pending_values[i]);
 		}
 	}
+	eeprom_dirty = 0;
 #endif
 }
 
-uint32_t position100_to_location( uint8_t position ) {
-	if (position >= 100) {
+#ifdef LIFETIME_STATS_ENABLED
+void motor_get_lifetime_stats( lifetime_stats_t * stats ) {
+	*stats = lifetime_stats;
+	stats->flash_erases += flashlog_erase_count + EE_PageTransferCount;
+}
+
+/*
+ * Add the distance of the finished move to the lifetime totals. Called from main loop when the motor is no longer
+ * energized (or when the next move is started)
+ */
+void motor_lifetime_move_finished() {
+	if (!lifetime_moving)
+		return;
+	lifetime_moving = 0;
+	uint32_t travel = lifetime_travel + abs(location - lifetime_start_location);
+	while (travel >= DEG_TO_LOCATION(360)) {
+		travel -= DEG_TO_LOCATION(360);
+		lifetime_stats.revolutions++;
+	}
+	lifetime_travel = travel;
+	lifetime_stats_dirty = 1;
+	lifetime_stats_timestamp = HAL_GetTick();
+}
+#endif
+
+#ifdef FLASHLOG_ENABLED
+void motor_append_flashlog() {
+	flashlog_record_t record;
+	memset(&record, 0, sizeof(record));
+	record.location = location;
+	record.lowest_voltage = lowest_voltage;
+	record.stalled_up_counter = stalled_moving_up_counter > 255 ? 255 : stalled_moving_up_counter;
+	record.stalled_down_counter = stalled_moving_down_counter > 255 ? 255 : stalled_moving_down_counter;
+#ifdef LIFETIME_STATS_ENABLED
+	motor_get_lifetime_stats(&record.lifetime);
+#endif
+	record.flags = orientation ? FLASHLOG_FLAG_ORIENTATION : 0;
+	flashlog_append(&record);
+	lifetime_stats_dirty = 0;
+}
+#endif
+
+#if defined(LIFETIME_STATS_ENABLED) && !defined(LOCATION_JOURNAL_ENABLED)
+/*
+ * Without the location journal the lifetime totals are stored after LIFETIME_STATS_DELAY of idle time,
+ * or right away before entering sleep mode
+ */
+void motor_update_lifetime_stats( uint8_t sleeping ) {
+	if ( lifetime_stats_dirty && ((status == Stopped) || (status == Error)) && (start_phase == StartIdle) &&
+			(sleeping || (HAL_GetTick() - lifetime_stats_timestamp > LIFETIME_STATS_DELAY)) ) {
+		motor_append_flashlog();
+	}
+}
+#endif
+
+#ifdef LOCATION_JOURNAL_ENABLED
+/*
+ * Invalidate the journal record right away when movement is requested, so that the stored location is never trusted
+ * if power is lost while moving. This only clears one halfword of the latest record in flash.
+ */
+void motor_invalidate_location_journal() {
+	flashlog_invalidate();
+	journal_location = journal_settling_location = -1;
+}
+
+/*
+ * Journal the location after the motor has stopped and the location has settled (or when location or orientation
+ * is changed via UART).
+ */
+void motor_update_location_journal() {
+	if ( (status == Stopped) && (start_phase == StartIdle) && (!calibrating) ) {
+		if (location != journal_settling_location) {
+			journal_settling_location = location;
+			journal_settling_timestamp = HAL_GetTick();
+		} else if ( ((location != journal_location) || (orientation != journal_orientation) || lifetime_stats_dirty) &&
+				(HAL_GetTick() - journal_settling_timestamp > LOCATION_JOURNAL_DELAY) ) {
+			if ( (location >= 0) && (location <= full_curtain_length) ) {
+				// lifetime totals are stored in the same record
+				motor_append_flashlog();
+				journal_location = location;
+				journal_orientation = orientation;
+			} else {
+				motor_invalidate_location_journal();
+			}
+		}
+	} else if (calibrating) {
+		motor_invalidate_location_journal();
+	}
+}
+#endif
+
+void motor_process_settings() {
+#ifdef EEPROM_SETTINGS_ENABLED
+	// Checks and repairs of the EEPROM pages postponed at boot
+	if ( EE_RepairPending() && ((status == Stopped) || (status == Error)) && (start_phase == StartIdle) &&
+			(HAL_GetTick() > EEPROM_COMMIT_DELAY) ) {
+		EE_Repair();
+	}
+#endif
+	if (eeprom_dirty == 0)
+		return;
+	// motor has to be stopped to change non-volatile settings (writing to FLASH should occur uninterrupted)
+	if ( ((status == Stopped) || (status == Error)) && (start_phase == StartIdle) ) {
+		if (HAL_GetTick() - eeprom_dirty_timestamp > EEPROM_COMMIT_DELAY) {
+			motor_commit_settings();
+		}
+	}
+}
+
+// position is given with 4 bits of fixed point decimal precision
+uint32_t position100fp4_to_location( uint16_t position ) {
+	if (position >= (100 << 4)) {
 		return max_curtain_length;
 	}
-	return position*max_curtain_length/100;
+	return (position * location_scale) >> 16;
+}
+
+uint32_t position100_to_location( uint8_t position ) {
+	return position100fp4_to_location(position << 4);
 }
 
 
@@ -340,555 +844,3363 @@ uint32_t location_to_position100fp() {
 	if (location >= max_curtain_length) {
 		return 100 << POSITION_DECIMAL_BITS;
 	}
-	return (100<<POSITION_DECIMAL_BITS)*location / max_curtain_length;
+	// location < max_curtain_length, so the product fits in 32 bits
+	return (location * position_scale) >> 16;
 }
 
 
-// Returns RPM with 2 decimal bits
-uint16_t get_rpm() {
+// Converts Hall sensor #1 interval (in milliseconds) to RPM with 2 decimal bits
+uint16_t interval_to_rpm( uint32_t interval ) {
 	uint16_t rpm = 0;
-	if (hall_sensor_1_interval) {
+	if (interval) {
 		// 60000 ms in minute
 		// 2 hall sensor #1 interrupts per motor revolution
 		// GEAR_RATIO motor revolutions per curtain rod revolution
-		rpm = (60*1000 << RPM_DECIMAL_BITS)/GEAR_RATIO/hall_sensor_1_interval/2;
+		rpm = (60*1000 << RPM_DECIMAL_BITS)/GEAR_RATIO/interval/2;
 	}
 	return rpm;
 }
 
+#ifdef ADAPTIVE_STALL_DETECTION_ENABLED
+// Converts RPM with 2 decimal bits to Hall sensor #1 interval (in milliseconds). Same formula as interval_to_rpm
+uint32_t rpm_to_interval( uint16_t rpm ) {
+	if (rpm == 0) {
+		return 0;
+	}
+	return (60*1000 << RPM_DECIMAL_BITS)/GEAR_RATIO/rpm/2;
+}
+
+// Called by the speed controller after target_speed has been updated
+void motor_update_stall_timeout() {
+	uint32_t interval = rpm_to_interval(target_speed);
+	if ( (interval == 0) || (hall_sensor_1_interval > interval) ) {
+		interval = hall_sensor_1_interval;
+	}
+	uint32_t timeout = interval * STALL_DETECTION_INTERVALS;
+	if ( (interval == 0) || (timeout > MAX_STALL_DETECTION_TIMEOUT) ) {
+		timeout = MAX_STALL_DETECTION_TIMEOUT;
+	} else if (timeout < MIN_STALL_DETECTION_TIMEOUT) {
+		timeout = MIN_STALL_DETECTION_TIMEOUT;
+	}
+	adaptive_stall_timeout = timeout;
+}
+#endif
+
+#ifdef HALL_TIMESTAMPS_ENABLED
+uint32_t rpm_cache_period = 0;
+uint16_t rpm_cache_value;
 
 /*
- * This function adjusts location when the curtain rod is rotated by motor AS WELL AS by passive movement.
- * During calibration limits won't be enforced.
+ * Converts motor revolution period (in microseconds) to RPM with 2 decimal bits. The period changes only when a new
+ * Hall sensor edge arrives, so the result of the (software) division is cached for repeated calls with the same period.
  */
-int process_sensor(motor_direction_t sensor_direction) {
-	if (sensor_direction == Up) {
-		location--;
-		if ( (direction == Up) && (!calibrating) ) {
-			if (target_location != -1) {	// if target is -1, force movement up until the motor stalls which causes calibration
-				if (location - 1 <= target_location) {	// stop just before the target
-					motor_stop();
-					return 1;
-				}
-			}
-		}
-	} else if (sensor_direction == Down) {
-		location++;
-		if ( (direction == Down) && (!calibrating) ) {
-			if(location + 1 >= target_location) { // stop just before the target
-				motor_stop();
-				return 1;
-			}
-		}
+uint16_t period_to_rpm( uint32_t period ) {
+	// Called both from the main loop and from UART interrupt (status queries), so keep the cache entry consistent
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	uint8_t hit = (period == rpm_cache_period);
+	uint16_t rpm = rpm_cache_value;
+	__set_PRIMASK(primask);
+	if (hit) {
+		return rpm;
 	}
+	// 60000000 us in minute
+	// GEAR_RATIO motor revolutions per curtain rod revolution
+	rpm = (60UL*1000*1000 << RPM_DECIMAL_BITS)/GEAR_RATIO/period;	// constant part is folded at compile time
+	__disable_irq();
+	rpm_cache_value = rpm;
+	rpm_cache_period = period;
+	__set_PRIMASK(primask);
+	return rpm;
+}
 
-	// If motor is rotating, slow it down when approaching the target location. Ignored for dance steps (we want fast moves!)
-	if ( (direction != None) && (target_location != -1) && (command != Dance)) {
-		int distance_to_target = abs(target_location - location);
-		if (distance_to_target < ((target_speed * slowdown_factor) >> (RPM_DECIMAL_BITS+3)) ) {
-			status = Stopping;
-			int new_speed = (distance_to_target << (RPM_DECIMAL_BITS+3))/slowdown_factor;
-			if (new_speed < min_slowdown_speed)
-				new_speed = min_slowdown_speed; // minimum approach speed
-			if (new_speed < target_speed) 
-				target_speed = new_speed;
-		}
+/*
+ * Returns period of one motor revolution in microseconds calculated from the latest Hall sensor edges, or 0 if there
+ * isn't enough data. Until the motor has done a full revolution, the period is extrapolated from the intervals we have.
+ */
+uint32_t get_revolution_period() {
+	uint32_t period = 0;
+	uint8_t count = hall_edge_count;
+	if (count == 0) {
+		return 0;
 	}
-	return 0;
+	for (int i=1;i<=count;i++) {
+		period += hall_edge_intervals[(hall_edge_pos - i) & (HALL_EDGES_PER_REVOLUTION-1)];
+	}
+	if (count < HALL_EDGES_PER_REVOLUTION) {
+		period = period * HALL_EDGES_PER_REVOLUTION / count;
+	}
+	return period;
 }
+#endif
 
+// Returns RPM with 2 decimal bits
+uint16_t get_rpm() {
+#ifdef HALL_TIMESTAMPS_ENABLED
+	uint32_t period = get_revolution_period();
+	if (period) {
+		return period_to_rpm(period);
+	}
+#endif
+	return interval_to_rpm(hall_sensor_1_interval);
+}
 
 /*
- * Hall sensors will create following interrupts:
- * Upwards movement: HALL1 HIGH, HALL2 HIGH, HALL1 LOW, HALL2 LOW
- * Downwards movement: HALL2 HIGH, HALL1 HIGH, HALL2 LOW, HALL1 LOW
+ * Returns the speed used by the speed controller. The latest Hall sensor interval is outdated when the motor is slowing down
+ * (or stalling), so if more time has already passed since the previous tick, use that instead. This way the
+ * controller can react before the next tick arrives.
  */
-void hall_sensor_callback( uint8_t sensor, uint8_t value ) {
-
-	// This calculation will give following values for rotor_position:
-	// Upwards movement: ..., 0, 1, 2, 3, 0, 1, 2, 3, 0, ...
-	// Downwards movement: ..., 1, 0, 3, 2, 1, 0, 3, 2, 1, 0, ...
-	// Note that changing direction will "skip" 1 position:
-	// 	e.g. HALL2_HIGH -> HALL1_LOW -> stop and change direction -> HALL1_HIGH -> HALL2_LOW will translate to:
-	//	1, 2, (stop & change dir), 0, 3, ...
-	// Also note that if orientation == REVERSE_ORIENTATION, the movement direction is reversed
-	int new_rotor_position = sensor + (1-value)*2;
-
-	if (sensor == HALL_1_SENSOR) {
-		hall_sensor_1_ticks++;
-		if (hall_sensor_1_ticks > 1) {
-			// At least two sensor ticks are needed to calculate interval correctly
-			hall_sensor_1_interval = hall_sensor_1_idle_time;	// update time passed between hall sensor interrupts
-			rpm_updated = 1;
+uint16_t get_controller_rpm() {
+#ifdef HALL_TIMESTAMPS_ENABLED
+	uint32_t period = get_revolution_period();
+	if (period) {
+		// time since the previous edge (of either sensor), scaled to the motor revolution
+		uint32_t elapsed;
+		if (hall_edge_idle_time < HALL_TIMER_MAX_INTERVAL) {
+			elapsed = (uint16_t)(HALL_TIMER->CNT - hall_edge_timestamp);
+		} else {
+			elapsed = hall_edge_idle_time * 1000;
 		}
-		hall_sensor_1_idle_time = 0;
-	} else {
-		hall_sensor_2_ticks++;
+#ifdef HALL_HEALTH_MONITORING_ENABLED
+		elapsed *= hall_failed_sensor ? HALL_EDGES_PER_REVOLUTION/2 : HALL_EDGES_PER_REVOLUTION;
+#else
+		elapsed *= HALL_EDGES_PER_REVOLUTION;
+#endif
+		if (elapsed > period) {
+			period = elapsed;
+		}
+		return period_to_rpm(period);
+	}
+#endif
+	if (hall_sensor_1_interval == 0) {
+		return 0;
 	}
+	if (hall_sensor_1_idle_time > hall_sensor_1_interval) {
+		return interval_to_rpm(hall_sensor_1_idle_time);
+	}
+	return interval_to_rpm(hall_sensor_1_interval);
+}
 
-	// save for debugging
-	if (status == Stopped) {
-		sensor_ticks_while_stopped++;
-	} else if (status == CalibratingEndPoint) {
-		sensor_ticks_while_calibrating_endpoint++;
+#ifdef SPEED_OBSERVER_ENABLED
+int32_t observer_rpm = 0;	// with RPM_DECIMAL_BITS + OBSERVER_EXTRA_BITS of decimal precision
+int32_t observer_bias = 0;	// measured minus back-EMF speed, same precision
+uint32_t observer_edges = 0;	// Hall sensor ticks at the previous update
+
+// Speed (RPM with RPM_DECIMAL_BITS) from the motor voltage and current: (V * duty - I * R) / Ke
+int32_t get_bemf_rpm() {
+	int32_t motor_mv = (uint32_t)get_voltage() * 1000 / (30*16) * curr_pwm / PWM_PERIOD;
+	int32_t emf = motor_mv - (int32_t)(get_motor_current() * MOTOR_RESISTANCE / 1000);
+	if (emf < 0) {
+		emf = 0;
 	}
+	return (emf << RPM_DECIMAL_BITS) / MOTOR_KE;
+}
+
+void speed_observer_reset() {
+	observer_rpm = 0;
+	observer_edges = hall_sensor_1_ticks + hall_sensor_2_ticks;
+}
 
+// Returns the speed used by the speed controller. Called every control tick
+uint16_t speed_observer_update() {
+	uint16_t hall_rpm = get_rpm();
+	uint16_t bound = get_controller_rpm();
+	int32_t model = get_bemf_rpm() << OBSERVER_EXTRA_BITS;
+#ifdef DYNAMIC_BRAKING_ENABLED
+	if (!dynamic_braking)	// the model doesn't hold while the windings are shorted
+#endif
+	observer_rpm += (model + observer_bias - observer_rpm) >> OBSERVER_MODEL_SHIFT;
+
+	uint32_t edges = hall_sensor_1_ticks + hall_sensor_2_ticks;
+	if ( (edges != observer_edges) && (hall_rpm > 0) ) {
+		observer_edges = edges;
+		int32_t measured = hall_rpm << OBSERVER_EXTRA_BITS;
+		observer_rpm += (measured - observer_rpm) >> OBSERVER_ALPHA_SHIFT;
+		observer_bias += (measured - model - observer_bias) >> OBSERVER_BETA_SHIFT;
+	}
+	if (hall_rpm == 0) {
+		// not turning yet (or the first edges after starting): the model is not trusted alone
+		observer_rpm = bound << OBSERVER_EXTRA_BITS;
+		return bound;
+	}
+	if ( (bound < hall_rpm) && (observer_rpm > (bound << OBSERVER_EXTRA_BITS)) ) {
+		observer_rpm = bound << OBSERVER_EXTRA_BITS;
+	} else if (observer_rpm < 0) {
+		observer_rpm = 0;
+	}
+	return (observer_rpm + (1 << (OBSERVER_EXTRA_BITS-1))) >> OBSERVER_EXTRA_BITS;
+}
+#endif
 
-	if (rotor_position != -1) {
-		int diff = (4 + new_rotor_position - rotor_position) & 0x3;
-		if ( ((diff == 1) && (orientation == NORMAL_ORIENTATION)) ||
-				 ((diff == 3) && (orientation == REVERSE_ORIENTATION)) ) {
-			// Sensor direction is UP
 
-			if (direction != Down) {
-				// Process Up movement while motor is rotating upwards or disengaged
-				process_sensor(Up);
-			} else if (direction == Down ) {
-				// Mismatched direction between sensor and motor.
-				dir_error++;
-			}
-		} else if ( ((diff == 3) && (orientation == NORMAL_ORIENTATION)) ||
-					 ((diff == 1) && (orientation == REVERSE_ORIENTATION)) ) {
-			// Sensor direction is DOWN
+#ifdef COAST_PREDICTION_ENABLED
+// Motor is stopped at target: measure the coasting distance until the curtain rod has settled
+void coast_measure_start() {
+	coast_measuring = 1;
+	coast_direction = direction;
+	coast_stop_rpm = coast_rpm;
+	coast_stop_location = location;
+}
 
-			if (direction != Up) {
-				// Process Down movement while motor is rotating downwards or disengaged
-				process_sensor(Down);
-			} else if (direction == Up) {
-				// Mismatched direction between sensor and motor.
-				dir_error++;
-			}
-		} else {
-			// Change of direction. Don't need to adjust location(?)
-			//process_sensor(direction);
-		}
+// Called from main loop
+void coast_measure_process() {
+	if ( (!coast_measuring) || (status != Stopped) || (HAL_GetTick() - hall_last_edge_timestamp <= COAST_SETTLE_TIME) ) {
+		return;
 	}
-
-	rotor_position = new_rotor_position;
+	coast_measuring = 0;
+	if (coast_stop_rpm == 0) {
+		return;
+	}
+	int32_t ticks = (coast_direction == Up) ? coast_stop_location - location : location - coast_stop_location;
+	if (ticks < 0) {
+		ticks = 0;	// rod was pulled back by the curtain tension
+	} else if (ticks > MAX_COAST_TICKS) {
+		return;	// curtain was probably moved by hand
+	}
+	uint8_t i = (coast_direction == Up) ? 0 : 1;
+	int32_t gain = (ticks << COAST_GAIN_DECIMAL_BITS) / coast_stop_rpm;
+	if (gain > 0xffff) {
+		gain = 0xffff;
+	}
+	coast_gain[i] += (gain - (int32_t)coast_gain[i]) >> COAST_GAIN_SMOOTHING_SHIFT;
 }
+#endif
 
-void update_motor_pwm() {
-	if ( ((direction == Up) && (orientation == NORMAL_ORIENTATION)) ||
-			 ((direction == Down) && (orientation == REVERSE_ORIENTATION)) ) {
-		TIM1->CCR4 = curr_pwm;
-	} else if ( ((direction == Down) && (orientation == NORMAL_ORIENTATION)) ||
-			 ((direction == Up) && (orientation == REVERSE_ORIENTATION)) ) {
-		TIM1->CCR1 = curr_pwm;
+#ifdef LOAD_MAP_ENABLED
+void load_map_close_bin() {
+	if ( (load_map_bin >= 0) && (load_map_count > 0) ) {
+		load_map_residual[load_map_bin] = load_map_sum / load_map_count;
+		load_map_residual_valid |= (1UL << load_map_bin);
 	}
+	load_map_bin = -1;
 }
 
-/* Called every 10ms by TIM3 */
-void motor_adjust_rpm() {
-	if ((status == Moving) || (status == Stopping)) {
-		uint16_t speed = get_rpm();
-		if (speed < target_speed) {
-			if (curr_pwm < 254) {
-				curr_pwm++;
-				if (target_speed - speed > (2<<RPM_DECIMAL_BITS))	// additional acceleration if speed difference is greater
-					curr_pwm++;
-				update_motor_pwm();
-			}
-		}
-
-		// Lower RPM only if new tick from Hall sensor has been received
-		if (rpm_updated) {
-			if (speed > target_speed) {
-				rpm_updated = 0;
-				if (curr_pwm > 1) {
-					curr_pwm--;
-					if (speed - target_speed > (2<<RPM_DECIMAL_BITS))	// additional deceleration if speed difference is greater
-						curr_pwm--;
-					if (speed - target_speed > (4<<RPM_DECIMAL_BITS))	// additional deceleration if speed difference is greater
-						curr_pwm--;
-					update_motor_pwm();
-				}
+// Merge the residuals of a completed movement into the map. Called when the target has been reached
+void load_map_commit() {
+	load_map_close_bin();
+	int8_t * map = load_map[(direction == Up) ? 0 : 1];
+	for (int i=0; i<LOAD_MAP_BINS; i++) {
+		if (load_map_residual_valid & (1UL << i)) {
+			int32_t value = map[i] + load_map_residual[i] / (1 << LOAD_MAP_SMOOTHING_SHIFT);
+			if (value > 127) {
+				value = 127;
+			} else if (value < -127) {
+				value = -127;
 			}
+			map[i] = value;
 		}
 	}
+	load_map_residual_valid = 0;
 }
+#endif
 
+// The stop point of the movement has been reached
+static void motor_stop_at_target() {
+#ifdef LOAD_MAP_ENABLED
+	load_map_commit();
+#endif
+#ifdef COAST_PREDICTION_ENABLED
+	coast_measure_start();
+#endif
+#ifdef STALL_RECOVERY_ENABLED
+	stall_recovery_move_completed(direction);
+#endif
+#ifdef DYNAMIC_BRAKING_ENABLED
+	motor_stop_braked();
+#else
+	motor_stop();
+#endif
+}
 
 /*
- * This is periodically (every 1 millisecond) called by SysTick_Handler
+ * This function adjusts location when the curtain rod is rotated by motor AS WELL AS by passive movement.
+ * During calibration limits won't be enforced.
  */
-void motor_stall_check() {
-	if ( (status == Moving) || (status == Stopping) ) {
-		// Count how many milliseconds since previous HALL sensor interrupt
-		// in order to calculate RPM and detect motor stalling
-		hall_sensor_1_idle_time ++;
-		if (HAL_GetTick() - movement_started_timestamp > HALL_SENSOR_TIMEOUT_WHILE_STARTING) {
-			// enough time has passed since motor is energized -> apply stall detection
-
-			if (hall_sensor_1_idle_time > stall_detection_timeout) {
-				// motor has stalled/stopped
-
-				if ( (status == Stopping) && (hall_sensor_1_idle_time < HALL_SENSOR_TIMEOUT_WHILE_STOPPING) ) {
-					// when slowing down, allow longer time to recover from premature stalling
-				} else {
-					motor_stopped();
+int process_sensor(motor_direction_t sensor_direction) {
+#ifdef COAST_PREDICTION_ENABLED
+	int32_t coast = coast_prediction;
+#else
+	int32_t coast = 0;
+#endif
+	if (sensor_direction == Up) {
+		location--;
+		if ( (direction == Up) && (!calibrating) ) {
+			if (target_location != -1) {	// if target is -1, force movement up until the motor stalls which causes calibration
+				if (location - 1 - coast <= target_location) {	// stop just before the target
+					motor_stop_at_target();
+					return 1;
 				}
 			}
 		}
-		uint16_t curr = get_motor_current();
-		if (curr > highest_motor_current) {
-			highest_motor_current = curr;
-		}
-		if (max_motor_current != 0) {
-			if (curr > max_motor_current) {
-				// maximum current limit exceeded while moving -> motor has stalled.
-				motor_stopped();
+	} else if (sensor_direction == Down) {
+		location++;
+		if ( (direction == Down) && (!calibrating) ) {
+			if(location + 1 + coast >= target_location) { // stop just before the target
+				motor_stop_at_target();
+				return 1;
 			}
 		}
-	} else if (status == CalibratingEndPoint) {
-		if (HAL_GetTick() - endpoint_calibration_started_timestamp > ENDPOINT_CALIBRATION_PERIOD) {
-			// Calibration is done and we are at top position
-			status = Stopped;
-			calibrating = 0;	// Limits will be enforced from now on
-			location = 0;
-		}
 	}
+	return 0;
 }
 
-void motor_stopped() {
-	if (status != Stopped) {
-		// motor has stalled!
-
-		motor_status_t current_status = status;
-		motor_direction_t current_direction = direction;
-		uint16_t motor_current = last_stalling_current = get_motor_current();
-		pwm_when_stalled = curr_pwm;
+#ifdef SUBTICK_INTERPOLATION_ENABLED
+/*
+ * Returns the location with LOCATION_FRACTION_BITS of precision, interpolated in the motor direction from the time since
+ * the latest Hall sensor edge and the average edge interval. The fraction stays below one tick, so the estimate never
+ * runs past the next edge. Without a valid interval (standstill or the first edges after starting) the location of the
+ * latest edge is returned. Caller must keep the Hall sensor interrupt from updating the state in the middle of this
+ */
+int32_t get_interpolated_location() {
+	int32_t loc = location * (1 << LOCATION_FRACTION_BITS);
+	uint32_t period = get_revolution_period();
+	if ( (direction == None) || (period == 0) || (hall_edge_idle_time >= HALL_TIMER_MAX_INTERVAL) ) {
+		return loc;
+	}
+	uint32_t elapsed = (uint16_t)(HALL_TIMER->CNT - hall_edge_timestamp);
+	uint32_t fraction = ((elapsed * HALL_EDGES_PER_REVOLUTION) << LOCATION_FRACTION_BITS) / period;
+	if (fraction >= (1 << LOCATION_FRACTION_BITS)) {
+		fraction = (1 << LOCATION_FRACTION_BITS) - 1;
+	}
+	return (direction == Up) ? loc - fraction : loc + fraction;
+}
 
-		// De-energize the motor
-		motor_stop();
+/*
+ * Same stop condition as in process_sensor, but evaluated with the interpolated location (and the unrounded coast
+ * prediction). Called from the control tick, so that the motor is stopped between the Hall sensor edges
+ */
+static uint8_t motor_subtick_stop() {
+	if ( (direction == None) || calibrating || ((direction == Up) && (target_location == -1)) ) {
+		return 0;
+	}
+#ifdef COAST_PREDICTION_ENABLED
+	int32_t coast = (coast_gain[(direction == Up) ? 0 : 1] * (uint32_t)coast_rpm) >>
+			(COAST_GAIN_DECIMAL_BITS - LOCATION_FRACTION_BITS);
+#else
+	int32_t coast = 0;
+#endif
+	uint8_t stopped = 0;
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	int32_t loc = get_interpolated_location();
+	int32_t target = target_location * (1 << LOCATION_FRACTION_BITS);
+	if ( ((direction == Up) && (loc - (1 << LOCATION_FRACTION_BITS) - coast <= target)) ||
+			((direction == Down) && (loc + (1 << LOCATION_FRACTION_BITS) + coast >= target)) ) {
+		motor_stop_at_target();
+		stopped = 1;
+	}
+	__set_PRIMASK(primask);
+	return stopped;
+}
+#endif
 
-		if (current_status == Moving)  {
-			if (current_direction == Up) {
-				if (motor_current > MINIMUM_CALIBRATION_CURRENT) {
-					// The motor has stalled with enough resistance (motor current) so we assume that we have reached 
-					// the top position. Now remaining is the endpoint calibration
-					// (adjusting for the backward movement because of curtain tension)
-					status = CalibratingEndPoint;
-					sensor_ticks_while_calibrating_endpoint = 0;	// for debugging
-					blink += 1;
-					// now we wait until curtain rod stabilizes				
-					endpoint_calibration_started_timestamp = HAL_GetTick();
-				} else {
-					if (hall_sensor_1_ticks == 0) {
-						// There hasn't been any signals from Hall sensor AND motor current is so low that the end-of-calibration
-						// wasn't triggered. Either the sensor is faulty OR blinds are already at the top position and
-						// calibration was attempted with so low speed that minimum calibration current wasn't exceeded. 
-						// Either way we cannot recover from this.
-						last_error = SensorError;
-						status = Error;
-						blink += 3;
-					} else {
-						// The motor has stalled but without too much resistance (motor current is low)
-						// This suggests that during low speed (usually RPM < 5) movement there was sudden increase in friction
-						// which caused the motor to stall. However the RPM adjustment function didn't respond quickly
-						// enough to ramp up the PWM duty cycle before Hall sensor timeout kicked in. 
-						// See MINIMUM_CALIBRATION_CURRENT definition
-						status = Stalled;
-						blink += 1;
-						// Recover from stalling, increase default speed by 0.25 RPM and increment counter for statistics
-						command = MotorUp;
-						stalled_moving_up_counter++;
-						default_speed += 1; // 0.25 RPM
-					}
-				}
-			} else {
-				// motor should not stall when direction is down! See comment above.
-				status = Stalled;
-				blink += 1;
-				// Recover from stalling, increase default speed by 0.25 RPM and increment counter for statistics
-				command = MotorDown;
-				stalled_moving_down_counter++;
-				default_speed += 1; // 0.25 RPM
-			}
-		} else if (current_status == Stopping) {
-			// Motor was accidentally stalled during slowing down. Not really a problem since position is not lost and
-			// the distance left to cover would usually be just few millimeters
-			status = Stopped;
+// Integer square root
+uint32_t isqrt( uint32_t x ) {
+	uint32_t result = 0;
+	uint32_t bit = 1UL << 30;
+	while (bit > x) {
+		bit >>= 2;
+	}
+	while (bit) {
+		if (x >= result + bit) {
+			x -= result + bit;
+			result = (result >> 1) + bit;
+		} else {
+			result >>= 1;
 		}
+		bit >>= 2;
 	}
+	return result;
 }
 
+#ifdef DIRECTIONAL_TUNING_ENABLED
+uint8_t motor_slowdown_factor( motor_direction_t dir ) {
+	return (dir == Down) ? slowdown_factor_down : slowdown_factor;
+}
 
-void motor_stop() {
-
-	// Make sure that all mosfets are off
-	pwm_stop(LOW1_PWM_CHANNEL);
-	pwm_stop(LOW2_PWM_CHANNEL);
-	/*
-	 * Remember to double-check that the code generated in HAL_TIM_MspPostInit by CubeMX has GPIO_PULLDOWN setting
-	 * enabled for LOW_1_GATE_Pin and LOW_2_GATE_Pin !!
-	 */
+uint8_t motor_min_slowdown_speed( motor_direction_t dir ) {
+	return (dir == Down) ? min_slowdown_speed_down : min_slowdown_speed;
+}
+#else
+#define motor_slowdown_factor(dir) slowdown_factor
+#define motor_min_slowdown_speed(dir) min_slowdown_speed
+#endif
 
-	HAL_GPIO_WritePin(HIGH_1_GATE_GPIO_Port, HIGH_1_GATE_Pin, GPIO_PIN_RESET);
-	HAL_GPIO_WritePin(HIGH_2_GATE_GPIO_Port, HIGH_2_GATE_Pin, GPIO_PIN_RESET);
-	TIM1->CCR1 = 0;
-	TIM1->CCR4 = 0;
+// Default speed for a move in the given direction (including the speed bumps learned from stalls)
+uint8_t motor_default_speed( motor_direction_t dir ) {
+#ifdef DIRECTIONAL_TUNING_ENABLED
+	uint16_t speed = default_speed + speed_bump[(dir == Up) ? 0 : 1];
+	return (speed > 255) ? 255 : speed;
+#else
+	return default_speed;
+#endif
+}
 
-	if (status == CalibratingEndPoint) {
-		// Stop command was issued when already at top position. Don't leave blinds in the middle of calibration 
-		calibrating = 0;	// Limits will be enforced from now on 
-		location = 0;
+// Called after a low-current stall: move 0.25 RPM faster from now on
+void motor_bump_speed( motor_direction_t dir ) {
+#ifdef DIRECTIONAL_TUNING_ENABLED
+	uint8_t * bump = &speed_bump[(dir == Up) ? 0 : 1];
+	if (*bump < MAX_SPEED_BUMP) {
+		(*bump)++;
 	}
-
-	status = Stopped;
-	last_error = NoError;
-	direction = None;
-	curr_pwm = 0;
-
-	// for debugging
-	sensor_ticks_while_stopped = 0;
-
-	// reset stall detection timeout
-	hall_sensor_1_interval = 0;
-	hall_sensor_1_idle_time = 0;
-	target_speed = 0;
+#else
+	default_speed += 1;
+#endif
 }
 
-
-void motor_start_common(uint8_t motor_speed) {
-	if (status == Moving) {
-		motor_stop();	// stop the motor and wait for the movement to stop
-		HAL_Delay(500);
-	} else {
-		motor_stop();	// first reset all the settings just in case..
-		HAL_Delay(10);
-	}
-	blink += 1;
-	movement_started_timestamp = HAL_GetTick();
-	highest_motor_current = 0; // clear previous record
-	if (command == Dance) {
-		// For dance steps we use faster speed
-		target_speed = DANCE_STEP_SPEED << RPM_DECIMAL_BITS;
-		curr_pwm = INITIAL_PWM_FOR_DANCE_STEP;
-	} else {
-		target_speed = motor_speed;
-		curr_pwm = INITIAL_PWM;
+#ifdef STALL_RECOVERY_ENABLED
+uint8_t stall_location_bin() {
+	if ( (location <= 0) || (full_curtain_length == 0) ) {
+		return 0;
 	}
-	status = Moving;
-	hall_sensor_1_ticks = 0;
-	hall_sensor_2_ticks = 0;
-	disable_sleep_timer();
+	uint32_t bin = (uint32_t)location * STALL_RECOVERY_BINS / full_curtain_length;
+	return (bin >= STALL_RECOVERY_BINS) ? STALL_RECOVERY_BINS - 1 : bin;
 }
 
-void motor_up(uint8_t motor_speed) {
-
-	motor_start_common(motor_speed);
-
-	direction = Up;
-	update_motor_pwm();
-	if (orientation == NORMAL_ORIENTATION) {
-		// turn on LOW2 PWM and HIGH1
-		pwm_start(LOW2_PWM_CHANNEL);
-		HAL_GPIO_WritePin(HIGH_1_GATE_GPIO_Port, HIGH_1_GATE_Pin, GPIO_PIN_SET);
-	} else {
-		// turn on LOW1 PWM and HIGH2
-		pwm_start(LOW1_PWM_CHANNEL);
-		HAL_GPIO_WritePin(HIGH_2_GATE_GPIO_Port, HIGH_2_GATE_Pin, GPIO_PIN_SET);
+/*
+ * Called after a low-current stall (with interrupts disabled). Schedule a retry with extra torque and escalate the speed
+ * only if the curtain keeps stalling at the same place
+ */
+void stall_recovery_stalled( motor_direction_t dir ) {
+	uint8_t d = (dir == Up) ? 0 : 1;
+	uint8_t bin = stall_location_bin();
+#ifdef EVENTLOG_ENABLED
+	eventlog_add(EVENTLOG_STALL_LOCATION, bin | (d << 7));
+#endif
+	uint32_t pwm = pwm_when_stalled + STALL_RETRY_PWM_BOOST;
+	stall_retry_pwm = (pwm > MAX_PWM) ? MAX_PWM : pwm;
+	stall_free_moves[d] = 0;
+	if (++stall_counts[d][bin] >= STALL_ESCALATION_COUNT) {
+		stall_counts[d][bin] = 0;
+		motor_bump_speed(dir);
 	}
 }
 
-void motor_down(uint8_t motor_speed) {
-
-	motor_start_common(motor_speed);
-
-	direction = Down;
-	update_motor_pwm();
-	if (orientation == NORMAL_ORIENTATION) {
-		// turn on LOW1 PWM and HIGH2
-		pwm_start(LOW1_PWM_CHANNEL);
-		HAL_GPIO_WritePin(HIGH_2_GATE_GPIO_Port, HIGH_2_GATE_Pin, GPIO_PIN_SET);
-	} else {
-		// turn on LOW2 PWM and HIGH1
-		pwm_start(LOW2_PWM_CHANNEL);
-		HAL_GPIO_WritePin(HIGH_1_GATE_GPIO_Port, HIGH_1_GATE_Pin, GPIO_PIN_SET);
+// Called when a move reaches its target: let the learned speed bump decay slowly
+void stall_recovery_move_completed( motor_direction_t dir ) {
+	uint8_t d = (dir == Up) ? 0 : 1;
+	if (++stall_free_moves[d] < SPEED_BUMP_DECAY_MOVES) {
+		return;
+	}
+	stall_free_moves[d] = 0;
+	if (speed_bump[d] > 0) {
+		speed_bump[d]--;
+	}
+	for (int i=0; i<STALL_RECOVERY_BINS; i++) {
+		stall_counts[d][i] >>= 1;
 	}
 }
+#endif
 
+#ifdef SPEED_ZONES_ENABLED
+// Location where the speed zone ends
+int32_t motor_zone_end( uint8_t zone ) {
+	return ((speed_zones[zone] >> 8) * location_scale) >> 12;
+}
 
-#ifndef SLIM_BINARY
-uint8_t check_voltage() {
-	if (minimum_voltage != 0) {
-		uint16_t voltage = get_voltage() / 30;
-		if (voltage < minimum_voltage) {
-			return 0;
+/*
+ * Speed of the current move at the given location: speed of the zone the location is in, or the given speed outside
+ * the zones and for moves not using them
+ */
+uint8_t motor_zone_speed( int32_t loc, uint8_t speed ) {
+	if (zoned_move && !calibrating) {
+		for (int i=0; i<SPEED_ZONE_COUNT; i++) {
+			if ( (speed_zones[i] >> 8) && (loc < motor_zone_end(i)) ) {
+				return (speed_zones[i] & 0xff) ? (speed_zones[i] & 0xff) : speed;
+			}
 		}
 	}
-	return 1;
+	return speed;
 }
 #endif
 
+/*
+ * Build the slowdown profile for current cruise speed (or the speed of the zone of the target). Slowdown distance is (cruise_speed * slowdown_factor) >> (RPM_DECIMAL_BITS+3)
+ * Hall sensor ticks and within it the speed decreases with constant deceleration (trapezoidal velocity profile, so speed is
+ * proportional to square root of the distance to target) down to minimum approach speed.
+ * Called from the main loop only.
+ */
+void motor_build_profile() {
+	motion_profile_dirty = 0;
+	motion_profile_length = 0;	// disable the profile while it's being built
+	if ( (target_location == -1) || script_fast_step ) {
+		// No slowdown when going up until stalling (calibration) or for dance steps (we want fast moves!)
+		return;
+	}
+#ifdef AUTOTUNE_ENABLED
+	if (autotune_phase != AutotuneIdle) {
+		return;	// tuning move is driven open loop up to the travel limit
+	}
+#endif
+	uint8_t cruise = cruise_speed;
+#ifdef SPEED_ZONES_ENABLED
+	cruise = motor_zone_speed(target_location, cruise);
+#endif
+	uint32_t length = (cruise * motor_slowdown_factor(direction)) >> (RPM_DECIMAL_BITS+3);
+	uint8_t min_speed = motor_min_slowdown_speed(direction);
+	if (length == 0) {
+		return;
+	}
+	uint8_t shift = 0;
+	while ( (MOTION_PROFILE_BINS << shift) < length ) {
+		shift++;
+	}
+	for (int i=0;i<MOTION_PROFILE_BINS;i++) {
+		uint32_t distance = i << shift;	// the distance nearest to target in this bin
+		uint32_t speed = min_speed;
+		if (distance < length) {
+			// speed = cruise * sqrt(distance / length), ratio is calculated with 16 bits of decimal precision
+			speed = (cruise * isqrt((distance << 16) / length)) >> 8;
+		}
+		if (speed < min_speed)
+			speed = min_speed; // minimum approach speed
+		if (speed > cruise)
+			speed = cruise;
+		motion_profile[i] = speed;
+	}
+	motion_profile_shift = shift;
+	motion_profile_length = length;
+}
 
-// Returns 1 if command was processed succesfully (or omitted) and 0 if we want to defer processing it later
-uint8_t process_next_command( motor_command_t next_command ) {
-	if ( (next_command == MotorUp) || (next_command == MotorDown) ) {
-		if ( (status == Stopping) || (status == CalibratingEndPoint) ) {
-			// wait until we are ready
-			return 0;
+/*
+ * Update target speed according to the motion profile. Called every 10ms by the control loop.
+ */
+void motor_apply_profile() {
+	uint8_t cruise = cruise_speed;
+#ifdef SPEED_ZONES_ENABLED
+	cruise = motor_zone_speed(location, cruise);
+#endif
+#ifdef THERMAL_PROTECTION_ENABLED
+	cruise = (cruise * thermal_speed_scale) >> 8;
+#endif
+#ifdef LIVE_RETARGETING_ENABLED
+	ramp_time += control_period;
+	while (ramp_time >= SPEED_RAMP_INTERVAL) {
+		ramp_time -= SPEED_RAMP_INTERVAL;
+		if (ramp_speed < cruise) {
+			ramp_speed++;
+		} else if (ramp_speed > cruise) {
+			ramp_speed--;
 		}
-		if (!check_voltage()) {
-			// Too low voltage -> skip this command
-			return 1;
+	}
+	uint8_t speed = ramp_speed;
+#else
+	uint8_t speed = cruise;
+#endif
+	uint16_t length = motion_profile_length;
+	if ( (length != 0) && (target_location != -1) ) {
+		uint32_t distance_to_target = abs(target_location - location);
+		if (distance_to_target < length) {
+			if (status == Moving) {
+				status = Stopping;
+			}
+			uint8_t profile_speed = motion_profile[distance_to_target >> motion_profile_shift];
+			if (profile_speed < speed)
+				speed = profile_speed;
 		}
 	}
+	target_speed = speed;
+}
 
-	if (next_command == MotorUp) {
-		motor_up(default_speed);
-	} else if (next_command == MotorDown) {
-		motor_down(default_speed);
-	} else if (next_command == Stop) {
-		motor_stop();
-	} else if( next_command == EnterBootloader) {
-		motor_stop();
-		// Wait until all UART TX is done
-		while (!uart_tx_done()) {
+
+/*
+ * Hall sensors will create following interrupts:
+ * Upwards movement: HALL1 HIGH, HALL2 HIGH, HALL1 LOW, HALL2 LOW
+ * Downwards movement: HALL2 HIGH, HALL1 HIGH, HALL2 LOW, HALL1 LOW
+ *
+ * The sensor state is (HALL1 << 1) | HALL2, which gives following sequences of states:
+ * Upwards movement: ..., 0, 2, 3, 1, 0, 2, 3, 1, 0, ...
+ * Downwards movement: ..., 0, 1, 3, 2, 0, 1, 3, 2, 0, ...
+ *
+ * Location change for each transition is looked up from hall_transition_table (indexed by previous state << 2 | new state).
+ * Transitions between 0 <-> 3 and 1 <-> 2 mean that we have missed an edge.
+ */
+static const int8_t hall_transitions_normal_orientation[16] = {
+	/* from 0 */ 0, 1, -1, HALL_STEP_INVALID,
+	/* from 1 */ -1, 0, HALL_STEP_INVALID, 1,
+	/* from 2 */ 1, HALL_STEP_INVALID, 0, -1,
+	/* from 3 */ HALL_STEP_INVALID, -1, 1, 0
+};
+
+// Transition table with current orientation folded in. Must be updated with hall_update_transition_table() when orientation changes
+int8_t hall_transition_table[16];
+
+uint8_t hall_read_state() {
+	uint8_t state = 0;
+	if (HALL_1_OUT_GPIO_Port->IDR & HALL_1_OUT_Pin)
+		state |= HALL_STATE_SENSOR_1;
+	if (HALL_2_OUT_GPIO_Port->IDR & HALL_2_OUT_Pin)
+		state |= HALL_STATE_SENSOR_2;
+	return state;
+}
+
+void hall_update_transition_table() {
+	for (int i=0;i<16;i++) {
+		int8_t step = hall_transitions_normal_orientation[i];
+		if ( (orientation == REVERSE_ORIENTATION) && (step != HALL_STEP_INVALID) ) {
+			// Movement direction is reversed
+			step = -step;
 		}
-		reset_to_bootloader();
-		// .. not reached
+		hall_transition_table[i] = step;
 	}
-	return 1; // this command was processed
 }
 
-void add_dance_step( motor_command_t cmd ) {
-	if (dance_steps_num < MAX_DANCE_STEPS) {
-		dance_steps[dance_steps_num] = cmd;
-		dance_steps_num++;
+/*
+ * Process the Hall sensor state as if an edge was received, but only if the state has changed since the previous edge.
+ * Used for polling the sensors during sleep. Returns 1 if the state had changed
+ */
+uint8_t motor_hall_poll() {
+	// Hall sensor interrupt must not run the callback at the same time
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	uint8_t changed = (hall_read_state() != hall_state);
+	if (changed) {
+		hall_sensor_callback();
 	}
+	__set_PRIMASK(primask);
+	return changed;
 }
 
-motor_command_t get_next_dance_step() {
-	if (dance_steps_num > 0) {
-		motor_command_t cmd = dance_steps[0];
-		dance_steps_num--;
-		for (int i=0;i<dance_steps_num;i++) {
-			dance_steps[i] = dance_steps[i+1];
+#ifdef HALL_HEALTH_MONITORING_ENABLED
+/*
+ * Cross-check the Hall sensors at every edge (see HALL_HEALTH_MONITORING_ENABLED). Returns 1 if a sensor was found to
+ * have failed and the degraded single-sensor mode was entered. The current edge isn't processed yet
+ */
+static uint8_t hall_health_check( uint8_t changed, int8_t step ) {
+	if ( (direction == None) || (step == HALL_STEP_INVALID) || (changed != hall_single_sensor) ) {
+		hall_single_sensor = ( (direction == None) || (step == HALL_STEP_INVALID) ) ? 0 : changed;
+		hall_single_edges = 0;
+		hall_single_steps = 0;
+	}
+	if (hall_single_sensor == 0) {
+		return 0;
+	}
+	if (++hall_single_edges < HALL_HEALTH_MAX_SINGLE_EDGES) {
+		hall_single_steps += step;
+		return 0;
+	}
+	hall_failed_sensor = changed ^ (HALL_STATE_SENSOR_1 | HALL_STATE_SENSOR_2);
+#ifdef EVENTLOG_ENABLED
+	eventlog_add(EVENTLOG_HALL_SENSOR_FAILED, (hall_failed_sensor == HALL_STATE_SENSOR_1) ? 1 : 2);
+#endif
+	// The previous edges of the working sensor stepped the location back and forth: count them in the motor direction
+	location -= hall_single_steps;
+	for (uint8_t i = 1; i < hall_single_edges; i++) {
+		if ( process_sensor(direction) || process_sensor(direction) ) {
+			break;
 		}
-		return cmd;
 	}
-	return NoCommand;
+	return 1;
 }
+#endif
 
-void dance() {
-	// Move the blinds up/down or down/up a bit, depending on whether the blinds are almost down or up
-	// (so not to cause calibration or to extend past lower limit)
-	dance_step_pos = 0;
-	command = Dance;
-	if (location < (max_curtain_length/2)) {
-		add_dance_step(MotorDown);
-		add_dance_step(MotorUp);
-	} else {
-		add_dance_step(MotorUp);
-		add_dance_step(MotorDown);
+void hall_sensor_callback() {
+#ifdef HALL_TIMESTAMPS_ENABLED
+	uint16_t timestamp = HALL_TIMER->CNT;
+	if ( (status == Moving) || (status == Stopping) ) {
+		if (hall_edge_idle_time < HALL_TIMER_MAX_INTERVAL) {
+			uint16_t interval = timestamp - hall_edge_timestamp;
+			uint8_t edges = 1;
+#ifdef HALL_HEALTH_MONITORING_ENABLED
+			if (hall_failed_sensor) {
+				// Only every other edge is seen: store two half intervals so that the buffer still spans a revolution
+				interval >>= 1;
+				edges = 2;
+			}
+#endif
+			while (edges--) {
+				hall_edge_intervals[hall_edge_pos] = interval;
+				hall_edge_pos = (hall_edge_pos + 1) & (HALL_EDGES_PER_REVOLUTION-1);
+				if (hall_edge_count < HALL_EDGES_PER_REVOLUTION) {
+					hall_edge_count++;
+				}
+			}
+		} else {
+			// Too long since previous edge (or this is the first edge after starting): the interval can't be measured
+			hall_edge_count = 0;
+		}
+	}
+	hall_edge_timestamp = timestamp;
+	hall_edge_idle_time = 0;
+#endif
+
+	hall_last_edge_timestamp = HAL_GetTick();
+
+	uint8_t state = hall_read_state();
+	uint8_t changed = hall_state ^ state;
+	int8_t step = hall_transition_table[(hall_state << 2) | state];
+	hall_state = state;
+
+	// Speed and stall detection follow sensor #1 (or the working sensor in degraded mode)
+	uint8_t timing_sensor = HALL_STATE_SENSOR_1;
+#ifdef HALL_HEALTH_MONITORING_ENABLED
+	if (hall_failed_sensor == HALL_STATE_SENSOR_1) {
+		timing_sensor = HALL_STATE_SENSOR_2;
+	}
+#endif
+	if (changed & timing_sensor) {
+		hall_sensor_1_ticks++;
+#ifdef BREAKAWAY_PWM_LEARNING_ENABLED
+		if (breakaway_learning) {
+			breakaway_learning = 0;
+			breakaway_sample_direction = direction;
+			breakaway_sample = curr_pwm;
+		}
+#endif
+		if (hall_sensor_1_ticks > 1) {
+			// At least two sensor ticks are needed to calculate interval correctly
+			hall_sensor_1_interval = hall_sensor_1_idle_time;	// update time passed between hall sensor interrupts
+		}
+		hall_sensor_1_idle_time = 0;
+	}
+	if (changed & (timing_sensor ^ (HALL_STATE_SENSOR_1 | HALL_STATE_SENSOR_2))) {
+		hall_sensor_2_ticks++;
+	}
+
+	// save for debugging
+	if (status == Stopped) {
+		sensor_ticks_while_stopped++;
+	} else if (status == CalibratingEndPoint) {
+		sensor_ticks_while_calibrating_endpoint++;
+	}
+
+#ifdef HALL_HEALTH_MONITORING_ENABLED
+	if ( hall_failed_sensor || hall_health_check(changed, step) ) {
+		if (changed & ~hall_failed_sensor) {
+			// Edge of the working sensor: half a period, i.e. two ticks
+			motor_direction_t dir = (direction != None) ? direction : hall_last_direction;
+			if ( (dir != None) && !process_sensor(dir) ) {
+				process_sensor(dir);
+			}
+		}
+		return;
+	}
+#endif
+
+	if (step == HALL_STEP_INVALID) {
+		// Both sensors changed at once: we missed an edge and can't tell the direction
+		hall_invalid_transitions++;
+#ifdef BACKLASH_COMPENSATION_ENABLED
+		if (direction != None) {
+			// The motor is driven, so assume the rod skipped two steps in the motor direction
+			if (!process_sensor(direction)) {
+				process_sensor(direction);
+			}
+		}
+#endif
+	} else if (step != 0) {
+		motor_direction_t sensor_direction = (step < 0) ? Up : Down;
+		if ( (direction != None) && (direction != sensor_direction) ) {
+			// Mismatched direction between sensor and motor (e.g. rod is momentarily pulled back by curtain tension)
+			dir_error++;
+		}
+		process_sensor(sensor_direction);
+	}
+}
+
+#ifdef BACKLASH_COMPENSATION_ENABLED
+// Apply the learned correction when the direction is reversed. Called from main loop when the motor is started
+void motor_apply_backlash( motor_direction_t dir ) {
+	if ( (last_move_direction == Up) && (dir == Down) ) {
+		if (reversals_since_calibration < 0xffff) {
+			reversals_since_calibration++;
+		}
+		backlash_remainder += backlash_correction;
+		int16_t ticks = backlash_remainder / (1 << BACKLASH_DECIMAL_BITS);
+		backlash_remainder -= ticks * (1 << BACKLASH_DECIMAL_BITS);
+		__disable_irq();
+		location -= ticks;
+		__enable_irq();
+	}
+	last_move_direction = dir;
+}
+
+/*
+ * Called when the top position has been calibrated. If the location was being tracked (not calibrating), the
+ * remaining location error is spread over the reversals since the previous calibration.
+ */
+void motor_learn_backlash( uint8_t tracked ) {
+	if (tracked && backlash_tracking) {
+		location_drift = location;
+		if ( (reversals_since_calibration > 0) && (location < MAX_CALIBRATION_DRIFT) && (location > -MAX_CALIBRATION_DRIFT) ) {
+			int32_t correction = backlash_correction +
+					((location << BACKLASH_DECIMAL_BITS) / reversals_since_calibration) / (1 << BACKLASH_SMOOTHING_SHIFT);
+			if (correction > MAX_BACKLASH_CORRECTION) {
+				correction = MAX_BACKLASH_CORRECTION;
+			} else if (correction < -MAX_BACKLASH_CORRECTION) {
+				correction = -MAX_BACKLASH_CORRECTION;
+			}
+			backlash_correction = correction;
+		}
+	}
+	backlash_tracking = 1;
+	reversals_since_calibration = 0;
+	backlash_remainder = 0;
+}
+#endif
+
+void update_motor_pwm() {
+#ifdef ADC_PWM_SYNC_ENABLED
+	// sample motor current at the centre of the on-time
+	TIM1->CCR2 = (curr_pwm > 2) ? (curr_pwm >> 1) : 1;
+#endif
+	if ( ((direction == Up) && (orientation == NORMAL_ORIENTATION)) ||
+			 ((direction == Down) && (orientation == REVERSE_ORIENTATION)) ) {
+		TIM1->CCR4 = curr_pwm;
+#ifdef PWM_DITHERING_ENABLED
+		pwm_dither_ccr = &TIM1->CCR4;
+#endif
+	} else if ( ((direction == Down) && (orientation == NORMAL_ORIENTATION)) ||
+			 ((direction == Up) && (orientation == REVERSE_ORIENTATION)) ) {
+		TIM1->CCR1 = curr_pwm;
+#ifdef PWM_DITHERING_ENABLED
+		pwm_dither_ccr = &TIM1->CCR1;
+#endif
+	}
+}
+
+#ifdef PWM_DITHERING_ENABLED
+/*
+ * Called from TIM1 update interrupt once per PWM period. The fractional part of the duty cycle is accumulated and
+ * the duty cycle of the (preloaded) next period is bumped by one step whenever the accumulator overflows.
+ */
+void motor_pwm_dither() {
+	if (pwm_dither_ccr == 0)
+		return;
+	uint16_t duty = curr_pwm;
+	pwm_dither_accumulator += pwm_dither_fraction;
+	if (pwm_dither_accumulator >= (1 << PWM_DITHER_BITS)) {
+		pwm_dither_accumulator -= (1 << PWM_DITHER_BITS);
+		duty++;
+	}
+	*pwm_dither_ccr = duty;
+}
+#endif
+
+#ifdef DYNAMIC_BRAKING_ENABLED
+/*
+ * Switch both low-side mosfets with the given duty cycle while the speed controller brakes. The high-side
+ * mosfet is turned off before the second low-side is switched on
+ */
+void motor_dynamic_brake( uint16_t duty ) {
+	if (!dynamic_braking) {
+		dynamic_braking = 1;
+#ifdef PWM_DITHERING_ENABLED
+		pwm_dither_ccr = 0;
+		pwm_dither_fraction = 0;
+#endif
+		GPIO_RESET(HIGH_1_GATE_GPIO_Port, HIGH_1_GATE_Pin);
+		GPIO_RESET(HIGH_2_GATE_GPIO_Port, HIGH_2_GATE_Pin);
+		TIM1->CCR1 = duty;
+		TIM1->CCR4 = duty;
+		pwm_start(LOW1_PWM_CHANNEL);
+		pwm_start(LOW2_PWM_CHANNEL);
+	} else {
+		TIM1->CCR1 = duty;
+		TIM1->CCR4 = duty;
+	}
+}
+
+// Back from braking to driving in the current direction with curr_pwm
+void motor_release_dynamic_brake() {
+	dynamic_braking = 0;
+	if ( ((direction == Up) && (orientation == NORMAL_ORIENTATION)) ||
+			 ((direction == Down) && (orientation == REVERSE_ORIENTATION)) ) {
+		// LOW2 PWM and HIGH1
+		pwm_stop(LOW1_PWM_CHANNEL);
+		TIM1->CCR1 = 0;
+		update_motor_pwm();
+		GPIO_SET(HIGH_1_GATE_GPIO_Port, HIGH_1_GATE_Pin);
+	} else {
+		// LOW1 PWM and HIGH2
+		pwm_stop(LOW2_PWM_CHANNEL);
+		TIM1->CCR4 = 0;
+		update_motor_pwm();
+		GPIO_SET(HIGH_2_GATE_GPIO_Port, HIGH_2_GATE_Pin);
+	}
+}
+#endif
+
+// Scale PWM duty cycle given for PWM_FF_REFERENCE_VOLTAGE according to the current supply voltage
+int32_t pwm_voltage_compensate( int32_t pwm ) {
+#ifdef VOLTAGE_FEED_FORWARD_ENABLED
+	uint16_t v = get_voltage();
+	if (v == 0) {
+		return pwm;	// not measured yet
+	}
+	if (v < PWM_FF_MINIMUM_VOLTAGE) {
+		v = PWM_FF_MINIMUM_VOLTAGE;
+	}
+	pwm = pwm * PWM_FF_REFERENCE_VOLTAGE / v;
+	if (pwm > MAX_PWM) {
+		pwm = MAX_PWM;
+	}
+#endif
+	return pwm;
+}
+
+// Inverse of pwm_voltage_compensate: PWM duty cycle that corresponds to the same motor voltage at PWM_FF_REFERENCE_VOLTAGE
+int32_t pwm_voltage_normalize( int32_t pwm ) {
+#ifdef VOLTAGE_FEED_FORWARD_ENABLED
+	uint16_t v = get_voltage();
+	if (v == 0) {
+		return pwm;
+	}
+	if (v < PWM_FF_MINIMUM_VOLTAGE) {
+		v = PWM_FF_MINIMUM_VOLTAGE;
+	}
+	pwm = pwm * v / PWM_FF_REFERENCE_VOLTAGE;
+#endif
+	return pwm;
+}
+
+// PWM duty cycle to start with when nothing has been learned
+int32_t motor_initial_pwm( motor_direction_t dir ) {
+#ifdef DIRECTIONAL_TUNING_ENABLED
+	if (dir == Down) {
+		return INITIAL_PWM_DOWN;
+	}
+#endif
+	return INITIAL_PWM;
+}
+
+#ifdef BREAKAWAY_PWM_LEARNING_ENABLED
+// PWM duty cycle (normalized to PWM_FF_REFERENCE_VOLTAGE) to start with
+int32_t motor_start_pwm( motor_direction_t dir ) {
+	uint16_t pwm = breakaway_pwm[(dir == Up) ? 0 : 1];
+	if (pwm == 0) {
+		return motor_initial_pwm(dir);
+	}
+	int32_t start_pwm = (PWM_DUTY((int32_t)pwm) >> BREAKAWAY_PWM_DECIMAL_BITS) - PWM_DUTY(BREAKAWAY_PWM_MARGIN);
+	if (start_pwm < MIN_PWM) {
+		start_pwm = MIN_PWM;
+	}
+	return start_pwm;
+}
+
+// Update the breakaway PWM estimate from the latest sample. Called from main loop
+void motor_update_breakaway_pwm() {
+	uint16_t sample = breakaway_sample;
+	if (sample == 0)
+		return;
+	breakaway_sample = 0;
+	uint8_t i = (breakaway_sample_direction == Up) ? 0 : 1;
+	int32_t pwm = (pwm_voltage_normalize(sample) << BREAKAWAY_PWM_DECIMAL_BITS) >> PWM_EXTRA_BITS;
+	if ( (pwm < (MIN_BREAKAWAY_PWM << BREAKAWAY_PWM_DECIMAL_BITS)) || (pwm > (MAX_BREAKAWAY_PWM << BREAKAWAY_PWM_DECIMAL_BITS)) ) {
+		return;	// motor was probably already rotating when started (or there's a sensor glitch)
+	}
+	if (breakaway_pwm[i] == 0) {
+		breakaway_pwm[i] = pwm;
+	} else {
+		breakaway_pwm[i] += (pwm - (int32_t)breakaway_pwm[i]) >> BREAKAWAY_PWM_SMOOTHING_SHIFT;
+	}
+	int32_t change = (int32_t)breakaway_pwm[i] - breakaway_pwm_stored[i];
+	if ( (change >= (BREAKAWAY_PWM_WRITE_THRESHOLD << BREAKAWAY_PWM_DECIMAL_BITS)) ||
+			(change <= -(BREAKAWAY_PWM_WRITE_THRESHOLD << BREAKAWAY_PWM_DECIMAL_BITS)) ) {
+		breakaway_pwm_stored[i] = breakaway_pwm[i];
+		motor_write_setting(BREAKAWAY_PWM_UP_EEPROM + i, breakaway_pwm[i]);
+	}
+}
+#endif
+
+#ifdef LOAD_MAP_ENABLED
+// Load map bin of the current location (-1 if location isn't known)
+int8_t load_map_get_bin() {
+	if ( calibrating || (location < 0) || (location > max_curtain_length) ) {
+		return -1;
+	}
+	return (uint32_t)location * LOAD_MAP_BINS / (max_curtain_length + 1);
+}
+
+// Learned load at the current location (8-bit PWM steps at PWM_FF_REFERENCE_VOLTAGE)
+int32_t load_map_feed_forward() {
+	int8_t bin = load_map_get_bin();
+	if ( (bin < 0) || (direction == None) ) {
+		return 0;
+	}
+	return load_map[(direction == Up) ? 0 : 1][bin];
+}
+
+// Accumulate the integral term (TIM1 compare units at current voltage) of the current bin
+void load_map_sample( int32_t residual ) {
+	int8_t bin = load_map_get_bin();
+	residual = pwm_voltage_normalize(residual) >> PWM_EXTRA_BITS;
+	if (residual > 127) {
+		residual = 127;
+	} else if (residual < -127) {
+		residual = -127;
+	}
+	// Hall sensor interrupt (higher priority) commits the residuals when the target is reached so the update must be atomic
+	__disable_irq();
+	if (bin != load_map_bin) {
+		load_map_close_bin();
+		load_map_bin = bin;
+		load_map_sum = 0;
+		load_map_count = 0;
+	}
+	if ( (bin >= 0) && (load_map_count < 255) ) {
+		load_map_sum += residual;
+		load_map_count++;
+	}
+	__enable_irq();
+}
+
+#endif
+
+// Feed-forward estimate of the PWM duty cycle needed for given speed (and the learned load at current location)
+int32_t pwm_feed_forward( uint8_t speed ) {
+	int32_t pwm = PWM_FF_OFFSET + ((speed * pwm_ff_gain) >> PI_GAIN_DECIMAL_BITS);
+#ifdef LOAD_MAP_ENABLED
+	pwm += PWM_DUTY(load_map_feed_forward());
+	if (pwm < 0) {
+		pwm = 0;
+	}
+#endif
+	return pwm_voltage_compensate(pwm);
+}
+
+/*
+ * Initialize the integral term so that the speed controller output starts from initial_pwm (bumpless start).
+ * target_speed must be set before calling this.
+ */
+void motor_controller_reset( uint16_t initial_pwm ) {
+	pi_integral = ((initial_pwm - pwm_feed_forward(target_speed)) << PI_GAIN_DECIMAL_BITS) * CONTROL_REFERENCE_PERIOD;
+#ifdef SPEED_OBSERVER_ENABLED
+	speed_observer_reset();
+#endif
+}
+
+#ifdef MOTION_TRACE_ENABLED
+void motor_trace_sample() {
+	if (++motion_trace_phase < motion_trace_decimation)
+		return;
+	motion_trace_phase = 0;
+	if (motion_trace_count == MOTION_TRACE_SIZE) {
+		// Buffer is full: keep every other sample and halve the sample rate
+		for (int i=0; i<MOTION_TRACE_SIZE/2; i++) {
+			motion_trace[i] = motion_trace[i*2];
+		}
+		motion_trace_count = MOTION_TRACE_SIZE/2;
+		if (motion_trace_decimation < 128) {
+			motion_trace_decimation *= 2;
+		}
+	}
+	trace_sample_t * sample = &motion_trace[motion_trace_count++];
+	sample->time = HAL_GetTick() - movement_started_timestamp;
+	sample->location = location;
+	sample->hall_interval = (hall_sensor_1_interval > 0xffff) ? 0xffff : hall_sensor_1_interval;
+	sample->pwm = curr_pwm;
+	uint16_t curr = get_motor_current() >> MOTOR_CURRENT_SHIFT_BITS;
+	sample->current = (curr > 255) ? 255 : curr;
+	sample->voltage = get_voltage() >> 4;
+}
+#endif
+
+#ifdef AUTOTUNE_ENABLED
+/*
+ * Open loop PWM steps of the tuning move. Called every control period instead of the speed controller
+ */
+void motor_autotune_step() {
+	uint8_t i = (autotune_phase == AutotuneHighStep) ? 1 : 0;
+	uint16_t rpm = get_rpm();
+	if (autotune_pwm[i] == 0) {
+		curr_pwm = pwm_voltage_compensate(i ? AUTOTUNE_PWM_HIGH : AUTOTUNE_PWM_LOW);
+#ifdef PWM_DITHERING_ENABLED
+		pwm_dither_fraction = 0;
+#endif
+		update_motor_pwm();
+		autotune_pwm[i] = curr_pwm;
+		autotune_step_timestamp = HAL_GetTick();
+		autotune_rpm_sum = 0;
+		autotune_rpm_count = 0;
+		autotune_area_sum = 0;
+		autotune_area_time = 0;
+	}
+	if (i) {
+		autotune_area_sum += rpm * control_period;
+		autotune_area_time += control_period;
+	}
+	uint32_t elapsed = HAL_GetTick() - autotune_step_timestamp;
+	if (elapsed >= AUTOTUNE_STEP_TIME - AUTOTUNE_AVERAGE_TIME) {
+		autotune_rpm_sum += rpm;
+		autotune_rpm_count++;
+	}
+	if (elapsed < AUTOTUNE_STEP_TIME) {
+		return;
+	}
+	autotune_rpm[i] = autotune_rpm_sum / autotune_rpm_count;
+	if (i == 0) {
+		autotune_phase = AutotuneHighStep;
+		return;
+	}
+	autotune_phase = AutotuneMeasured;
+#ifdef DYNAMIC_BRAKING_ENABLED
+	motor_stop_braked();
+#else
+	motor_stop();
+#endif
+}
+#endif
+
+#ifdef SOFT_START_ENABLED
+/*
+ * Upper limit of the speed controller output during acceleration (with PWM_DITHER_BITS of decimal precision). The limit
+ * follows the motor current: it's raised while the current is below start_current_limit and lowered when it's above.
+ * Once target_speed is reached the speed controller continues alone.
+ */
+int32_t motor_soft_start_limit( int32_t error ) {
+	if (error <= 0) {
+		soft_start = 0;
+		return MAX_PWM << PWM_DITHER_BITS;
+	}
+	soft_start_pwm += (((int32_t)start_current_limit - get_motor_current()) * control_period / CONTROL_REFERENCE_PERIOD)
+			>> SOFT_START_GAIN_SHIFT;
+	if (soft_start_pwm > MAX_PWM) {
+		soft_start_pwm = MAX_PWM;
+	} else if (soft_start_pwm < MIN_PWM) {
+		soft_start_pwm = MIN_PWM;
+	}
+	return soft_start_pwm << PWM_DITHER_BITS;
+}
+#endif
+
+#ifdef BROWNOUT_RIDE_THROUGH_ENABLED
+/*
+ * Upper limit of the speed controller output (with PWM_DITHER_BITS of decimal precision) while the supply voltage sags.
+ * See BROWNOUT_RIDE_THROUGH_ENABLED
+ */
+int32_t motor_brownout_limit() {
+	uint16_t v = get_voltage();
+	if (v < BROWNOUT_LIMIT_VOLTAGE) {
+		if (!brownout_limiting) {
+			brownout_limiting = 1;
+			brownout_pwm = curr_pwm;
+#ifdef EVENTLOG_ENABLED
+			eventlog_add(EVENTLOG_BROWNOUT, v / 16);
+#endif
+		}
+		brownout_pwm -= ((BROWNOUT_LIMIT_VOLTAGE - v) * control_period / CONTROL_REFERENCE_PERIOD) >> BROWNOUT_GAIN_SHIFT;
+		if (brownout_pwm < MIN_PWM) {
+			brownout_pwm = MIN_PWM;
+		}
+		if (brownout_pwm < brownout_start_pwm) {
+			brownout_start_pwm = brownout_pwm;
+		}
+	} else if (brownout_limiting && (v >= BROWNOUT_RECOVERY_VOLTAGE)) {
+		brownout_pwm += BROWNOUT_RECOVERY_STEP * control_period / CONTROL_REFERENCE_PERIOD;
+		if (brownout_pwm >= MAX_PWM) {
+			brownout_limiting = 0;
+		}
+	}
+	return brownout_limiting ? (brownout_pwm << PWM_DITHER_BITS) : (MAX_PWM << PWM_DITHER_BITS);
+}
+#endif
+
+/* Called every control_period milliseconds by TIM3 */
+void motor_adjust_rpm() {
+	control_sample_time += control_period;
+	if (control_sample_time >= CONTROL_SAMPLE_PERIOD) {
+		control_sample_time = 0;
+		control_sample_rpm = get_rpm();
+		control_sample_pwm = curr_pwm;
+	}
+
+	if ((status == Moving) || (status == Stopping)) {
+		motor_apply_profile();
+#ifdef ADAPTIVE_STALL_DETECTION_ENABLED
+		motor_update_stall_timeout();
+#endif
+
+#ifdef SPEED_OBSERVER_ENABLED
+		uint16_t rpm = speed_observer_update();
+#else
+		uint16_t rpm = get_controller_rpm();
+#endif
+		int32_t error = target_speed - rpm;
+#ifdef COAST_PREDICTION_ENABLED
+		coast_rpm = rpm;
+		coast_prediction = (coast_gain[(direction == Up) ? 0 : 1] * (uint32_t)rpm) >> COAST_GAIN_DECIMAL_BITS;
+#endif
+#ifdef SUBTICK_INTERPOLATION_ENABLED
+		if (motor_subtick_stop()) {
+			return;
+		}
+#endif
+#ifdef AUTOTUNE_ENABLED
+		if ( (autotune_phase == AutotuneLowStep) || (autotune_phase == AutotuneHighStep) ) {
+			motor_autotune_step();
+			return;
+		}
+#endif
+		int32_t integral = pi_integral + pi_ki * error * control_period;
+
+		// Keep the integral term within the PWM range (integer part)
+		if (integral > (MAX_PWM << PI_GAIN_DECIMAL_BITS) * CONTROL_REFERENCE_PERIOD) {
+			integral = (MAX_PWM << PI_GAIN_DECIMAL_BITS) * CONTROL_REFERENCE_PERIOD;
+		} else if (integral < -(MAX_PWM << PI_GAIN_DECIMAL_BITS) * CONTROL_REFERENCE_PERIOD) {
+			integral = -(MAX_PWM << PI_GAIN_DECIMAL_BITS) * CONTROL_REFERENCE_PERIOD;
+		}
+
+		// Controller output has PWM_DITHER_BITS of decimal precision
+		int32_t pwm = (pwm_feed_forward(target_speed) << PWM_DITHER_BITS)
+				+ ((pi_kp * error + integral / CONTROL_REFERENCE_PERIOD) >> (PI_GAIN_DECIMAL_BITS - PWM_DITHER_BITS));
+
+		int32_t max_pwm = MAX_PWM << PWM_DITHER_BITS;
+#ifdef SOFT_START_ENABLED
+		if (soft_start) {
+			max_pwm = motor_soft_start_limit(error);
+		}
+#endif
+#ifdef BROWNOUT_RIDE_THROUGH_ENABLED
+		int32_t brownout_limit = motor_brownout_limit();
+		if (max_pwm > brownout_limit) {
+			max_pwm = brownout_limit;
+		}
+#endif
+
+		// Anti-windup: when the output is saturated, integrate only if it would bring the output back within limits
+		if (pwm > max_pwm) {
+			pwm = max_pwm;
+			if (error < 0)
+				pi_integral = integral;
+#ifdef DYNAMIC_BRAKING_ENABLED
+		} else if (pwm < -(MAX_BRAKE_PWM << PWM_DITHER_BITS)) {
+			pwm = -(MAX_BRAKE_PWM << PWM_DITHER_BITS);
+#else
+		} else if (pwm < (MIN_PWM << PWM_DITHER_BITS)) {
+			pwm = MIN_PWM << PWM_DITHER_BITS;
+#endif
+			if (error > 0)
+				pi_integral = integral;
+		} else {
+			pi_integral = integral;
+#ifdef LOAD_MAP_ENABLED
+			if ( (status == Moving) && (!script_fast_step) && (HAL_GetTick() - movement_started_timestamp > LOAD_MAP_SETTLE_TIME) ) {
+				// With the load map fed forward the integral term is the remaining error of the map
+				load_map_sample((integral / CONTROL_REFERENCE_PERIOD) >> PI_GAIN_DECIMAL_BITS);
+			}
+#endif
+		}
+
+#ifdef DYNAMIC_BRAKING_ENABLED
+		if (pwm < 0) {
+			motor_dynamic_brake((-pwm) >> PWM_DITHER_BITS);
+		} else {
+			if (pwm < (MIN_PWM << PWM_DITHER_BITS)) {
+				pwm = MIN_PWM << PWM_DITHER_BITS;
+			}
+#endif
+#ifdef PWM_DITHERING_ENABLED
+		pwm_dither_fraction = pwm & ((1 << PWM_DITHER_BITS) - 1);
+#endif
+		pwm >>= PWM_DITHER_BITS;
+#ifdef DYNAMIC_BRAKING_ENABLED
+		if (dynamic_braking) {
+			curr_pwm = pwm;
+			motor_release_dynamic_brake();
+		} else
+#endif
+		if (pwm != curr_pwm) {
+			curr_pwm = pwm;
+			update_motor_pwm();
+		}
+#ifdef DYNAMIC_BRAKING_ENABLED
+		}
+#endif
+#ifdef MOTION_TRACE_ENABLED
+		motor_trace_sample();
+#endif
+	}
+}
+
+
+#ifdef EARLY_ENDPOINT_DETECTION_ENABLED
+/*
+ * Detect hitting the top position from the motor current rise and the Hall sensor intervals: when the curtain rod hits
+ * the end stop, motor current rises quickly while the motor slows down sharply. Called every 1ms while moving.
+ */
+uint8_t motor_endpoint_detected( uint16_t curr ) {
+	if (++endpoint_sample_timer < ENDPOINT_SLOPE_SAMPLE_PERIOD) {
+		return 0;
+	}
+	endpoint_sample_timer = 0;
+
+	// Current ENDPOINT_SLOPE_SAMPLES * ENDPOINT_SLOPE_SAMPLE_PERIOD milliseconds ago
+	uint16_t previous = endpoint_current_history[endpoint_current_pos];
+	endpoint_current_history[endpoint_current_pos] = curr;
+	endpoint_current_pos = (endpoint_current_pos + 1) & (ENDPOINT_SLOPE_SAMPLES-1);
+	if (endpoint_current_samples < ENDPOINT_SLOPE_SAMPLES) {
+		endpoint_current_samples++;
+		return 0;
+	}
+
+	if (curr < MINIMUM_CALIBRATION_CURRENT)
+		return 0;
+	if ( !calibrating && (location >= ENDPOINT_DETECTION_MARGIN) )
+		return 0;	// stiff spot in the middle of the travel, not the top
+	if (curr < previous + ENDPOINT_CURRENT_RISE)
+		return 0;
+	if ( (hall_sensor_1_interval == 0) || (HAL_GetTick() - movement_started_timestamp < ENDPOINT_DETECTION_GRACE_PERIOD) )
+		return 0;
+	// The motor is slowing down sharply?
+	if ( (hall_sensor_1_idle_time < 2*hall_sensor_1_interval) || (hall_sensor_1_idle_time < ENDPOINT_MINIMUM_IDLE_TIME) )
+		return 0;
+	return 1;
+}
+#endif
+
+/*
+ * This is periodically (every 1 millisecond) called by SysTick_Handler
+ */
+void motor_stall_check() {
+#ifdef EVENTLOG_ENABLED
+	static motor_status_t logged_status = Stopped;
+	if (status != logged_status) {
+		// Transitions are polled here (every millisecond) instead of at every assignment of status
+		logged_status = status;
+		eventlog_add(EVENTLOG_STATUS, status);
+	}
+#endif
+	if ( (status == Moving) || (status == Stopping) ) {
+		// Count how many milliseconds since previous HALL sensor interrupt
+		// in order to calculate RPM and detect motor stalling
+		// Hall sensor interrupt (higher priority) resets these counters so the increments must be atomic
+		__disable_irq();
+		hall_sensor_1_idle_time ++;
+#ifdef HALL_TIMESTAMPS_ENABLED
+		hall_edge_idle_time++;
+#endif
+		__enable_irq();
+		if (HAL_GetTick() - movement_started_timestamp > HALL_SENSOR_TIMEOUT_WHILE_STARTING) {
+			// enough time has passed since motor is energized -> apply stall detection
+
+#ifdef ADAPTIVE_STALL_DETECTION_ENABLED
+			uint32_t timeout = stall_detection_timeout ? stall_detection_timeout : adaptive_stall_timeout;
+#else
+			uint32_t timeout = stall_detection_timeout;
+#endif
+			if (hall_sensor_1_idle_time > timeout) {
+				// motor has stalled/stopped
+
+				if ( (status == Stopping) && (hall_sensor_1_idle_time < HALL_SENSOR_TIMEOUT_WHILE_STOPPING) ) {
+					// when slowing down, allow longer time to recover from premature stalling
+				} else {
+					motor_stopped();
+				}
+			}
+		}
+		uint16_t curr = get_motor_current();
+		if (curr > highest_motor_current) {
+			highest_motor_current = curr;
+		}
+#ifdef MOVE_METERING_ENABLED
+		move_energy += ((uint32_t)get_voltage() * curr) >> MOVE_ENERGY_SHIFT;
+		move_time++;
+#endif
+#ifdef LIFETIME_STATS_ENABLED
+		if (++lifetime_motor_on_ms == 1000) {
+			lifetime_motor_on_ms = 0;
+			lifetime_stats.motor_on_time++;
+		}
+#endif
+		if (max_motor_current != 0) {
+			if (curr > max_motor_current) {
+				// maximum current limit exceeded while moving -> motor has stalled.
+				motor_stopped();
+				return;
+			}
+		}
+#ifdef EARLY_ENDPOINT_DETECTION_ENABLED
+		if ( (status == Moving) && (direction == Up) && motor_endpoint_detected(curr) ) {
+			// We have hit the top position. Proceed to endpoint calibration without waiting for Hall sensor timeout
+			motor_stopped();
+		}
+#endif
+	} else if (status == CalibratingEndPoint) {
+		uint32_t now = HAL_GetTick();
+		uint32_t elapsed = now - endpoint_calibration_started_timestamp;
+		// Calibration is done when the curtain rod has stopped rotating backwards (no Hall sensor ticks during ENDPOINT_SETTLE_TIME),
+		// or at latest after ENDPOINT_CALIBRATION_PERIOD
+		if ( (elapsed > ENDPOINT_CALIBRATION_PERIOD) ||
+			( (elapsed > ENDPOINT_SETTLE_TIME) && (now - hall_last_edge_timestamp > ENDPOINT_SETTLE_TIME) ) ) {
+			// Calibration is done and we are at top position
+			status = Stopped;
+#ifdef LIFETIME_STATS_ENABLED
+			lifetime_stats.calibrations++;
+#endif
+#ifdef BACKLASH_COMPENSATION_ENABLED
+			motor_learn_backlash(!calibrating);
+#endif
+			calibrating = 0;	// Limits will be enforced from now on
+			location = 0;
+		}
+	}
+}
+
+void motor_stopped() {
+	// Called from SysTick, which can be pre-empted by the speed controller (TIM3). Make the transition atomic
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	if (status != Stopped) {
+		// motor has stalled!
+
+		motor_status_t current_status = status;
+		motor_direction_t current_direction = direction;
+		uint16_t motor_current = last_stalling_current = get_motor_current();
+		pwm_when_stalled = curr_pwm;
+
+		// De-energize the motor
+		motor_stop();
+
+		if (current_status == Moving)  {
+			if (current_direction == Up) {
+				if (motor_current > MINIMUM_CALIBRATION_CURRENT) {
+					// The motor has stalled with enough resistance (motor current) so we assume that we have reached 
+					// the top position. Now remaining is the endpoint calibration
+					// (adjusting for the backward movement because of curtain tension)
+					status = CalibratingEndPoint;
+					sensor_ticks_while_calibrating_endpoint = 0;	// for debugging
+					blink += 1;
+					// now we wait until curtain rod stabilizes				
+					endpoint_calibration_started_timestamp = HAL_GetTick();
+				} else {
+					if (hall_sensor_1_ticks == 0) {
+						// There hasn't been any signals from Hall sensor AND motor current is so low that the end-of-calibration
+						// wasn't triggered. Either the sensor is faulty OR blinds are already at the top position and
+						// calibration was attempted with so low speed that minimum calibration current wasn't exceeded. 
+						// Either way we cannot recover from this.
+						last_error = SensorError;
+						status = Error;
+#ifdef EVENTLOG_ENABLED
+						eventlog_add(EVENTLOG_SENSOR_ERROR, 0);
+#endif
+						blink += 3;
+					} else {
+						// The motor has stalled but without too much resistance (motor current is low)
+						// This suggests that during low speed (usually RPM < 5) movement there was sudden increase in friction
+						// which caused the motor to stall. However the RPM adjustment function didn't respond quickly
+						// enough to ramp up the PWM duty cycle before Hall sensor timeout kicked in. 
+						// See MINIMUM_CALIBRATION_CURRENT definition
+						status = Stalled;
+						blink += 1;
+						// Recover from stalling, increase speed and increment counter for statistics
+						command = MotorUp;
+						stalled_moving_up_counter++;
+#ifdef LIFETIME_STATS_ENABLED
+						lifetime_stats.stalls_up++;
+#endif
+#ifdef EVENTLOG_ENABLED
+						eventlog_add(EVENTLOG_STALL_UP, (motor_current >> MOTOR_CURRENT_SHIFT_BITS) > 255 ? 255 : motor_current >> MOTOR_CURRENT_SHIFT_BITS);
+#endif
+#ifdef STALL_RECOVERY_ENABLED
+						stall_recovery_stalled(Up);
+#else
+						motor_bump_speed(Up);
+#endif
+					}
+				}
+			} else {
+				// motor should not stall when direction is down! See comment above.
+				status = Stalled;
+				blink += 1;
+				// Recover from stalling, increase speed and increment counter for statistics
+				command = MotorDown;
+				stalled_moving_down_counter++;
+#ifdef LIFETIME_STATS_ENABLED
+				lifetime_stats.stalls_down++;
+#endif
+#ifdef EVENTLOG_ENABLED
+				eventlog_add(EVENTLOG_STALL_DOWN, (motor_current >> MOTOR_CURRENT_SHIFT_BITS) > 255 ? 255 : motor_current >> MOTOR_CURRENT_SHIFT_BITS);
+#endif
+#ifdef STALL_RECOVERY_ENABLED
+				stall_recovery_stalled(Down);
+#else
+				motor_bump_speed(Down);
+#endif
+			}
+		} else if (current_status == Stopping) {
+			// Motor was accidentally stalled during slowing down. Not really a problem since position is not lost and
+			// the distance left to cover would usually be just few millimeters
+			status = Stopped;
+		}
+	}
+	__set_PRIMASK(primask);
+}
+
+
+void motor_stop_outputs() {
+
+#ifdef PWM_DITHERING_ENABLED
+	TIM1->DIER &= ~TIM_DIER_UIE;
+	pwm_dither_ccr = 0;
+	pwm_dither_fraction = 0;
+	pwm_dither_accumulator = 0;
+#endif
+	// Make sure that all mosfets are off
+	pwm_stop(LOW1_PWM_CHANNEL);
+	pwm_stop(LOW2_PWM_CHANNEL);
+	/*
+	 * Remember to double-check that the code generated in HAL_TIM_MspPostInit by CubeMX has GPIO_PULLDOWN setting
+	 * enabled for LOW_1_GATE_Pin and LOW_2_GATE_Pin !!
+	 */
+
+	GPIO_RESET(HIGH_1_GATE_GPIO_Port, HIGH_1_GATE_Pin);
+	GPIO_RESET(HIGH_2_GATE_GPIO_Port, HIGH_2_GATE_Pin);
+	TIM1->CCR1 = 0;
+	TIM1->CCR4 = 0;
+#ifdef DYNAMIC_BRAKING_ENABLED
+	dynamic_braking = 0;
+	stop_braking = 0;
+#endif
+}
+
+#ifdef HW_OVERCURRENT_ENABLED
+/*
+ * Called from the ADC analog watchdog interrupt when a single current sample exceeds OVERCURRENT_TRIP_CURRENT.
+ * Pre-empts everything else, so the low-side PWM is cut first and the rest is the usual stop
+ */
+void motor_overcurrent_trip() {
+	TIM1->BDTR &= ~TIM_BDTR_MOE;
+	GPIO_RESET(HIGH_1_GATE_GPIO_Port, HIGH_1_GATE_Pin);
+	GPIO_RESET(HIGH_2_GATE_GPIO_Port, HIGH_2_GATE_Pin);
+#ifdef EVENTLOG_ENABLED
+	eventlog_add(EVENTLOG_OVERCURRENT, status);
+#endif
+	motor_stop();
+	status = Error;
+	last_error = OvercurrentError;
+	blink += 3;
+}
+#endif
+
+void motor_stop() {
+	// Speed controller (TIM3) must not re-energize the motor in the middle of this
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	motor_stop_outputs();
+	start_phase = StartIdle;	// cancel pending start
+
+	if (status == CalibratingEndPoint) {
+		// Stop command was issued when already at top position. Don't leave blinds in the middle of calibration 
+		calibrating = 0;	// Limits will be enforced from now on 
+		location = 0;
+	}
+
+	status = Stopped;
+	last_error = NoError;
+	direction = None;
+	curr_pwm = 0;
+#ifdef BREAKAWAY_PWM_LEARNING_ENABLED
+	breakaway_learning = 0;	// stopped before the first Hall sensor tick
+#endif
+
+	// for debugging
+	sensor_ticks_while_stopped = 0;
+
+	// reset stall detection timeout
+	hall_sensor_1_interval = 0;
+	hall_sensor_1_idle_time = 0;
+#ifdef HALL_TIMESTAMPS_ENABLED
+	hall_edge_count = 0;
+	hall_edge_idle_time = HALL_TIMER_MAX_INTERVAL; // first edge after starting doesn't give a valid interval
+#endif
+	target_speed = 0;
+	cruise_speed = 0;
+#ifdef SPEED_ZONES_ENABLED
+	zoned_move = 0;
+#endif
+#ifdef SOFT_START_ENABLED
+	soft_start = 0;
+#endif
+	motion_profile_length = 0;
+	__set_PRIMASK(primask);
+}
+
+
+/*
+ * Brake the motor by shorting the windings via both low-side mosfets (high-side mosfets are turned off first)
+ */
+void motor_brake() {
+	GPIO_RESET(HIGH_1_GATE_GPIO_Port, HIGH_1_GATE_Pin);
+	GPIO_RESET(HIGH_2_GATE_GPIO_Port, HIGH_2_GATE_Pin);
+	TIM1->CCR1 = TIM1->ARR + 1;	// 100% duty cycle
+	TIM1->CCR4 = TIM1->ARR + 1;
+	pwm_start(LOW1_PWM_CHANNEL);
+	pwm_start(LOW2_PWM_CHANNEL);
+}
+
+#ifdef DYNAMIC_BRAKING_ENABLED
+// Stop at target and keep the windings shorted for STOP_BRAKE_TIME so that the rod doesn't coast past the target
+void motor_stop_braked() {
+	motor_stop();
+	motor_brake();
+	stop_brake_timestamp = HAL_GetTick();
+	stop_braking = 1;
+}
+
+// Called from main loop. Any new start or stop turns the outputs off (and cancels the brake) before this
+void motor_process_stop_brake() {
+	if ( stop_braking && (HAL_GetTick() - stop_brake_timestamp >= STOP_BRAKE_TIME) ) {
+		motor_stop_outputs();
+	}
+}
+#endif
+
+#ifdef MOVE_METERING_ENABLED
+/*
+ * Store the record of the metered move. Called from main loop when the motor is no longer energized
+ * (or when the next move is started)
+ */
+void motor_close_move_record() {
+	if (!move_metering)
+		return;
+	move_metering = 0;
+	move_record_t * record = &move_log[move_log_head];
+	uint32_t energy = move_energy / MOVE_ENERGY_DIVIDER;
+	record->energy = (energy > 0xffff) ? 0xffff : energy;
+	uint32_t duration = move_time / 10;
+	record->duration = (duration > 0xffff) ? 0xffff : duration;
+	record->ticks = (hall_sensor_1_ticks > 0xffff) ? 0xffff : hall_sensor_1_ticks;
+	uint16_t curr = highest_motor_current >> MOTOR_CURRENT_SHIFT_BITS;
+	record->peak_current = (curr > 255) ? 255 : curr;
+	record->flags |= status << 4;
+	move_log_head = (move_log_head + 1) & (MOVE_LOG_SIZE-1);
+}
+#endif
+
+void motor_start_common(motor_direction_t dir, uint8_t motor_speed) {
+#ifdef MOVE_METERING_ENABLED
+	motor_close_move_record();
+#endif
+#ifdef LIFETIME_STATS_ENABLED
+	motor_lifetime_move_finished();
+#endif
+#ifdef BACKLASH_COMPENSATION_ENABLED
+	motor_apply_backlash(dir);
+#endif
+	blink += 1;
+	movement_started_timestamp = HAL_GetTick();
+	highest_motor_current = 0; // clear previous record
+	if (script_fast_step) {
+		// For dance steps we use faster speed
+		target_speed = DANCE_STEP_SPEED << RPM_DECIMAL_BITS;
+		curr_pwm = pwm_voltage_compensate(INITIAL_PWM_FOR_DANCE_STEP);
+	} else {
+		target_speed = motor_speed;
+#ifdef BREAKAWAY_PWM_LEARNING_ENABLED
+		curr_pwm = pwm_voltage_compensate(motor_start_pwm(dir));
+		breakaway_learning = 1;
+#else
+		curr_pwm = pwm_voltage_compensate(motor_initial_pwm(dir));
+#endif
+	}
+#ifdef BROWNOUT_RIDE_THROUGH_ENABLED
+	// Supply sagged during earlier moves: the first control period is too short to react, so start lower. The cap is
+	// relaxed a bit on every start in case the supply has recovered
+	if (curr_pwm > brownout_start_pwm) {
+		curr_pwm = brownout_start_pwm;
+	}
+#endif
+#ifdef STALL_RECOVERY_ENABLED
+	if (stall_retry_pwm) {
+		// Retry after a stall: start with more torque than what wasn't enough (and don't learn the breakaway PWM from it)
+		if (curr_pwm < stall_retry_pwm) {
+			curr_pwm = stall_retry_pwm;
+		}
+		stall_retry_pwm = 0;
+#ifdef BREAKAWAY_PWM_LEARNING_ENABLED
+		breakaway_learning = 0;
+#endif
+	}
+#endif
+	cruise_speed = target_speed;
+#ifdef SPEED_ZONES_ENABLED
+	target_speed = motor_zone_speed(location, cruise_speed);	// start at the speed of the zone
+#endif
+#ifdef LIVE_RETARGETING_ENABLED
+	ramp_speed = target_speed;
+	ramp_time = 0;
+#endif
+	direction = dir;	// needed already by the slowdown profile and load map feed-forward
+#ifdef HALL_HEALTH_MONITORING_ENABLED
+	hall_last_direction = dir;
+#endif
+	motor_build_profile();
+#ifdef COAST_PREDICTION_ENABLED
+	coast_measuring = 0;
+	coast_rpm = 0;
+	coast_prediction = 0;
+#endif
+#ifdef LOAD_MAP_ENABLED
+	load_map_residual_valid = 0;
+	load_map_bin = -1;
+#endif
+	motor_controller_reset(curr_pwm);
+#ifdef SOFT_START_ENABLED
+	soft_start = (start_current_limit != 0) && !script_fast_step;
+#ifdef THERMAL_PROTECTION_ENABLED
+	if (thermal_speed_scale < 256) {
+		soft_start = (start_current_limit != 0);	// dance steps too, the inrush of repeated starts heats up the motor
+	}
+#endif
+	soft_start_pwm = curr_pwm;
+#endif
+#ifdef BROWNOUT_RIDE_THROUGH_ENABLED
+	brownout_pwm = brownout_start_pwm;
+	brownout_limiting = (brownout_start_pwm < MAX_PWM);	// released gradually if the supply holds
+	brownout_start_pwm = (brownout_start_pwm + BROWNOUT_START_RELAX_STEP < MAX_PWM) ? brownout_start_pwm + BROWNOUT_START_RELAX_STEP : MAX_PWM;
+#endif
+#ifdef MOVE_METERING_ENABLED
+	move_energy = 0;
+	move_time = 0;
+	move_log[move_log_head].speed = target_speed;
+	move_log[move_log_head].flags = (dir == Down) ? MOVE_RECORD_DOWN : 0;
+	move_metering = 1;
+#endif
+#ifdef LIFETIME_STATS_ENABLED
+	lifetime_start_location = location;
+	lifetime_moving = 1;
+#endif
+#ifdef MOTION_TRACE_ENABLED
+	motion_trace_count = 0;
+	motion_trace_decimation = 1;
+	motion_trace_phase = 0;
+#endif
+	status = Moving;
+#ifdef PWM_DITHERING_ENABLED
+	TIM1->SR = ~TIM_SR_UIF;
+	TIM1->DIER |= TIM_DIER_UIE;
+#endif
+	hall_sensor_1_ticks = 0;
+	hall_sensor_2_ticks = 0;
+#ifdef EARLY_ENDPOINT_DETECTION_ENABLED
+	endpoint_current_samples = 0;
+#endif
+	disable_sleep_timer();
+}
+
+void motor_up(uint8_t motor_speed) {
+
+	motor_start_common(Up, motor_speed);
+
+	direction = Up;
+	update_motor_pwm();
+	if (orientation == NORMAL_ORIENTATION) {
+		// turn on LOW2 PWM and HIGH1
+		pwm_start(LOW2_PWM_CHANNEL);
+		GPIO_SET(HIGH_1_GATE_GPIO_Port, HIGH_1_GATE_Pin);
+	} else {
+		// turn on LOW1 PWM and HIGH2
+		pwm_start(LOW1_PWM_CHANNEL);
+		GPIO_SET(HIGH_2_GATE_GPIO_Port, HIGH_2_GATE_Pin);
+	}
+}
+
+void motor_down(uint8_t motor_speed) {
+
+	motor_start_common(Down, motor_speed);
+
+	direction = Down;
+	update_motor_pwm();
+	if (orientation == NORMAL_ORIENTATION) {
+		// turn on LOW1 PWM and HIGH2
+		pwm_start(LOW1_PWM_CHANNEL);
+		GPIO_SET(HIGH_2_GATE_GPIO_Port, HIGH_2_GATE_Pin);
+	} else {
+		// turn on LOW2 PWM and HIGH1
+		pwm_start(LOW2_PWM_CHANNEL);
+		GPIO_SET(HIGH_1_GATE_GPIO_Port, HIGH_1_GATE_Pin);
+	}
+}
+
+
+/*
+ * Request the motor to start moving. The motor is first stopped and (if it was moving) braked. Then we wait until the
+ * curtain rod has settled before energizing the motor again. The phases are timed by motor_process_start() in the
+ * main loop so that it keeps running in the meantime.
+ */
+void motor_request_start( motor_direction_t dir, uint8_t motor_speed ) {
+	uint8_t was_moving = (status == Moving);
+	motor_stop();	// first reset all the settings just in case..
+#ifdef LOCATION_JOURNAL_ENABLED
+	motor_invalidate_location_journal();
+#endif
+	// switch clock while the motor is not energized
+	system_clock_fast(1);
+	start_direction = dir;
+	start_speed = motor_speed;
+	start_phase_timestamp = HAL_GetTick();
+#ifdef MOTOR_ACTIVE_BRAKING_ENABLED
+	if (was_moving) {
+		motor_brake();
+		start_phase = StartBraking;
+	} else
+#endif
+	{
+		start_settle_time = was_moving ? MOTOR_SETTLE_MAX_TIME : MOTOR_SETTLE_MIN_TIME;
+		start_phase = StartSettling;
+	}
+	start_settle_min_time = MOTOR_SETTLE_MIN_TIME;
+	disable_sleep_timer();
+}
+
+void motor_process_start() {
+	uint32_t now = HAL_GetTick();
+	if (start_phase == StartBraking) {
+		if (now - start_phase_timestamp >= MOTOR_BRAKE_TIME) {
+			motor_stop_outputs();
+			start_phase_timestamp = now;
+			start_settle_time = MOTOR_SETTLE_MAX_TIME;
+			start_phase = StartSettling;
+		}
+	} else if (start_phase == StartSettling) {
+		uint32_t elapsed = now - start_phase_timestamp;
+		// Start after the minimum settling time, once the rod has stopped generating Hall sensor ticks (or at latest after start_settle_time)
+		if ( (elapsed >= start_settle_min_time) &&
+			( (now - hall_last_edge_timestamp >= MOTOR_SETTLE_QUIET_TIME) || (elapsed >= start_settle_time) ) ) {
+			start_phase = StartIdle;
+			if (start_direction == Up) {
+				motor_up(start_speed);
+			} else {
+				motor_down(start_speed);
+			}
+		}
+	}
+}
+
+
+#ifdef THERMAL_PROTECTION_ENABLED
+/*
+ * Update the thermal model and the derating derived from it (see THERMAL_PROTECTION_ENABLED). Called from the main loop
+ */
+void motor_update_thermal() {
+	thermal_update(get_motor_current());
+	int32_t rise = thermal_get_rise();
+	if (rise <= THERMAL_DERATE_RISE * 1000) {
+		thermal_speed_scale = 256;
+	} else if (rise >= THERMAL_LIMIT_RISE * 1000) {
+		thermal_speed_scale = THERMAL_MIN_SPEED_SCALE;
+	} else {
+		thermal_speed_scale = 256 - (256 - THERMAL_MIN_SPEED_SCALE) * (rise - THERMAL_DERATE_RISE * 1000)
+			/ ((THERMAL_LIMIT_RISE - THERMAL_DERATE_RISE) * 1000);
+	}
+	if ( (!thermal_overheated) && (rise >= THERMAL_LIMIT_RISE * 1000) ) {
+		thermal_overheated = 1;
+#ifdef EVENTLOG_ENABLED
+		eventlog_add(EVENTLOG_OVERHEAT, rise / 1000);
+#endif
+	} else if ( thermal_overheated && (rise <= THERMAL_RESUME_RISE * 1000) ) {
+		thermal_overheated = 0;
+	}
+}
+#endif
+
+
+uint8_t check_voltage() {
+	if (minimum_voltage != 0) {
+		uint16_t voltage = get_voltage() / 30;
+		if (voltage < minimum_voltage) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+#ifdef MOVE_PIPELINING_ENABLED
+// Stage the next move. It's started as soon as the current phase has ended (see motor_process_staged_move)
+void motor_stage_move( int32_t target ) {
+	staged_target = target;
+	staged_move = 1;
+}
+
+/*
+ * Start the staged move once the motor has stopped, finished the end point calibration and isn't starting.
+ * A move staged during calibration is dropped if the calibration move ended without reaching the top.
+ * Called from the main loop when no other motor command is pending
+ */
+void motor_process_staged_move() {
+	if ( (status == Moving) || (status == Stopping) || (status == CalibratingEndPoint) || (start_phase != StartIdle) ) {
+		return;
+	}
+	staged_move = 0;
+	if (calibrating) {
+		return;
+	}
+	target_location = staged_target;
+	// direction is chosen only now, since the location has changed while stopping
+	command = ( (target_location == -1) || (target_location < location) ) ? MotorUp : MotorDown;
+}
+#endif
+
+// Returns 1 if command was processed succesfully (or omitted) and 0 if we want to defer processing it later
+uint8_t process_next_command( motor_command_t next_command ) {
+#ifdef LIVE_RETARGETING_ENABLED
+	if ( ( ((next_command == MotorUp) && (direction == Up)) || ((next_command == MotorDown) && (direction == Down)) ) &&
+			( (status == Moving) || (status == Stopping) ) && (start_phase == StartIdle) && (!calibrating) ) {
+		// Already moving in the same direction: continue towards the new target (target_location is already set)
+		cruise_speed = motor_default_speed(direction);
+#ifdef SPEED_ZONES_ENABLED
+		zoned_move = 1;
+#endif
+		status = Moving;	// motor_apply_profile will switch back to Stopping when within the slowdown distance
+		motor_build_profile();
+		return 1;
+	}
+#endif
+	if ( (next_command == MotorUp) || (next_command == MotorDown) || (next_command == Autotune) ) {
+		if ( (status == Stopping) || (status == CalibratingEndPoint) ) {
+#ifdef MOVE_PIPELINING_ENABLED
+			if (next_command != Autotune) {
+				// Let the current move finish at its own target and take this one over after it
+				motor_stage_move(target_location);
+				target_location = pipeline_target;
+				return 1;
+			}
+#endif
+			// wait until we are ready
+			return 0;
+		}
+		if (!adc_readings_valid()) {
+			// voltage isn't known yet right after boot -> try again later
+			return 0;
+		}
+		if (!check_voltage()) {
+			// Too low voltage -> skip this command
+			return 1;
+		}
+#ifdef THERMAL_PROTECTION_ENABLED
+		if (thermal_overheated) {
+			// wait until the motor has cooled down
+			return 0;
+		}
+#endif
+	}
+
+	if (next_command == MotorUp) {
+		motor_request_start(Up, motor_default_speed(Up));
+#ifdef SPEED_ZONES_ENABLED
+		zoned_move = 1;
+#endif
+	} else if (next_command == MotorDown) {
+		motor_request_start(Down, motor_default_speed(Down));
+#ifdef SPEED_ZONES_ENABLED
+		zoned_move = 1;
+#endif
+	} else if (next_command == Stop) {
+		motor_stop();
+#ifdef AUTOTUNE_ENABLED
+	} else if (next_command == Autotune) {
+		motor_autotune_start();
+#endif
+	} else if( next_command == EnterBootloader) {
+		motor_stop();
+		motor_commit_settings();
+		// Wait until all UART TX is done
+		while (!uart_tx_done()) {
+		}
+#ifdef WARM_RESTART_ENABLED
+		warmstate_invalidate();
+#endif
+		reset_to_bootloader();
+		// .. not reached
+#ifdef RESIDENT_UPDATER_ENABLED
+	} else if (next_command == EnterUpdater) {
+		motor_stop();
+		motor_commit_settings();
+		while (!uart_tx_done()) {
+		}
+#ifdef WARM_RESTART_ENABLED
+		warmstate_invalidate();
+#endif
+		reset_to_updater(updater_baud * 9600);
+		// .. not reached
+#endif
+	}
+	return 1; // this command was processed
+}
+
+uint8_t motor_script_length() {
+	return (motion_script_tail - motion_script_head) & (MOTION_SCRIPT_SIZE-1);
+}
+
+void motor_script_clear() {
+	motion_script_head = motion_script_tail;
+	script_fast_step = 0;
+	script_dwell_pending = 0;
+}
+
+/*
+ * Append a step to the motion script. Speed 0 means the default speed. Returns 0 if the script is full.
+ * Script execution is started by setting command to Dance.
+ */
+uint8_t motor_script_add( int16_t loc, uint8_t speed, uint8_t dwell, uint8_t flags ) {
+	if (motor_script_length() >= MOTION_SCRIPT_SIZE-1) {
+		return 0;
+	}
+	motion_step_t * step = &motion_script[motion_script_tail];
+	step->location = loc;
+	step->speed = speed;
+	step->dwell = dwell;
+	step->flags = flags;
+	motion_script_tail = (motion_script_tail+1) & (MOTION_SCRIPT_SIZE-1);
+	return 1;
+}
+
+void motor_script_start() {
+	if (motor_script_length() > 0) {
+		command = Dance;
+	}
+}
+
+void add_dance_step( motor_command_t cmd ) {
+	motor_script_add(0, 0, 0, MOTION_STEP_FAST | ((cmd == MotorUp) ? MOTION_STEP_RELATIVE_UP : MOTION_STEP_RELATIVE_DOWN));
+}
+
+void dance() {
+	// Move the blinds up/down or down/up a bit, depending on whether the blinds are almost down or up
+	// (so not to cause calibration or to extend past lower limit)
+	command = Dance;
+	if (location < (max_curtain_length/2)) {
+		add_dance_step(MotorDown);
+		add_dance_step(MotorUp);
+	} else {
+		add_dance_step(MotorUp);
+		add_dance_step(MotorDown);
+	}
+}
+
+/*
+ * Execute the motion script one step at a time: each step is started only after the previous one has stopped
+ * and its dwell time has elapsed. Called from motor_process() while command == Dance.
+ */
+void motor_script_process() {
+	if (status == Error) {
+		motor_script_clear();
+		command = NoCommand;
+		return;
+	}
+	if ( (status != Stopped) || (start_phase != StartIdle) ) {
+		return;
+	}
+	if (motion_script_dwell) {
+		if (!script_dwell_pending) {
+			script_dwell_pending = 1;
+			script_dwell_timestamp = HAL_GetTick();
+		}
+		if (HAL_GetTick() - script_dwell_timestamp < (uint32_t)motion_script_dwell * 100) {
+			return;
+		}
+		motion_script_dwell = 0;
+		script_dwell_pending = 0;
+	}
+	script_fast_step = 0;
+	while (motion_script_head != motion_script_tail) {
+		motion_step_t step = motion_script[motion_script_head];
+		motion_script_head = (motion_script_head+1) & (MOTION_SCRIPT_SIZE-1);
+
+		motor_direction_t dir;
+		if (step.flags & MOTION_STEP_RELATIVE_UP) {
+			target_location = location - DEG_TO_LOCATION(90);
+			if (target_location < 0) {
+				target_location = -1;
+			}
+			dir = Up;
+		} else if (step.flags & MOTION_STEP_RELATIVE_DOWN) {
+			target_location = location + DEG_TO_LOCATION(90);
+			dir = Down;
+		} else if ( (step.location == location) || calibrating ) {
+			// already there (or location is not known yet) -> only dwell
+			motion_script_dwell = step.dwell;
+			if (step.dwell) {
+				return;
+			}
+			continue;
+		} else {
+			target_location = step.location;
+			dir = (step.location < location) ? Up : Down;
+		}
+		if (!check_voltage()) {
+			// Too low voltage -> abort the script
+			break;
+		}
+		motion_script_dwell = step.dwell;
+		script_fast_step = (step.flags & MOTION_STEP_FAST) ? 1 : 0;
+		motor_request_start(dir, step.speed ? step.speed : motor_default_speed(dir));
+		return;
+	}
+	motor_script_clear();
+	command = NoCommand;
+}
+
+#ifdef SUNRISE_MODE_ENABLED
+void sunrise_begin( int16_t target ) {
+	// Any previous move or motion script is aborted first
+	motor_script_clear();
+	command = NoCommand;
+	if (status != Stopped) {
+		motor_stop();
+	}
+	sunrise_target = target;
+	sunrise_interval = (uint32_t)sunrise_duration * 60 * 1000;	// divided by the number of bursts when starting
+	sunrise_duration = 0;
+	sunrise_burst_pos = 0;
+	sunrise_active = 1;
+}
+
+/*
+ * Start the next burst when the previous one has stopped and its time slot has come. Burst targets are interpolated
+ * from the start location so that the curtain arrives at the final target even if some bursts overshoot or undershoot.
+ */
+void sunrise_process() {
+	if (!sunrise_active) {
+		return;
+	}
+	if (status == Error) {
+		sunrise_active = 0;
+		return;
+	}
+	if ( (status != Stopped) || (start_phase != StartIdle) ) {
+		return;
+	}
+	if (sunrise_burst_pos == 0) {
+		int16_t distance = (sunrise_target > location) ? (sunrise_target - location) : (location - sunrise_target);
+		sunrise_bursts = (distance + SUNRISE_BURST_LENGTH - 1) / SUNRISE_BURST_LENGTH;
+		if (sunrise_bursts == 0) {
+			sunrise_active = 0;
+			return;
+		}
+		sunrise_interval /= sunrise_bursts;
+		sunrise_start_location = location;
+		sunrise_start_timestamp = HAL_GetTick();
+	} else if (sunrise_burst_pos >= sunrise_bursts) {
+		sunrise_active = 0;
+		return;
+	} else if (HAL_GetTick() - sunrise_start_timestamp < sunrise_burst_pos * sunrise_interval) {
+		return;
+	}
+	sunrise_burst_pos++;
+	target_location = sunrise_start_location +
+		(int32_t)(sunrise_target - sunrise_start_location) * sunrise_burst_pos / sunrise_bursts;
+	if (target_location == location) {
+		return;
+	}
+	if (!check_voltage()) {
+		// Too low voltage -> abort
+		sunrise_active = 0;
+		return;
+	}
+	motor_request_start( (target_location < location) ? Up : Down, SUNRISE_BURST_SPEED << RPM_DECIMAL_BITS);
+}
+#endif
+
+#ifdef GROUP_MOVE_ENABLED
+/*
+ * Start the armed group move. Speed is derived from the distance to target so that the move takes travel_time
+ * seconds (not counting acceleration and slowdown). The motor is energized GROUP_START_DELAY after CMD_EXT_GROUP_GO
+ * was received.
+ */
+void motor_group_go( uint8_t travel_time ) {
+	uint32_t now = HAL_GetTick();
+	uint32_t received = group_go_received ? group_go_timestamp : now;
+	group_go_received = 0;
+	if (!group_armed) {
+		return;
+	}
+	group_armed = 0;
+	if ( (group_target == location) || calibrating ) {
+		return;
+	}
+	motor_direction_t dir = (group_target < location) ? Up : Down;
+	uint8_t speed = motor_default_speed(dir);
+	if (travel_time > 0) {
+		uint32_t distance = (group_target > location) ? (group_target - location) : (location - group_target);
+		uint32_t rpm = distance * (60 << RPM_DECIMAL_BITS) / (DEG_TO_LOCATION(360) * travel_time);
+		if (rpm < motor_min_slowdown_speed(dir)) {
+			rpm = motor_min_slowdown_speed(dir);
+		} else if (rpm > 255) {
+			rpm = 255;
+		}
+		speed = rpm;
+	}
+	if (!check_voltage()) {
+		return;
+	}
+	target_location = group_target;
+	motor_request_start(dir, speed);
+	if ( (start_phase == StartSettling) && (now - received < GROUP_START_DELAY) ) {
+		// Wait for the common start moment regardless of the Hall sensor activity
+		start_phase_timestamp = received;
+		start_settle_min_time = start_settle_time = GROUP_START_DELAY;
+	}
+}
+#endif
+
+#ifdef AUTOTUNE_ENABLED
+/*
+ * Start the tuning move away from the nearer end of the curtain. The location must be known so that the move
+ * can be limited to AUTOTUNE_MAX_TRAVEL within the curtain length
+ */
+void motor_autotune_start() {
+	if (calibrating) {
+		autotune_result = AutotuneAborted;
+		return;
+	}
+	if (location < max_curtain_length/2) {
+		autotune_direction = Down;
+		target_location = location + AUTOTUNE_MAX_TRAVEL;
+		if (target_location > max_curtain_length) {
+			target_location = max_curtain_length;
+		}
+	} else {
+		autotune_direction = Up;
+		target_location = location - AUTOTUNE_MAX_TRAVEL;
+		if (target_location < 0) {
+			target_location = 0;
+		}
+	}
+	autotune_pwm[0] = autotune_pwm[1] = 0;
+	autotune_phase = AutotuneLowStep;	// set before starting so that no slowdown profile is built
+	autotune_result = AutotuneRunning;
+	motor_request_start(autotune_direction, AUTOTUNE_SPEED << RPM_DECIMAL_BITS);
+}
+
+uint8_t autotune_clamp( int32_t value, int32_t min ) {
+	if (value < min) {
+		return min;
+	}
+	return (value > 255) ? 255 : value;
+}
+
+/*
+ * Compute the parameters from the measurements of the tuning move (see AUTOTUNE_ENABLED) and store them.
+ * Called from the main loop
+ */
+void motor_autotune_finish() {
+	autotune_phase = AutotuneIdle;
+	int32_t rpm_low = autotune_rpm[0];
+	int32_t rpm_high = autotune_rpm[1];
+	int32_t delta_rpm = rpm_high - rpm_low;
+	int32_t delta_pwm = autotune_pwm[1] - autotune_pwm[0];
+	if ( (rpm_low == 0) || (delta_rpm <= 0) || (delta_pwm <= 0) ) {
+		autotune_result = AutotuneFailed;
+		return;
+	}
+
+	// Area between the final speed and the step response is delta_rpm * tau. The speed is averaged over one motor
+	// revolution, which delays it by half of the revolution period (one Hall sensor #1 interval)
+	int32_t tau = ((int32_t)(rpm_high * autotune_area_time - autotune_area_sum)) / delta_rpm;
+	tau -= (60*1000 << RPM_DECIMAL_BITS)/GEAR_RATIO/((rpm_low + rpm_high)/2)/2;
+	if (tau < control_period) {
+		tau = control_period;
+	}
+	autotune_tau = tau;
+
+	// Lambda tuning of a first order system with gain K = delta_rpm / delta_pwm:
+	// Kp = tau / (K * lambda), Ki = 1 / (K * lambda) per millisecond
+	int32_t lambda = tau * AUTOTUNE_LAMBDA_RATIO;
+	pi_kp = autotune_clamp((delta_pwm << PI_GAIN_DECIMAL_BITS) / (delta_rpm * AUTOTUNE_LAMBDA_RATIO), 1);
+	pi_ki = autotune_clamp((delta_pwm << PI_GAIN_DECIMAL_BITS) * CONTROL_REFERENCE_PERIOD / (delta_rpm * lambda), 1);
+	pwm_ff_gain = autotune_clamp(((AUTOTUNE_PWM_HIGH - PWM_FF_OFFSET) << PI_GAIN_DECIMAL_BITS) / rpm_high, 1);
+
+	// Slowing down from speed v with constant deceleration takes 2 * slowdown length / v, which is
+	// slowdown_factor * 2 * 60000 / (8 * DEG_TO_LOCATION(360)) milliseconds regardless of v
+	uint8_t factor = autotune_clamp(tau * AUTOTUNE_SLOWDOWN_TAUS * 8 * DEG_TO_LOCATION(360) / (2*60*1000),
+			AUTOTUNE_MIN_SLOWDOWN_FACTOR);
+	uint8_t min_speed = autotune_clamp(rpm_low, 1 << RPM_DECIMAL_BITS);
+#ifdef DIRECTIONAL_TUNING_ENABLED
+	if (autotune_direction == Down) {
+		slowdown_factor_down = factor;
+		min_slowdown_speed_down = min_speed;
+		motor_write_setting(SLOWDOWN_DOWN_EEPROM, (factor << 8) | min_speed);
+	} else
+#endif
+	{
+		slowdown_factor = factor;
+		min_slowdown_speed = min_speed;
+		motor_write_setting(SLOWDOWN_UP_EEPROM, (factor << 8) | min_speed);
+	}
+	motor_write_setting(PI_GAINS_EEPROM, (pi_kp << 8) | pi_ki);
+	motor_write_setting(PWM_FF_GAIN_EEPROM, pwm_ff_gain);
+	autotune_result = AutotuneDone;
+}
+
+// Called from the main loop
+void motor_autotune_process() {
+	motor_status_t curr_status = status;	// read before the phase, which is changed before the motor is stopped
+	if (autotune_phase == AutotuneMeasured) {
+		motor_autotune_finish();
+	} else if ( (autotune_phase != AutotuneIdle) && (curr_status != Moving) && (curr_status != Stopping) &&
+			(start_phase == StartIdle) ) {
+		// Stopped before the measurements were done (stalled, travel limit reached or a fault)
+		autotune_phase = AutotuneIdle;
+		autotune_result = AutotuneAborted;
+	}
+}
+#endif
+
+// Move to target_location (or start a sunrise move if its duration has been set)
+void motor_go_to_target() {
+#ifdef GROUP_MOVE_ENABLED
+	if (group_arm_next) {
+		group_arm_next = 0;
+		group_target = target_location;
+		group_armed = 1;
+		group_armed_timestamp = HAL_GetTick();
+		return;
+	}
+#endif
+#ifdef SUNRISE_MODE_ENABLED
+	if (sunrise_duration) {
+		sunrise_begin(target_location);
+		return;
+	}
+#endif
+	if (target_location < location) {
+		command = MotorUp;
+	} else {
+		command = MotorDown;
+	}
+}
+
+uint8_t check_flexispeed_trigger() {
+#ifdef FLEXISPEED_ENABLED
+	if (last_command == CMD_UP) {
+		flexispeed_trigger_counter++;
+		if ( flexispeed_trigger_counter >= FLEXISPEED_TRIGGER_LIMIT -1) {
+			// Speed switching is triggered
+			flexispeed_trigger_counter = 0;
+			flexispeed_sel++;
+			if (flexispeed_sel >= sizeof(flexispeed_settings)) {
+				flexispeed_sel = 0;
+			}
+			uint8_t speed = flexispeed_settings[ flexispeed_sel ] << RPM_DECIMAL_BITS;
+			motor_write_setting(DEFAULT_SPEED_EEPROM, speed);
+			default_speed = speed;
+			dance();
+			return 1;
+		}
+	} else {
+		// Using any other command than CMD_UP (besides get status commands) will reset the trigger counter
+		flexispeed_trigger_counter = 0;
+	}
+#endif
+	return 0;
+}
+
+uint8_t command_queue_push( uint16_t cmd ) {
+	uint8_t next = (command_queue_head + 1) & (COMMAND_QUEUE_SIZE-1);
+	if (next == command_queue_tail) {
+		return 0;	// full
+	}
+	command_queue[command_queue_head] = cmd;
+	command_queue_head = next;
+	return 1;
+}
+
+uint8_t command_queue_pop( uint16_t * cmd ) {
+	if (command_queue_tail == command_queue_head) {
+		return 0;	// empty
+	}
+	*cmd = command_queue[command_queue_tail];
+	command_queue_tail = (command_queue_tail + 1) & (COMMAND_QUEUE_SIZE-1);
+	return 1;
+}
+
+/*
+ * Publish the state for the status queries. Called from the main loop
+ */
+void motor_publish_state() {
+	motor_state_t * state = &motor_state[(motor_state_seq + 1) & 1];
+
+	// Hall sensor interrupt updates location and tick counters together, so copy them in one go
+	__disable_irq();
+	state->location = location;
+	state->hall_sensor_1_ticks = hall_sensor_1_ticks;
+	state->hall_sensor_2_ticks = hall_sensor_2_ticks;
+	uint8_t curr_status = status;
+	uint8_t pwm = curr_pwm >> PWM_EXTRA_BITS;
+	__enable_irq();
+	state->target_location = target_location;
+
+	uint8_t active = (curr_status == Moving) || (curr_status == Stopping) ||
+		(curr_status == CalibratingEndPoint) || (curr_status == Stalled);
+	uint8_t speed, ext_speed;
+	uint16_t rpm = get_rpm();
+	if ( (rpm < (1<<RPM_DECIMAL_BITS)) && active) {
+		// If speed is so slow that it's (almost) stalling or we in the middle of end-point calibration,
+		// report a minimal speed anyway so that controller module knows that we are not finished yet
+		speed = 1;
+		ext_speed = 1; // 0.25 RPM
+	} else {
+		speed = rpm >> RPM_DECIMAL_BITS;
+		ext_speed = rpm;
+	}
+	uint16_t curr = get_motor_current();
+	if ( (curr > 0) && (curr < (1<< MOTOR_CURRENT_SHIFT_BITS))) {
+		// return at least the minimum (16 mA) if non-zero
+		curr = 1;
+	} else {
+		curr = curr >> MOTOR_CURRENT_SHIFT_BITS;
+	}
+	uint16_t pos = location_to_position100fp();
+	uint32_t eta = motor_estimate_eta() / ETA_UNIT;
+
+	uint8_t * reply = state->status_reply;
+	reply[0] = 0xd8;
+#ifdef BATTERY_SOC_ENABLED
+	reply[1] = soc_get_level();
+#else
+	reply[1] = get_battery_level();
+#endif
+	reply[2] = get_voltage()/16;	// Volts * 30 as in original FW
+	reply[3] = speed;
+	// round the position up and return integer part
+	reply[4] = (pos + (1<<(POSITION_DECIMAL_BITS-1))) >> POSITION_DECIMAL_BITS;
+
+	reply = state->ext_status_reply;
+	reply[0] = 0xda;
+	reply[1] = curr_status;
+	reply[2] = (curr > 255) ? 255 : curr;	// mA / 16, maximum reported value is 4 amps
+	reply[3] = ext_speed; // extended speed is with RPM_DECIMAL_BITS (2) bits of decimal precision
+	reply[4] = pos >> 8; // Position100 with 8 bits of fixed point precision
+	reply[5] = pos & 0xff;
+	reply[6] = pwm;	// reported as 8-bit duty cycle
+	reply[7] = (eta > 255) ? 255 : eta;	// estimated time to target
+
+	__DMB();	// buffer must be complete before it's made visible
+	motor_state_seq++;
+}
+
+/*
+ * Copy the latest published state. Safe to call from interrupt context
+ */
+void motor_read_state(motor_state_t * state) {
+	uint8_t seq;
+	do {
+		seq = motor_state_seq;
+		__DMB();
+		*state = motor_state[seq & 1];
+		__DMB();
+	} while (seq != motor_state_seq);
+}
+
+/*
+ * Copy len bytes at offset of the latest published state (one of the prebuilt replies). Safe to call from
+ * interrupt context
+ */
+void motor_read_reply(uint8_t offset, uint8_t len, uint8_t * buf) {
+	uint8_t seq;
+	do {
+		seq = motor_state_seq;
+		__DMB();
+		memcpy(buf, (const uint8_t *)&motor_state[seq & 1] + offset, len);
+		__DMB();
+	} while (seq != motor_state_seq);
+}
+
+/*
+ * Push the telemetry frame when status has changed, and periodically while moving
+ */
+void motor_telemetry_process() {
+	if (telemetry_interval == 0)
+		return;
+	if (status != telemetry_last_status) {
+		telemetry_pending = 1;
+	}
+	uint8_t active = (status == Moving) || (status == Stopping) || (status == CalibratingEndPoint) || (start_phase != StartIdle);
+	if (!telemetry_pending && !(active && (HAL_GetTick() - telemetry_timestamp >= telemetry_interval)))
+		return;
+	if (!uart_tx_done()) {
+		// Don't steal the bandwidth from replies. Try again later
+		return;
+	}
+	telemetry_pending = 0;
+	telemetry_last_status = status;
+	telemetry_timestamp = HAL_GetTick();
+
+	telemetry_buffer[2] = 0xdc;
+	telemetry_buffer[3] = status;
+	telemetry_buffer[4] = location >> 8;
+	telemetry_buffer[5] = location & 0xff;
+	uint16_t rpm = control_sample_rpm;
+	telemetry_buffer[6] = (rpm > 255) ? 255 : rpm; // with RPM_DECIMAL_BITS (2) bits of decimal precision
+	uint16_t curr = get_motor_current() >> MOTOR_CURRENT_SHIFT_BITS;
+	telemetry_buffer[7] = (curr > 255) ? 255 : curr;
+	telemetry_buffer[8] = control_sample_pwm >> PWM_EXTRA_BITS;	// reported as 8-bit duty cycle
+	uart_send_reply(telemetry_buffer, 10);
+}
+
+#ifdef WARM_RESTART_ENABLED
+// Called from the main loop: refresh the copy of the state which survives a reset
+void motor_save_warm_state() {
+	warmstate_t state;
+	memset(&state, 0, sizeof(state));
+	state.location = location;
+	state.target_location = target_location;
+#ifdef COAST_PREDICTION_ENABLED
+	state.coast_gain[0] = coast_gain[0];
+	state.coast_gain[1] = coast_gain[1];
+#endif
+	state.orientation = orientation;
+	state.calibrating = calibrating;
+	state.moving = (status == Moving) || (status == Stopping) || (status == CalibratingEndPoint) || (start_phase != StartIdle);
+	state.default_speed = default_speed;
+	state.slowdown_factor[0] = slowdown_factor;
+	state.min_slowdown_speed[0] = min_slowdown_speed;
+#ifdef DIRECTIONAL_TUNING_ENABLED
+	state.slowdown_factor[1] = slowdown_factor_down;
+	state.min_slowdown_speed[1] = min_slowdown_speed_down;
+	state.speed_bump[0] = speed_bump[0];
+	state.speed_bump[1] = speed_bump[1];
+#endif
+	state.pi_kp = pi_kp;
+	state.pi_ki = pi_ki;
+	state.pwm_ff_gain = pwm_ff_gain;
+	state.control_period = control_period;
+#ifdef SPEED_ZONES_ENABLED
+	memcpy(state.speed_zones, speed_zones, sizeof(speed_zones));
+#endif
+	warmstate_store(&state);
+}
+
+/*
+ * Restore the state retained over a warm restart. Settings stored in flash memory have been loaded already.
+ * Returns 0 if there's nothing to restore or the location wasn't known before the reset.
+ */
+uint8_t motor_restore_warm_state() {
+	warmstate_t state;
+	if ( (!warmstate_load(&state)) || state.calibrating ) {
+		return 0;
+	}
+	location = state.location;
+	// An interrupted move isn't resumed
+	target_location = state.moving ? state.location : state.target_location;
+#ifdef COAST_PREDICTION_ENABLED
+	coast_gain[0] = state.coast_gain[0];
+	coast_gain[1] = state.coast_gain[1];
+#endif
+	orientation = state.orientation;
+	default_speed = state.default_speed;
+	slowdown_factor = state.slowdown_factor[0];
+	min_slowdown_speed = state.min_slowdown_speed[0];
+#ifdef DIRECTIONAL_TUNING_ENABLED
+	slowdown_factor_down = state.slowdown_factor[1];
+	min_slowdown_speed_down = state.min_slowdown_speed[1];
+	speed_bump[0] = state.speed_bump[0];
+	speed_bump[1] = state.speed_bump[1];
+#endif
+	pi_kp = state.pi_kp;
+	pi_ki = state.pi_ki;
+	pwm_ff_gain = state.pwm_ff_gain;
+	motor_set_parameter(ParamControlPeriod, state.control_period);
+#ifdef SPEED_ZONES_ENABLED
+	memcpy(speed_zones, state.speed_zones, sizeof(speed_zones));
+#endif
+	return 1;
+}
+#endif
+
+void motor_process() {
+#ifdef DYNAMIC_BRAKING_ENABLED
+	motor_process_stop_brake();
+#endif
+	motor_process_start();
+	motor_publish_state();
+#ifdef MOVE_PIPELINING_ENABLED
+	if (staged_move && (command == NoCommand)) {
+		motor_process_staged_move();
+	}
+#endif
+	if ( (command == NoCommand) || (command == Dance) ) {
+		// Execute the next queued command only when there isn't a deferred motor command pending
+		uint16_t cmd;
+		if (command_queue_pop(&cmd)) {
+#ifdef MOVE_PIPELINING_ENABLED
+			pipeline_target = target_location;
+			motor_command_t previous_command = command;
+#endif
+			motor_execute_command(cmd >> 8, cmd & 0xff);
+#ifdef MOVE_PIPELINING_ENABLED
+			if (command != previous_command) {
+				// Any other motor command replaces the staged move (a new move may stage itself again)
+				staged_move = 0;
+			}
+#endif
+		}
+	}
+	if (motion_profile_dirty) {
+		if ( (status == Moving) || (status == Stopping) ) {
+			motor_build_profile();
+		} else {
+			motion_profile_dirty = 0;
+		}
+	}
+#ifdef SUNRISE_MODE_ENABLED
+	if (command != NoCommand) {
+		// Any other movement command aborts the sunrise move
+		sunrise_active = 0;
+	}
+	sunrise_process();
+#endif
+#ifdef GROUP_MOVE_ENABLED
+	if ( (command != NoCommand) || (HAL_GetTick() - group_armed_timestamp > GROUP_ARM_TIMEOUT) ) {
+		// Any other movement command disarms the group move
+		group_armed = 0;
+	}
+#endif
+#ifdef AUTOTUNE_ENABLED
+	if ( (command != NoCommand) && (command != Autotune) && (autotune_phase != AutotuneIdle) ) {
+		// Any other movement command aborts the tuning move. The speed controller takes over until it's processed
+		autotune_phase = AutotuneIdle;
+		autotune_result = AutotuneAborted;
+	}
+	motor_autotune_process();
+#endif
+	if (command == Dance) {
+		motor_script_process();
+	} else if (command != NoCommand) {
+		// Any other command overrides the running motion script
+		motor_script_clear();
+		if (process_next_command(command)) {
+			// command was processed
+			command = NoCommand;
+		} else {
+			// processing this command was deferred
+		}
+	}
+	motor_telemetry_process();
+#ifdef MOVE_METERING_ENABLED
+	if ( (status != Moving) && (status != Stopping) ) {
+		motor_close_move_record();
+	}
+#endif
+#ifdef LIFETIME_STATS_ENABLED
+	if ( (status != Moving) && (status != Stopping) && (status != CalibratingEndPoint) ) {
+		// endpoint calibration is included in the record
+		motor_lifetime_move_finished();
+	}
+#endif
+#ifdef BATTERY_SOC_ENABLED
+	soc_update(get_motor_current(), (status == Moving) || (status == Stopping) || (status == CalibratingEndPoint) || (start_phase != StartIdle));
+#endif
+#ifdef THERMAL_PROTECTION_ENABLED
+	motor_update_thermal();
+#endif
+#ifdef LOCATION_JOURNAL_ENABLED
+	motor_update_location_journal();
+#elif defined(LIFETIME_STATS_ENABLED)
+	motor_update_lifetime_stats(0);
+#endif
+#ifdef BREAKAWAY_PWM_LEARNING_ENABLED
+	motor_update_breakaway_pwm();
+#endif
+#ifdef COAST_PREDICTION_ENABLED
+	coast_measure_process();
+#endif
+#ifdef WARM_RESTART_ENABLED
+	motor_save_warm_state();
+#endif
+	motor_process_settings();
+	if ( ((status == Stopped) || (status == Error)) && (start_phase == StartIdle) ) {
+		system_clock_fast(0);
+	}
+#ifdef SENSOR_POWER_GATING_ENABLED
+	// Hall sensors are needed from the start request until the rod has stopped turning
+	sensor_power_process( ((status != Stopped) && (status != Error)) || (start_phase != StartIdle) ||
+		(HAL_GetTick() - hall_last_edge_timestamp < SENSOR_POWER_IDLE_DELAY) );
+#endif
+	if ( (idle_mode_sleep_delay > 0) && (start_phase == StartIdle) ) {
+#ifdef SUNRISE_MODE_ENABLED
+		if (sunrise_active) {
+			// SysTick is stopped in sleep mode so stay awake between the bursts
+			reset_sleep_timer();
+		} else
+#endif
+#ifdef GROUP_MOVE_ENABLED
+		if (group_armed) {
+			// Stay awake so that we don't lose the first byte of CMD_EXT_GROUP_GO when waking up
+			reset_sleep_timer();
+		} else
+#endif
+		if ( (status == Stopped) || (status == Error) ) {
+			if (!sleep_timer_enabled()) {
+				reset_sleep_timer();
+			} else {
+				if (sleep_timer_timeout() && uart_tx_done() && sleep_mode_ready()) {
+					disable_sleep_timer();
+					motor_commit_settings();
+#if defined(LIFETIME_STATS_ENABLED) && !defined(LOCATION_JOURNAL_ENABLED)
+					motor_update_lifetime_stats(1);
+#endif
+					enter_sleep_mode();
+				}
+			}
+		}
+	}
+}
+
+
+// Time (in milliseconds) to travel the given number of Hall sensor ticks at speed (RPM with RPM_DECIMAL_BITS)
+uint32_t ticks_to_ms( uint32_t ticks, uint8_t speed ) {
+	if (speed == 0) {
+		return 0;
+	}
+	return ticks * (60UL*1000 << RPM_DECIMAL_BITS) / ((uint32_t)speed * DEG_TO_LOCATION(360));
+}
+
+/*
+ * Time (in milliseconds) to travel the next ticks of the current move at speed, or at the speeds of the zones it passes
+ */
+uint32_t motor_cruise_time( uint32_t ticks, uint8_t speed ) {
+#ifdef SPEED_ZONES_ENABLED
+	if (zoned_move && !calibrating) {
+		motor_direction_t dir = (start_phase != StartIdle) ? start_direction : direction;
+		int32_t from = (dir == Up) ? location - (int32_t)ticks : location;
+		int32_t to = from + (int32_t)ticks;
+		uint32_t time = 0;
+		for (int i=0; (i < SPEED_ZONE_COUNT) && (from < to); i++) {
+			int32_t end = motor_zone_end(i);
+			if ( (speed_zones[i] >> 8) && (from < end) ) {
+				uint8_t zone_speed = (speed_zones[i] & 0xff) ? (speed_zones[i] & 0xff) : speed;
+				int32_t zone_to = (to < end) ? to : end;
+				time += ticks_to_ms(zone_to - from, zone_speed);
+				from = zone_to;
+			}
+		}
+		return time + ticks_to_ms(to - from, speed);
+	}
+#endif
+	return ticks_to_ms(ticks, speed);
+}
+
+/*
+ * Estimated time (in milliseconds) until the current move reaches its target. Remaining distance is travelled at cruise
+ * speed (see motor_cruise_time) until the slowdown profile begins and then at the speed of each profile bin.
+ * Returns 0 if idle.
+ */
+uint32_t motor_estimate_eta() {
+#ifdef SUNRISE_MODE_ENABLED
+	if ( (sunrise_active) && (sunrise_burst_pos > 0) ) {
+		uint32_t elapsed = HAL_GetTick() - sunrise_start_timestamp;
+		uint32_t total = sunrise_bursts * sunrise_interval;
+		return (elapsed < total) ? (total - elapsed) : 0;
+	}
+#endif
+	if ( (status != Moving) && (status != Stopping) && (start_phase == StartIdle) ) {
+		return 0;
+	}
+	uint8_t speed = (start_phase != StartIdle) ? start_speed : cruise_speed;
+	uint32_t distance = (target_location == -1) ? location : abs(target_location - location);
+	uint32_t length = motion_profile_length;
+	if ( (length == 0) || (target_location == -1) ) {
+		return motor_cruise_time(distance, speed);
+	}
+	uint32_t eta = 0;
+	if (distance > length) {
+		eta = motor_cruise_time(distance - length, speed);
+		distance = length;
+	}
+	uint32_t bin_ticks = 1 << motion_profile_shift;
+	for (int i=0; (i < MOTION_PROFILE_BINS) && (distance > 0); i++) {
+		uint32_t ticks = (distance > bin_ticks) ? bin_ticks : distance;
+		eta += ticks_to_ms(ticks, motion_profile[i]);
+		distance -= ticks;
+	}
+	return eta;
+}
+
+uint8_t query_ext_status(uint8_t * buf) {
+	motor_read_reply(offsetof(motor_state_t, ext_status_reply) + 1, EXT_STATUS_REPLY_SIZE - 1, buf);
+	return EXT_STATUS_REPLY_SIZE - 1;
+}
+
+uint8_t query_location(uint8_t * buf) {
+	motor_state_t state;
+	motor_read_state(&state);
+	buf[0] = state.location >> 8;
+	buf[1] = state.location & 0xff;
+	buf[2] = state.target_location >> 8;
+	buf[3] = state.target_location & 0xff;
+	return 4;
+}
+
+uint8_t query_limits(uint8_t * buf) {
+	buf[0] = calibrating | (orientation<<1) | (auto_calibration<<2);
+	buf[1] = max_curtain_length >> 8;
+	buf[2] = max_curtain_length & 0xff;
+	buf[3] = full_curtain_length >> 8;
+	buf[4] = full_curtain_length & 0xff;
+	return 5;
+}
+
+uint8_t query_tuning_params(uint8_t * buf) {
+	buf[0] = slowdown_factor;
+	buf[1] = min_slowdown_speed;	// with RPM_DECIMAL_BITS of precision
+	buf[2] = stall_detection_timeout >> STALL_DETECTION_TIMEOUT_SHIFT_BITS;
+	buf[3] = max_motor_current >> MOTOR_CURRENT_SHIFT_BITS;
+	buf[4] = idle_mode_sleep_delay >> IDLE_MODE_SLEEP_DELAY_SHIFT_BITS;
+	buf[5] = pi_kp;
+	buf[6] = pi_ki;
+	return 7;
+}
+
+uint8_t query_debug(uint8_t * buf) {
+	buf[0] = (uint8_t)last_error;
+	uint16_t curr = highest_motor_current >> MOTOR_CURRENT_SHIFT_BITS;
+	if (curr > 255) {
+		curr = 255;	// maximum reported value is 4 amps
+	}
+	buf[1] = curr;
+	curr = last_stalling_current >> MOTOR_CURRENT_SHIFT_BITS;
+	if (curr>255) {
+		curr = 255; // maximum reported value is 4 amps
+	}
+	buf[2] = curr;
+	buf[3] = pwm_when_stalled >> PWM_EXTRA_BITS;
+	buf[4] = stalled_moving_up_counter;
+	buf[5] = stalled_moving_down_counter;
+	buf[6] = flexispeed_trigger_counter;
+	buf[7] = lowest_voltage/16;
+	return 8;
+}
+
+/*
+ * Sections of the aggregate query (CMD_EXT_GET_MULTI). Bit N of the query mask selects section N
+ */
+typedef uint8_t (*query_section_t)(uint8_t * buf);
+const query_section_t query_sections[] = {
+	query_ext_status,		// bit 0: same as CMD_EXT_GET_STATUS (7 bytes)
+	query_location,			// bit 1: same as CMD_EXT_GET_LOCATION (4 bytes)
+	query_limits,			// bit 2: same as CMD_EXT_GET_LIMITS (5 bytes)
+	query_tuning_params,	// bit 3: same as CMD_EXT_GET_TUNING_PARAMS (7 bytes)
+	query_debug				// bit 4: same as CMD_EXT_DEBUG (8 bytes)
+};
+
+/*
+ * Build the reply to a status query. Called from UART interrupt context.
+ */
+uint8_t handle_query(uint16_t cmd, uint8_t * tx_buffer, uint8_t * tx_bytes) {
+	switch (cmd) {
+
+		case CMD_GET_STATUS:
+			{
+				motor_read_reply(offsetof(motor_state_t, status_reply), STATUS_REPLY_SIZE, &tx_buffer[2]);
+				*tx_bytes=8;
+			}
+			break;
+
+		case CMD_EXT_GET_VERSION:
+			{
+				tx_buffer[2] = 0xd0;
+				tx_buffer[3] = VERSION_MAJOR;
+				tx_buffer[4] = VERSION_MINOR;
+				tx_buffer[5] = minimum_voltage;
+				tx_buffer[6] = default_speed;
+				tx_buffer[7] = 0;	// reserved for future use
+				tx_buffer[8] = 0; 	// reserved for future use
+				*tx_bytes=10;
+			}
+			break;
+		case CMD_EXT_GET_TUNING_PARAMS:
+			{
+				tx_buffer[2] = 0xd5;
+				*tx_bytes = 4 + query_tuning_params(&tx_buffer[3]);
+			}
+			break;
+		case CMD_EXT_DEBUG:
+			{
+				tx_buffer[2] = 0xd2;
+				*tx_bytes = 4 + query_debug(&tx_buffer[3]);
+			}
+			break;
+		case CMD_EXT_SENSOR_DEBUG:
+			{
+				motor_state_t state;
+				motor_read_state(&state);
+				tx_buffer[2] = 0xd3;
+				tx_buffer[3] = state.hall_sensor_1_ticks >> 8;
+				tx_buffer[4] = state.hall_sensor_1_ticks & 0xff;
+				tx_buffer[5] = state.hall_sensor_2_ticks >> 8;
+				tx_buffer[6] = state.hall_sensor_2_ticks & 0xff;
+				tx_buffer[7] = (uint8_t)sensor_ticks_while_calibrating_endpoint;
+				tx_buffer[8] = (uint8_t)sensor_ticks_while_stopped;
+#ifdef BACKLASH_COMPENSATION_ENABLED
+				tx_buffer[9] = (location_drift > 127) ? 127 : ((location_drift < -127) ? -127 : location_drift);
+				tx_buffer[10] = (reversals_since_calibration > 255) ? 255 : reversals_since_calibration;
+				tx_buffer[11] = backlash_correction;
+				*tx_bytes=13;
+#else
+				*tx_bytes=10;
+#endif
+			}
+			break;
+		case CMD_EXT_UART_DEBUG:
+			{
+				tx_buffer[2] = 0xd4;
+				tx_buffer[3] = uart_tx_dropped >> 8;
+				tx_buffer[4] = uart_tx_dropped & 0xff;
+				tx_buffer[5] = uart_rx_errors >> 8;
+				tx_buffer[6] = uart_rx_errors & 0xff;
+				tx_buffer[7] = (uart_tx_max_len > 255) ? 255 : uart_tx_max_len;
+				*tx_bytes=9;
+			}
+			break;
+		case CMD_EXT_EEPROM_DEBUG:
+			{
+				tx_buffer[2] = 0xd6;
+				tx_buffer[3] = EE_PageTransferCount >> 8;
+				tx_buffer[4] = EE_PageTransferCount & 0xff;
+				tx_buffer[5] = EE_WriteCount >> 8;
+				tx_buffer[6] = EE_WriteCount & 0xff;
+				tx_buffer[7] = eeprom_dirty >> 8;
+				tx_buffer[8] = eeprom_dirty & 0xff;
+				*tx_bytes=10;
+			}
+			break;
+#ifdef BATTERY_SOC_ENABLED
+		case CMD_EXT_GET_BATTERY:
+			{
+				uint16_t consumed = soc_get_consumed_mah();
+				tx_buffer[2] = 0xd7;
+				tx_buffer[3] = soc_get_level();
+				tx_buffer[4] = get_battery_level();
+				tx_buffer[5] = consumed >> 8;
+				tx_buffer[6] = consumed & 0xff;
+				*tx_bytes=8;
+			}
+			break;
+#endif
+#ifdef LIFETIME_STATS_ENABLED
+		case CMD_EXT_GET_LIFETIME_STATS:
+			{
+				lifetime_stats_t stats;
+				motor_get_lifetime_stats(&stats);
+				tx_buffer[2] = 0xdd;
+				tx_buffer[3] = stats.revolutions >> 24;
+				tx_buffer[4] = (stats.revolutions >> 16) & 0xff;
+				tx_buffer[5] = (stats.revolutions >> 8) & 0xff;
+				tx_buffer[6] = stats.revolutions & 0xff;
+				tx_buffer[7] = stats.motor_on_time >> 24;
+				tx_buffer[8] = (stats.motor_on_time >> 16) & 0xff;
+				tx_buffer[9] = (stats.motor_on_time >> 8) & 0xff;
+				tx_buffer[10] = stats.motor_on_time & 0xff;
+				tx_buffer[11] = stats.calibrations >> 8;
+				tx_buffer[12] = stats.calibrations & 0xff;
+				tx_buffer[13] = stats.stalls_up >> 8;
+				tx_buffer[14] = stats.stalls_up & 0xff;
+				tx_buffer[15] = stats.stalls_down >> 8;
+				tx_buffer[16] = stats.stalls_down & 0xff;
+				tx_buffer[17] = stats.flash_erases >> 8;
+				tx_buffer[18] = stats.flash_erases & 0xff;
+				*tx_bytes=20;
+			}
+			break;
+#endif
+#ifdef RAM_STATS_ENABLED
+		case CMD_EXT_GET_RAM_STATS:
+			{
+				// sizes of the regions in the order of ramstats_region_t
+				uint8_t len = 3;
+				tx_buffer[2] = 0xdc;
+				for (int i=0; i<RAMSTATS_REGION_COUNT; i++) {
+					uint16_t size = ramstats_get(i);
+					tx_buffer[len++] = size >> 8;
+					tx_buffer[len++] = size & 0xff;
+				}
+				*tx_bytes = len + 1;
+			}
+			break;
+#endif
+#ifdef MOVE_METERING_ENABLED
+		case CMD_EXT_GET_MOVE_LOG:
+			{
+				// newest record first
+				uint8_t * buf = &tx_buffer[3];
+				tx_buffer[2] = 0xd9;
+				for (int i=1; i<=MOVE_LOG_SIZE; i++) {
+					move_record_t * record = &move_log[(move_log_head - i) & (MOVE_LOG_SIZE-1)];
+					*buf++ = record->energy >> 8;
+					*buf++ = record->energy & 0xff;
+					*buf++ = record->duration >> 8;
+					*buf++ = record->duration & 0xff;
+					*buf++ = record->ticks >> 8;
+					*buf++ = record->ticks & 0xff;
+					*buf++ = record->peak_current;
+					*buf++ = record->speed;
+					*buf++ = record->flags;
+				}
+				*tx_bytes = 4 + MOVE_LOG_SIZE*9;
+			}
+			break;
+#endif
+#ifdef AUTOTUNE_ENABLED
+		case CMD_EXT_GET_AUTOTUNE:
+			{
+				tx_buffer[2] = 0xbc;
+				tx_buffer[3] = autotune_result;
+				tx_buffer[4] = autotune_rpm[0];	// with RPM_DECIMAL_BITS of precision
+				tx_buffer[5] = autotune_rpm[1];
+				tx_buffer[6] = autotune_tau >> 8;
+				tx_buffer[7] = autotune_tau & 0xff;
+				*tx_bytes=9;
+			}
+			break;
+#endif
+		case CMD_EXT_GET_LOCATION:
+			{
+				tx_buffer[2] = 0xd1;
+				*tx_bytes = 4 + query_location(&tx_buffer[3]);
+			}
+			break;
+		case CMD_EXT_GET_STATUS:
+			{
+				motor_read_reply(offsetof(motor_state_t, ext_status_reply), EXT_STATUS_REPLY_SIZE, &tx_buffer[2]);
+				*tx_bytes = 3 + EXT_STATUS_REPLY_SIZE;
+			}
+			break;
+		case CMD_EXT_GET_LIMITS:
+			{
+				tx_buffer[2] = 0xdb;
+				*tx_bytes = 4 + query_limits(&tx_buffer[3]);
+			}
+			break;
+		default:
+			if ((cmd & 0xffe0) == CMD_EXT_GET_MULTI) {
+				// Aggregate query: the selected sections are returned in one frame, in bit order
+				uint8_t mask = cmd & 0x1f;
+				uint8_t len = 3;
+				tx_buffer[2] = cmd & 0xff;
+				for (int i=0; i<sizeof(query_sections)/sizeof(query_section_t); i++) {
+					if (mask & (1<<i)) {
+						len += query_sections[i](&tx_buffer[len]);
+					}
+				}
+				*tx_bytes = len + 1;
+				break;
+			}
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Set a parameter with full resolution. Non-volatile settings are also written to flash memory. 
+ * Called from the main loop. Returns 1 if parameter id and value are valid
+ */
+uint8_t motor_set_parameter(uint8_t id, uint16_t value) {
+	switch (id) {
+		case ParamSpeed:
+			if ( (value <= 1) || (value > 255) )
+				return 0;
+			default_speed = value;
+			if (cruise_speed != 0) {
+				cruise_speed = value;
+#ifdef SPEED_ZONES_ENABLED
+				zoned_move = 0;	// explicit speed overrides the zones for the rest of the move
+#endif
+				motion_profile_dirty = 1;
+			}
+			break;
+		case ParamDefaultSpeed:
+			if ( (value <= 1) || (value > 255) )
+				return 0;
+			motor_write_setting(DEFAULT_SPEED_EEPROM, value);
+			default_speed = value;
+			break;
+		case ParamMinimumVoltage:
+			motor_write_setting(MINIMUM_VOLTAGE_EEPROM, value);
+			minimum_voltage = value;
+			break;
+		case ParamMaxMotorCurrent:
+			motor_write_setting(MAX_MOTOR_CURRENT_EEPROM, value);
+			max_motor_current = value;
+			break;
+		case ParamStallDetectionTimeout:
+			motor_write_setting(STALL_DETECTION_TIMEOUT_EEPROM, value);
+			stall_detection_timeout = value;
+			break;
+		case ParamSleepDelay:
+			motor_write_setting(IDLE_MODE_SLEEP_DELAY_EEPROM, value);
+			idle_mode_sleep_delay = value;
+			break;
+		case ParamSlowdownFactor:
+			slowdown_factor = value;
+			motion_profile_dirty = 1;
+			break;
+		case ParamMinSlowdownSpeed:
+			min_slowdown_speed = value;
+			motion_profile_dirty = 1;
+			break;
+		case ParamPiKp:
+			pi_kp = value;
+			break;
+		case ParamPiKi:
+			pi_ki = value;
+			break;
+		case ParamPwmFfGain:
+			pwm_ff_gain = value;
+			break;
+		case ParamAutoCalibration:
+			motor_write_setting(AUTO_CAL_EEPROM, value);
+			auto_calibration = value;
+			break;
+		case ParamOrientation:
+			if (value > REVERSE_ORIENTATION)
+				return 0;
+			motor_write_setting(ORIENTATION_EEPROM, value);
+			orientation = value;
+			hall_update_transition_table();
+			break;
+		case ParamLocation:
+			location = (int16_t)value;
+			calibrating = 0;
+			break;
+		case ParamMaxCurtainLength:
+			motor_write_setting(MAX_CURTAIN_LEN_EEPROM, value);
+			set_max_curtain_length(value);
+			break;
+		case ParamFullCurtainLength:
+			motor_write_setting(FULL_CURTAIN_LEN_EEPROM, value);
+			full_curtain_length = value;
+			break;
+		case ParamControlPeriod:
+			if ( (value < MIN_CONTROL_PERIOD) || (value > MAX_CONTROL_PERIOD) )
+				return 0;
+			control_period = value;
+			set_control_period(value);
+			break;
+#ifdef SLEEP_TRACKING_ENABLED
+		case ParamSleepTracking:
+			if ( (value > SLEEP_TRACKING_MAX_SHIFT) && (value != SLEEP_TRACKING_CONTINUOUS) )
+				return 0;
+			sleep_tracking = value;
+			break;
+#endif
+#ifdef SUNRISE_MODE_ENABLED
+		case ParamSunriseDuration:
+			if (value > 255)
+				return 0;
+			sunrise_duration = value;
+			break;
+#endif
+#ifdef MULTIDROP_BUS_ENABLED
+		case ParamDeviceAddress:
+			if (value > 255)
+				return 0;
+			motor_write_setting(DEVICE_ADDRESS_EEPROM, value);
+			device_address = value;
+			uart_apply_bus_mode();
+			break;
+#endif
+#ifdef DIRECTIONAL_TUNING_ENABLED
+		case ParamSlowdownFactorDown:
+			slowdown_factor_down = value;
+			motion_profile_dirty = 1;
+			break;
+		case ParamMinSlowdownSpeedDown:
+			min_slowdown_speed_down = value;
+			motion_profile_dirty = 1;
+			break;
+		case ParamSpeedBumpUp:
+		case ParamSpeedBumpDown:
+			if (value > MAX_SPEED_BUMP)
+				return 0;
+			speed_bump[id - ParamSpeedBumpUp] = value;
+			break;
+#endif
+#ifdef ADAPTIVE_SLEEP_DELAY_ENABLED
+		case ParamMaxSleepDelay:
+			max_sleep_delay = value;
+			break;
+#endif
+#ifdef SOFT_START_ENABLED
+		case ParamStartCurrentLimit:
+			start_current_limit = value;
+			break;
+#endif
+#ifdef SPEED_ZONES_ENABLED
+		case ParamSpeedZone0:
+		case ParamSpeedZone1:
+		case ParamSpeedZone2:
+		case ParamSpeedZone3:
+			if ( (id - ParamSpeedZone0 >= SPEED_ZONE_COUNT) || ((value >> 8) > 100) || ((value & 0xff) == 1) )
+				return 0;
+			speed_zones[id - ParamSpeedZone0] = value;
+			motion_profile_dirty = 1;
+			break;
+#endif
+		default:
+			return 0;
 	}
+	return 1;
 }
 
-void do_dance() {
-	if (status == Stopped) {
-		motor_command_t next_command = get_next_dance_step();
-		if (next_command != NoCommand) {
-			if (next_command == MotorUp) {
-				target_location = location - DEG_TO_LOCATION(90);
-				if (target_location < 0) {
-					target_location = -1;
-				}
-			} else if (next_command == MotorDown) {
-				target_location = location + DEG_TO_LOCATION(90);
+/*
+ * Get a parameter with full resolution. Returns 1 if parameter id is valid
+ */
+uint8_t motor_get_parameter(uint8_t id, uint16_t * value) {
+	switch (id) {
+		case ParamSpeed: *value = (cruise_speed != 0) ? cruise_speed : default_speed; break;
+		case ParamDefaultSpeed: *value = default_speed; break;
+		case ParamMinimumVoltage: *value = minimum_voltage; break;
+		case ParamMaxMotorCurrent: *value = max_motor_current; break;
+		case ParamStallDetectionTimeout: *value = stall_detection_timeout; break;
+		case ParamSleepDelay: *value = idle_mode_sleep_delay; break;
+		case ParamSlowdownFactor: *value = slowdown_factor; break;
+		case ParamMinSlowdownSpeed: *value = min_slowdown_speed; break;
+		case ParamPiKp: *value = pi_kp; break;
+		case ParamPiKi: *value = pi_ki; break;
+		case ParamPwmFfGain: *value = pwm_ff_gain; break;
+		case ParamAutoCalibration: *value = auto_calibration; break;
+		case ParamOrientation: *value = orientation; break;
+		case ParamLocation: *value = (uint16_t)location; break;
+		case ParamMaxCurtainLength: *value = max_curtain_length; break;
+		case ParamFullCurtainLength: *value = full_curtain_length; break;
+		case ParamControlPeriod: *value = control_period; break;
+#ifdef SLEEP_TRACKING_ENABLED
+		case ParamSleepTracking: *value = sleep_tracking; break;
+#endif
+#ifdef SUNRISE_MODE_ENABLED
+		case ParamSunriseDuration: *value = sunrise_duration; break;
+#endif
+#ifdef MULTIDROP_BUS_ENABLED
+		case ParamDeviceAddress: *value = device_address; break;
+#endif
+		case ParamEta:
+			{
+				uint32_t eta = motor_estimate_eta() / 100;
+				*value = (eta > 0xffff) ? 0xffff : eta;
 			}
-			process_next_command( next_command );
-		} else {
-			command = NoCommand;
-		}
-	} else if (status == Error) {
-		command = NoCommand;
+			break;
+#ifdef DIRECTIONAL_TUNING_ENABLED
+		case ParamSlowdownFactorDown: *value = slowdown_factor_down; break;
+		case ParamMinSlowdownSpeedDown: *value = min_slowdown_speed_down; break;
+		case ParamSpeedBumpUp: *value = speed_bump[0]; break;
+		case ParamSpeedBumpDown: *value = speed_bump[1]; break;
+#endif
+#ifdef ADAPTIVE_SLEEP_DELAY_ENABLED
+		case ParamMaxSleepDelay: *value = max_sleep_delay; break;
+		case ParamActiveSleepDelay:
+			{
+				uint32_t delay = get_sleep_delay();
+				*value = (delay > 0xffff) ? 0xffff : delay;
+			}
+			break;
+#endif
+#ifdef SOFT_START_ENABLED
+		case ParamStartCurrentLimit: *value = start_current_limit; break;
+#endif
+#ifdef HALL_HEALTH_MONITORING_ENABLED
+		case ParamHallSensorFailed: *value = (hall_failed_sensor == HALL_STATE_SENSOR_1) ? 1 : ((hall_failed_sensor == HALL_STATE_SENSOR_2) ? 2 : 0); break;
+#endif
+#ifdef THERMAL_PROTECTION_ENABLED
+		case ParamMotorTemperatureRise: *value = thermal_get_rise() / 100; break;
+#endif
+#ifdef SPEED_ZONES_ENABLED
+		case ParamSpeedZone0:
+		case ParamSpeedZone1:
+		case ParamSpeedZone2:
+		case ParamSpeedZone3:
+			if (id - ParamSpeedZone0 >= SPEED_ZONE_COUNT)
+				return 0;
+			*value = speed_zones[id - ParamSpeedZone0];
+			break;
+#endif
+		default:
+			return 0;
 	}
+	return 1;
 }
 
-uint8_t check_flexispeed_trigger() {
-#ifdef FLEXISPEED_ENABLED
-	if (last_command == CMD_UP) {
-		flexispeed_trigger_counter++;
-		if ( flexispeed_trigger_counter >= FLEXISPEED_TRIGGER_LIMIT -1) {
-			// Speed switching is triggered
-			flexispeed_trigger_counter = 0;
-			flexispeed_sel++;
-			if (flexispeed_sel >= sizeof(flexispeed_settings)) {
-				flexispeed_sel = 0;
-			}
-			uint8_t speed = flexispeed_settings[ flexispeed_sel ] << RPM_DECIMAL_BITS;
-			motor_write_setting(DEFAULT_SPEED_EEPROM, speed);
-			default_speed = speed;
-			dance();
+#ifdef PROTOCOL_V2_ENABLED
+// Order of the values in the settings block. Append only, a changed layout needs a new SETTINGS_BLOCK_VERSION
+static const uint8_t settings_block_params[SETTINGS_BLOCK_COUNT] = {
+	ParamDefaultSpeed, ParamMinimumVoltage, ParamMaxMotorCurrent, ParamStallDetectionTimeout, ParamSleepDelay,
+	ParamAutoCalibration, ParamOrientation, ParamSlowdownFactor, ParamMinSlowdownSpeed, ParamSlowdownFactorDown,
+	ParamMinSlowdownSpeedDown, ParamPiKp, ParamPiKi, ParamPwmFfGain
+};
+
+static uint8_t settings_value_valid( uint8_t id, uint16_t value ) {
+	switch (id) {
+		case ParamDefaultSpeed: return (value > 1) && (value <= 255);
+		case ParamOrientation: return (value <= REVERSE_ORIENTATION);
+		case ParamMinimumVoltage:
+		case ParamMaxMotorCurrent:
+		case ParamStallDetectionTimeout:
+		case ParamSleepDelay:
 			return 1;
-		}
-	} else {
-		// Using any other command than CMD_UP (besides get status commands) will reset the trigger counter
-		flexispeed_trigger_counter = 0;
+		default: return (value <= 255);	// 8-bit settings
 	}
-#endif
-	return 0;
 }
 
-void motor_process() {
-	if (command == Dance) {
-		do_dance();
-	} else if (command != NoCommand) {
-		if (process_next_command(command)) {
-			// command was processed
-			command = NoCommand;
-		} else {
-			// processing this command was deferred
+uint8_t motor_export_settings( uint8_t * block ) {
+	uint8_t len = 0;
+	uint16_t value;
+	block[len++] = SETTINGS_BLOCK_VERSION;
+	for (int i=0; i<SETTINGS_BLOCK_COUNT; i++) {
+		if (!motor_get_parameter(settings_block_params[i], &value)) {
+			value = 0;	// not supported by this build, ignored when imported
 		}
+		block[len++] = value >> 8;
+		block[len++] = value & 0xff;
 	}
-	if (idle_mode_sleep_delay > 0) {
-		if ( (status == Stopped) || (status == Error) ) {
-			if (!sleep_timer_enabled()) {
-				reset_sleep_timer();
-			} else {
-				if (sleep_timer_timeout() && uart_tx_done()) {
-					disable_sleep_timer();
-					enter_sleep_mode();
-				}
-			}
-		}
+	uint8_t crc = 0;
+	for (int i=0; i<len; i++) {
+		crc = v2_crc8(crc, block[i]);
 	}
+	block[len++] = crc;
+	return len;
 }
 
+uint8_t motor_import_settings( const uint8_t * block, uint8_t len ) {
+	if ( (len != SETTINGS_BLOCK_SIZE) || (block[0] != SETTINGS_BLOCK_VERSION) )
+		return 0;
+	uint8_t crc = 0;
+	for (int i=0; i<len-1; i++) {
+		crc = v2_crc8(crc, block[i]);
+	}
+	if (crc != block[len-1])
+		return 0;
+	// Validate everything before applying anything
+	for (int i=0; i<SETTINGS_BLOCK_COUNT; i++) {
+		if (!settings_value_valid(settings_block_params[i], (block[1+2*i] << 8) + block[2+2*i]))
+			return 0;
+	}
+	for (int i=0; i<SETTINGS_BLOCK_COUNT; i++) {
+		motor_set_parameter(settings_block_params[i], (block[1+2*i] << 8) + block[2+2*i]);
+	}
+#ifdef AUTOTUNE_ENABLED
+	// Tuning values are otherwise stored only by the tuning move
+	motor_write_setting(PI_GAINS_EEPROM, (pi_kp << 8) | pi_ki);
+	motor_write_setting(PWM_FF_GAIN_EEPROM, pwm_ff_gain);
+	motor_write_setting(SLOWDOWN_UP_EEPROM, (slowdown_factor << 8) | min_slowdown_speed);
+#ifdef DIRECTIONAL_TUNING_ENABLED
+	motor_write_setting(SLOWDOWN_DOWN_EEPROM, (slowdown_factor_down << 8) | min_slowdown_speed_down);
+#endif
+#endif
+	// Write all at once unless the motor is running, in which case motor_process_settings() commits the batch later
+	if ( ((status == Stopped) || (status == Error)) && (start_phase == StartIdle) ) {
+		motor_commit_settings();
+	}
+	return 1;
+}
+#endif
 
-uint8_t handle_command(uint8_t * rx_buffer, uint8_t * tx_buffer, uint8_t * tx_bytes) {
-	uint8_t cmd1, cmd2;
-	cmd1 = rx_buffer[3];
-	cmd2 = rx_buffer[4];
+/*
+ * Execute the command popped from the command queue. Called from the main loop.
+ */
+void motor_execute_command(uint8_t cmd1, uint8_t cmd2) {
 	uint16_t cmd = (cmd1 << 8) + cmd2;
 
 	uint8_t cmd_handled = 1;
 
-	if (sleep_timer_enabled()) {
-		reset_sleep_timer();
-	}
-
 	switch (cmd) {
 
-		case CMD_GET_STATUS:
+		case CMD_EXT_ENTER_BOOTLOADER:
 			{
-				tx_buffer[2] = 0xd8;
-				tx_buffer[3] = get_battery_level();
-				tx_buffer[4] = (uint8_t)(get_voltage()/16);  // returned value is Volts * 30 as in original FW
-				uint16_t rpm = get_rpm();
-				if ( (rpm < (1<<RPM_DECIMAL_BITS)) && 
-					( (status == Moving) || (status == Stopping) || (status == CalibratingEndPoint) || (status == Stalled) )) {
-					// If speed is so slow that it's (almost) stalling or we in the middle of end-point calibration,
-					// report a minimal speed anyway so that controller module knows that we are not finished yet
-					rpm = 1;
-				} else {
-					rpm >>= RPM_DECIMAL_BITS;
-				}
-				tx_buffer[5] = (uint8_t)rpm;
-				// round the position up and return integer part
-				tx_buffer[6] = (uint8_t)( (location_to_position100fp()+(1<<(POSITION_DECIMAL_BITS-1))) >> POSITION_DECIMAL_BITS);
-				*tx_bytes=8;
+				command = EnterBootloader;
 			}
 			break;
 
@@ -977,7 +4289,7 @@ uint8_t handle_command(uint8_t * rx_buffer, uint8_t * tx_buffer, uint8_t * tx_by
 		case CMD_SET_MAX_CURTAIN_LENGTH:
 			{
 				motor_write_setting(MAX_CURTAIN_LEN_EEPROM, location);
-				max_curtain_length = location;
+				set_max_curtain_length(location);
 				dance();
 			}
 			break;
@@ -985,7 +4297,7 @@ uint8_t handle_command(uint8_t * rx_buffer, uint8_t * tx_buffer, uint8_t * tx_by
 		case CMD_RESET_CURTAIN_LENGTH:
 			{
 				motor_write_setting(MAX_CURTAIN_LEN_EEPROM, full_curtain_length);
-				max_curtain_length = full_curtain_length;
+				set_max_curtain_length(full_curtain_length);
 				calibrating = 1;	// allow unrestricted movement until the end of calibration
 
 				// Emulate the functionality of the original firmware: Rewind 90 degrees up so that
@@ -999,6 +4311,7 @@ uint8_t handle_command(uint8_t * rx_buffer, uint8_t * tx_buffer, uint8_t * tx_by
 			{
 				orientation = (orientation+1)&1;
 				motor_write_setting(ORIENTATION_EEPROM, orientation);
+				hall_update_transition_table();
 				location = full_curtain_length - location;
 			}
 			break;
@@ -1007,6 +4320,7 @@ uint8_t handle_command(uint8_t * rx_buffer, uint8_t * tx_buffer, uint8_t * tx_by
 				if (orientation == 1) {
 					orientation = 0;
 					motor_write_setting(ORIENTATION_EEPROM, orientation);
+					hall_update_transition_table();
 					location = full_curtain_length - location;
 				}
 			}
@@ -1017,122 +4331,6 @@ uint8_t handle_command(uint8_t * rx_buffer, uint8_t * tx_buffer, uint8_t * tx_by
 				command = MotorDown;
 			}
 			break;
-		case CMD_EXT_GET_VERSION:
-			{
-				tx_buffer[2] = 0xd0;
-				tx_buffer[3] = VERSION_MAJOR;
-				tx_buffer[4] = VERSION_MINOR;
-				tx_buffer[5] = minimum_voltage;
-				tx_buffer[6] = default_speed;
-				tx_buffer[7] = 0;	// reserved for future use
-				tx_buffer[8] = 0; 	// reserved for future use
-				*tx_bytes=10;
-			}
-			break;
-		case CMD_EXT_GET_TUNING_PARAMS:
-			{
-				tx_buffer[2] = 0xd5;
-				tx_buffer[3] = slowdown_factor;
-				tx_buffer[4] = min_slowdown_speed;	// with RPM_DECIMAL_BITS of precision
-				tx_buffer[5] = stall_detection_timeout >> STALL_DETECTION_TIMEOUT_SHIFT_BITS;
-				tx_buffer[6] = max_motor_current >> MOTOR_CURRENT_SHIFT_BITS;
-				tx_buffer[7] = idle_mode_sleep_delay >> IDLE_MODE_SLEEP_DELAY_SHIFT_BITS;
-				tx_buffer[8] = 0;	// reserved for future use
-				tx_buffer[9] = 0; 	// reserved for future use
-				*tx_bytes=11;
-			}
-			break;
-		case CMD_EXT_DEBUG:
-			{
-				tx_buffer[2] = 0xd2;
-				tx_buffer[3] = (uint8_t)last_error;
-				uint16_t curr = highest_motor_current >> MOTOR_CURRENT_SHIFT_BITS;
-				if (curr > 255) {
-					curr = 255;	// maximum reported value is 4 amps
-				}
-				tx_buffer[4] = curr;
-				curr = last_stalling_current >> MOTOR_CURRENT_SHIFT_BITS;
-				if (curr>255) {
-					curr = 255; // maximum reported value is 4 amps
-				}
-				tx_buffer[5] = curr;
-				tx_buffer[6] = pwm_when_stalled;
-				tx_buffer[7] = stalled_moving_up_counter;
-				tx_buffer[8] = stalled_moving_down_counter;
-				tx_buffer[9] = flexispeed_trigger_counter;
-				tx_buffer[10] = lowest_voltage/16;
-				*tx_bytes=12;
-			}
-			break;
-		case CMD_EXT_SENSOR_DEBUG:
-			{
-				tx_buffer[2] = 0xd3;
-				tx_buffer[3] = hall_sensor_1_ticks >> 8;
-				tx_buffer[4] = hall_sensor_1_ticks & 0xff;
-				tx_buffer[5] = hall_sensor_2_ticks >> 8;
-				tx_buffer[6] = hall_sensor_2_ticks & 0xff;
-				tx_buffer[7] = (uint8_t)sensor_ticks_while_calibrating_endpoint;
-				tx_buffer[8] = (uint8_t)sensor_ticks_while_stopped;
-				*tx_bytes=10;
-			}
-			break;
-		case CMD_EXT_GET_LOCATION:
-			{
-				tx_buffer[2] = 0xd1;
-				tx_buffer[3] = location >> 8;
-				tx_buffer[4] = location & 0xff;
-				tx_buffer[5] = target_location >> 8;
-				tx_buffer[6] = target_location & 0xff;
-				*tx_bytes=8;
-			}
-			break;
-		case CMD_EXT_ENTER_BOOTLOADER:
-			{
-				command = EnterBootloader;
-				status = Bootloader;
-			}
-			// fall-thru (send 'entering bootloader' status)
-		case CMD_EXT_GET_STATUS:
-			{
-				tx_buffer[2] = 0xda;
-				tx_buffer[3] = status;
-				uint16_t curr = get_motor_current();
-				if ( (curr > 0) && (curr < (1<< MOTOR_CURRENT_SHIFT_BITS))) {
-					// return at least the minimum (16 mA) if non-zero
-					curr = 1;
-				} else {
-					curr = curr >> MOTOR_CURRENT_SHIFT_BITS;
-				}
-				if (curr > 255) {
-					curr = 255;	// maximum reported value is 4 amps
-				}
-				tx_buffer[4] = (uint8_t)curr;
-				uint16_t rpm = get_rpm();
-				if ( (rpm < (1<<RPM_DECIMAL_BITS)) && ( (status == Moving) || (status == Stopping) || (status == CalibratingEndPoint) || (status == Stalled) )) {
-					// If speed is so slow that it's (almost) stalling or we in the middle of end-point calibration,
-					// report a minimal speed anyway so that controller module knows that we are not finished yet
-					rpm = 1; // 0.25 RPM
-				}
-				tx_buffer[5] = (uint8_t)rpm; // extended speed is with RPM_DECIMAL_BITS (2) bits of decimal precision
-				uint16_t pos = location_to_position100fp(); // Position100 with 8 bits of fixed point precision
-				tx_buffer[6] = pos >> 8;
-				tx_buffer[7] = pos & 0xff;
-				tx_buffer[8] = curr_pwm;
-				tx_buffer[9] = 0; // reserved for future use
-				*tx_bytes=11;
-			}
-			break;
-		case CMD_EXT_GET_LIMITS:
-			{
-				tx_buffer[2] = 0xdb;
-				tx_buffer[3] = calibrating | (orientation<<1) | (auto_calibration<<2);
-				tx_buffer[4] = max_curtain_length >> 8;
-				tx_buffer[5] = max_curtain_length & 0xff;
-				tx_buffer[6] = full_curtain_length >> 8;
-				tx_buffer[7] = full_curtain_length & 0xff;
-				*tx_bytes=9;
-			}
-			break;
 		case CMD_EXT_DANCE:
 			{
 				dance();
@@ -1141,6 +4339,7 @@ uint8_t handle_command(uint8_t * rx_buffer, uint8_t * tx_buffer, uint8_t * tx_by
 		case CMD_EXT_RESET_STATISTICS:
 			{
 			 	dir_error = 0;
+				hall_invalid_transitions = 0;
 				sensor_ticks_while_stopped = 0;
 				sensor_ticks_while_calibrating_endpoint = 0;
 				last_stalling_current = 0;
@@ -1149,6 +4348,15 @@ uint8_t handle_command(uint8_t * rx_buffer, uint8_t * tx_buffer, uint8_t * tx_by
 				stalled_moving_up_counter = 0;
 				stalled_moving_down_counter = 0;
 				lowest_voltage = 8.4*16*30;
+				uart_tx_dropped = 0;
+				uart_tx_max_len = 0;
+				uart_rx_errors = 0;
+#ifdef BATTERY_SOC_ENABLED
+				soc_reset_consumed();
+#endif
+#ifdef MOVE_METERING_ENABLED
+				memset(move_log, 0, sizeof(move_log));
+#endif
 			}
 			break;
 		default:
@@ -1158,36 +4366,29 @@ uint8_t handle_command(uint8_t * rx_buffer, uint8_t * tx_buffer, uint8_t * tx_by
 	if (!cmd_handled) {
 		// one byte commands with parameter
 		if (cmd1 == CMD_EXT_SET_SPEED) {
-			if (cmd2 > 1) {
-				default_speed = cmd2;
-				if (target_speed != 0)
-					target_speed = cmd2;
-			}
+			motor_set_parameter(ParamSpeed, cmd2);
 		} else if (cmd1 == CMD_EXT_SET_DEFAULT_SPEED) {
-			if (cmd2 > 1) {
-				motor_write_setting(DEFAULT_SPEED_EEPROM, cmd2);
-				default_speed = cmd2;
+			if (motor_set_parameter(ParamDefaultSpeed, cmd2)) {
 				dance();
 			}
 		} else if (cmd1 == CMD_GO_TO) {
 			if (!calibrating) {
 				target_location = position100_to_location(cmd2);
-				if (target_location < location) {
-					command = MotorUp;
-				} else {
-					command = MotorDown;
-				}
+				motor_go_to_target();
+#ifdef MOVE_PIPELINING_ENABLED
+			} else {
+				motor_stage_move(position100_to_location(cmd2));
+#endif
 			}
 		} else if ((cmd1 & 0xf0) == CMD_EXT_GO_TO) {
+			uint16_t pos = ((cmd1 & 0x0f)<<8) + cmd2;
 			if (!calibrating) {
-				uint16_t pos = ((cmd1 & 0x0f)<<8) + cmd2;
-				float pos2 = ((float)pos)/16;
-				target_location = position100_to_location(pos2);
-				if (target_location < location) {
-					command = MotorUp;
-				} else {
-					command = MotorDown;
-				}
+				target_location = position100fp4_to_location(pos);
+				motor_go_to_target();
+#ifdef MOVE_PIPELINING_ENABLED
+			} else {
+				motor_stage_move(position100fp4_to_location(pos));
+#endif
 			}
 		} else if ((cmd1 & 0xf0) == CMD_EXT_SET_LOCATION) {
 			// There is only room for 12 bits of data, so we have omitted 1 least-significant bit
@@ -1195,67 +4396,100 @@ uint8_t handle_command(uint8_t * rx_buffer, uint8_t * tx_buffer, uint8_t * tx_by
 			location = loc;
 			calibrating = 0;
 		} else if (cmd1 == CMD_EXT_SET_MINIMUM_VOLTAGE) {
-			motor_write_setting(MINIMUM_VOLTAGE_EEPROM, cmd2);
-			minimum_voltage = cmd2;
+			motor_set_parameter(ParamMinimumVoltage, cmd2);
 		} else if (cmd1 == CMD_EXT_SET_AUTO_CAL) {
-			motor_write_setting(AUTO_CAL_EEPROM, cmd2);
-			auto_calibration = cmd2;
+			motor_set_parameter(ParamAutoCalibration, cmd2);
 		} else if (cmd1 == CMD_EXT_SET_ORIENTATION) {
-			motor_write_setting(ORIENTATION_EEPROM, cmd2);
-			orientation = cmd2;
+			motor_set_parameter(ParamOrientation, cmd2);
 		} else if (cmd1 == CMD_EXT_SET_MAX_MOTOR_CURRENT) {
-			uint16_t curr = cmd2 << MOTOR_CURRENT_SHIFT_BITS;
-			motor_write_setting(MAX_MOTOR_CURRENT_EEPROM, curr);
-			max_motor_current = curr;
+			motor_set_parameter(ParamMaxMotorCurrent, cmd2 << MOTOR_CURRENT_SHIFT_BITS);
 		} else if (cmd1 == CMD_EXT_SET_STALL_DETECTION_TIMEOUT) {
-			uint16_t timeout = cmd2 << STALL_DETECTION_TIMEOUT_SHIFT_BITS;
-			motor_write_setting(STALL_DETECTION_TIMEOUT_EEPROM, timeout);
-			stall_detection_timeout = timeout;
+			motor_set_parameter(ParamStallDetectionTimeout, cmd2 << STALL_DETECTION_TIMEOUT_SHIFT_BITS);
 		} else if (cmd1 == CMD_EXT_SET_SLEEP_DELAY) {
-			uint16_t delay = cmd2 << IDLE_MODE_SLEEP_DELAY_SHIFT_BITS;
-			motor_write_setting(IDLE_MODE_SLEEP_DELAY_EEPROM, delay);
-			idle_mode_sleep_delay = delay;
+			motor_set_parameter(ParamSleepDelay, cmd2 << IDLE_MODE_SLEEP_DELAY_SHIFT_BITS);
 		} else if ((cmd1 & 0xf0) == CMD_EXT_GO_TO_LOCATION) {
 			// There is only room for 12 bits of data, so we have omitted 1 least-significant bit
 			target_location = (((cmd1 & 0x0f)<<8) + cmd2) << 1;
-			if (target_location < location) {
-				command = MotorUp;
-			} else {
-				command = MotorDown;
-			}
+			motor_go_to_target();
 		} else if (cmd1 == CMD_EXT_SET_SLOWDOWN_FACTOR) {
-			slowdown_factor = cmd2;
+			motor_set_parameter(ParamSlowdownFactor, cmd2);
 		} else if (cmd1 == CMD_EXT_SET_MIN_SLOWDOWN_SPEED) {
-			min_slowdown_speed = cmd2;
-		} else if (cmd1 == CMD_EXT_PING) {
-			if (cmd2 == 0) {
-				blink += 1;
-			} else {
-				tx_buffer[2] = 0xba;
-				tx_buffer[3] = 0x00;
-				tx_buffer[4] = 0xff;
-				tx_buffer[5] = 0x9a;
-				tx_buffer[6] = cmd2+1;
-				*tx_bytes=8;
+			motor_set_parameter(ParamMinSlowdownSpeed, cmd2);
+		} else if (cmd1 == CMD_EXT_SET_PI_KP) {
+			motor_set_parameter(ParamPiKp, cmd2);
+		} else if (cmd1 == CMD_EXT_SET_PI_KI) {
+			motor_set_parameter(ParamPiKi, cmd2);
+		} else if (cmd1 == CMD_EXT_SET_PWM_FF_GAIN) {
+			motor_set_parameter(ParamPwmFfGain, cmd2);
+		} else if (cmd1 == CMD_EXT_SET_CONTROL_PERIOD) {
+			motor_set_parameter(ParamControlPeriod, cmd2);
+		} else if (cmd1 == CMD_EXT_SET_SLEEP_TRACKING) {
+			motor_set_parameter(ParamSleepTracking, cmd2);
+		} else if (cmd1 == CMD_EXT_SET_SUNRISE_DURATION) {
+			motor_set_parameter(ParamSunriseDuration, cmd2);
+		} else if (cmd1 == CMD_EXT_SET_DEVICE_ADDRESS) {
+			motor_set_parameter(ParamDeviceAddress, cmd2);
+#ifdef AUTOTUNE_ENABLED
+		} else if (cmd1 == CMD_EXT_AUTOTUNE) {
+			command = Autotune;
+#endif
+#ifdef RESIDENT_UPDATER_ENABLED
+		} else if (cmd1 == CMD_EXT_ENTER_UPDATER) {
+			updater_baud = cmd2;
+			command = EnterUpdater;
+#endif
+#ifdef GROUP_MOVE_ENABLED
+		} else if (cmd1 == CMD_EXT_ARM_GROUP_MOVE) {
+			group_arm_next = cmd2;
+			if (!cmd2) {
+				group_armed = 0;
+			}
+		} else if (cmd1 == CMD_EXT_GROUP_GO) {
+			motor_group_go(cmd2);
+#endif
+		} else if (cmd1 == CMD_EXT_SUBSCRIBE) {
+			telemetry_interval = cmd2 * 10;
+			if ( (telemetry_interval > 0) && (telemetry_interval < TELEMETRY_MIN_INTERVAL) ) {
+				telemetry_interval = TELEMETRY_MIN_INTERVAL;
 			}
+			telemetry_pending = 1;
 		}
 	}
 
-	if (cmd1 != STATUS_CMD_BYTE) {
-		// Save the last command so that we can check if flexi speed switching is triggered by 3 sequential CMD_UP commands.
-		// Between those commands we want to be able to get status updates without resetting the trigger counter though.
-		last_command = cmd;
-	}
-
-	return 1;
+	// Save the last command so that we can check if flexi speed switching is triggered by 3 sequential CMD_UP commands.
+	// Between those commands we want to be able to get status updates without resetting the trigger counter though.
+	last_command = cmd;
 }
 
 void motor_init() {
 
 	motor_stop();
 
+	hall_update_transition_table();
+	hall_state = hall_read_state();
+
 	reset_sleep_timer();
 
+#ifdef WARM_RESTART_ENABLED
+	if (motor_restore_warm_state()) {
+		// Warm restart: the location is still known. No calibration is needed
+		hall_update_transition_table();	// orientation may have changed
+		calibrating = 0;
+		command = NoCommand;
+		return;
+	}
+#endif
+
+#ifdef LOCATION_JOURNAL_ENABLED
+	if (journal_location != -1) {
+		// Restore the position where the motor was stopped last time. No calibration is needed
+		location = target_location = journal_location;
+		calibrating = 0;
+		command = NoCommand;
+		return;
+	}
+#endif
+
 	location = max_curtain_length; // assume we are at bottom position
 	
 	if (auto_calibration) {
@@ -1267,6 +4501,194 @@ void motor_init() {
 	}
 }
 
+#ifdef FAST_STOP_ENABLED
+/*
+ * Called from UART interrupt for every received command: de-energize the motor right away if it's a stop command.
+ * The queued command does the rest later in the main loop (see FAST_STOP_ENABLED)
+ */
+void motor_fast_stop(uint8_t cmd1, uint8_t cmd2) {
+	if ( ((cmd1 << 8) + cmd2) == CMD_STOP ) {
+		motor_stop();
+	}
+}
+#endif
+
+/*
+ * Status queries are answered right away (in UART interrupt context). Other commands are pushed into command queue
+ * and executed later in the main loop (see motor_execute_command).
+ * addr is the first header byte (device address on a multi-drop bus, see MULTIDROP_BUS_ENABLED).
+ * Returns 1 if command was handled.
+ */
+uint8_t handle_command(uint8_t addr, uint8_t cmd1, uint8_t cmd2, uint8_t * tx_buffer, uint8_t * tx_bytes) {
+	uint16_t cmd = (cmd1 << 8) + cmd2;
+
+#ifdef MULTIDROP_BUS_ENABLED
+	if ( (addr != UART_BROADCAST_ADDRESS) && (addr != device_address) ) {
+		// Meant for another module
+		return 0;
+	}
+#else
+	if (addr != 0x00) {
+		return 0;
+	}
+#endif
+
+	if (sleep_timer_enabled()) {
+		reset_sleep_timer();
+	}
+
+	if (cmd1 == STATUS_CMD_BYTE) {
+		return handle_query(cmd, tx_buffer, tx_bytes);
+	}
+
+	if (cmd1 == CMD_EXT_PING) {
+		if (cmd2 == 0) {
+			blink += 1;
+		} else {
+			tx_buffer[2] = 0xba;
+			tx_buffer[3] = 0x00;
+			tx_buffer[4] = 0xff;
+			tx_buffer[5] = 0x9a;
+			tx_buffer[6] = cmd2+1;
+			*tx_bytes=8;
+		}
+		last_command = cmd;
+		return 1;
+	}
+
+#ifdef GROUP_MOVE_ENABLED
+	if (cmd1 == CMD_EXT_GROUP_GO) {
+		// Common start moment of the group move is relative to the reception of this command
+		group_go_timestamp = HAL_GetTick();
+		group_go_received = 1;
+	}
+#endif
+
+#ifdef MOTION_TRACE_ENABLED
+	if (cmd1 == CMD_EXT_GET_TRACE) {
+		// Sample count, chunk number and the samples of the chunk (fewer in the last chunk)
+		tx_buffer[2] = 0xde;
+		tx_buffer[3] = motion_trace_count;
+		tx_buffer[4] = cmd2;
+		uint8_t len = 5;
+		for (int i=cmd2*MOTION_TRACE_SAMPLES_PER_CHUNK; (i<motion_trace_count) && (i<(cmd2+1)*MOTION_TRACE_SAMPLES_PER_CHUNK); i++) {
+			trace_sample_t * sample = &motion_trace[i];
+			tx_buffer[len++] = sample->time >> 8;
+			tx_buffer[len++] = sample->time & 0xff;
+			tx_buffer[len++] = (uint16_t)sample->location >> 8;
+			tx_buffer[len++] = sample->location & 0xff;
+			tx_buffer[len++] = sample->hall_interval >> 8;
+			tx_buffer[len++] = sample->hall_interval & 0xff;
+			tx_buffer[len++] = sample->pwm >> 8;
+			tx_buffer[len++] = sample->pwm & 0xff;
+			tx_buffer[len++] = sample->current;
+			tx_buffer[len++] = sample->voltage;
+		}
+		*tx_bytes = len + 1;
+		return 1;
+	}
+#endif
+
+#ifdef EVENTLOG_ENABLED
+	if (cmd1 == CMD_EXT_GET_EVENTS) {
+		// Record count, chunk number, current time and the records of the chunk (newest first)
+		uint16_t now = HAL_GetTick() >> EVENTLOG_TIME_SHIFT;
+		uint8_t count = eventlog_count();
+		tx_buffer[2] = 0xdf;
+		tx_buffer[3] = count;
+		tx_buffer[4] = cmd2;
+		tx_buffer[5] = now >> 8;
+		tx_buffer[6] = now & 0xff;
+		uint8_t len = 7;
+		for (int i=cmd2*EVENTLOG_CHUNK_RECORDS; (i<count) && (i<(cmd2+1)*EVENTLOG_CHUNK_RECORDS); i++) {
+			eventlog_record_t record = eventlog_get(i);
+			tx_buffer[len++] = record.time >> 8;
+			tx_buffer[len++] = record.time & 0xff;
+			tx_buffer[len++] = record.id;
+			tx_buffer[len++] = record.arg;
+		}
+		*tx_bytes = len + 1;
+		return 1;
+	}
+#endif
+
+#ifdef ISR_PROFILER_ENABLED
+	if (cmd1 == CMD_EXT_GET_PROFILE) {
+		// Chunk number and (MIN, MAX, AVG, MAX_LATENCY) of the slots in the chunk. Reset is acknowledged with empty chunk
+		tx_buffer[2] = 0xbe;
+		tx_buffer[3] = cmd2;
+		uint8_t len = 4;
+		if (cmd2 == PROFILE_RESET) {
+			profile_reset();
+		} else {
+			for (int i=cmd2*PROFILE_SLOTS_PER_CHUNK; (i<PROFILE_SLOT_COUNT) && (i<(cmd2+1)*PROFILE_SLOTS_PER_CHUNK); i++) {
+				uint16_t values[4];
+				profile_get(i, &values[0], &values[1], &values[2], &values[3]);
+				for (int j=0; j<4; j++) {
+					tx_buffer[len++] = values[j] >> 8;
+					tx_buffer[len++] = values[j] & 0xff;
+				}
+			}
+		}
+		*tx_bytes = len + 1;
+		return 1;
+	}
+#endif
+
+#ifdef MICROBENCH_ENABLED
+	if (cmd1 == CMD_EXT_MICROBENCH) {
+		// Kernel, iteration count and elapsed time in microseconds. Refused (0 iterations) while the motor is running,
+		// because interrupts are disabled during the run
+		uint8_t log2 = cmd2 >> 4;
+		if (log2 > MICROBENCH_MAX_ITERATIONS_LOG2) {
+			log2 = MICROBENCH_MAX_ITERATIONS_LOG2;
+		}
+		uint16_t iterations = 1 << log2;
+		uint32_t elapsed = 0;
+		if ( (status == Moving) || (status == Stopping) || ((cmd2 & 0x0f) >= MICROBENCH_KERNEL_COUNT) ) {
+			iterations = 0;
+		} else {
+			elapsed = microbench_run(cmd2 & 0x0f, iterations);
+		}
+		tx_buffer[2] = 0xbf;
+		tx_buffer[3] = cmd2 & 0x0f;
+		tx_buffer[4] = iterations >> 8;
+		tx_buffer[5] = iterations & 0xff;
+		tx_buffer[6] = elapsed >> 24;
+		tx_buffer[7] = (elapsed >> 16) & 0xff;
+		tx_buffer[8] = (elapsed >> 8) & 0xff;
+		tx_buffer[9] = elapsed & 0xff;
+		*tx_bytes = 11;
+		return 1;
+	}
+#endif
+
+	if (cmd1 == CMD_EXT_SET_BAUD_RATE) {
+		// Acknowledge using the current baud rate, then switch
+		tx_buffer[2] = 0xbd;
+		tx_buffer[3] = cmd2;
+		tx_buffer[4] = uart_request_baud_rate(cmd2);
+		*tx_bytes=6;
+		return 1;
+	}
 
+#ifdef FAST_STOP_ENABLED
+	motor_fast_stop(cmd1, cmd2);
+#endif
 
+	if (!command_queue_push(cmd)) {
+		// Queue is full. Drop the command
+		return 0;
+	}
 
+	if ( (cmd == CMD_EXT_ENTER_BOOTLOADER)
+#ifdef RESIDENT_UPDATER_ENABLED
+			|| (cmd1 == CMD_EXT_ENTER_UPDATER)
+#endif
+			) {
+		// send 'entering bootloader' status
+		status = Bootloader;
+		return handle_query(CMD_EXT_GET_STATUS, tx_buffer, tx_bytes);
+	}
+	return 1;
+}
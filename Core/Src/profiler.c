@@ -0,0 +1,106 @@
+#include "profiler.h"
+
+#ifdef ISR_PROFILER_ENABLED
+
+#define PROFILE_NO_IRQ 0xff
+
+typedef struct profile_stats_t {
+    uint16_t min;
+    uint16_t max;
+    uint16_t count;
+    uint16_t max_latency;
+    uint32_t sum;
+} profile_stats_t;
+
+static const uint8_t profile_irq[PROFILE_SLOT_COUNT] = {
+    PROFILE_NO_IRQ,         // SysTick is a system exception
+    EXTI4_15_IRQn,
+    EXTI0_1_IRQn,
+    DMA1_Channel1_IRQn,
+    DMA1_Channel2_3_IRQn,
+    TIM3_IRQn,
+    USART1_IRQn,
+    PROFILE_NO_IRQ,
+};
+
+profile_stats_t profile_stats[PROFILE_SLOT_COUNT];
+uint16_t profile_pending_since[PROFILE_SLOT_COUNT];
+uint8_t profile_waiting = 0;    // bit N is set when pending_since of slot N is valid
+
+// Record the waiting start for interrupts that are pending now
+static void profile_mark_pending(uint16_t since) {
+    uint32_t pending = NVIC->ISPR[0];
+    for (int i=0; i<PROFILE_SLOT_COUNT; i++) {
+        if ( (profile_irq[i] != PROFILE_NO_IRQ) && (pending & (1UL << profile_irq[i])) && !(profile_waiting & (1 << i)) ) {
+            profile_pending_since[i] = since;
+            profile_waiting |= (1 << i);
+        }
+    }
+}
+
+uint16_t profile_enter(profile_slot_t slot) {
+    uint16_t now = HALL_TIMER->CNT;
+    if (slot == PROFILE_MAIN_LOOP) {
+        return now;
+    }
+    uint16_t latency = 0;
+    if (slot == PROFILE_SYSTICK) {
+        latency = (SysTick->LOAD - SysTick->VAL) / (SystemCoreClock / 1000000);
+    } else if (profile_waiting & (1 << slot)) {
+        latency = now - profile_pending_since[slot];
+        profile_waiting &= ~(1 << slot);
+    }
+    if (latency > profile_stats[slot].max_latency) {
+        profile_stats[slot].max_latency = latency;
+    }
+    profile_mark_pending(now);
+    return now;
+}
+
+void profile_exit(profile_slot_t slot, uint16_t start) {
+    profile_stats_t * stats = &profile_stats[slot];
+    uint16_t duration = HALL_TIMER->CNT - start;
+    if (slot != PROFILE_MAIN_LOOP) {
+        profile_mark_pending(start);
+    }
+    if ( (stats->count == 0) || (duration < stats->min) ) {
+        stats->min = duration;
+    }
+    if (duration > stats->max) {
+        stats->max = duration;
+    }
+    stats->sum += duration;
+    if (++stats->count == 0xffff) {
+        // Keep the running average
+        stats->count >>= 1;
+        stats->sum >>= 1;
+    }
+}
+
+uint16_t profile_get(profile_slot_t slot, uint16_t * min, uint16_t * max, uint16_t * avg, uint16_t * max_latency) {
+    profile_stats_t * stats = &profile_stats[slot];
+    if (stats->count == 0) {
+        *min = *max = *avg = *max_latency = 0;
+        return 0;
+    }
+    *min = stats->min;
+    *max = stats->max;
+    *avg = stats->sum / stats->count;
+    *max_latency = stats->max_latency;
+    return stats->count;
+}
+
+void profile_reset() {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    for (int i=0; i<PROFILE_SLOT_COUNT; i++) {
+        profile_stats[i].count = 0;
+        profile_stats[i].sum = 0;
+        profile_stats[i].max = 0;
+        profile_stats[i].max_latency = 0;
+    }
+    profile_waiting = 0;
+    __set_PRIMASK(primask);
+}
+
+#endif
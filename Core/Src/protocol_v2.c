@@ -0,0 +1,160 @@
+#include "protocol_v2.h"
+#include "motor.h"
+
+// CRC-8 (polynomial 0x07). Used also by the flash log
+uint8_t v2_crc8(uint8_t crc, uint8_t data) {
+    crc ^= data;
+    for (int i=0; i<8; i++) {
+        crc = (crc & 0x80) ? ((crc << 1) ^ 0x07) : (crc << 1);
+    }
+    return crc;
+}
+
+#ifdef PROTOCOL_V2_ENABLED
+
+#if SETTINGS_BLOCK_SIZE + 1 > V2_MAX_PAYLOAD
+#error "Settings block doesn't fit in one frame"
+#endif
+
+// Request received from UART, waiting to be processed in main loop
+uint8_t v2_rx_payload[V2_MAX_PAYLOAD];
+uint8_t v2_rx_len = 0;
+uint8_t v2_rx_seq;
+uint8_t v2_rx_addr;
+volatile uint8_t v2_rx_pending = 0;
+
+// The last reply. Kept for resending if the request is retransmitted
+uint8_t v2_tx_frame[V2_MAX_PAYLOAD + V2_FRAME_OVERHEAD];
+uint8_t v2_tx_len = 0;	// 0 = no reply sent yet
+
+extern uint8_t device_address;
+
+// Add header and CRC to the payload in frame[5..] and send it as a reply to a request sent to addr
+void v2_send_frame(uint8_t * frame, uint8_t addr, uint8_t seq, uint8_t len) {
+    uint8_t crc = 0;
+    frame[0] = device_address;
+    frame[1] = 0xff;
+    frame[2] = V2_HEADER_BYTE;
+    frame[3] = len;
+    frame[4] = seq;
+    for (int i=3; i<len+5; i++) {
+        crc = v2_crc8(crc, frame[i]);
+    }
+    frame[len+5] = crc;
+    uart_send_slotted(frame, len + V2_FRAME_OVERHEAD, addr);
+}
+
+void v2_send_nak(uint8_t addr, uint8_t seq, uint8_t reason) {
+    uint8_t frame[2 + V2_FRAME_OVERHEAD];
+    frame[5] = V2_OP_NAK;
+    frame[6] = reason;
+    v2_send_frame(frame, addr, seq, 2);
+}
+
+void v2_receive_frame(uint8_t addr, uint8_t seq, uint8_t * payload, uint8_t len) {
+#ifdef FAST_STOP_ENABLED
+    if ( (len == 3) && (payload[0] == V2_OP_COMMAND) ) {
+        motor_fast_stop(payload[1], payload[2]);  // even if the previous request is still being processed
+    }
+#endif
+    if (v2_rx_pending) {
+        v2_send_nak(addr, seq, V2_NAK_BUSY);
+        return;
+    }
+    for (int i=0; i<len; i++) {
+        v2_rx_payload[i] = payload[i];
+    }
+    v2_rx_len = len;
+    v2_rx_seq = seq;
+    v2_rx_addr = addr;
+    v2_rx_pending = 1;
+
+    if (sleep_timer_enabled()) {
+        reset_sleep_timer();
+    }
+}
+
+void v2_process() {
+    if (!v2_rx_pending)
+        return;
+
+    if ( (v2_tx_len > 0) && (v2_tx_frame[4] == v2_rx_seq) ) {
+        // Retransmitted request: don't execute it again but resend the reply
+        uart_send_slotted(v2_tx_frame, v2_tx_len, v2_rx_addr);
+        v2_rx_pending = 0;
+        return;
+    }
+
+    uint8_t op = v2_rx_payload[0];
+    uint8_t * reply = &v2_tx_frame[5];
+    uint8_t len = 1;
+    reply[0] = op | V2_REPLY_FLAG;
+
+    if ( (op == V2_OP_COMMAND) && (v2_rx_len == 3) ) {
+        uint8_t cmd1 = v2_rx_payload[1];
+        uint8_t cmd2 = v2_rx_payload[2];
+        // Legacy reply is assembled from byte 2 onwards and it is followed by checksum
+        uint8_t tx_buffer[UART_MAX_PACKET_SIZE];
+        uint8_t tx_bytes = 0;
+        if (handle_query((cmd1 << 8) + cmd2, tx_buffer, &tx_bytes)) {
+            if (tx_bytes - 3 >= V2_MAX_PAYLOAD) {
+                // Reply doesn't fit in one frame
+                v2_rx_pending = 0;
+                v2_send_nak(v2_rx_addr, v2_rx_seq, V2_NAK_INVALID);
+                return;
+            }
+            for (int i=2; i<tx_bytes-1; i++) {
+                reply[len++] = tx_buffer[i];
+            }
+        } else {
+            // Not a status query
+            motor_execute_command(cmd1, cmd2);
+        }
+    } else if ( (op == V2_OP_SET_PARAMS) && ((v2_rx_len - 1) % 3 == 0) ) {
+        uint8_t count = 0;
+        for (int i=1; i<v2_rx_len; i+=3) {
+            if (!motor_set_parameter(v2_rx_payload[i], (v2_rx_payload[i+1] << 8) + v2_rx_payload[i+2]))
+                break;
+            count++;
+        }
+        reply[len++] = count;
+    } else if ( (op == V2_OP_GET_PARAMS) && (v2_rx_len <= 1 + (V2_MAX_PAYLOAD-1)/3) ) {
+        uint16_t value;
+        for (int i=1; i<v2_rx_len; i++) {
+            if (motor_get_parameter(v2_rx_payload[i], &value)) {
+                reply[len++] = v2_rx_payload[i];
+                reply[len++] = value >> 8;
+                reply[len++] = value & 0xff;
+            }
+        }
+    } else if ( (op == V2_OP_LOAD_SCRIPT) && ((v2_rx_len - 1) % 4 == 0) ) {
+        uint8_t count = 0;
+        motor_script_clear();
+        for (int i=1; i<v2_rx_len; i+=4) {
+            int16_t loc = (v2_rx_payload[i] << 8) + v2_rx_payload[i+1];
+            if (!motor_script_add(loc, v2_rx_payload[i+2], v2_rx_payload[i+3], 0))
+                break;
+            count++;
+        }
+        motor_script_start();
+        reply[len++] = count;
+    } else if ( (op == V2_OP_GET_SETTINGS) && (v2_rx_len == 1) ) {
+        len += motor_export_settings(&reply[len]);
+    } else if (op == V2_OP_SET_SETTINGS) {
+        if (!motor_import_settings(&v2_rx_payload[1], v2_rx_len - 1)) {
+            v2_rx_pending = 0;
+            v2_send_nak(v2_rx_addr, v2_rx_seq, V2_NAK_INVALID);
+            return;
+        }
+    } else {
+        v2_rx_pending = 0;
+        v2_send_nak(v2_rx_addr, v2_rx_seq, V2_NAK_INVALID);
+        return;
+    }
+
+    v2_tx_len = len + V2_FRAME_OVERHEAD;
+    v2_send_frame(v2_tx_frame, v2_rx_addr, v2_rx_seq, len);
+    v2_rx_pending = 0;
+}
+
+#endif
@@ -0,0 +1,48 @@
+#include "ramstats.h"
+
+#ifdef RAM_STATS_ENABLED
+
+// Symbols defined in the linker script
+extern uint8_t _sdata, _edata, _ebss, _end, _estack;
+extern uint8_t _sbss_main, _sbss_motor, _sbss_protocol_v2, _sbss_eventlog, _sbss_profiler, _sbss_other;
+extern uint8_t _snoinit, _enoinit;
+
+// Start of each .bss region, followed by the end of the last one
+static const uint8_t * const ramstats_bss_bounds[RAMSTATS_BSS_OTHER + 2] = {
+    &_sbss_main,
+    &_sbss_motor,
+    &_sbss_protocol_v2,
+    &_sbss_eventlog,
+    &_sbss_profiler,
+    &_sbss_other,
+    &_ebss,
+};
+
+// Lowest word of the painted area that has been overwritten by the stack
+static const uint8_t * ramstats_stack_low() {
+    const uint32_t * p = (const uint32_t *)&_end;
+    while ( (p < (const uint32_t *)&_estack) && (*p == STACK_PAINT_PATTERN) ) {
+        p++;
+    }
+    return (const uint8_t *)p;
+}
+
+uint16_t ramstats_get(ramstats_region_t region) {
+    if (region <= RAMSTATS_BSS_OTHER) {
+        return (ramstats_bss_bounds[region+1] - ramstats_bss_bounds[region]);
+    }
+    switch (region) {
+        case RAMSTATS_DATA:
+            return (&_edata - &_sdata);
+        case RAMSTATS_NOINIT:
+            return (&_enoinit - &_snoinit);
+        case RAMSTATS_STACK_PEAK:
+            return (&_estack - ramstats_stack_low());
+        case RAMSTATS_STACK_HEADROOM:
+            return (ramstats_stack_low() - &_end);
+        default:
+            return 0;
+    }
+}
+
+#endif
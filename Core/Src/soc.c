@@ -0,0 +1,109 @@
+#include "soc.h"
+
+#ifdef BATTERY_SOC_ENABLED
+
+#define UAH_PER_MAH         1000
+#define UA_MS_PER_UAH       (3600UL*1000)
+
+uint32_t soc_remaining_uah;         // estimated remaining charge
+uint8_t soc_anchored = 0;           // set when the estimate has been initialized from the voltage
+uint32_t soc_consumed_uah = 0;
+uint32_t soc_accumulator = 0;       // microamp-milliseconds not yet added to soc_consumed_uah
+uint32_t soc_rest_time = 0;         // milliseconds since the motor was last energized (including sleep)
+uint32_t soc_awake_time = 0;        // milliseconds since waking up
+uint32_t soc_timestamp;
+
+// Add current (in microamps) drawn during ms milliseconds
+static void soc_consume(uint32_t ms, uint32_t current) {
+    uint32_t charge = 0;
+    if (current == 0) {
+        return;
+    }
+    // Split long periods so that ms * current doesn't overflow
+    uint32_t max_chunk = 0x7fffffff / current;
+    while (ms > 0) {
+        uint32_t chunk = (ms < max_chunk) ? ms : max_chunk;
+        soc_accumulator += chunk * current;
+        ms -= chunk;
+        if (soc_accumulator >= UA_MS_PER_UAH) {
+            charge += soc_accumulator / UA_MS_PER_UAH;
+            soc_accumulator %= UA_MS_PER_UAH;
+        }
+    }
+    soc_consumed_uah += charge;
+    soc_remaining_uah = (soc_remaining_uah > charge) ? (soc_remaining_uah - charge) : 0;
+}
+
+static uint32_t soc_level_to_uah(uint8_t level) {
+    return (uint32_t)level * (SOC_BATTERY_CAPACITY * UAH_PER_MAH / 100);
+}
+
+// Correct the estimate towards the resting voltage level
+static void soc_anchor() {
+    uint8_t voltage_level = get_battery_level();
+    uint8_t level = soc_get_level();
+    if ( (!soc_anchored) || (voltage_level > level + SOC_RESYNC_MARGIN) || (level > voltage_level + SOC_RESYNC_MARGIN) ) {
+        // First estimate, or the battery has been charged/replaced
+        soc_remaining_uah = soc_level_to_uah(voltage_level);
+        soc_anchored = 1;
+        return;
+    }
+    int32_t target = soc_level_to_uah(voltage_level);
+    soc_remaining_uah += (target - (int32_t)soc_remaining_uah) >> SOC_ANCHOR_SHIFT;
+}
+
+void soc_update(uint16_t motor_current, uint8_t moving) {
+    uint32_t now = HAL_GetTick();
+    uint32_t elapsed = now - soc_timestamp;
+    soc_timestamp = now;
+    if (elapsed == 0) {
+        return;
+    }
+    soc_consume(elapsed, SOC_AWAKE_CURRENT + (moving ? (uint32_t)motor_current * 1000 : 0));
+    soc_awake_time += elapsed;
+    if (moving) {
+        soc_rest_time = 0;
+    } else if (soc_rest_time < SOC_REST_TIME) {
+        soc_rest_time += elapsed;
+        if ( (soc_rest_time >= SOC_REST_TIME) && (soc_awake_time < SOC_VOLTAGE_SETTLE_TIME) ) {
+            soc_rest_time = SOC_REST_TIME - 1;  // wait until the voltage reading has settled
+        } else if (soc_rest_time >= SOC_REST_TIME) {
+            soc_anchor();
+        }
+    }
+    if ( (!soc_anchored) && (soc_awake_time >= SOC_VOLTAGE_SETTLE_TIME) ) {
+        // Initial estimate after power-up
+        soc_anchor();
+    }
+}
+
+void soc_add_sleep(uint32_t ms) {
+    soc_consume(ms, SOC_SLEEP_CURRENT);
+    if (soc_rest_time < SOC_REST_TIME) {
+        soc_rest_time += ms;
+        if (soc_rest_time >= SOC_REST_TIME) {
+            soc_rest_time = SOC_REST_TIME - 1;  // anchored after the voltage reading has settled
+        }
+    }
+    soc_awake_time = 0;
+    soc_timestamp = HAL_GetTick();
+}
+
+uint8_t soc_get_level() {
+    if (!soc_anchored) {
+        return get_battery_level();
+    }
+    uint32_t level = (soc_remaining_uah + soc_level_to_uah(1) / 2) / soc_level_to_uah(1);
+    return (level > 100) ? 100 : level;
+}
+
+uint16_t soc_get_consumed_mah() {
+    uint32_t mah = soc_consumed_uah / UAH_PER_MAH;
+    return (mah > 0xffff) ? 0xffff : mah;
+}
+
+void soc_reset_consumed() {
+    soc_consumed_uah = 0;
+}
+
+#endif
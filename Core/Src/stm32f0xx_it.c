@@ -23,6 +23,9 @@
 #include "stm32f0xx_it.h"
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
+#include "swtimer.h"
+#include "motor.h"
+#include "profiler.h"
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -62,7 +65,9 @@ extern DMA_HandleTypeDef hdma_usart1_rx;
 extern DMA_HandleTypeDef hdma_usart1_tx;
 extern UART_HandleTypeDef huart1;
 /* USER CODE BEGIN EV */
-extern DMA_Event_t dma_uart_rx;
+#ifdef SLEEP_TRACKING_ENABLED
+extern volatile uint8_t rtc_alarm_flag;
+#endif
 /* USER CODE END EV */
 
 /******************************************************************************/
@@ -87,7 +92,10 @@ void NMI_Handler(void)
 void HardFault_Handler(void)
 {
   /* USER CODE BEGIN HardFault_IRQn 0 */
-
+#ifdef WARM_RESTART_ENABLED
+  // Reset the MCU (which turns the mosfets off). The location is restored from the warm restart state
+  NVIC_SystemReset();
+#endif
   /* USER CODE END HardFault_IRQn 0 */
   while (1)
   {
@@ -128,24 +136,22 @@ void PendSV_Handler(void)
 void SysTick_Handler(void)
 {
   /* USER CODE BEGIN SysTick_IRQn 0 */
-
+#ifdef ISR_PROFILER_ENABLED
+  uint16_t profile_start = profile_enter(PROFILE_SYSTICK);
+#endif
   /* USER CODE END SysTick_IRQn 0 */
   HAL_IncTick();
   /* USER CODE BEGIN SysTick_IRQn 1 */
+  post_event(EVENT_TICK);
 
   motor_stall_check();
 
-  /* DMA timer */
-  if(dma_uart_rx.timer == 1)
-  {
-    if (hdma_usart1_rx.XferCpltCallback) {
-      /* DMA Timeout event: set Timeout Flag and call DMA Rx Complete Callback */
-      dma_uart_rx.flag = 1;
-      hdma_usart1_rx.XferCpltCallback(&hdma_usart1_rx);
-    }
-  }
-  if(dma_uart_rx.timer) { --dma_uart_rx.timer; }
+  /* Software timers (including DMA timeout) */
+  swtimer_tick();
 
+#ifdef ISR_PROFILER_ENABLED
+  profile_exit(PROFILE_SYSTICK, profile_start);
+#endif
   /* USER CODE END SysTick_IRQn 1 */
 }
 
@@ -162,11 +168,20 @@ void SysTick_Handler(void)
 void EXTI0_1_IRQHandler(void)
 {
   /* USER CODE BEGIN EXTI0_1_IRQn 0 */
-
+#ifdef ISR_PROFILER_ENABLED
+  uint16_t profile_start = profile_enter(PROFILE_HALL_2);
+#endif
+  // Handle the Hall sensor line directly instead of HAL_GPIO_EXTI_IRQHandler to shorten the handler
+  if (EXTI->PR & HALL_2_OUT_Pin)
+  {
+    EXTI->PR = HALL_2_OUT_Pin;
+    hall_edge_callback();
+  }
   /* USER CODE END EXTI0_1_IRQn 0 */
-  HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_0);
   /* USER CODE BEGIN EXTI0_1_IRQn 1 */
-
+#ifdef ISR_PROFILER_ENABLED
+  profile_exit(PROFILE_HALL_2, profile_start);
+#endif
   /* USER CODE END EXTI0_1_IRQn 1 */
 }
 
@@ -179,15 +194,24 @@ void EXTI4_15_IRQHandler(void)
   if(__HAL_GPIO_EXTI_GET_IT(GPIO_PIN_10) != 0x00u)
   { 
     __HAL_GPIO_EXTI_CLEAR_IT(GPIO_PIN_10);
-    // Ignore WAKEUP signal from UART1_RX in our IRQHandler. UART will still be enabled shortly
+    // Ignore WAKEUP signal from UART1_RX in our IRQHandler. UART is kept enabled during Stop mode
     // and it will catch the message that woke up the CPU
     return;
   }
+#ifdef ISR_PROFILER_ENABLED
+  uint16_t profile_start = profile_enter(PROFILE_HALL_1);
+#endif
 
+  if (EXTI->PR & HALL_1_OUT_Pin)
+  {
+    EXTI->PR = HALL_1_OUT_Pin;
+    hall_edge_callback();
+  }
   /* USER CODE END EXTI4_15_IRQn 0 */
-  HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_7);
   /* USER CODE BEGIN EXTI4_15_IRQn 1 */
-
+#ifdef ISR_PROFILER_ENABLED
+  profile_exit(PROFILE_HALL_1, profile_start);
+#endif
   /* USER CODE END EXTI4_15_IRQn 1 */
 }
 
@@ -197,11 +221,15 @@ void EXTI4_15_IRQHandler(void)
 void DMA1_Channel1_IRQHandler(void)
 {
   /* USER CODE BEGIN DMA1_Channel1_IRQn 0 */
-
+#ifdef ISR_PROFILER_ENABLED
+  uint16_t profile_start = profile_enter(PROFILE_ADC);
+#endif
   /* USER CODE END DMA1_Channel1_IRQn 0 */
   HAL_DMA_IRQHandler(&hdma_adc);
   /* USER CODE BEGIN DMA1_Channel1_IRQn 1 */
-
+#ifdef ISR_PROFILER_ENABLED
+  profile_exit(PROFILE_ADC, profile_start);
+#endif
   /* USER CODE END DMA1_Channel1_IRQn 1 */
 }
 
@@ -211,12 +239,16 @@ void DMA1_Channel1_IRQHandler(void)
 void DMA1_Channel2_3_IRQHandler(void)
 {
   /* USER CODE BEGIN DMA1_Channel2_3_IRQn 0 */
-
+#ifdef ISR_PROFILER_ENABLED
+  uint16_t profile_start = profile_enter(PROFILE_UART_DMA);
+#endif
   /* USER CODE END DMA1_Channel2_3_IRQn 0 */
   HAL_DMA_IRQHandler(&hdma_usart1_tx);
   HAL_DMA_IRQHandler(&hdma_usart1_rx);
   /* USER CODE BEGIN DMA1_Channel2_3_IRQn 1 */
-
+#ifdef ISR_PROFILER_ENABLED
+  profile_exit(PROFILE_UART_DMA, profile_start);
+#endif
   /* USER CODE END DMA1_Channel2_3_IRQn 1 */
 }
 
@@ -226,11 +258,15 @@ void DMA1_Channel2_3_IRQHandler(void)
 void TIM3_IRQHandler(void)
 {
   /* USER CODE BEGIN TIM3_IRQn 0 */
-
+#ifdef ISR_PROFILER_ENABLED
+  uint16_t profile_start = profile_enter(PROFILE_CONTROL);
+#endif
   /* USER CODE END TIM3_IRQn 0 */
   HAL_TIM_IRQHandler(&htim3);
   /* USER CODE BEGIN TIM3_IRQn 1 */
-
+#ifdef ISR_PROFILER_ENABLED
+  profile_exit(PROFILE_CONTROL, profile_start);
+#endif
   /* USER CODE END TIM3_IRQn 1 */
 }
 
@@ -240,7 +276,17 @@ void TIM3_IRQHandler(void)
 void USART1_IRQHandler(void)
 {
   /* USER CODE BEGIN USART1_IRQn 0 */
-
+#ifdef ISR_PROFILER_ENABLED
+  uint16_t profile_start = profile_enter(PROFILE_UART);
+#endif
+#ifdef UART_RX_TIMEOUT_ENABLED
+  /* UART receiver timeout. Cleared before HAL_UART_IRQHandler, which would abort the reception as an error */
+  if((USART1->ISR & USART_ISR_RTOF) != RESET)
+  {
+      USART1->ICR = USART_ICR_RTOCF;
+      uart_rx_event(1);
+  }
+#endif
   /* USER CODE END USART1_IRQn 0 */
   HAL_UART_IRQHandler(&huart1);
   /* USER CODE BEGIN USART1_IRQn 1 */
@@ -249,13 +295,56 @@ void USART1_IRQHandler(void)
   if((USART1->ISR & USART_ISR_IDLE) != RESET)
   {
       USART1->ICR = UART_CLEAR_IDLEF;
-      /* Start DMA timer */
-      dma_uart_rx.timer = DMA_TIMEOUT_MS;
+      /* Process the received packets and start DMA timer if there's incomplete packet */
+      uart_rx_event(1);
   }
+#ifdef ISR_PROFILER_ENABLED
+  profile_exit(PROFILE_UART, profile_start);
+#endif
   /* USER CODE END USART1_IRQn 1 */
 }
 
 /* USER CODE BEGIN 1 */
+#ifdef SLEEP_TRACKING_ENABLED
+/**
+  * @brief This function handles RTC alarm interrupt (periodic wake-up for sleep mode position tracking).
+  */
+void RTC_IRQHandler(void)
+{
+  RTC->ISR &= ~RTC_ISR_ALRAF;
+  EXTI->PR = EXTI_PR_PR17;
+  rtc_alarm_flag = 1;
+}
+#endif
+
+#ifdef HW_OVERCURRENT_ENABLED
+/**
+  * @brief This function handles ADC analog watchdog interrupt (overcurrent cutoff). HAL_ADC_IRQHandler is bypassed
+  * to keep the latency short. The overrun interrupt enabled by HAL_ADC_Start_DMA is only acknowledged, since the
+  * data is allowed to be overwritten.
+  */
+void ADC1_IRQHandler(void)
+{
+  if (ADC1->ISR & ADC_ISR_AWD)
+  {
+    ADC1->ISR = ADC_ISR_AWD;
+    motor_overcurrent_trip();
+  }
+  ADC1->ISR = ADC_ISR_OVR;
+}
+#endif
+
+#ifdef PWM_DITHERING_ENABLED
+/**
+  * @brief This function handles TIM1 update interrupt (PWM dithering). HAL_TIM_IRQHandler is bypassed since
+  * this runs once per PWM period.
+  */
+void TIM1_BRK_UP_TRG_COM_IRQHandler(void)
+{
+  TIM1->SR = ~TIM_SR_UIF;
+  motor_pwm_dither();
+}
+#endif
 
 /* USER CODE END 1 */
 /************************ (C) COPYRIGHT STMicroelectronics *****END OF FILE****/
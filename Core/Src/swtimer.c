@@ -0,0 +1,95 @@
+#include "swtimer.h"
+
+typedef enum swtimer_state_t {
+    SwTimerIdle = 0,
+    SwTimerRunning,
+    SwTimerExpired
+} swtimer_state_t;
+
+typedef struct swtimer_t {
+    uint32_t expires;
+    uint32_t period;
+    swtimer_callback_t callback;
+    swtimer_state_t state;
+} swtimer_t;
+
+swtimer_t swtimers[SWTIMER_COUNT];
+
+// Expiry time of the nearest running timer. Valid only when swtimer_armed is set
+volatile uint32_t swtimer_next_expiry;
+volatile uint8_t swtimer_armed = 0;
+
+// Must be called with interrupts disabled
+static void swtimer_update_next_expiry() {
+    uint32_t now = HAL_GetTick();
+    uint8_t armed = 0;
+    for (int i=0; i<SWTIMER_COUNT; i++) {
+        if (swtimers[i].state == SwTimerRunning) {
+            if ( (!armed) || ((int32_t)(swtimers[i].expires - swtimer_next_expiry) < 0) ) {
+                swtimer_next_expiry = swtimers[i].expires;
+            }
+            armed = 1;
+        }
+    }
+    swtimer_armed = armed;
+    if (armed && ((int32_t)(now - swtimer_next_expiry) >= 0)) {
+        post_event(EVENT_TIMER);    // already expired
+    }
+}
+
+void swtimer_start(swtimer_id_t id, uint32_t delay, uint32_t period, swtimer_callback_t callback) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    swtimers[id].expires = HAL_GetTick() + delay;
+    swtimers[id].period = period;
+    swtimers[id].callback = callback;
+    swtimers[id].state = SwTimerRunning;
+    swtimer_update_next_expiry();
+    __set_PRIMASK(primask);
+}
+
+void swtimer_stop(swtimer_id_t id) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    swtimers[id].state = SwTimerIdle;
+    swtimer_update_next_expiry();
+    __set_PRIMASK(primask);
+}
+
+uint8_t swtimer_running(swtimer_id_t id) {
+    return swtimers[id].state != SwTimerIdle;
+}
+
+uint8_t swtimer_expired(swtimer_id_t id) {
+    return swtimers[id].state == SwTimerExpired;
+}
+
+void swtimer_tick() {
+    if (swtimer_armed && ((int32_t)(HAL_GetTick() - swtimer_next_expiry) >= 0)) {
+        swtimer_armed = 0;  // re-armed by swtimer_process
+        post_event(EVENT_TIMER);
+    }
+}
+
+void swtimer_process() {
+    for (int i=0; i<SWTIMER_COUNT; i++) {
+        swtimer_callback_t callback = NULL;
+        __disable_irq();
+        swtimer_t * t = &swtimers[i];
+        if ( (t->state == SwTimerRunning) && ((int32_t)(HAL_GetTick() - t->expires) >= 0) ) {
+            callback = t->callback;
+            if (t->period) {
+                t->expires += t->period;
+            } else {
+                t->state = callback ? SwTimerIdle : SwTimerExpired;
+            }
+        }
+        __enable_irq();
+        if (callback) {
+            callback();
+        }
+    }
+    __disable_irq();
+    swtimer_update_next_expiry();
+    __enable_irq();
+}
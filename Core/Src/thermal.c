@@ -0,0 +1,52 @@
+#include "thermal.h"
+#include "motor.h"
+
+#ifdef THERMAL_PROTECTION_ENABLED
+
+int32_t thermal_rise = 0;           // estimated temperature rise above ambient (milli-°C)
+int32_t thermal_accumulator = 0;    // milli-°C * milliseconds not yet added to thermal_rise
+uint32_t thermal_timestamp;
+
+// Move the estimate towards the steady state rise target (milli-°C) for ms milliseconds
+static void thermal_integrate(uint32_t ms, int32_t target) {
+    while (ms > 0) {
+        uint32_t chunk = (ms < THERMAL_CHUNK) ? ms : THERMAL_CHUNK;
+        thermal_accumulator += (target - thermal_rise) * (int32_t)chunk;
+        thermal_rise += thermal_accumulator / THERMAL_TIME_CONSTANT;
+        thermal_accumulator %= THERMAL_TIME_CONSTANT;
+        ms -= chunk;
+    }
+}
+
+void thermal_update(uint16_t motor_current) {
+    uint32_t now = HAL_GetTick();
+    uint32_t elapsed = now - thermal_timestamp;
+    thermal_timestamp = now;
+    if (elapsed == 0) {
+        return;
+    }
+    // Heat in milliwatts and the rise it would settle to
+    uint32_t heat = (uint32_t)motor_current * motor_current / 1000 * MOTOR_RESISTANCE / 1000;
+    uint32_t target = heat * THERMAL_RESISTANCE;
+    if (target > THERMAL_MAX_RISE * 1000) {
+        target = THERMAL_MAX_RISE * 1000;
+    }
+    thermal_integrate(elapsed, target);
+}
+
+void thermal_add_sleep(uint32_t ms) {
+    if (ms >= 4 * THERMAL_TIME_CONSTANT) {
+        // cooled down to within 2% of the ambient
+        thermal_rise = 0;
+        thermal_accumulator = 0;
+    } else {
+        thermal_integrate(ms, 0);
+    }
+    thermal_timestamp = HAL_GetTick();
+}
+
+int32_t thermal_get_rise() {
+    return thermal_rise;
+}
+
+#endif
@@ -0,0 +1,345 @@
+#include "updater.h"
+
+/*
+ * Resident updater (see updater.h). Built as a separate binary into the first UPDATER_SIZE bytes of flash (see the
+ * "updater" target in STM32Make.make). There's no C runtime: all state is kept in local variables and only constant
+ * data is used.
+ */
+
+#define BYTE_TIMEOUT    100     // milliseconds between bytes of a frame
+
+typedef void (*vector_t)(void);
+
+extern uint32_t _estack;
+void updater_reset(void);
+static void updater_fault(void);
+
+__attribute__((section(".isr_vector"), used))
+const vector_t updater_vectors[4] = {
+    (vector_t) &_estack,
+    updater_reset,
+    updater_fault,      // NMI
+    updater_fault       // HardFault
+};
+
+static void updater_fault(void) {
+    NVIC_SystemReset();
+}
+
+// Initial stack pointer of the application is programmed last (see UPDATER_CMD_COMMIT)
+static uint8_t app_valid(void) {
+    uint32_t sp = *(volatile uint32_t *) APP_ADDRESS;
+    return (sp > 0x20000000) && (sp <= 0x20001000);
+}
+
+static void start_app(void) {
+    const uint32_t * app = (const uint32_t *) APP_ADDRESS;
+    volatile uint32_t * ram = (volatile uint32_t *) 0x20000000;
+    for (int i = 0; i < APP_VECTOR_COUNT; i++) {
+        ram[i] = app[i];
+    }
+    RCC->APB2ENR |= RCC_APB2ENR_SYSCFGEN;
+    SYSCFG->CFGR1 |= SYSCFG_CFGR1_MEM_MODE;   // SRAM at address 0
+    __set_MSP(app[0]);
+    ((vector_t) app[1])();
+}
+
+static void hw_init(uint32_t baud) {
+    // 48 MHz from HSI / 2 * 12
+    FLASH->ACR = FLASH_ACR_PRFTBE | FLASH_ACR_LATENCY;
+    RCC->CFGR = RCC_CFGR_PLLSRC_HSI_DIV2 | RCC_CFGR_PLLMUL12;
+    RCC->CR |= RCC_CR_PLLON;
+    while (!(RCC->CR & RCC_CR_PLLRDY)) {
+    }
+    RCC->CFGR |= RCC_CFGR_SW_PLL;
+    while ((RCC->CFGR & RCC_CFGR_SWS) != RCC_CFGR_SWS_PLL) {
+    }
+
+    RCC->AHBENR |= RCC_AHBENR_GPIOAEN | RCC_AHBENR_CRCEN;
+    RCC->APB2ENR |= RCC_APB2ENR_USART1EN;
+
+    // MOSFET gates are held off. USART1 TX/RX on PA9/PA10 (AF1)
+    GPIOA->BRR = HIGH_1_GATE_Pin | HIGH_2_GATE_Pin | LOW_1_GATE_Pin | LOW_2_GATE_Pin;
+    GPIOA->MODER |= GPIO_MODER_MODER4_0 | GPIO_MODER_MODER5_0 | GPIO_MODER_MODER8_0 | GPIO_MODER_MODER11_0
+        | GPIO_MODER_MODER9_1 | GPIO_MODER_MODER10_1;
+    GPIOA->AFR[1] |= (1 << GPIO_AFRH_AFSEL9_Pos) | (1 << GPIO_AFRH_AFSEL10_Pos);
+
+    USART1->BRR = UPDATER_SYSCLK / baud;
+    USART1->CR1 = USART_CR1_UE | USART_CR1_TE | USART_CR1_RE;
+
+    // 1 ms tick (polled with COUNTFLAG)
+    SysTick->LOAD = UPDATER_SYSCLK / 1000 - 1;
+    SysTick->VAL = 0;
+    SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_ENABLE_Msk;
+}
+
+// Returns the received byte or -1 on timeout
+static int uart_read(uint32_t timeout) {
+    while (1) {
+        uint32_t isr = USART1->ISR;
+        if (isr & USART_ISR_RXNE) {
+            return USART1->RDR & 0xff;
+        }
+        if (isr & USART_ISR_ORE) {
+            USART1->ICR = USART_ICR_ORECF;
+        }
+        if (SysTick->CTRL & SysTick_CTRL_COUNTFLAG_Msk) {
+            if (timeout-- == 0) {
+                return -1;
+            }
+        }
+    }
+}
+
+static void uart_write(uint8_t byte) {
+    while (!(USART1->ISR & USART_ISR_TXE)) {
+    }
+    USART1->TDR = byte;
+}
+
+static void crc_reset(void) {
+    CRC->CR = CRC_CR_RESET;
+}
+
+static void crc_feed(uint8_t byte) {
+    *(volatile uint8_t *) &CRC->DR = byte;
+}
+
+static void flash_unlock(void) {
+    if (FLASH->CR & FLASH_CR_LOCK) {
+        FLASH->KEYR = FLASH_KEY1;
+        FLASH->KEYR = FLASH_KEY2;
+    }
+}
+
+static uint32_t flash_wait(void) {
+    while (FLASH->SR & FLASH_SR_BSY) {
+    }
+    uint32_t sr = FLASH->SR;
+    FLASH->SR = FLASH_SR_EOP | FLASH_SR_PGERR | FLASH_SR_WRPRTERR;
+    FLASH->CR = 0;
+    return sr & (FLASH_SR_PGERR | FLASH_SR_WRPRTERR);
+}
+
+static uint32_t flash_erase(uint32_t address) {
+    FLASH->CR = FLASH_CR_PER;
+    FLASH->AR = address;
+    FLASH->CR = FLASH_CR_PER | FLASH_CR_STRT;
+    return flash_wait();
+}
+
+static uint32_t flash_program(uint32_t address, uint16_t value) {
+    FLASH->CR = FLASH_CR_PG;
+    *(volatile uint16_t *) address = value;
+    return flash_wait();
+}
+
+static uint32_t get_u32(const uint8_t * p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void put_u32(uint8_t * p, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        p[i] = value >> (i * 8);
+    }
+}
+
+// CRC of the first 'length' bytes of the image with the first word replaced by 'sp'
+static uint32_t image_crc(uint32_t length, uint32_t sp) {
+    const uint8_t * image = (const uint8_t *) APP_ADDRESS;
+    crc_reset();
+    for (uint32_t i = 0; i < length; i++) {
+        crc_feed( (i < 4) ? (sp >> (i * 8)) : image[i] );
+    }
+    return CRC->DR;
+}
+
+static void send_frame(uint8_t cmd, const uint8_t * payload, uint16_t len) {
+    uint8_t header[3] = { cmd, len & 0xff, len >> 8 };
+    uint8_t crc[4];
+    crc_reset();
+    uart_write(UPDATER_SYNC);
+    for (int i = 0; i < 3; i++) {
+        crc_feed(header[i]);
+        uart_write(header[i]);
+    }
+    for (int i = 0; i < len; i++) {
+        crc_feed(payload[i]);
+        uart_write(payload[i]);
+    }
+    put_u32(crc, CRC->DR);
+    for (int i = 0; i < 4; i++) {
+        uart_write(crc[i]);
+    }
+    while (!(USART1->ISR & USART_ISR_TC)) {
+    }
+}
+
+/*
+ * Receive the rest of the frame after UPDATER_SYNC. Returns the payload length, or -1 if the frame was truncated
+ * or corrupted (such frames are ignored and the host retries after not receiving a reply)
+ */
+static int receive_frame(uint8_t * cmd, uint8_t * payload) {
+    uint8_t header[3];
+    uint8_t crc[4];
+    int c;
+    crc_reset();
+    for (int i = 0; i < 3; i++) {
+        if ((c = uart_read(BYTE_TIMEOUT)) < 0) {
+            return -1;
+        }
+        header[i] = c;
+        crc_feed(c);
+    }
+    uint16_t len = header[1] | (header[2] << 8);
+    if (len > UPDATER_MAX_PAYLOAD) {
+        return -1;
+    }
+    for (int i = 0; i < len; i++) {
+        if ((c = uart_read(BYTE_TIMEOUT)) < 0) {
+            return -1;
+        }
+        payload[i] = c;
+        crc_feed(c);
+    }
+    uint32_t expected = CRC->DR;
+    for (int i = 0; i < 4; i++) {
+        if ((c = uart_read(BYTE_TIMEOUT)) < 0) {
+            return -1;
+        }
+        crc[i] = c;
+    }
+    if (get_u32(crc) != expected) {
+        return -1;
+    }
+    *cmd = header[0];
+    return len;
+}
+
+/*
+ * Erase and program one page of the application. The first word of page 0 is left erased. The active application
+ * is invalidated before anything else is changed
+ */
+static uint8_t write_page(uint8_t page, const uint8_t * data) {
+    if (page >= APP_PAGES) {
+        return UPDATER_ERROR_ARGUMENT;
+    }
+    flash_unlock();
+    if ( app_valid() && (page != 0) && flash_erase(APP_ADDRESS) ) {
+        return UPDATER_ERROR_FLASH;
+    }
+    uint32_t address = APP_ADDRESS + page * UPDATER_PAGE_SIZE;
+    if (flash_erase(address)) {
+        return UPDATER_ERROR_FLASH;
+    }
+    for (int i = (page == 0) ? 4 : 0; i < UPDATER_PAGE_SIZE; i += 2) {
+        uint16_t value = data[i] | (data[i+1] << 8);
+        if (flash_program(address + i, value) || (*(volatile uint16_t *) (address + i) != value)) {
+            return UPDATER_ERROR_FLASH;
+        }
+    }
+    return UPDATER_OK;
+}
+
+// Verify the image and program the initial stack pointer, high half-word first
+static uint8_t commit(uint32_t length, uint32_t crc, uint32_t sp) {
+    if ( (length < 8) || (length > APP_PAGES * UPDATER_PAGE_SIZE)
+            || (*(volatile uint32_t *) APP_ADDRESS != 0xffffffff) ) {
+        return UPDATER_ERROR_ARGUMENT;
+    }
+    if (image_crc(length, sp) != crc) {
+        return UPDATER_ERROR_VERIFY;
+    }
+    flash_unlock();
+    if (flash_program(APP_ADDRESS + 2, sp >> 16) || flash_program(APP_ADDRESS, sp & 0xffff)) {
+        return UPDATER_ERROR_FLASH;
+    }
+    return app_valid() ? UPDATER_OK : UPDATER_ERROR_ARGUMENT;
+}
+
+static void updater_run(uint32_t baud) {
+    uint8_t payload[UPDATER_MAX_PAYLOAD];
+    uint8_t reply[6];
+    uint32_t idle = 0;
+
+    hw_init(baud);
+
+    while (1) {
+        int c = uart_read(1);
+        if (c < 0) {
+            // Restart to the application when the host has gone away. Without an application we stay here
+            if ( (++idle >= UPDATER_IDLE_TIMEOUT) && app_valid() ) {
+                NVIC_SystemReset();
+            }
+            continue;
+        }
+        uint8_t cmd;
+        int len;
+        if ( (c != UPDATER_SYNC) || ((len = receive_frame(&cmd, payload)) < 0) ) {
+            continue;
+        }
+        idle = 0;
+
+        uint8_t reply_len = 1;
+        reply[0] = UPDATER_OK;
+        if ( (cmd == UPDATER_CMD_INFO) && (len == 0) ) {
+            reply[1] = UPDATER_VERSION;
+            reply[2] = APP_PAGES;
+            reply[3] = UPDATER_PAGE_SIZE & 0xff;
+            reply[4] = UPDATER_PAGE_SIZE >> 8;
+            reply[5] = app_valid();
+            reply_len = 6;
+        } else if ( (cmd == UPDATER_CMD_SET_BAUD) && (len == 4) ) {
+            uint32_t new_baud = get_u32(payload);
+            if ( (new_baud < 1200) || (new_baud > UPDATER_SYSCLK / 16) ) {
+                reply[0] = UPDATER_ERROR_ARGUMENT;
+            } else {
+                put_u32(&reply[1], baud);
+                send_frame(cmd | UPDATER_REPLY, reply, 5);
+                baud = new_baud;
+                USART1->CR1 = 0;
+                USART1->BRR = UPDATER_SYSCLK / baud;
+                USART1->CR1 = USART_CR1_UE | USART_CR1_TE | USART_CR1_RE;
+                continue;
+            }
+        } else if ( (cmd == UPDATER_CMD_PAGE_CRC) && (len == 1) ) {
+            if (payload[0] >= APP_PAGES) {
+                reply[0] = UPDATER_ERROR_ARGUMENT;
+            } else {
+                const uint8_t * page = (const uint8_t *) (APP_ADDRESS + payload[0] * UPDATER_PAGE_SIZE);
+                crc_reset();
+                for (int i = 0; i < UPDATER_PAGE_SIZE; i++) {
+                    crc_feed(page[i]);
+                }
+                put_u32(&reply[1], CRC->DR);
+                reply_len = 5;
+            }
+        } else if ( (cmd == UPDATER_CMD_WRITE) && (len == 1 + UPDATER_PAGE_SIZE) ) {
+            reply[0] = write_page(payload[0], &payload[1]);
+        } else if ( (cmd == UPDATER_CMD_COMMIT) && (len == 12) ) {
+            reply[0] = commit(get_u32(payload), get_u32(&payload[4]), get_u32(&payload[8]));
+        } else if ( (cmd == UPDATER_CMD_BOOT) && (len == 0) ) {
+            reply[0] = app_valid() ? UPDATER_OK : UPDATER_ERROR_VERIFY;
+        } else {
+            reply[0] = UPDATER_ERROR_FRAME;
+        }
+        send_frame(cmd | UPDATER_REPLY, reply, reply_len);
+        if ( (cmd == UPDATER_CMD_BOOT) && (reply[0] == UPDATER_OK) ) {
+            NVIC_SystemReset();
+        }
+    }
+}
+
+void updater_reset(void) {
+    volatile updater_handoff_t * handoff = (volatile updater_handoff_t *) UPDATER_HANDOFF_ADDRESS;
+    uint32_t baud = UPDATER_DEFAULT_BAUD;
+    if (handoff->magic == UPDATER_HANDOFF_MAGIC) {
+        handoff->magic = 0;
+        if (handoff->baud) {
+            baud = handoff->baud;
+        }
+    } else if (app_valid()) {
+        start_app();
+    }
+    updater_run(baud);
+}
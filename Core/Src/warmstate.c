@@ -0,0 +1,44 @@
+#include "warmstate.h"
+#include <stddef.h>
+
+#ifdef WARM_RESTART_ENABLED
+
+/*
+ * Refreshed on every main loop iteration, so the checksum is a cheap rotate-and-xor over the words instead of a CRC
+ */
+typedef struct warmstate_block_t {
+    uint32_t magic;
+    warmstate_t state;
+    uint32_t checksum;
+} warmstate_block_t;
+
+__attribute__((section(".noinit"))) warmstate_block_t warmstate_block;
+
+static uint32_t warmstate_checksum(const warmstate_block_t * block) {
+    const uint32_t * words = (const uint32_t *)block;
+    uint32_t sum = 0;
+    for (int i=0; i<offsetof(warmstate_block_t, checksum) / 4; i++) {
+        sum = ((sum << 5) | (sum >> 27)) ^ words[i];
+    }
+    return sum;
+}
+
+void warmstate_store(const warmstate_t * state) {
+    warmstate_block.magic = WARMSTATE_MAGIC ^ sizeof(warmstate_t);
+    warmstate_block.state = *state;
+    warmstate_block.checksum = warmstate_checksum(&warmstate_block);
+}
+
+uint8_t warmstate_load(warmstate_t * state) {
+    if ( (warmstate_block.magic != (WARMSTATE_MAGIC ^ sizeof(warmstate_t))) || (warmstate_block.checksum != warmstate_checksum(&warmstate_block)) ) {
+        return 0;
+    }
+    *state = warmstate_block.state;
+    return 1;
+}
+
+void warmstate_invalidate() {
+    warmstate_block.magic = 0;
+}
+
+#endif
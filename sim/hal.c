@@ -0,0 +1,442 @@
+/*
+ * Minimal implementation of the STM32F0 HAL functions used by the firmware, on top of the simulated MCU (mcu.c).
+ * Only the behaviour the firmware relies on is implemented. Register writes done by the real HAL are reproduced
+ * where the simulated peripherals (or the firmware itself) read the registers back.
+ */
+#include "mcu.h"
+#include <string.h>
+
+#define FLASH_ERASE_TIME_US 20000
+#define FLASH_PROGRAM_TIME_US 50
+
+__IO uint32_t uwTick;
+uint32_t uwTickPrio = TICK_INT_PRIORITY;
+HAL_TickFreqTypeDef uwTickFreq = HAL_TICK_FREQ_DEFAULT;
+
+static DMA_HandleTypeDef * adc_dma;
+
+/* ------------------------------------------------------------------------------------------------------------------
+ * Core
+ */
+
+HAL_StatusTypeDef HAL_Init(void) {
+    sim_systick_running = 1;
+    sim_irq_enabled[SimIrqSysTick] = 1;
+    sim_irq_priority[SimIrqSysTick] = TICK_INT_PRIORITY;
+    HAL_MspInit();
+    return HAL_OK;
+}
+
+void HAL_IncTick(void) {
+    uwTick += uwTickFreq;
+}
+
+uint32_t HAL_GetTick(void) {
+    return uwTick;
+}
+
+void HAL_Delay(uint32_t Delay) {
+    mcu_run_us(Delay * 1000);
+}
+
+void HAL_SuspendTick(void) {
+    sim_systick_running = 0;
+}
+
+void HAL_ResumeTick(void) {
+    sim_systick_running = 1;
+}
+
+void HAL_NVIC_SetPriority(IRQn_Type IRQn, uint32_t PreemptPriority, uint32_t SubPriority) {
+    (void)SubPriority;
+    int irq = mcu_irq_from_irqn(IRQn);
+    if (irq >= 0) {
+        sim_irq_priority[irq] = PreemptPriority;
+    }
+}
+
+void HAL_NVIC_EnableIRQ(IRQn_Type IRQn) {
+    int irq = mcu_irq_from_irqn(IRQn);
+    if (irq >= 0) {
+        sim_irq_enabled[irq] = 1;
+    }
+}
+
+void HAL_NVIC_DisableIRQ(IRQn_Type IRQn) {
+    int irq = mcu_irq_from_irqn(IRQn);
+    if (irq >= 0) {
+        sim_irq_enabled[irq] = 0;
+    }
+}
+
+void HAL_PWR_EnterSTOPMode(uint32_t Regulator, uint8_t STOPEntry) {
+    (void)Regulator;
+    (void)STOPEntry;
+    mcu_stop_mode();
+}
+
+/* ------------------------------------------------------------------------------------------------------------------
+ * RCC
+ */
+
+HAL_StatusTypeDef HAL_RCC_OscConfig(RCC_OscInitTypeDef * RCC_OscInitStruct) {
+    (void)RCC_OscInitStruct;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_RCC_ClockConfig(RCC_ClkInitTypeDef * RCC_ClkInitStruct, uint32_t FLatency) {
+    (void)FLatency;
+    SystemCoreClock = (RCC_ClkInitStruct->SYSCLKSource == RCC_SYSCLKSOURCE_PLLCLK) ? 48000000 : 8000000;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_RCCEx_PeriphCLKConfig(RCC_PeriphCLKInitTypeDef * PeriphClkInit) {
+    if (PeriphClkInit->PeriphClockSelection & RCC_PERIPHCLK_USART1) {
+        __HAL_RCC_USART1_CONFIG(PeriphClkInit->Usart1ClockSelection);
+    }
+    return HAL_OK;
+}
+
+uint32_t HAL_RCC_GetPCLK1Freq(void) {
+    return SystemCoreClock;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------
+ * GPIO
+ */
+
+#define GPIO_EXTI_MODE 0x10000000U
+#define GPIO_RISING_EDGE 0x00100000U
+#define GPIO_FALLING_EDGE 0x00200000U
+
+void HAL_GPIO_Init(GPIO_TypeDef * GPIOx, GPIO_InitTypeDef * GPIO_Init) {
+    if (GPIO_Init->Mode & GPIO_EXTI_MODE) {
+        mcu_exti_configure(GPIOx, GPIO_Init->Pin, (GPIO_Init->Mode & GPIO_RISING_EDGE) != 0,
+                (GPIO_Init->Mode & GPIO_FALLING_EDGE) != 0);
+    }
+}
+
+void HAL_GPIO_DeInit(GPIO_TypeDef * GPIOx, uint32_t GPIO_Pin) {
+    mcu_exti_release(GPIOx, GPIO_Pin);
+}
+
+void HAL_GPIO_WritePin(GPIO_TypeDef * GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState) {
+    if (PinState != GPIO_PIN_RESET) {
+        GPIOx->ODR |= GPIO_Pin;
+    } else {
+        GPIOx->ODR &= ~GPIO_Pin;
+    }
+    mcu_gpio_written();
+}
+
+void HAL_GPIO_TogglePin(GPIO_TypeDef * GPIOx, uint16_t GPIO_Pin) {
+    GPIOx->ODR ^= GPIO_Pin;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------
+ * Flash (programming stalls the CPU)
+ */
+
+HAL_StatusTypeDef HAL_FLASH_Unlock(void) {
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef * pEraseInit, uint32_t * PageError) {
+    *PageError = 0xFFFFFFFF;
+    if (pEraseInit->TypeErase == FLASH_TYPEERASE_MASSERASE) {
+        return HAL_ERROR;   // would erase the firmware itself
+    }
+    for (uint32_t i = 0; i < pEraseInit->NbPages; i++) {
+        uint32_t address = pEraseInit->PageAddress + i * FLASH_PAGE_SIZE;
+        memset((void *)(uintptr_t)address, 0xff, FLASH_PAGE_SIZE);
+        mcu_stall(FLASH_ERASE_TIME_US);
+    }
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t TypeProgram, uint32_t Address, uint64_t Data) {
+    int halfwords = (TypeProgram == FLASH_TYPEPROGRAM_HALFWORD) ? 1 : (TypeProgram == FLASH_TYPEPROGRAM_WORD) ? 2 : 4;
+    for (int i = 0; i < halfwords; i++) {
+        volatile uint16_t * p = (volatile uint16_t *)(uintptr_t)(Address + i * 2);
+        uint16_t value = (uint16_t)(Data >> (16 * i));
+        mcu_stall(FLASH_PROGRAM_TIME_US);
+        if ( (*p != 0xffff) && (value != 0) ) {
+            return HAL_ERROR;   // PGERR: only zero can be written over programmed bits
+        }
+        *p = value;
+    }
+    return HAL_OK;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------
+ * DMA
+ */
+
+HAL_StatusTypeDef HAL_DMA_Init(DMA_HandleTypeDef * hdma) {
+    hdma->State = HAL_DMA_STATE_READY;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_DMA_DeInit(DMA_HandleTypeDef * hdma) {
+    hdma->State = HAL_DMA_STATE_RESET;
+    return HAL_OK;
+}
+
+void HAL_DMA_IRQHandler(DMA_HandleTypeDef * hdma) {
+    uint8_t flags = mcu_dma_take_flags(hdma);
+    if (flags == 0) {
+        return;
+    }
+    if (hdma == adc_dma) {
+        ADC_HandleTypeDef * hadc = (ADC_HandleTypeDef *)hdma->Parent;
+        if (flags & SIM_DMA_HT) {
+            HAL_ADC_ConvHalfCpltCallback(hadc);
+        }
+        if (flags & SIM_DMA_TC) {
+            HAL_ADC_ConvCpltCallback(hadc);
+        }
+        return;
+    }
+    UART_HandleTypeDef * huart = (UART_HandleTypeDef *)hdma->Parent;
+    if (hdma == huart->hdmarx) {
+        if (flags & SIM_DMA_HT) {
+            HAL_UART_RxHalfCpltCallback(huart);
+        }
+        if (flags & SIM_DMA_TC) {
+            hdma->XferCpltCallback(hdma);
+        }
+    } else if (flags & SIM_DMA_TC) {
+        huart->gState = HAL_UART_STATE_READY;
+        HAL_UART_TxCpltCallback(huart);
+    }
+}
+
+/* ------------------------------------------------------------------------------------------------------------------
+ * ADC
+ */
+
+HAL_StatusTypeDef HAL_ADC_Init(ADC_HandleTypeDef * hadc) {
+    if (hadc->State == HAL_ADC_STATE_RESET) {
+        HAL_ADC_MspInit(hadc);
+        hadc->State = HAL_ADC_STATE_READY;
+    }
+    uint32_t cfgr1 = 0;
+    if (hadc->Init.ScanConvMode == ADC_SCAN_DIRECTION_BACKWARD) {
+        cfgr1 |= ADC_CFGR1_SCANDIR;
+    }
+    if (hadc->Init.ContinuousConvMode == ENABLE) {
+        cfgr1 |= ADC_CFGR1_CONT;
+    }
+    if (hadc->Init.ExternalTrigConv != ADC_SOFTWARE_START) {
+        cfgr1 |= hadc->Init.ExternalTrigConv | hadc->Init.ExternalTrigConvEdge;
+    }
+    hadc->Instance->CFGR1 = cfgr1;
+    hadc->Instance->CFGR2 = hadc->Init.ClockPrescaler;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_ADC_ConfigChannel(ADC_HandleTypeDef * hadc, ADC_ChannelConfTypeDef * sConfig) {
+    hadc->Instance->CHSELR |= 1u << sConfig->Channel;
+    hadc->Instance->SMPR = sConfig->SamplingTime;  // common for all channels
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_ADC_AnalogWDGConfig(ADC_HandleTypeDef * hadc, ADC_AnalogWDGConfTypeDef * AnalogWDGConfig) {
+    hadc->Instance->CFGR1 = (hadc->Instance->CFGR1 & ~(ADC_CFGR1_AWDEN | ADC_CFGR1_AWDSGL | ADC_CFGR1_AWDCH)) |
+            AnalogWDGConfig->WatchdogMode | ADC_CFGR_AWDCH(AnalogWDGConfig->Channel);
+    hadc->Instance->TR = (AnalogWDGConfig->HighThreshold << 16) | AnalogWDGConfig->LowThreshold;
+    if (AnalogWDGConfig->ITMode == ENABLE) {
+        hadc->Instance->IER |= ADC_IER_AWDIE;
+    }
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_ADC_Start_DMA(ADC_HandleTypeDef * hadc, uint32_t * pData, uint32_t Length) {
+    adc_dma = hadc->DMA_Handle;
+    sim_adc_buf = (uint16_t *)pData;
+    sim_adc_len = Length;
+    hadc->Instance->CR |= ADC_CR_ADSTART;
+    mcu_adc_start();
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_ADC_Stop_DMA(ADC_HandleTypeDef * hadc) {
+    hadc->Instance->CR &= ~ADC_CR_ADSTART;
+    sim_adc_running = 0;
+    return HAL_OK;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------
+ * Timers
+ */
+
+#define TIM_CCER_ENABLE_MASK (TIM_CCER_CC1E | TIM_CCER_CC2E | TIM_CCER_CC3E | TIM_CCER_CC4E | \
+        TIM_CCER_CC1NE | TIM_CCER_CC2NE | TIM_CCER_CC3NE)
+
+static void tim_init(TIM_HandleTypeDef * htim) {
+    htim->Instance->PSC = htim->Init.Prescaler;
+    htim->Instance->ARR = htim->Init.Period;
+    htim->Instance->CNT = 0;
+    htim->State = HAL_TIM_STATE_READY;
+}
+
+// Counter is stopped only when no channel is in use (like __HAL_TIM_DISABLE)
+static void tim_disable(TIM_HandleTypeDef * htim) {
+    if (!(htim->Instance->CCER & TIM_CCER_ENABLE_MASK)) {
+        htim->Instance->CR1 &= ~TIM_CR1_CEN;
+    }
+}
+
+static volatile uint32_t * tim_ccr(TIM_HandleTypeDef * htim, uint32_t Channel) {
+    return &htim->Instance->CCR1 + Channel / 4;
+}
+
+HAL_StatusTypeDef HAL_TIM_Base_Init(TIM_HandleTypeDef * htim) {
+    if (htim->State == HAL_TIM_STATE_RESET) {
+        HAL_TIM_Base_MspInit(htim);
+    }
+    tim_init(htim);
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_PWM_Init(TIM_HandleTypeDef * htim) {
+    if (htim->State == HAL_TIM_STATE_RESET) {
+        HAL_TIM_PWM_MspInit(htim);
+    }
+    tim_init(htim);
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_OC_Init(TIM_HandleTypeDef * htim) {
+    tim_init(htim);
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_ConfigClockSource(TIM_HandleTypeDef * htim, TIM_ClockConfigTypeDef * sClockSourceConfig) {
+    (void)htim;
+    (void)sClockSourceConfig;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIMEx_MasterConfigSynchronization(TIM_HandleTypeDef * htim,
+        TIM_MasterConfigTypeDef * sMasterConfig) {
+    (void)htim;
+    (void)sMasterConfig;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIMEx_ConfigBreakDeadTime(TIM_HandleTypeDef * htim,
+        TIM_BreakDeadTimeConfigTypeDef * sBreakDeadTimeConfig) {
+    (void)htim;
+    (void)sBreakDeadTimeConfig;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_PWM_ConfigChannel(TIM_HandleTypeDef * htim, TIM_OC_InitTypeDef * sConfig, uint32_t Channel) {
+    *tim_ccr(htim, Channel) = sConfig->Pulse;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_OC_ConfigChannel(TIM_HandleTypeDef * htim, TIM_OC_InitTypeDef * sConfig, uint32_t Channel) {
+    *tim_ccr(htim, Channel) = sConfig->Pulse;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_PWM_Start(TIM_HandleTypeDef * htim, uint32_t Channel) {
+    htim->Instance->CCER |= TIM_CCER_CC1E << Channel;
+    htim->Instance->CR1 |= TIM_CR1_CEN;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_PWM_Stop(TIM_HandleTypeDef * htim, uint32_t Channel) {
+    htim->Instance->CCER &= ~(TIM_CCER_CC1E << Channel);
+    tim_disable(htim);
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_Base_Start(TIM_HandleTypeDef * htim) {
+    htim->Instance->CR1 |= TIM_CR1_CEN;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_Base_Start_IT(TIM_HandleTypeDef * htim) {
+    htim->Instance->DIER |= TIM_DIER_UIE;
+    htim->Instance->CR1 |= TIM_CR1_CEN;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_Base_Stop_IT(TIM_HandleTypeDef * htim) {
+    htim->Instance->DIER &= ~TIM_DIER_UIE;
+    tim_disable(htim);
+    return HAL_OK;
+}
+
+void HAL_TIM_IRQHandler(TIM_HandleTypeDef * htim) {
+    if ( (htim->Instance->SR & TIM_SR_UIF) && (htim->Instance->DIER & TIM_DIER_UIE) ) {
+        htim->Instance->SR &= ~TIM_SR_UIF;
+        HAL_TIM_PeriodElapsedCallback(htim);
+    }
+}
+
+/* ------------------------------------------------------------------------------------------------------------------
+ * UART
+ */
+
+static uint32_t usart_clock(void) {
+    return ((RCC->CFGR3 & RCC_CFGR3_USART1SW) == RCC_CFGR3_USART1SW_HSI) ? HSI_VALUE : SystemCoreClock;
+}
+
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef * huart) {
+    if (huart->gState == HAL_UART_STATE_RESET) {
+        HAL_UART_MspInit(huart);
+    }
+    huart->Instance->BRR = UART_DIV_SAMPLING16(usart_clock(), huart->Init.BaudRate);
+    huart->Instance->CR1 = USART_CR1_UE | USART_CR1_TE | USART_CR1_RE;
+    huart->Instance->CR3 = 0;
+    huart->gState = HAL_UART_STATE_READY;
+    huart->RxState = HAL_UART_STATE_READY;
+    huart->ErrorCode = HAL_UART_ERROR_NONE;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_DeInit(UART_HandleTypeDef * huart) {
+    mcu_uart_stop();
+    huart->Instance->CR1 = 0;
+    HAL_UART_MspDeInit(huart);
+    huart->gState = HAL_UART_STATE_RESET;
+    huart->RxState = HAL_UART_STATE_RESET;
+    return HAL_OK;
+}
+
+// DMA RX timeout (see uart_rx_timeout in main.c) calls this through hdmarx->XferCpltCallback
+static void uart_dma_receive_complete(DMA_HandleTypeDef * hdma) {
+    HAL_UART_RxCpltCallback((UART_HandleTypeDef *)hdma->Parent);
+}
+
+HAL_StatusTypeDef HAL_UART_Receive_DMA(UART_HandleTypeDef * huart, uint8_t * pData, uint16_t Size) {
+    huart->RxState = HAL_UART_STATE_BUSY_RX;
+    huart->ErrorCode = HAL_UART_ERROR_NONE;
+    huart->hdmarx->XferCpltCallback = uart_dma_receive_complete;
+    huart->Instance->CR3 |= USART_CR3_EIE | USART_CR3_DMAR;
+    mcu_uart_start_rx(huart, pData, Size);
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef * huart, uint8_t * pData, uint16_t Size) {
+    if (huart->gState != HAL_UART_STATE_READY) {
+        return HAL_BUSY;
+    }
+    if (!mcu_uart_transmit(huart, pData, Size)) {
+        return HAL_ERROR;
+    }
+    huart->gState = HAL_UART_STATE_BUSY_TX;
+    return HAL_OK;
+}
+
+void HAL_UART_IRQHandler(UART_HandleTypeDef * huart) {
+    if (mcu_uart_take_error() && (huart->Instance->CR3 & USART_CR3_EIE)) {
+        huart->ErrorCode |= HAL_UART_ERROR_FE;
+        HAL_UART_ErrorCallback(huart);
+        huart->ErrorCode = HAL_UART_ERROR_NONE;
+    }
+}
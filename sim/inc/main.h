@@ -0,0 +1,29 @@
+/*
+ * Wrapper of Core/Inc/main.h for the host simulation. Found before the original in the include path, so every
+ * firmware source picks up these overrides after the real header.
+ *
+ * Peripherals live at their real addresses (mapped by mcu.c), so plain register accesses just work. The timers are
+ * advanced by the simulated MCU on every step. Only the RTC, whose status flags the firmware busy-waits on and whose
+ * calendar is derived from the simulation time, and the ADC, whose ADSTP bit is busy-waited on, are synced before each
+ * access. Direct GPIO writes go to ODR.
+ */
+#ifndef SIM_MAIN_H
+#define SIM_MAIN_H
+
+#include_next "main.h"
+
+void * sim_rtc_sync(void);
+void * sim_adc_sync(void);
+
+#undef RTC
+#define RTC ((RTC_TypeDef *)sim_rtc_sync())
+#undef ADC1
+#define ADC1 ((ADC_TypeDef *)sim_adc_sync())
+
+// BSRR and BRR are not emulated, because their writes would have to be ordered with the direct ODR accesses
+#undef GPIO_SET
+#undef GPIO_RESET
+#define GPIO_SET(port, pin)     ((port)->ODR |= (pin))
+#define GPIO_RESET(port, pin)   ((port)->ODR &= ~(pin))
+
+#endif /* SIM_MAIN_H */
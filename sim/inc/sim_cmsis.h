@@ -0,0 +1,69 @@
+/*
+ * Host replacement of cmsis_gcc.h. Included before everything else (gcc -include) so that the original header,
+ * which is full of ARM inline assembly, is skipped. Interrupt masking and waiting are routed to the simulated MCU.
+ */
+#ifndef __CMSIS_GCC_H
+#define __CMSIS_GCC_H
+
+#include <stdint.h>
+
+#define __ASM                       __asm
+#define __INLINE                    inline
+#define __STATIC_INLINE             static inline
+#define __STATIC_FORCEINLINE        __attribute__((always_inline)) static inline
+#define __NO_RETURN                 __attribute__((__noreturn__))
+#define __USED                      __attribute__((used))
+#define __WEAK                      __attribute__((weak))
+#define __PACKED                    __attribute__((packed, aligned(1)))
+#define __PACKED_STRUCT             struct __attribute__((packed, aligned(1)))
+#define __PACKED_UNION              union __attribute__((packed, aligned(1)))
+#define __ALIGNED(x)                __attribute__((aligned(x)))
+#define __RESTRICT                  __restrict
+
+struct __attribute__((packed)) T_UINT32 { uint32_t v; };
+#define __UNALIGNED_UINT32(x)                  (((struct T_UINT32 *)(x))->v)
+__PACKED_STRUCT T_UINT16_WRITE { uint16_t v; };
+#define __UNALIGNED_UINT16_WRITE(addr, val)    (void)((((struct T_UINT16_WRITE *)(void *)(addr))->v) = (val))
+__PACKED_STRUCT T_UINT16_READ { uint16_t v; };
+#define __UNALIGNED_UINT16_READ(addr)          (((const struct T_UINT16_READ *)(const void *)(addr))->v)
+__PACKED_STRUCT T_UINT32_WRITE { uint32_t v; };
+#define __UNALIGNED_UINT32_WRITE(addr, val)    (void)((((struct T_UINT32_WRITE *)(void *)(addr))->v) = (val))
+__PACKED_STRUCT T_UINT32_READ { uint32_t v; };
+#define __UNALIGNED_UINT32_READ(addr)          (((const struct T_UINT32_READ *)(const void *)(addr))->v)
+
+// Implemented in mcu.c
+void sim_set_primask(uint32_t mask);
+uint32_t sim_get_primask(void);
+void sim_wfi(void);
+void sim_nop(void);
+
+__STATIC_FORCEINLINE void __enable_irq(void) { sim_set_primask(0); }
+__STATIC_FORCEINLINE void __disable_irq(void) { sim_set_primask(1); }
+__STATIC_FORCEINLINE uint32_t __get_PRIMASK(void) { return sim_get_primask(); }
+__STATIC_FORCEINLINE void __set_PRIMASK(uint32_t priMask) { sim_set_primask(priMask); }
+
+__STATIC_FORCEINLINE uint32_t __get_CONTROL(void) { return 0; }
+__STATIC_FORCEINLINE void __set_CONTROL(uint32_t control) { (void)control; }
+__STATIC_FORCEINLINE uint32_t __get_IPSR(void) { return 0; }
+__STATIC_FORCEINLINE uint32_t __get_APSR(void) { return 0; }
+__STATIC_FORCEINLINE uint32_t __get_xPSR(void) { return 0; }
+__STATIC_FORCEINLINE uint32_t __get_PSP(void) { return 0; }
+__STATIC_FORCEINLINE void __set_PSP(uint32_t topOfProcStack) { (void)topOfProcStack; }
+__STATIC_FORCEINLINE uint32_t __get_MSP(void) { return 0; }
+__STATIC_FORCEINLINE void __set_MSP(uint32_t topOfMainStack) { (void)topOfMainStack; }
+
+#define __NOP()     sim_nop()
+#define __WFI()     sim_wfi()
+#define __WFE()     sim_wfi()
+#define __SEV()     ((void)0)
+#define __ISB()     __sync_synchronize()
+#define __DSB()     __sync_synchronize()
+#define __DMB()     __sync_synchronize()
+#define __BKPT(value) ((void)0)
+
+#define __REV(value)    __builtin_bswap32(value)
+#define __REV16(value)  ((uint32_t)((((value) & 0xff00ff00UL) >> 8) | (((value) & 0x00ff00ffUL) << 8)))
+#define __REVSH(value)  ((int16_t)__builtin_bswap16(value))
+#define __CLZ           (uint8_t)__builtin_clz
+
+#endif /* __CMSIS_GCC_H */
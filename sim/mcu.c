@@ -0,0 +1,777 @@
+#include "mcu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+#define THREAD_LEVEL 4                  // below any configurable priority (0..3)
+#define FLASH_SIZE 0x8000
+#define PERIPH_SIZE 0x08002000          // APB, AHB1 and AHB2 (GPIO) peripherals
+#define SCS_SIZE 0x1000                 // SysTick, NVIC and SCB
+#define RTC_REGS ((RTC_TypeDef *)RTC_BASE)  // RTC without the sync (see inc/main.h)
+#define ADC_REGS ((ADC_TypeDef *)ADC1_BASE) // ADC without the sync
+#define RTC_EPOCH_US (12ULL * 3600 * 1000000)   // RTC calendar starts at noon
+#define RTC_SUBSECOND_US 3125           // 320 Hz sub-second counter
+#define UART_QUEUE_SIZE 4096
+
+uint64_t sim_time_us;
+uint8_t sim_stop_mode;
+bridge_t sim_bridge;
+mcu_stats_t mcu_stats;
+uint32_t sim_uart_sender_baud;
+uint8_t sim_uart_wake_byte_lost = 1;
+
+uint16_t * sim_adc_buf;
+uint32_t sim_adc_len;
+uint8_t sim_adc_running;
+uint8_t sim_systick_running;
+uint32_t sim_irq_priority[SIM_IRQ_COUNT];
+uint8_t sim_irq_enabled[SIM_IRQ_COUNT];
+
+// Interrupt handlers of the firmware (stm32f0xx_it.c). The last three exist only with some features enabled
+void SysTick_Handler(void);
+void EXTI0_1_IRQHandler(void);
+void EXTI4_15_IRQHandler(void);
+void DMA1_Channel1_IRQHandler(void);
+void DMA1_Channel2_3_IRQHandler(void);
+void USART1_IRQHandler(void);
+void TIM3_IRQHandler(void);
+void TIM1_BRK_UP_TRG_COM_IRQHandler(void) __attribute__((weak));
+void RTC_IRQHandler(void) __attribute__((weak));
+void ADC1_IRQHandler(void) __attribute__((weak));
+
+static void (* const irq_handlers[SIM_IRQ_COUNT])(void) = {
+    SysTick_Handler, EXTI0_1_IRQHandler, EXTI4_15_IRQHandler, DMA1_Channel1_IRQHandler,
+    DMA1_Channel2_3_IRQHandler, USART1_IRQHandler, TIM3_IRQHandler, TIM1_BRK_UP_TRG_COM_IRQHandler, RTC_IRQHandler,
+    ADC1_IRQHandler
+};
+
+// Exception numbers decide the order when priorities are equal
+static const int irq_numbers[SIM_IRQ_COUNT] = {
+    SysTick_IRQn, EXTI0_1_IRQn, EXTI4_15_IRQn, DMA1_Channel1_IRQn,
+    DMA1_Channel2_3_IRQn, USART1_IRQn, TIM3_IRQn, TIM1_BRK_UP_TRG_COM_IRQn, RTC_IRQn, ADC1_IRQn
+};
+
+// EXTI lines behind each interrupt
+static const uint32_t irq_exti_lines[SIM_IRQ_COUNT] = {
+    [SimIrqExti0_1] = 0x0003, [SimIrqExti4_15] = 0xfff0, [SimIrqRtc] = EXTI_IMR_MR17
+};
+
+static uint32_t primask;
+static uint32_t current_level = THREAD_LEVEL;
+static uint32_t irq_pending;
+/*
+ * EXTI pending lines are kept here since EXTI->PR is write-1-to-clear. The line being serviced is copied to EXTI->PR
+ * for the duration of the handler
+ */
+static uint32_t exti_pending;
+static uint8_t dma_flags[8];        // by DMA channel number
+static uint32_t systick_us;
+
+typedef struct {
+    TIM_TypeDef * regs;
+    sim_irq_t irq;                  // SIM_IRQ_COUNT = no interrupt
+    double ticks;                   // fraction of a timer tick
+} sim_timer_t;
+
+static sim_timer_t timers[] = {
+    { TIM1, SimIrqTim1, 0 },
+    { TIM3, SimIrqTim3, 0 },
+    { TIM14, SIM_IRQ_COUNT, 0 },
+};
+
+static uint32_t adc_pos;            // next DMA write position
+static uint32_t adc_sequence_pos;   // next channel of the scan sequence
+static double adc_conversions;      // fraction of a conversion (continuous mode)
+
+static UART_HandleTypeDef * uart;
+static uint8_t * uart_rx_buf;
+static uint16_t uart_rx_size;
+static uint8_t uart_queue[UART_QUEUE_SIZE];    // bytes waiting to be sent to the firmware
+static uint32_t uart_queue_head, uart_queue_tail;
+static uint8_t uart_rx_busy;
+static uint8_t uart_rx_byte;
+static uint8_t uart_rx_lost;
+static uint64_t uart_rx_end;        // end of the stop bit of the byte being received
+static uint64_t uart_idle_time;     // when the IDLE flag will be raised (0 = line already idle)
+static uint64_t uart_rto_time;      // when the receiver timeout flag will be raised (0 = not counting)
+static uint8_t uart_error;
+static const uint8_t * uart_tx_data;
+static uint16_t uart_tx_size, uart_tx_pos;
+static uint64_t uart_tx_end;
+
+static uint64_t rtc_last_us;
+
+/* ------------------------------------------------------------------------------------------------------------------
+ * Memory map
+ */
+
+static void map_region(uintptr_t base, size_t size) {
+    void * p = mmap((void *)base, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    if (p != (void *)base) {
+        fprintf(stderr, "sim: can't map %#lx (%lu bytes) for the peripherals\n", (unsigned long)base, (unsigned long)size);
+        exit(1);
+    }
+}
+
+void mcu_init(void) {
+    map_region(FLASH_BASE, FLASH_SIZE);
+    memset((void *)FLASH_BASE, 0xff, FLASH_SIZE);
+    map_region(PERIPH_BASE, PERIPH_SIZE);
+    map_region(SCS_BASE & ~(SCS_SIZE - 1), SCS_SIZE);
+
+    RCC->CSR = RCC_CSR_PORRSTF | RCC_CSR_PINRSTF | RCC_CSR_LSIRDY;
+    // Idle levels of the inputs: UART RX, button and the unpowered Hall sensors are pulled up
+    GPIOA->IDR = GPIO_PIN_10 | HALL_1_OUT_Pin;
+    GPIOB->IDR = BUT_Pin | HALL_2_OUT_Pin;
+    for (int i = 0; i < SIM_IRQ_COUNT; i++) {
+        sim_irq_priority[i] = 0;
+    }
+}
+
+/* ------------------------------------------------------------------------------------------------------------------
+ * Interrupts
+ */
+
+int mcu_irq_from_irqn(int irqn) {
+    for (int i = 0; i < SIM_IRQ_COUNT; i++) {
+        if (irq_numbers[i] == irqn) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void mcu_set_pending(sim_irq_t irq) {
+    irq_pending |= 1u << irq;
+}
+
+// Highest priority interrupt that can preempt the given level, or -1
+static int next_irq(uint32_t level) {
+    int best = -1;
+    for (int i = 0; i < SIM_IRQ_COUNT; i++) {
+        if ( (!(irq_pending & (1u << i))) || (!sim_irq_enabled[i]) || (sim_irq_priority[i] >= level) ) {
+            continue;
+        }
+        if ( (best < 0) || (sim_irq_priority[i] < sim_irq_priority[best]) ||
+                ((sim_irq_priority[i] == sim_irq_priority[best]) && (irq_numbers[i] < irq_numbers[best])) ) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+// Write-1-to-clear registers are emulated by applying the written bits after the firmware has run
+static void apply_clear_registers(void) {
+    if (USART1->ICR) {
+        USART1->ISR &= ~USART1->ICR;
+        USART1->ICR = 0;
+    }
+}
+
+static void call_handler(sim_irq_t irq) {
+    uint32_t lines = irq_exti_lines[irq];
+    if (lines) {
+        uint32_t line = exti_pending & lines;
+        line &= -line;  // lowest pending line
+        exti_pending &= ~line;
+        if (exti_pending & lines) {
+            mcu_set_pending(irq);
+        }
+        EXTI->PR = line;
+    }
+    if (irq == SimIrqAdc) {
+        // like EXTI->PR, the watchdog flag (write-1-to-clear) is visible only to the handler
+        ADC_REGS->ISR = ADC_ISR_AWD;
+    }
+    mcu_stats.irq_count[irq]++;
+    if (irq_handlers[irq]) {
+        irq_handlers[irq]();
+    }
+    if (lines) {
+        EXTI->PR = 0;
+    }
+    if (irq == SimIrqAdc) {
+        ADC_REGS->ISR = 0;
+    }
+    apply_clear_registers();
+}
+
+void mcu_dispatch(void) {
+    int irq;
+    while ( (!primask) && ((irq = next_irq(current_level)) >= 0) ) {
+        irq_pending &= ~(1u << irq);
+        uint32_t level = current_level;
+        current_level = sim_irq_priority[irq];
+        call_handler(irq);
+        current_level = level;
+    }
+}
+
+void sim_set_primask(uint32_t mask) {
+    primask = mask & 1;
+    mcu_dispatch();
+}
+
+uint32_t sim_get_primask(void) {
+    return primask;
+}
+
+static uint8_t wake_up_pending(void) {
+    return next_irq(current_level) >= 0;
+}
+
+void sim_wfi(void) {
+    while (!wake_up_pending()) {
+        mcu_step();
+    }
+    mcu_dispatch();
+}
+
+// NVIC_SystemReset spins on __NOP after requesting the reset
+void sim_nop(void) {
+    if ( ((SCB->AIRCR >> SCB_AIRCR_VECTKEY_Pos) == 0x5FA) && (SCB->AIRCR & SCB_AIRCR_SYSRESETREQ_Msk) ) {
+        sim_reset_requested();
+    }
+}
+
+uint8_t mcu_dma_take_flags(DMA_HandleTypeDef * hdma) {
+    uint32_t channel = ((uintptr_t)hdma->Instance - DMA1_Channel1_BASE) / (DMA1_Channel2_BASE - DMA1_Channel1_BASE) + 1;
+    uint8_t flags = dma_flags[channel & 7];
+    dma_flags[channel & 7] = 0;
+    return flags;
+}
+
+static void dma_complete(uint32_t channel, uint8_t flags, sim_irq_t irq) {
+    dma_flags[channel] |= flags;
+    mcu_set_pending(irq);
+}
+
+static void exti_trigger(uint32_t line, sim_irq_t irq) {
+    exti_pending |= 1u << line;
+    mcu_set_pending(irq);
+}
+
+// EXTI line is connected to the pin of one port only (SYSCFG_EXTICRx)
+static uint32_t exti_port(uint32_t line) {
+    return (SYSCFG->EXTICR[line >> 2] >> (4 * (line & 3))) & 0xf;
+}
+
+static uint32_t port_index(GPIO_TypeDef * port) {
+    return ((uintptr_t)port - GPIOA_BASE) / (GPIOB_BASE - GPIOA_BASE);
+}
+
+void mcu_exti_configure(GPIO_TypeDef * port, uint32_t pins, uint8_t rising, uint8_t falling) {
+    for (uint32_t line = 0; line < 16; line++) {
+        if (pins & (1u << line)) {
+            SYSCFG->EXTICR[line >> 2] = (SYSCFG->EXTICR[line >> 2] & ~(0xfu << (4 * (line & 3)))) |
+                    (port_index(port) << (4 * (line & 3)));
+        }
+    }
+    EXTI->IMR |= pins;
+    if (rising) {
+        EXTI->RTSR |= pins;
+    } else {
+        EXTI->RTSR &= ~pins;
+    }
+    if (falling) {
+        EXTI->FTSR |= pins;
+    } else {
+        EXTI->FTSR &= ~pins;
+    }
+}
+
+void mcu_exti_release(GPIO_TypeDef * port, uint32_t pins) {
+    for (uint32_t line = 0; line < 16; line++) {
+        if ( (pins & (1u << line)) && (exti_port(line) == port_index(port)) ) {
+            EXTI->IMR &= ~(1u << line);
+        }
+    }
+}
+
+/* ------------------------------------------------------------------------------------------------------------------
+ * GPIO, timers and H-bridge
+ */
+
+static void set_input(GPIO_TypeDef * port, uint16_t pin, uint8_t level) {
+    if ( ((port->IDR & pin) != 0) == level ) {
+        return;
+    }
+    if (level) {
+        port->IDR |= pin;
+    } else {
+        port->IDR &= ~pin;
+    }
+    uint32_t line = __builtin_ctz(pin);
+    if ( (EXTI->IMR & pin) && ((level ? EXTI->RTSR : EXTI->FTSR) & pin) && (exti_port(line) == port_index(port)) ) {
+        exti_trigger(line, (line < 2) ? SimIrqExti0_1 : SimIrqExti4_15);
+    }
+}
+
+// Hall sensor outputs are open collector with pull-ups, so they read high while the sensors are unpowered
+static void hall_update(void) {
+    uint8_t powered = (PWR_EN_GPIO_Port->ODR & PWR_EN_Pin) != 0;
+    set_input(HALL_1_OUT_GPIO_Port, HALL_1_OUT_Pin, powered ? (model.hall_state >> 1) & 1 : 1);
+    set_input(HALL_2_OUT_GPIO_Port, HALL_2_OUT_Pin, powered ? model.hall_state & 1 : 1);
+}
+
+// Inputs that depend on the outputs (PWR_EN) follow them right away, so that a busy-wait sees the powered sensors
+void mcu_gpio_written(void) {
+    hall_update();
+}
+
+// Returns the number of update events
+static uint32_t timer_advance(sim_timer_t * t, uint32_t dt) {
+    TIM_TypeDef * regs = t->regs;
+    if (regs->EGR & TIM_EGR_UG) {
+        // prescaler change (see timer_set_prescaler in main.c): restart the counter without an update interrupt
+        regs->EGR = 0;
+        regs->CNT = 0;
+        t->ticks = 0;
+    }
+    if (!(regs->CR1 & TIM_CR1_CEN)) {
+        return 0;
+    }
+    t->ticks += dt * (SystemCoreClock / 1e6) / (regs->PSC + 1);
+    uint32_t ticks = (uint32_t)t->ticks;
+    t->ticks -= ticks;
+    uint32_t period = (regs->ARR & 0xffff) + 1;
+    uint32_t count = regs->CNT + ticks;
+    uint32_t updates = count / period;
+    regs->CNT = count % period;
+    if (updates) {
+        regs->SR |= TIM_SR_UIF;
+        if ( (regs->DIER & TIM_DIER_UIE) && (t->irq != SIM_IRQ_COUNT) ) {
+            mcu_set_pending(t->irq);
+        }
+    }
+    return updates;
+}
+
+static double pwm_duty(uint32_t enable, volatile uint32_t * ccr) {
+    if ( (!(TIM1->CR1 & TIM_CR1_CEN)) || (!(TIM1->CCER & enable)) ) {
+        return 0;
+    }
+    double period = (TIM1->ARR & 0xffff) + 1;
+    return (*ccr < period) ? *ccr / period : 1;
+}
+
+/*
+ * Decode the gate signals: HIGH_x_GATE are GPIOs and LOW_x_GATE the PWM outputs of TIM1 channels 1 and 4.
+ * HIGH_1 + LOW_2 drives the motor up (normal orientation)
+ */
+static void bridge_update(void) {
+    uint8_t high1 = (HIGH_1_GATE_GPIO_Port->ODR & HIGH_1_GATE_Pin) != 0;
+    uint8_t high2 = (HIGH_2_GATE_GPIO_Port->ODR & HIGH_2_GATE_Pin) != 0;
+    double low1 = pwm_duty(TIM_CCER_CC1E, &TIM1->CCR1);
+    double low2 = pwm_duty(TIM_CCER_CC4E, &TIM1->CCR4);
+
+    sim_bridge.duty = 0;
+    sim_bridge.dir = 0;
+    if ( (high1 && (low1 > 0)) || (high2 && (low2 > 0)) ) {
+        mcu_stats.shoot_through++;
+        sim_bridge.mode = BridgeOff;    // the battery is shorted, not the motor
+    } else if (high1 && high2) {
+        sim_bridge.duty = 1;
+        sim_bridge.mode = BridgeBrake;
+    } else if (high1 || high2) {
+        sim_bridge.duty = high1 ? low2 : low1;
+        sim_bridge.dir = high1 ? 1 : -1;
+        sim_bridge.mode = (sim_bridge.duty > 0) ? BridgeDrive : BridgeOff;
+    } else if ( (low1 > 0) && (low2 > 0) ) {
+        sim_bridge.duty = (low1 < low2) ? low1 : low2;  // both channels are edge-aligned
+        sim_bridge.mode = BridgeBrake;
+    } else {
+        sim_bridge.mode = BridgeOff;
+    }
+}
+
+/* ------------------------------------------------------------------------------------------------------------------
+ * ADC
+ */
+
+static const double adc_sampling_cycles[8] = { 1.5, 7.5, 13.5, 28.5, 41.5, 55.5, 71.5, 239.5 };
+
+static double adc_clock(void) {
+    switch (ADC_REGS->CFGR2 & ADC_CFGR2_CKMODE) {
+        case ADC_CFGR2_CKMODE_0:
+            return SystemCoreClock / 2.0;
+        case ADC_CFGR2_CKMODE_1:
+            return SystemCoreClock / 4.0;
+        default:
+            return 14e6;    // HSI14
+    }
+}
+
+static uint32_t adc_channel(uint32_t pos) {
+    uint32_t channels = ADC_REGS->CHSELR & 0x7ffff;
+    uint8_t backward = (ADC_REGS->CFGR1 & ADC_CFGR1_SCANDIR) != 0;
+    for (int i = 0; i < 19; i++) {
+        int channel = backward ? 18 - i : i;
+        if ( (channels & (1u << channel)) && (pos-- == 0) ) {
+            return channel;
+        }
+    }
+    return 0;
+}
+
+static uint16_t adc_sample(uint32_t channel) {
+    uint8_t powered = (PWR_EN_GPIO_Port->ODR & PWR_EN_Pin) != 0;
+    uint8_t synchronized = (ADC_REGS->CFGR1 & ADC_CFGR1_EXTEN) != 0;
+    double raw = 0;
+    if ( (channel == 6) && powered ) {
+        raw = model.supply_voltage * 30 * 16;   // see get_voltage()
+    } else if (channel == 9) {
+        raw = model_adc_current(&sim_bridge, synchronized) * 1000 / 2;  // see adc_process_half()
+    }
+    if (raw > 4095) {
+        raw = 4095;
+    }
+    return (uint16_t)(raw + 0.5);
+}
+
+static void adc_convert(void) {
+    uint32_t count = __builtin_popcount(ADC_REGS->CHSELR & 0x7ffff);
+    if ( (count == 0) || (sim_adc_len == 0) ) {
+        return;
+    }
+    uint32_t channel = adc_channel(adc_sequence_pos);
+    uint16_t sample = adc_sample(channel);
+    sim_adc_buf[adc_pos++] = sample;
+    DMA1_Channel1->CNDTR = sim_adc_len - adc_pos;
+    if ( (ADC_REGS->CFGR1 & ADC_CFGR1_AWDEN) && ( (!(ADC_REGS->CFGR1 & ADC_CFGR1_AWDSGL)) ||
+            (((ADC_REGS->CFGR1 & ADC_CFGR1_AWDCH) >> ADC_CFGR1_AWD1CH_Pos) == channel) ) ) {
+        if ( ((sample > (ADC_REGS->TR >> 16)) || (sample < (ADC_REGS->TR & 0xfff))) && (ADC_REGS->IER & ADC_IER_AWDIE) ) {
+            mcu_set_pending(SimIrqAdc);
+        }
+    }
+    adc_sequence_pos = (adc_sequence_pos + 1) % count;
+    if (adc_pos == sim_adc_len / 2) {
+        dma_complete(1, SIM_DMA_HT, SimIrqAdcDma);
+    } else if (adc_pos == sim_adc_len) {
+        adc_pos = 0;
+        DMA1_Channel1->CNDTR = sim_adc_len;
+        dma_complete(1, SIM_DMA_TC, SimIrqAdcDma);
+    }
+}
+
+void mcu_adc_start(void) {
+    adc_pos = 0;
+    adc_sequence_pos = 0;
+    adc_conversions = 0;
+    sim_adc_running = 1;
+    DMA1_Channel1->CNDTR = sim_adc_len;
+}
+
+// ADSTP stops the conversions (and restarts the scan sequence) immediately, since the firmware busy-waits on it
+void * sim_adc_sync(void) {
+    ADC_TypeDef * adc = ADC_REGS;
+    if (adc->CR & ADC_CR_ADSTP) {
+        adc->CR &= ~(ADC_CR_ADSTP | ADC_CR_ADSTART);
+        adc_sequence_pos = 0;
+        adc_conversions = 0;
+    }
+    return adc;
+}
+
+static void adc_advance(uint32_t dt, uint32_t triggers) {
+    sim_adc_sync();
+    if ( (!sim_adc_running) || (!(ADC_REGS->CR & ADC_CR_ADSTART)) ) {
+        return;
+    }
+    uint32_t count = __builtin_popcount(ADC_REGS->CHSELR & 0x7ffff);
+    if (ADC_REGS->CFGR1 & ADC_CFGR1_EXTEN) {
+        // the whole sequence is converted on every trigger (TIM1 TRGO once per PWM period)
+        for (uint32_t i = 0; i < triggers * count; i++) {
+            adc_convert();
+        }
+    } else if (ADC_REGS->CFGR1 & ADC_CFGR1_CONT) {
+        double conversion_cycles = adc_sampling_cycles[ADC_REGS->SMPR & 7] + 12.5;
+        adc_conversions += dt * 1e-6 * adc_clock() / conversion_cycles;
+        while (adc_conversions >= 1) {
+            adc_convert();
+            adc_conversions -= 1;
+        }
+    }
+}
+
+/* ------------------------------------------------------------------------------------------------------------------
+ * UART
+ */
+
+uint32_t mcu_uart_baud(void) {
+    uint32_t clock = ((RCC->CFGR3 & RCC_CFGR3_USART1SW) == RCC_CFGR3_USART1SW_HSI) ? HSI_VALUE : SystemCoreClock;
+    return USART1->BRR ? clock / USART1->BRR : 0;
+}
+
+static uint32_t byte_time_us(uint32_t baud) {
+    return (10000000 + baud / 2) / baud;     // start bit + 8 data bits + stop bit
+}
+
+void mcu_uart_send(const uint8_t * data, int len) {
+    for (int i = 0; i < len; i++) {
+        if (((uart_queue_head + 1) % UART_QUEUE_SIZE) == uart_queue_tail) {
+            fprintf(stderr, "sim: UART send queue full\n");
+            return;
+        }
+        uart_queue[uart_queue_head] = data[i];
+        uart_queue_head = (uart_queue_head + 1) % UART_QUEUE_SIZE;
+    }
+}
+
+uint8_t mcu_uart_rx_idle(void) {
+    return (!uart_rx_busy) && (uart_queue_head == uart_queue_tail);
+}
+
+uint8_t mcu_uart_tx_idle(void) {
+    return uart_tx_data == NULL;
+}
+
+void mcu_uart_start_rx(UART_HandleTypeDef * huart, uint8_t * buf, uint16_t size) {
+    uart = huart;
+    uart_rx_buf = buf;
+    uart_rx_size = size;
+    huart->hdmarx->Instance->CNDTR = size;
+}
+
+void mcu_uart_stop(void) {
+    uart_rx_buf = NULL;
+    uart_tx_data = NULL;
+}
+
+int mcu_uart_transmit(UART_HandleTypeDef * huart, const uint8_t * data, uint16_t size) {
+    if ( (uart_tx_data != NULL) || (size == 0) ) {
+        return 0;
+    }
+    uart = huart;
+    uart_tx_data = data;
+    uart_tx_size = size;
+    uart_tx_pos = 0;
+    uart_tx_end = sim_time_us + byte_time_us(mcu_uart_baud());
+    return 1;
+}
+
+uint8_t mcu_uart_take_error(void) {
+    uint8_t error = uart_error;
+    uart_error = 0;
+    return error;
+}
+
+// Received byte is written by DMA to the circular buffer
+static void uart_rx_deliver(uint8_t byte) {
+    if ( (uart_rx_buf == NULL) || ((USART1->CR1 & (USART_CR1_UE | USART_CR1_RE)) != (USART_CR1_UE | USART_CR1_RE)) ) {
+        return;
+    }
+    DMA_Channel_TypeDef * channel = uart->hdmarx->Instance;
+    uart_rx_buf[uart_rx_size - channel->CNDTR] = byte;
+    channel->CNDTR--;
+    if (channel->CNDTR == uart_rx_size / 2) {
+        dma_complete(3, SIM_DMA_HT, SimIrqUartDma);
+    } else if (channel->CNDTR == 0) {
+        channel->CNDTR = uart_rx_size;
+        dma_complete(3, SIM_DMA_TC, SimIrqUartDma);
+    }
+}
+
+static void uart_advance(void) {
+    uint32_t baud = mcu_uart_baud();
+    uint32_t sender_baud = sim_uart_sender_baud ? sim_uart_sender_baud : baud;
+
+    if ( (!uart_rx_busy) && (uart_queue_head != uart_queue_tail) && (sender_baud != 0) ) {
+        // start bit: the falling edge of UART1_RX is routed to EXTI line 10 while sleeping
+        uart_rx_byte = uart_queue[uart_queue_tail];
+        uart_queue_tail = (uart_queue_tail + 1) % UART_QUEUE_SIZE;
+        uart_rx_busy = 1;
+        uart_rx_end = sim_time_us + byte_time_us(sender_baud);
+        uart_rx_lost = sim_stop_mode && sim_uart_wake_byte_lost;
+        uart_idle_time = 0;
+        uart_rto_time = 0;
+        if ( (EXTI->IMR & EXTI_IMR_MR10) && (EXTI->FTSR & EXTI_FTSR_TR10) ) {
+            exti_trigger(10, SimIrqExti4_15);
+        }
+    }
+    if (uart_rx_busy && (sim_time_us >= uart_rx_end)) {
+        uart_rx_busy = 0;
+        if (uart_rx_lost) {
+            // UART clock wasn't running when the start bit arrived
+            mcu_stats.uart_rx_lost++;
+        } else if ( (baud == 0) || (sender_baud * 100 < baud * 97) || (sender_baud * 100 > baud * 103) ) {
+            uart_error = 1;
+            USART1->ISR |= USART_ISR_FE;
+            mcu_set_pending(SimIrqUart);
+        } else {
+            uart_rx_deliver(uart_rx_byte);
+        }
+        uart_idle_time = sim_time_us + (baud ? byte_time_us(baud) : 0);
+        if ( (USART1->CR2 & USART_CR2_RTOEN) && baud ) {
+            // counted in bit periods from the end of the stop bit
+            uart_rto_time = sim_time_us + ((uint64_t) (USART1->RTOR & USART_RTOR_RTO) * 1000000 + baud / 2) / baud;
+        }
+    }
+    if ( uart_rto_time && (!uart_rx_busy) && (sim_time_us >= uart_rto_time) ) {
+        uart_rto_time = 0;
+        USART1->ISR |= USART_ISR_RTOF;
+        if (USART1->CR1 & USART_CR1_RTOIE) {
+            mcu_set_pending(SimIrqUart);
+        }
+    }
+    if ( uart_idle_time && (!uart_rx_busy) && (sim_time_us >= uart_idle_time) ) {
+        uart_idle_time = 0;
+        USART1->ISR |= USART_ISR_IDLE;
+        if (USART1->CR1 & USART_CR1_IDLEIE) {
+            mcu_set_pending(SimIrqUart);
+        }
+    }
+
+    if ( uart_tx_data && (sim_time_us >= uart_tx_end) ) {
+        sim_uart_tx_byte(uart_tx_data[uart_tx_pos++]);
+        if (uart_tx_pos == uart_tx_size) {
+            uart_tx_data = NULL;
+            dma_complete(2, SIM_DMA_TC, SimIrqUartDma);
+        } else {
+            uart_tx_end += byte_time_us(baud);
+        }
+    }
+}
+
+/* ------------------------------------------------------------------------------------------------------------------
+ * RTC
+ */
+
+static uint64_t rtc_time_us(void) {
+    return sim_time_us + RTC_EPOCH_US;
+}
+
+static uint32_t bcd(uint32_t x) {
+    return ((x / 10) << 4) | (x % 10);
+}
+
+void * sim_rtc_sync(void) {
+    RTC_TypeDef * rtc = RTC_REGS;
+    if (rtc->ISR & RTC_ISR_INIT) {
+        rtc->ISR |= RTC_ISR_INITF;
+    } else {
+        rtc->ISR &= ~RTC_ISR_INITF;
+    }
+    rtc->ISR |= RTC_ISR_RSF | RTC_ISR_ALRAWF;
+    uint64_t t = rtc_time_us();
+    uint32_t seconds = (t / 1000000) % 86400;
+    rtc->TR = (bcd(seconds / 3600) << 16) | (bcd(seconds / 60 % 60) << 8) | bcd(seconds % 60);
+    rtc->SSR = 319 - (t % 1000000) / RTC_SUBSECOND_US;
+    return rtc;
+}
+
+// Alarm A with only the lowest MASKSS bits of the sub-second counter compared (see rtc_set_periodic_alarm)
+static uint64_t rtc_alarm_period_us(void) {
+    RTC_TypeDef * rtc = RTC_REGS;
+    if (!(rtc->CR & RTC_CR_ALRAE)) {
+        return 0;
+    }
+    uint32_t shift = (rtc->ALRMASSR & RTC_ALRMASSR_MASKSS) >> RTC_ALRMASSR_MASKSS_Pos;
+    return (uint64_t)RTC_SUBSECOND_US << shift;
+}
+
+static uint64_t rtc_next_alarm(void) {
+    uint64_t period = rtc_alarm_period_us();
+    if (period == 0) {
+        return UINT64_MAX;
+    }
+    return (rtc_time_us() / period + 1) * period - RTC_EPOCH_US;
+}
+
+static void rtc_advance(void) {
+    RTC_TypeDef * rtc = RTC_REGS;
+    uint64_t period = rtc_alarm_period_us();
+    uint64_t now = rtc_time_us();
+    if ( period && (now / period != rtc_last_us / period) ) {
+        rtc->ISR |= RTC_ISR_ALRAF;
+        if ( (rtc->CR & RTC_CR_ALRAIE) && (EXTI->IMR & EXTI_IMR_MR17) && (EXTI->RTSR & EXTI_RTSR_TR17) ) {
+            exti_trigger(17, SimIrqRtc);
+        }
+    }
+    rtc_last_us = now;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------
+ * Time
+ */
+
+static void advance(uint32_t dt) {
+    sim_time_us += dt;
+    if (!sim_stop_mode) {
+        // core and peripheral clocks are stopped in Stop mode
+        if (sim_systick_running) {
+            systick_us += dt;
+            if (systick_us >= 1000) {
+                systick_us %= 1000;
+                mcu_set_pending(SimIrqSysTick);
+            }
+        }
+        uint32_t pwm_periods = timer_advance(&timers[0], dt);
+        timer_advance(&timers[1], dt);
+        timer_advance(&timers[2], dt);
+        adc_advance(dt, pwm_periods);
+        mcu_stats.awake_us += dt;
+        if (PWR_EN_GPIO_Port->ODR & PWR_EN_Pin) {
+            mcu_stats.sensor_power_us += dt;
+        }
+    }
+    rtc_advance();
+    uart_advance();
+    apply_clear_registers();
+    bridge_update();
+    model_step(&sim_bridge, dt * 1e-6);
+    hall_update();
+    sim_poll();
+}
+
+void mcu_step(void) {
+    advance(SIM_STEP_US);
+}
+
+// The CPU can't fetch instructions while flash is being programmed, so interrupts are served only afterwards
+void mcu_stall(uint32_t us) {
+    for (uint32_t t = 0; t < us; t += SIM_STEP_US) {
+        mcu_step();
+    }
+    mcu_dispatch();
+}
+
+void mcu_run_us(uint32_t us) {
+    for (uint32_t t = 0; t < us; t += SIM_STEP_US) {
+        mcu_step();
+        mcu_dispatch();
+    }
+}
+
+// Nothing can change until the next scripted action or RTC alarm
+static uint8_t mcu_quiescent(void) {
+    return (model.speed == 0) && (model.current == 0) && (sim_bridge.mode == BridgeOff) &&
+            mcu_uart_rx_idle() && mcu_uart_tx_idle() && (uart_idle_time == 0) &&
+            (uart_rto_time == 0);
+}
+
+void mcu_stop_mode(void) {
+    mcu_stats.stop_mode_entries++;
+    sim_stop_mode = 1;
+    while (!wake_up_pending()) {
+        if (mcu_quiescent()) {
+            uint64_t next = sim_next_action_time();
+            uint64_t alarm = rtc_next_alarm();
+            if (alarm < next) {
+                next = alarm;
+            }
+            // skip ahead, keeping the time a multiple of the step
+            if ( (next != UINT64_MAX) && (next > sim_time_us + SIM_STEP_US) ) {
+                sim_time_us = (next - SIM_STEP_US) / SIM_STEP_US * SIM_STEP_US;
+            }
+        }
+        mcu_step();
+    }
+    sim_stop_mode = 0;
+    mcu_dispatch();
+}
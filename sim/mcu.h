@@ -0,0 +1,88 @@
+#ifndef SIM_MCU_H_
+#define SIM_MCU_H_
+
+#include <stdint.h>
+#include "main.h"
+#include "model.h"
+
+/*
+ * Simulated STM32F030: memory map, interrupt controller and the peripherals used by the firmware (SysTick, TIM1,
+ * TIM3, TIM14, ADC + DMA, USART1 + DMA, GPIO/EXTI, RTC and flash).
+ *
+ * Firmware code takes no simulated time. Time advances in steps of SIM_STEP_US only while the firmware waits
+ * (WFI, Stop mode, HAL_Delay) or the CPU is stalled by flash programming. Pending interrupts are dispatched when
+ * they are unmasked, honoring the NVIC priorities configured by the firmware.
+ */
+
+#define SIM_STEP_US 5
+
+typedef enum {
+    SimIrqSysTick,
+    SimIrqExti0_1,      // Hall sensor #2
+    SimIrqExti4_15,     // Hall sensor #1 and UART RX wake-up
+    SimIrqAdcDma,       // DMA1 channel 1
+    SimIrqUartDma,      // DMA1 channels 2 and 3
+    SimIrqUart,         // USART1
+    SimIrqTim3,         // speed controller
+    SimIrqTim1,         // PWM dithering
+    SimIrqRtc,
+    SimIrqAdc,          // analog watchdog
+    SIM_IRQ_COUNT
+} sim_irq_t;
+
+typedef struct {
+    uint32_t irq_count[SIM_IRQ_COUNT];
+    uint32_t shoot_through;     // steps with a high-side and low-side MOSFET of the same leg both on
+    uint32_t uart_rx_lost;      // bytes lost while waking up from Stop mode
+    uint32_t stop_mode_entries;
+    uint64_t awake_us;          // time out of Stop mode
+    uint64_t sensor_power_us;   // time out of Stop mode with the Hall and voltage sensors powered (PWR_EN)
+} mcu_stats_t;
+
+extern uint64_t sim_time_us;
+extern uint8_t sim_stop_mode;
+extern bridge_t sim_bridge;
+extern mcu_stats_t mcu_stats;
+extern uint32_t sim_uart_sender_baud;   // 0 = follow the firmware baud rate
+extern uint8_t sim_uart_wake_byte_lost; // first byte after waking up from Stop mode is lost (the default)
+
+void mcu_init(void);
+void mcu_step(void);
+void mcu_gpio_written(void);
+void mcu_stall(uint32_t us);
+void mcu_run_us(uint32_t us);
+void mcu_set_pending(sim_irq_t irq);
+void mcu_dispatch(void);
+void mcu_stop_mode(void);
+void mcu_uart_send(const uint8_t * data, int len);
+uint8_t mcu_uart_rx_idle(void);
+uint8_t mcu_uart_tx_idle(void);
+uint32_t mcu_uart_baud(void);
+
+// Interface to the rest of the simulator (sim.c)
+void sim_poll(void);                        // called after every step
+uint64_t sim_next_action_time(void);        // earliest time when sim_poll has something to do
+void sim_uart_tx_byte(uint8_t byte);        // byte transmitted by the firmware (when its stop bit ends)
+void sim_reset_requested(void);             // NVIC_SystemReset
+
+// Used by the HAL stubs (hal.c)
+extern uint16_t * sim_adc_buf;
+extern uint32_t sim_adc_len;
+extern uint8_t sim_adc_running;
+extern uint8_t sim_systick_running;
+extern uint32_t sim_irq_priority[SIM_IRQ_COUNT];
+extern uint8_t sim_irq_enabled[SIM_IRQ_COUNT];
+int mcu_irq_from_irqn(int irqn);
+void mcu_adc_start(void);
+void mcu_uart_start_rx(UART_HandleTypeDef * huart, uint8_t * buf, uint16_t size);
+void mcu_uart_stop(void);
+int mcu_uart_transmit(UART_HandleTypeDef * huart, const uint8_t * data, uint16_t size);
+uint8_t mcu_dma_take_flags(DMA_HandleTypeDef * hdma);
+uint8_t mcu_uart_take_error(void);
+void mcu_exti_configure(GPIO_TypeDef * port, uint32_t pins, uint8_t rising, uint8_t falling);
+void mcu_exti_release(GPIO_TypeDef * port, uint32_t pins);
+
+#define SIM_DMA_HT 1
+#define SIM_DMA_TC 2
+
+#endif /* SIM_MCU_H_ */
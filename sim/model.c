@@ -0,0 +1,228 @@
+#include "model.h"
+#include <math.h>
+#include <string.h>
+
+#define GRAVITY 9.81
+#define TICKS_PER_REVOLUTION 4  // Hall sensor ticks per motor revolution
+
+/*
+ * Default parameters are rough estimates of the Fyrtur motor unit: no-load speed about 40 RPM (rod) at 8 V,
+ * 100-200 mA when lifting and about 2 A stall current.
+ */
+model_params_t model_params = {
+    .battery_voltage = 8.0,
+    .battery_resistance = 0.15,
+    .resistance = 4.0,
+    .inductance = 0.8e-3,
+    .ke = 0.0105,
+    .inertia = 0.8e-6,
+    .viscous_friction = 1.0e-6,
+    .coulomb_friction = 0.8e-3,
+    .static_friction = 1.2e-3,
+    .gear_ratio = 171,
+    .efficiency = 0.6,
+    .rod_radius = 0.014,
+    .bar_mass = 0.25,
+    .fabric_density = 0.15,
+    .full_length = 171 * (13 + 265.0/360) * 4,
+    .endstop_stiffness = 20,
+    .spike_friction = 0,
+    .spike_start = 0,
+    .spike_end = 0,
+    .current_noise = 0.005,
+};
+
+model_state_t model;
+
+static uint32_t noise_seed = 12345;
+
+// Gaussian noise (Box-Muller) from a deterministic generator so that runs are repeatable
+static double noise(double sigma) {
+    if (sigma == 0) {
+        return 0;
+    }
+    noise_seed = noise_seed * 1664525 + 1013904223;
+    double u1 = ((noise_seed >> 8) + 1.0) / 16777217.0;
+    noise_seed = noise_seed * 1664525 + 1013904223;
+    double u2 = (noise_seed >> 8) / 16777216.0;
+    return sigma * sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+}
+
+static uint8_t hall_state_from_angle(double angle) {
+    double rev = angle / (2 * M_PI);
+    double frac = rev - floor(rev);
+    double frac2 = frac - 0.25;
+    if (frac2 < 0) {
+        frac2 += 1;
+    }
+    // moving up gives the state sequence 0, 2, 3, 1 (see motor.c)
+    uint8_t state = ((frac < 0.5) << 1) | (frac2 < 0.5);
+    if (model_params.hall_stuck == 1) {
+        state &= ~2;
+    } else if (model_params.hall_stuck == 2) {
+        state &= ~1;
+    }
+    return state;
+}
+
+void model_init(double location) {
+    memset(&model, 0, sizeof(model));
+    model.location = location;
+    model.supply_voltage = model_params.battery_voltage;
+    // angle is chosen so that the Hall sensors are in the middle of a state
+    model.angle = M_PI / 4;
+    model.hall_state = hall_state_from_angle(model.angle);
+}
+
+// Length of the curtain hanging from the rod (m)
+static double hanging_length(void) {
+    double location = model.location;
+    if (location < 0) {
+        location = 0;
+    } else if (location > model_params.full_length) {
+        location = model_params.full_length;
+    }
+    return location / (TICKS_PER_REVOLUTION * model_params.gear_ratio) * 2 * M_PI * model_params.rod_radius;
+}
+
+// Torque at the motor shaft caused by the end stops. Positive torque pushes the curtain up
+static double endstop_torque(void) {
+    double overtravel = 0;
+    if (model.location < 0) {
+        overtravel = model.location;    // bottom bar is pressed against the housing
+    } else if (model.location > model_params.full_length) {
+        overtravel = model.location - model_params.full_length; // fabric is fully unrolled and stretched
+    }
+    if (overtravel == 0) {
+        return 0;
+    }
+    double rod_angle = overtravel / (TICKS_PER_REVOLUTION * model_params.gear_ratio) * 2 * M_PI;
+    double k = model_params.endstop_stiffness / (model_params.gear_ratio * model_params.gear_ratio);
+    // some damping so that the curtain doesn't bounce at the end stop
+    double c = sqrt(k * model_params.inertia);
+    return rod_angle * model_params.endstop_stiffness / model_params.gear_ratio - c * model.speed;
+}
+
+void model_step(const bridge_t * bridge, double dt) {
+    const model_params_t * p = &model_params;
+    double vs = model.supply_voltage;
+
+    // --- Electrical
+    double emf = p->ke * model.speed;
+    switch (bridge->mode) {
+        case BridgeOff:
+            // current decays through the body diodes much faster than the step
+            model.current = 0;
+            break;
+        case BridgeDrive:
+            model.current += (bridge->dir * bridge->duty * vs - emf - p->resistance * model.current) / p->inductance * dt;
+            if (bridge->dir * model.current < 0) {
+                // discontinuous conduction: current can't flow backwards through the freewheeling diode
+                model.current = 0;
+            }
+            break;
+        case BridgeBrake: {
+            // during the off-time the current flows back to the supply through the high-side body diodes
+            double v = (model.current < 0) ? vs : ((model.current > 0) ? -vs : 0);
+            double next = model.current + (-emf - p->resistance * model.current + (1 - bridge->duty) * v) / p->inductance * dt;
+            if ( (bridge->duty < 1) && (next * model.current < 0) ) {
+                next = 0;   // discontinuous conduction
+            }
+            model.current = next;
+            break;
+        }
+    }
+    model.supply_current = (bridge->mode == BridgeDrive) ? bridge->duty * fabs(model.current) : 0;
+    model.supply_voltage = p->battery_voltage - p->battery_resistance * model.supply_current;
+    model.energy += p->battery_voltage * model.supply_current * dt;
+
+    // --- Mechanical
+    double gravity = GRAVITY * (p->bar_mass + p->fabric_density * hanging_length()) * p->rod_radius / p->gear_ratio;
+    if (model.speed > 0) {
+        gravity /= p->efficiency;   // motor is lifting the curtain
+    } else {
+        gravity *= p->efficiency;   // curtain is driving the gearbox
+    }
+    double friction = p->coulomb_friction;
+    if ( (model.location >= p->spike_start) && (model.location < p->spike_end) ) {
+        friction += p->spike_friction;
+    }
+    double torque = p->ke * model.current - gravity + endstop_torque() - p->viscous_friction * model.speed;
+
+    if (model.speed == 0) {
+        if (fabs(torque) > p->static_friction + (friction - p->coulomb_friction)) {
+            // breakaway
+            model.speed = (torque - copysign(friction, torque)) / p->inertia * dt;
+        }
+    } else {
+        double speed = model.speed + (torque - copysign(friction, model.speed)) / p->inertia * dt;
+        if (speed * model.speed < 0) {
+            speed = 0;  // friction stops the motor (rather than reversing it)
+        }
+        model.speed = speed;
+    }
+
+    model.angle += model.speed * dt;
+    model.location -= model.speed * dt / (2 * M_PI) * TICKS_PER_REVOLUTION;
+    model.hall_state = hall_state_from_angle(model.angle);
+}
+
+double model_rod_rpm(void) {
+    return model.speed / (2 * M_PI) * 60 / model_params.gear_ratio;
+}
+
+/*
+ * Motor current seen by the shunt resistor (in the low-side path). When the ADC is synchronized to the PWM it's
+ * sampled during the on-time, otherwise the average over the PWM period is measured.
+ */
+double model_adc_current(const bridge_t * bridge, uint8_t synchronized) {
+    double current = fabs(model.current);
+    if ( (bridge->mode == BridgeDrive) && (!synchronized) ) {
+        current *= bridge->duty;    // freewheeling current bypasses the shunt during the off-time
+    }
+    current += noise(model_params.current_noise);
+    return (current > 0) ? current : 0;
+}
+
+struct param_name {
+    const char * name;
+    double * value;
+};
+
+static const struct param_name param_names[] = {
+    { "battery_voltage", &model_params.battery_voltage },
+    { "battery_resistance", &model_params.battery_resistance },
+    { "resistance", &model_params.resistance },
+    { "inductance", &model_params.inductance },
+    { "ke", &model_params.ke },
+    { "inertia", &model_params.inertia },
+    { "viscous_friction", &model_params.viscous_friction },
+    { "coulomb_friction", &model_params.coulomb_friction },
+    { "static_friction", &model_params.static_friction },
+    { "gear_ratio", &model_params.gear_ratio },
+    { "efficiency", &model_params.efficiency },
+    { "rod_radius", &model_params.rod_radius },
+    { "bar_mass", &model_params.bar_mass },
+    { "fabric_density", &model_params.fabric_density },
+    { "full_length", &model_params.full_length },
+    { "endstop_stiffness", &model_params.endstop_stiffness },
+    { "spike_friction", &model_params.spike_friction },
+    { "spike_start", &model_params.spike_start },
+    { "spike_end", &model_params.spike_end },
+    { "current_noise", &model_params.current_noise },
+    { "hall_stuck", &model_params.hall_stuck },
+    { "location", &model.location },
+};
+
+/*
+ * Set a model parameter by name. Returns 0 if the name is unknown
+ */
+int model_set_param(const char * name, double value) {
+    for (unsigned i = 0; i < sizeof(param_names)/sizeof(param_names[0]); i++) {
+        if (strcmp(param_names[i].name, name) == 0) {
+            *param_names[i].value = value;
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,76 @@
+#ifndef SIM_MODEL_H_
+#define SIM_MODEL_H_
+
+#include <stdint.h>
+
+/*
+ * Physics model of the blinds: H-bridge, brushed DC motor, GEAR_RATIO gearbox and the curtain hanging from the rod.
+ *
+ * Curtain position is expressed in Hall sensor ticks (4 per motor revolution) like the firmware location:
+ * 0 is the top end stop (bottom bar against the housing) and full_length the fully lowered curtain.
+ * Moving up is the positive motor direction.
+ */
+
+typedef enum {
+    BridgeOff,      // all MOSFETs off: motor is disconnected
+    BridgeDrive,    // one high-side MOSFET on and the opposite low-side switched with duty cycle
+    BridgeBrake     // both low-side MOSFETs on (or switched with duty cycle): motor windings shorted
+} bridge_mode_t;
+
+typedef struct {
+    bridge_mode_t mode;
+    double duty;            // 0..1 (BridgeDrive and BridgeBrake)
+    int8_t dir;             // +1 = up, -1 = down (BridgeDrive)
+} bridge_t;
+
+typedef struct {
+    // supply
+    double battery_voltage;     // open circuit voltage (V)
+    double battery_resistance;  // internal resistance including wiring (ohm)
+    // motor
+    double resistance;          // armature resistance (ohm)
+    double inductance;          // armature inductance (H)
+    double ke;                  // back-EMF and torque constant (V*s/rad or N*m/A)
+    double inertia;             // motor and load inertia seen by the motor (kg*m^2)
+    double viscous_friction;    // N*m*s/rad
+    double coulomb_friction;    // N*m (at motor shaft, includes gearbox)
+    double static_friction;     // N*m breakaway torque
+    // gearbox and curtain
+    double gear_ratio;
+    double efficiency;          // gearbox efficiency
+    double rod_radius;          // m
+    double bar_mass;            // kg (bottom bar)
+    double fabric_density;      // kg/m
+    double full_length;         // ticks
+    double endstop_stiffness;   // N*m/rad at the rod
+    // friction spike: extra coulomb friction (N*m at motor) between two locations (ticks)
+    double spike_friction;
+    double spike_start;
+    double spike_end;
+    // ADC
+    double current_noise;       // standard deviation (A)
+    // Hall sensors
+    double hall_stuck;          // 1 or 2: output of that sensor is stuck low, 0 = both working
+} model_params_t;
+
+typedef struct {
+    double location;            // ticks
+    double angle;               // motor shaft angle (rad), increases when moving up
+    double speed;               // motor shaft speed (rad/s)
+    double current;             // armature current (A), positive when driving up
+    double supply_voltage;      // voltage at the board (V)
+    double supply_current;      // battery current (A)
+    double energy;              // energy drawn from the battery (J)
+    uint8_t hall_state;         // (HALL1 << 1) | HALL2
+} model_state_t;
+
+extern model_params_t model_params;
+extern model_state_t model;
+
+void model_init(double location);
+void model_step(const bridge_t * bridge, double dt);
+double model_rod_rpm(void);
+double model_adc_current(const bridge_t * bridge, uint8_t synchronized);
+int model_set_param(const char * name, double value);
+
+#endif /* SIM_MODEL_H_ */
@@ -0,0 +1,502 @@
+/*
+ * Replay of recorded UART traffic. Timestamped byte streams (e.g. captured from the ESP or Zigbee module with a logic
+ * analyzer) are sent to the firmware over the simulated UART, so they go through the real DMA receiver, the frame
+ * parser (uart_rx_parse) and the command handlers. The replies are checked against the expected frames and their
+ * latency is measured.
+ *
+ * Usage: fyrtur-replay [-v] trace
+ *
+ *   -v    print every frame sent and received
+ *
+ * Trace lines ('#' starts a comment):
+ *
+ *   set NAME VALUE               as in the simulator scripts (sim.c). Leading "set" lines are applied before boot
+ *   wait stopped|sleeping [MS]   wait for the motor to stop / the firmware to enter Stop mode (timeout, default 120 s)
+ *   wait replies                 wait until the expected replies have been received (or their time limit has passed)
+ *   T > HEX...                   send bytes T milliseconds after the last wait (or the start). Bytes are queued if
+ *                                the line is still busy, so a burst can be given with the same timestamp
+ *   < HEX... [within MS]         expect the next reply frame, ".." matches any byte. Latency is measured from the end
+ *                                of the last frame sent before this line to the start of the reply (default limit
+ *                                DEFAULT_REPLY_TIMEOUT_MS)
+ *   < none [within MS]           expect no reply
+ *   repeat N ... end             repeat the lines in between. Timestamps are relative to the start of each round
+ *
+ * Replies that arrive when none is expected are reported as errors. The exit code is 1 if any check failed.
+ */
+#include "mcu.h"
+#include "motor.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_TRACE_LINES 4096
+#define MAX_LINE 256
+#define MAX_FRAME 64
+#define MAX_EXPECTED 256
+#define DEFAULT_WAIT_TIMEOUT_MS 120000
+#define DEFAULT_REPLY_TIMEOUT_MS 100
+#define REPLY_FRAME_GAP_BYTES 2  // silence (in byte times) after which an incomplete or unexpected reply is reported
+#define REPLY_BUF_SIZE 256
+
+int firmware_main(void);
+
+extern motor_status_t status;
+extern motor_command_t command;
+
+typedef struct {
+    int line;
+    int len;                // 0 = no reply is expected
+    uint8_t bytes[MAX_FRAME];
+    uint8_t any[MAX_FRAME]; // byte isn't checked
+    uint64_t after;         // request end time (latency reference)
+    uint64_t deadline;
+} expected_t;
+
+static char * trace_lines[MAX_TRACE_LINES];
+static int trace_len;
+static int trace_pos;
+static int verbose;
+
+static enum { WaitNone, WaitTime, WaitStopped, WaitSleeping, WaitReplies } waiting;
+static uint64_t wait_until;
+static uint64_t wait_started;
+static uint8_t wait_move_seen;
+static uint64_t origin;             // timestamps are relative to this
+
+static int repeat_start;            // first line of the repeat block (0 = none)
+static int repeat_left;
+
+static uint64_t request_end;        // when the last queued byte has been sent
+
+static expected_t expected[MAX_EXPECTED];
+static int expected_head;
+static int expected_tail;
+
+// Bytes transmitted by the firmware that haven't been matched yet
+static uint8_t reply_bytes[REPLY_BUF_SIZE];
+static uint64_t reply_start[REPLY_BUF_SIZE];    // start bit of each byte
+static int reply_len;
+static uint64_t reply_last_byte;
+
+// Results
+static uint32_t frames_sent;
+static uint32_t replies_checked;
+static uint32_t failures;
+static uint64_t latency_sum;
+static uint64_t latency_min = UINT64_MAX;
+static uint64_t latency_max;
+static uint64_t first_request;
+static uint64_t last_reply;
+
+static uint64_t byte_time_us(void) {
+    uint32_t baud = sim_uart_sender_baud ? sim_uart_sender_baud : mcu_uart_baud();
+    return baud ? 10000000ULL / baud : 0;
+}
+
+static void print_bytes(const uint8_t * bytes, int len) {
+    for (int i = 0; i < len; i++) {
+        printf(" %02x", bytes[i]);
+    }
+}
+
+static void fail(int line, const char * msg) {
+    failures++;
+    printf("[%10.3f] line %d: %s\n", sim_time_us * 1e-6, line, msg);
+}
+
+static void finish(void) {
+    if (replies_checked) {
+        double span = (last_reply - first_request) * 1e-6;
+        printf("%lu frames sent, %lu replies checked, latency %.2f / %.2f / %.2f ms (min / avg / max)",
+                (unsigned long)frames_sent, (unsigned long)replies_checked, latency_min * 1e-3,
+                (double)latency_sum / replies_checked * 1e-3, latency_max * 1e-3);
+        if (span > 0) {
+            printf(", %.1f replies/s", replies_checked / span);
+        }
+        printf("\n");
+    } else {
+        printf("%lu frames sent, no replies checked\n", (unsigned long)frames_sent);
+    }
+    printf("%s: %lu failures, %lu UART bytes lost, %lu Stop mode entries\n", failures ? "FAILED" : "OK",
+            (unsigned long)failures, (unsigned long)mcu_stats.uart_rx_lost, (unsigned long)mcu_stats.stop_mode_entries);
+    fflush(stdout);
+    exit(failures ? 1 : 0);
+}
+
+/* ------------------------------------------------------------------------------------------------------------------
+ * Replies
+ */
+
+static uint8_t expected_pending(void) {
+    return expected_head != expected_tail;
+}
+
+static void reply_consume(int len) {
+    reply_len -= len;
+    memmove(reply_bytes, reply_bytes + len, reply_len);
+    memmove(reply_start, reply_start + len, reply_len * sizeof(reply_start[0]));
+}
+
+static void reply_report(const char * msg, int line, int len) {
+    printf("[%10.3f] ", reply_start[0] * 1e-6);
+    if (line) {
+        printf("line %d: ", line);
+    }
+    printf("%s:", msg);
+    print_bytes(reply_bytes, len);
+    printf("\n");
+    failures++;
+}
+
+static void check_reply(expected_t * e) {
+    for (int i = 0; i < e->len; i++) {
+        if ( (!e->any[i]) && (reply_bytes[i] != e->bytes[i]) ) {
+            reply_report("reply doesn't match", e->line, e->len);
+            return;
+        }
+    }
+    uint64_t latency = (reply_start[0] > e->after) ? reply_start[0] - e->after : 0;
+    if (reply_start[0] > e->deadline) {
+        char msg[64];
+        snprintf(msg, sizeof(msg), "reply too late (%.2f ms)", latency * 1e-3);
+        fail(e->line, msg);
+    }
+    if (verbose) {
+        printf("[%10.3f] <", reply_start[0] * 1e-6);
+        print_bytes(reply_bytes, e->len);
+        printf("\n");
+    }
+    replies_checked++;
+    latency_sum += latency;
+    if (latency < latency_min) {
+        latency_min = latency;
+    }
+    if (latency > latency_max) {
+        latency_max = latency;
+    }
+    last_reply = sim_time_us;
+}
+
+/*
+ * Match the transmitted bytes against the expected replies in order. The replies are handled as a byte stream,
+ * because the firmware may send several of them back to back.
+ */
+static void process_replies(void) {
+    uint8_t line_idle = sim_time_us - reply_last_byte > REPLY_FRAME_GAP_BYTES * byte_time_us();
+    while (expected_pending()) {
+        expected_t * e = &expected[expected_tail];
+        if (e->len == 0) {
+            if ( reply_len && (reply_start[0] <= e->deadline) ) {
+                if (!line_idle) {
+                    return;
+                }
+                reply_report("reply when none was expected", e->line, reply_len);
+                reply_consume(reply_len);
+            } else if (sim_time_us <= e->deadline) {
+                return;
+            }
+        } else if (reply_len >= e->len) {
+            check_reply(e);
+            reply_consume(e->len);
+        } else if (reply_len) {
+            if (!line_idle) {
+                return;
+            }
+            reply_report("incomplete reply", e->line, reply_len);
+            reply_consume(reply_len);
+        } else if (sim_time_us > e->deadline) {
+            fail(e->line, "no reply");
+        } else {
+            return;
+        }
+        expected_tail = (expected_tail + 1) % MAX_EXPECTED;
+    }
+    if (reply_len && line_idle) {
+        reply_report("unexpected reply", 0, reply_len);
+        reply_consume(reply_len);
+    }
+}
+
+void sim_uart_tx_byte(uint8_t byte) {
+    if (reply_len == REPLY_BUF_SIZE) {
+        reply_report("unexpected reply", 0, reply_len);
+        reply_consume(reply_len);
+    }
+    reply_bytes[reply_len] = byte;
+    reply_start[reply_len++] = sim_time_us - byte_time_us();
+    reply_last_byte = sim_time_us;
+}
+
+void sim_reset_requested(void) {
+    printf("[%10.3f] system reset requested\n", sim_time_us * 1e-6);
+    finish();
+}
+
+/* ------------------------------------------------------------------------------------------------------------------
+ * Trace
+ */
+
+static void trace_error(const char * msg) {
+    fprintf(stderr, "replay: line %d: %s: %s", trace_pos, msg, trace_lines[trace_pos - 1]);
+    exit(2);
+}
+
+static int parse_bytes(char * tok, uint8_t * bytes, uint8_t * any, char ** rest) {
+    int len = 0;
+    for (; tok && (strcmp(tok, "within") != 0); tok = strtok(NULL, " \t\r\n")) {
+        if (len == MAX_FRAME) {
+            trace_error("frame too long");
+        }
+        char * end;
+        if ( (strcmp(tok, "..") == 0) && any ) {
+            any[len] = 1;
+            bytes[len++] = 0;
+            continue;
+        }
+        unsigned long value = strtoul(tok, &end, 16);
+        if ( (*end != 0) || (value > 0xff) ) {
+            trace_error("bad byte");
+        }
+        if (any) {
+            any[len] = 0;
+        }
+        bytes[len++] = (uint8_t)value;
+    }
+    *rest = tok ? strtok(NULL, " \t\r\n") : NULL;
+    return len;
+}
+
+static int set_param(const char * name, double value) {
+    if (strcmp(name, "sender_baud") == 0) {
+        sim_uart_sender_baud = (uint32_t)value;
+    } else if (strcmp(name, "wake_byte_lost") == 0) {
+        sim_uart_wake_byte_lost = (value != 0);
+    } else {
+        return model_set_param(name, value);
+    }
+    return 1;
+}
+
+static void send_bytes(const uint8_t * bytes, int len) {
+    uint64_t start = (request_end > sim_time_us) ? request_end : sim_time_us;
+    request_end = start + len * byte_time_us();
+    if (frames_sent++ == 0) {
+        first_request = start;
+    }
+    if (verbose) {
+        printf("[%10.3f] >", start * 1e-6);
+        print_bytes(bytes, len);
+        printf("\n");
+    }
+    mcu_uart_send(bytes, len);
+}
+
+// Execute the next trace line. Returns 0 when it takes time
+static int trace_step(void) {
+    char line[MAX_LINE];
+    int line_number = ++trace_pos;
+    strncpy(line, trace_lines[line_number - 1], sizeof(line) - 1);
+    line[sizeof(line) - 1] = 0;
+    char * comment = strchr(line, '#');
+    if (comment) {
+        *comment = 0;
+    }
+    char * tok = strtok(line, " \t\r\n");
+    if (tok == NULL) {
+        return 1;
+    }
+
+    if (strcmp(tok, "set") == 0) {
+        char * name = strtok(NULL, " \t\r\n");
+        char * value = strtok(NULL, " \t\r\n");
+        if ( (name == NULL) || (value == NULL) || (!set_param(name, atof(value))) ) {
+            trace_error("unknown parameter");
+        }
+    } else if (strcmp(tok, "wait") == 0) {
+        char * cond = strtok(NULL, " \t\r\n");
+        char * timeout = strtok(NULL, " \t\r\n");
+        if ( (cond != NULL) && (strcmp(cond, "stopped") == 0) ) {
+            waiting = WaitStopped;
+        } else if ( (cond != NULL) && (strcmp(cond, "sleeping") == 0) ) {
+            waiting = WaitSleeping;
+        } else if ( (cond != NULL) && (strcmp(cond, "replies") == 0) ) {
+            waiting = WaitReplies;
+        } else {
+            trace_error("unknown condition");
+        }
+        wait_started = sim_time_us;
+        wait_until = sim_time_us + (uint64_t)(timeout ? atof(timeout) : DEFAULT_WAIT_TIMEOUT_MS) * 1000;
+        wait_move_seen = 0;
+        return 0;
+    } else if (strcmp(tok, "repeat") == 0) {
+        char * count = strtok(NULL, " \t\r\n");
+        if ( (count == NULL) || (atoi(count) < 1) || repeat_start ) {
+            trace_error("bad repeat");
+        }
+        repeat_start = trace_pos + 1;
+        repeat_left = atoi(count);
+        origin = sim_time_us;
+    } else if (strcmp(tok, "end") == 0) {
+        if (!repeat_start) {
+            trace_error("end without repeat");
+        }
+        if (--repeat_left > 0) {
+            // next round starts when the previous one has been sent
+            trace_pos = repeat_start - 1;
+            origin = (request_end > sim_time_us) ? request_end : sim_time_us;
+            waiting = WaitTime;
+            wait_until = origin;
+            return 0;
+        }
+        repeat_start = 0;
+    } else if (strcmp(tok, "<") == 0) {
+        if ((expected_head + 1) % MAX_EXPECTED == expected_tail) {
+            trace_error("too many pending replies");
+        }
+        expected_t * e = &expected[expected_head];
+        char * rest;
+        char * first = strtok(NULL, " \t\r\n");
+        memset(e, 0, sizeof(*e));
+        e->line = line_number;
+        if ( (first != NULL) && (strcmp(first, "none") == 0) ) {
+            char * within = strtok(NULL, " \t\r\n");
+            rest = (within && (strcmp(within, "within") == 0)) ? strtok(NULL, " \t\r\n") : NULL;
+        } else {
+            e->len = parse_bytes(first, e->bytes, e->any, &rest);
+            if (e->len == 0) {
+                trace_error("missing reply bytes");
+            }
+        }
+        e->after = (request_end > sim_time_us) ? request_end : sim_time_us;
+        e->deadline = e->after + (uint64_t)(rest ? atof(rest) : DEFAULT_REPLY_TIMEOUT_MS) * 1000;
+        expected_head = (expected_head + 1) % MAX_EXPECTED;
+    } else {
+        char * end;
+        double t = strtod(tok, &end);
+        char * dir = strtok(NULL, " \t\r\n");
+        if ( (*end != 0) || (dir == NULL) || (strcmp(dir, ">") != 0) ) {
+            trace_error("unknown line");
+        }
+        uint64_t at = origin + (uint64_t)(t * 1000);
+        if (at > sim_time_us) {
+            // come back to this line when it's time
+            trace_pos--;
+            waiting = WaitTime;
+            wait_until = at;
+            return 0;
+        }
+        uint8_t bytes[MAX_FRAME];
+        char * rest;
+        int len = parse_bytes(strtok(NULL, " \t\r\n"), bytes, NULL, &rest);
+        if (len == 0) {
+            trace_error("missing bytes");
+        }
+        send_bytes(bytes, len);
+    }
+    return 1;
+}
+
+static uint8_t firmware_moving(void) {
+    return (status == Moving) || (status == Stopping) || (status == CalibratingEndPoint) ||
+            ( (status == Stalled) && (command != NoCommand) );
+}
+
+static uint8_t wait_done(void) {
+    if ( (waiting == WaitStopped) || (waiting == WaitSleeping) ) {
+        if (sim_time_us >= wait_until) {
+            printf("[%10.3f] line %d: wait timed out\n", sim_time_us * 1e-6, trace_pos);
+            failures++;
+            return 1;
+        }
+    }
+    switch (waiting) {
+        case WaitTime:
+            return sim_time_us >= wait_until;
+        case WaitStopped:
+            if (firmware_moving()) {
+                wait_move_seen = 1;
+                return 0;
+            }
+            // a move starts within a few milliseconds after the command
+            return wait_move_seen || (sim_time_us - wait_started >= 1000000);
+        case WaitSleeping:
+            return sim_stop_mode;
+        case WaitReplies:
+            return !expected_pending();
+        default:
+            return 1;
+    }
+}
+
+uint64_t sim_next_action_time(void) {
+    // "wait sleeping" is done as soon as the firmware has entered Stop mode
+    uint64_t t = ( (waiting == WaitNone) || (waiting == WaitSleeping) ) ? sim_time_us : wait_until;
+    if (expected_pending() && (expected[expected_tail].deadline + 1 < t)) {
+        t = expected[expected_tail].deadline + 1;
+    }
+    return t;
+}
+
+void sim_poll(void) {
+    process_replies();
+
+    if ( (waiting != WaitNone) && wait_done() ) {
+        if ( (waiting == WaitStopped) || (waiting == WaitSleeping) || (waiting == WaitReplies) ) {
+            origin = sim_time_us;
+        }
+        waiting = WaitNone;
+    }
+    while (waiting == WaitNone) {
+        if (trace_pos == trace_len) {
+            if ( expected_pending() || (!mcu_uart_rx_idle()) || reply_len ) {
+                waiting = WaitReplies;
+                wait_until = UINT64_MAX;
+                return;
+            }
+            finish();
+        }
+        trace_step();
+    }
+}
+
+static int is_set_line(const char * line) {
+    while ( (*line == ' ') || (*line == '\t') ) {
+        line++;
+    }
+    return strncmp(line, "set ", 4) == 0;
+}
+
+int main(int argc, char ** argv) {
+    int i;
+    for (i = 1; (i < argc) && (argv[i][0] == '-'); i++) {
+        if (strcmp(argv[i], "-v") == 0) {
+            verbose = 1;
+        } else {
+            break;
+        }
+    }
+    if (i != argc - 1) {
+        fprintf(stderr, "usage: %s [-v] trace\n", argv[0]);
+        return 1;
+    }
+    FILE * f = fopen(argv[i], "r");
+    if (f == NULL) {
+        fprintf(stderr, "replay: can't open %s\n", argv[i]);
+        return 1;
+    }
+    char line[MAX_LINE];
+    while ( fgets(line, sizeof(line), f) && (trace_len < MAX_TRACE_LINES) ) {
+        trace_lines[trace_len++] = strdup(line);
+    }
+    fclose(f);
+
+    mcu_init();
+    model_init(model_params.full_length / 2);
+    while ( (trace_pos < trace_len) && is_set_line(trace_lines[trace_pos]) ) {
+        trace_step();
+    }
+    model.supply_voltage = model_params.battery_voltage;
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    firmware_main();
+    return 0;
+}
@@ -0,0 +1,607 @@
+/*
+ * Host simulation of the firmware. The unmodified firmware sources run against the simulated MCU (mcu.c, hal.c),
+ * which drives the motor, gearbox and curtain model (model.c). A script sends commands over the simulated UART and
+ * every move is summarized with a few metrics, so that control changes can be evaluated without hardware.
+ *
+ * Usage: fyrtur-sim [-v] [-q] [-r name] [-t trace.csv] [-f flash.bin] [script]
+ *
+ *   -v    print the frames transmitted by the firmware
+ *   -q    print only the move summaries
+ *   -r    print only one line of metrics over the whole script (see print_report), used by "make bench"
+ *   -t    write a CSV trace (one row per millisecond while awake)
+ *   -f    flash image: loaded at start if it exists and saved at exit, so settings persist between runs
+ *
+ * Script commands (one per line, '#' starts a comment). The script is read from stdin if no file is given:
+ *
+ *   set NAME VALUE        model parameter (see model.c), "sender_baud" (0 = follow the firmware) or "wake_byte_lost"
+ *   run MS                let the simulation run for MS milliseconds
+ *   up | down | stop      motor commands (also up17 / down17 and up6 / down6, which ignore the curtain limits)
+ *   goto PERCENT          go to position (0 = top, 100 = bottom)
+ *   cmd B1 B2             any command (hex bytes), sent in a 6-byte frame
+ *   send HEX...           raw bytes
+ *   wait stopped|moving|sleeping [TIMEOUT_MS]
+ *   print                 one line of current state
+ *   limit NAME VALUE      pass/fail limit of the -r report: "error" and "overshoot" (ticks) or "stalls". A scenario
+ *                         exceeding a limit fails "make bench". Defaults are DEFAULT_LIMIT_*
+ *
+ * Leading "set" commands are applied before the firmware boots (e.g. the initial curtain location).
+ */
+#include "mcu.h"
+#include "motor.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_SCRIPT_LINES 4096
+#define MAX_LINE 256
+#define DEFAULT_WAIT_TIMEOUT_MS 120000
+#define MOVE_START_TIMEOUT_MS 1000  // "wait stopped" gives up if the command didn't start a move
+#define RPM_SETTLE_TOLERANCE 0.05
+#define TX_FRAME_GAP_US 3000
+#define DEFAULT_LIMIT_ERROR 5       // ticks
+#define DEFAULT_LIMIT_OVERSHOOT 5   // ticks
+#define DEFAULT_LIMIT_STALLS 0
+
+// Commands of the original protocol (see motor.c)
+#define CMD_GO_TO   0xdd
+#define CMD_UP      0x0add
+#define CMD_DOWN    0x0aee
+#define CMD_UP_17   0x0a0d
+#define CMD_DOWN_17 0x0a0e
+#define CMD_STOP    0x0acc
+#define CMD_OVERRIDE_UP_6   0xfad3
+#define CMD_OVERRIDE_DOWN_6 0xfad4
+
+int firmware_main(void);
+
+// Firmware state (motor.c)
+extern motor_status_t status;
+extern int32_t location;
+extern int32_t target_location;
+extern uint8_t target_speed;
+extern uint8_t cruise_speed;
+extern uint16_t curr_pwm;
+extern uint8_t calibrating;
+extern motor_command_t command;
+extern uint16_t stalled_moving_up_counter;
+extern uint16_t stalled_moving_down_counter;
+
+static char * script[MAX_SCRIPT_LINES];
+static int script_len;
+static int script_pos;
+static int verbose;
+static int quiet;
+static const char * report_name;
+static FILE * trace;
+static const char * flash_file;
+
+// Command in progress
+static enum { CmdNone, CmdRun, CmdWaitStopped, CmdWaitMoving, CmdWaitSleeping } pending_cmd;
+static uint64_t pending_until;
+static uint64_t pending_started;
+static uint8_t pending_move_seen;
+
+// Metrics of the current move
+typedef struct {
+    int number;
+    uint64_t start_time;
+    double start_location;
+    int32_t start_firmware_location;
+    int32_t target;
+    double peak_current;
+    double peak_overshoot;
+    double settle_time;     // seconds until rod RPM stays within tolerance of the target, negative = never
+    double rpm_error_sum;
+    uint32_t rpm_samples;
+    double energy;
+    uint32_t stalls_at_start;
+    uint8_t calibration;
+    uint8_t to_end_stop;    // "up" command moves until the motor stalls at the top (target -1), no target metrics
+} move_metrics_t;
+
+// Metrics over the whole script (see print_report)
+typedef struct {
+    double move_time;
+    double max_target_error;
+    double max_overshoot;
+    double rpm_error_sum;
+    uint32_t rpm_samples;
+    double peak_current;
+    uint32_t stalls;
+    double calibration_time;
+    uint32_t timeouts;
+} totals_t;
+
+// Pass/fail limits of the report (see the "limit" command)
+typedef struct {
+    double error;
+    double overshoot;
+    uint32_t stalls;
+} limits_t;
+
+static move_metrics_t move;
+static uint8_t move_active;
+static int move_count;
+static totals_t totals;
+static limits_t limits = { DEFAULT_LIMIT_ERROR, DEFAULT_LIMIT_OVERSHOOT, DEFAULT_LIMIT_STALLS };
+static uint64_t last_ms;
+
+static uint8_t tx_frame[64];
+static int tx_frame_len;
+static uint64_t tx_last_byte;
+
+static const char * status_names[] = { "Stopped", "Moving", "Stopping", "CalibratingEndPoint", "Bootloader",
+        "Stalled", "Error" };
+
+static uint32_t stall_count(void) {
+    return stalled_moving_up_counter + stalled_moving_down_counter;
+}
+
+// A stalled motor is restarted by the firmware (the command is deferred until then), which counts as the same move
+static uint8_t firmware_moving(void) {
+    return (status == Moving) || (status == Stopping) || (status == CalibratingEndPoint) ||
+            ( (status == Stalled) && (command != NoCommand) );
+}
+
+static double target_rpm(void) {
+    return target_speed / (double)(1 << RPM_DECIMAL_BITS);
+}
+
+/* ------------------------------------------------------------------------------------------------------------------
+ * Metrics
+ */
+
+static void move_begin(void) {
+    memset(&move, 0, sizeof(move));
+    move.number = ++move_count;
+    move.start_time = sim_time_us;
+    move.start_location = model.location;
+    move.start_firmware_location = location;
+    move.target = target_location;
+    move.settle_time = -1;
+    move.energy = model.energy;
+    move.stalls_at_start = stall_count();
+    move.calibration = calibrating;
+    move.to_end_stop = calibrating || (target_location < 0);
+    move_active = 1;
+}
+
+static void move_sample(void) {
+    double current = fabs(model.current);
+    if (current > move.peak_current) {
+        move.peak_current = current;
+    }
+    // overshoot past the target in the direction of the move (in firmware coordinates, see move_end)
+    double moved = model.location - move.start_location;
+    double over = (move.target >= move.start_firmware_location) ?
+            move.start_firmware_location + moved - move.target : move.target - move.start_firmware_location - moved;
+    if ( (!move.to_end_stop) && (over > move.peak_overshoot) ) {
+        move.peak_overshoot = over;
+    }
+    double rpm = fabs(model_rod_rpm());
+    double target = target_rpm();
+    if (target > 0) {
+        uint8_t settled = fabs(rpm - target) <= target * RPM_SETTLE_TOLERANCE;
+        if (settled && (move.settle_time < 0)) {
+            move.settle_time = (sim_time_us - move.start_time) * 1e-6;
+        } else if (!settled && (status == Moving) && (target_speed == cruise_speed)) {
+            move.settle_time = -1;  // not settled until it stays within the tolerance at cruise speed
+        }
+        if (move.settle_time >= 0) {
+            move.rpm_error_sum += (rpm - target) * (rpm - target);
+            move.rpm_samples++;
+        }
+    }
+}
+
+static void move_end(void) {
+    move_active = 0;
+    double duration = (sim_time_us - move.start_time) * 1e-6;
+    double rms = move.rpm_samples ? sqrt(move.rpm_error_sum / move.rpm_samples) : 0;
+    uint32_t stalls = stall_count() - move.stalls_at_start;
+    // distance actually travelled vs. the commanded one, so that an offset between the firmware and model locations
+    // (e.g. left by calibration) doesn't count
+    double target_error = (model.location - move.start_location) - (move.target - move.start_firmware_location);
+
+    // calibration always ends with a stall, so it only counts for the calibration time
+    if (move.calibration) {
+        totals.calibration_time += duration;
+    } else {
+        totals.move_time += duration;
+        if ( (!move.to_end_stop) && (fabs(target_error) > totals.max_target_error) ) {
+            totals.max_target_error = fabs(target_error);
+        }
+        if (move.peak_overshoot > totals.max_overshoot) {
+            totals.max_overshoot = move.peak_overshoot;
+        }
+        totals.rpm_error_sum += move.rpm_error_sum;
+        totals.rpm_samples += move.rpm_samples;
+        if (move.peak_current > totals.peak_current) {
+            totals.peak_current = move.peak_current;
+        }
+    }
+    totals.stalls += stalls;
+
+    if (report_name) {
+        return;
+    }
+    printf("[%10.3f] move %d%s: %.0f -> %d ticks in %.3f s, final %s, location %ld (model %.1f, error %+.1f), ",
+            sim_time_us * 1e-6, move.number, move.calibration ? " (calibration)" : "", move.start_location,
+            (int)move.target, duration, status_names[status], (long)location, model.location,
+            location - model.location);
+    if (!move.to_end_stop) {
+        printf("target error %+.1f ticks, ", target_error);
+    }
+    printf("overshoot %.1f ticks, settle %.3f s, RPM error %.2f rms, peak current %.2f A, energy %.2f J",
+            move.peak_overshoot, move.settle_time, rms, move.peak_current, model.energy - move.energy);
+    if (stalls) {
+        printf(", %u stalls", (unsigned)stalls);
+    }
+    printf("\n");
+}
+
+/*
+ * One line of metrics over the whole script: total duration of the moves, largest final position error (ticks),
+ * largest overshoot (ticks), RPM error (rms over all moves), peak motor current (A), stalls and total duration of
+ * the calibration moves. Calibration moves count only for the last two. Columns match the header printed by
+ * "make bench". The metrics exceeding their limits are listed after the columns. Returns 0 if the scenario failed
+ */
+static int print_report(void) {
+    char failures[64] = "";
+    if (totals.timeouts) {
+        strcat(failures, "  TIMEOUT");
+    }
+    if (totals.max_target_error > limits.error) {
+        strcat(failures, "  FAIL:error");
+    }
+    if (totals.max_overshoot > limits.overshoot) {
+        strcat(failures, "  FAIL:overshoot");
+    }
+    if (totals.stalls > limits.stalls) {
+        strcat(failures, "  FAIL:stalls");
+    }
+    printf("%-16s %8.2f %8.1f %8.1f %8.2f %8.2f %6u %8.2f%s\n", report_name, totals.move_time,
+            totals.max_target_error, totals.max_overshoot,
+            totals.rpm_samples ? sqrt(totals.rpm_error_sum / totals.rpm_samples) : 0, totals.peak_current,
+            (unsigned)totals.stalls, totals.calibration_time, failures);
+    return failures[0] == 0;
+}
+
+static void print_state(void) {
+    if (report_name) {
+        return;
+    }
+    printf("[%10.3f] status %s, location %ld (model %.1f), target %ld, rod %.2f RPM (target %.2f), pwm %u, "
+            "current %.3f A, supply %.2f V%s\n", sim_time_us * 1e-6, status_names[status], (long)location,
+            model.location, (long)target_location, model_rod_rpm(), target_rpm(), curr_pwm, model.current,
+            model.supply_voltage, sim_stop_mode ? ", sleeping" : "");
+}
+
+static void finish(int code) {
+    if (move_active) {
+        move_end();
+    }
+    if (report_name) {
+        if (!print_report()) {
+            code = 1;
+        }
+    } else if (!quiet) {
+        printf("[%10.3f] done: %lu Stop mode entries, %lu UART bytes lost, %lu shoot-through steps\n",
+                sim_time_us * 1e-6, (unsigned long)mcu_stats.stop_mode_entries,
+                (unsigned long)mcu_stats.uart_rx_lost, (unsigned long)mcu_stats.shoot_through);
+        printf("             sensors powered %.1f %% of the awake time\n",
+                mcu_stats.awake_us ? 100.0 * mcu_stats.sensor_power_us / mcu_stats.awake_us : 0.0);
+        printf("             interrupts: SysTick %lu, Hall %lu/%lu, ADC %lu, UART %lu/%lu, TIM3 %lu, TIM1 %lu, RTC %lu\n",
+                (unsigned long)mcu_stats.irq_count[SimIrqSysTick], (unsigned long)mcu_stats.irq_count[SimIrqExti4_15],
+                (unsigned long)mcu_stats.irq_count[SimIrqExti0_1], (unsigned long)mcu_stats.irq_count[SimIrqAdcDma],
+                (unsigned long)mcu_stats.irq_count[SimIrqUartDma], (unsigned long)mcu_stats.irq_count[SimIrqUart],
+                (unsigned long)mcu_stats.irq_count[SimIrqTim3], (unsigned long)mcu_stats.irq_count[SimIrqTim1],
+                (unsigned long)mcu_stats.irq_count[SimIrqRtc]);
+    }
+    if (flash_file) {
+        FILE * f = fopen(flash_file, "wb");
+        if ( (f == NULL) || (fwrite((void *)FLASH_BASE, 1, 0x8000, f) != 0x8000) ) {
+            fprintf(stderr, "sim: can't write %s\n", flash_file);
+            code = 1;
+        }
+        if (f) {
+            fclose(f);
+        }
+    }
+    if (trace) {
+        fclose(trace);
+    }
+    fflush(stdout);
+    exit(code);
+}
+
+/* ------------------------------------------------------------------------------------------------------------------
+ * UART
+ */
+
+static void send_command(uint8_t b1, uint8_t b2) {
+    uint8_t frame[6] = { 0x00, 0xff, 0x9a, b1, b2, (uint8_t)(b1 ^ b2) };
+    mcu_uart_send(frame, sizeof(frame));
+}
+
+static void tx_flush(void) {
+    if (verbose && tx_frame_len) {
+        printf("[%10.3f] tx:", tx_last_byte * 1e-6);
+        for (int i = 0; i < tx_frame_len; i++) {
+            printf(" %02x", tx_frame[i]);
+        }
+        printf("\n");
+    }
+    tx_frame_len = 0;
+}
+
+void sim_uart_tx_byte(uint8_t byte) {
+    if (tx_frame_len == sizeof(tx_frame)) {
+        tx_flush();
+    }
+    tx_frame[tx_frame_len++] = byte;
+    tx_last_byte = sim_time_us;
+}
+
+void sim_reset_requested(void) {
+    if (!report_name) {
+        printf("[%10.3f] system reset requested\n", sim_time_us * 1e-6);
+    }
+    finish(0);
+}
+
+/* ------------------------------------------------------------------------------------------------------------------
+ * Script
+ */
+
+static void script_error(const char * msg) {
+    fprintf(stderr, "sim: line %d: %s: %s\n", script_pos, msg, script[script_pos - 1]);
+    finish(2);
+}
+
+static int set_param(const char * name, double value) {
+    if (strcmp(name, "sender_baud") == 0) {
+        sim_uart_sender_baud = (uint32_t)value;
+    } else if (strcmp(name, "wake_byte_lost") == 0) {
+        sim_uart_wake_byte_lost = (value != 0);
+    } else {
+        return model_set_param(name, value);
+    }
+    return 1;
+}
+
+static uint64_t wait_timeout(const char * arg) {
+    return sim_time_us + (uint64_t)(arg ? atof(arg) : DEFAULT_WAIT_TIMEOUT_MS) * 1000;
+}
+
+// Execute the next script line. Returns 0 when the command takes time
+static int script_step(void) {
+    char line[MAX_LINE];
+    strncpy(line, script[script_pos++], sizeof(line) - 1);
+    line[sizeof(line) - 1] = 0;
+    char * comment = strchr(line, '#');
+    if (comment) {
+        *comment = 0;
+    }
+    char * cmd = strtok(line, " \t\r\n");
+    if (cmd == NULL) {
+        return 1;
+    }
+    char * arg1 = strtok(NULL, " \t\r\n");
+    char * arg2 = strtok(NULL, " \t\r\n");
+
+    if (strcmp(cmd, "set") == 0) {
+        if ( (arg1 == NULL) || (arg2 == NULL) || (!set_param(arg1, atof(arg2))) ) {
+            script_error("unknown parameter");
+        }
+    } else if (strcmp(cmd, "run") == 0) {
+        pending_cmd = CmdRun;
+        pending_until = wait_timeout(arg1 ? arg1 : "0");
+        return 0;
+    } else if (strcmp(cmd, "up") == 0) {
+        send_command(CMD_UP >> 8, CMD_UP & 0xff);
+    } else if (strcmp(cmd, "down") == 0) {
+        send_command(CMD_DOWN >> 8, CMD_DOWN & 0xff);
+    } else if (strcmp(cmd, "up17") == 0) {
+        send_command(CMD_UP_17 >> 8, CMD_UP_17 & 0xff);
+    } else if (strcmp(cmd, "down17") == 0) {
+        send_command(CMD_DOWN_17 >> 8, CMD_DOWN_17 & 0xff);
+    } else if (strcmp(cmd, "up6") == 0) {
+        send_command(CMD_OVERRIDE_UP_6 >> 8, CMD_OVERRIDE_UP_6 & 0xff);
+    } else if (strcmp(cmd, "down6") == 0) {
+        send_command(CMD_OVERRIDE_DOWN_6 >> 8, CMD_OVERRIDE_DOWN_6 & 0xff);
+    } else if (strcmp(cmd, "stop") == 0) {
+        send_command(CMD_STOP >> 8, CMD_STOP & 0xff);
+    } else if (strcmp(cmd, "goto") == 0) {
+        if (arg1 == NULL) {
+            script_error("missing position");
+        }
+        send_command(CMD_GO_TO, (uint8_t)atoi(arg1));
+    } else if (strcmp(cmd, "cmd") == 0) {
+        if ( (arg1 == NULL) || (arg2 == NULL) ) {
+            script_error("missing command bytes");
+        }
+        send_command((uint8_t)strtoul(arg1, NULL, 16), (uint8_t)strtoul(arg2, NULL, 16));
+    } else if (strcmp(cmd, "send") == 0) {
+        for (char * hex = arg1; hex; hex = arg2, arg2 = strtok(NULL, " \t\r\n")) {
+            uint8_t byte = (uint8_t)strtoul(hex, NULL, 16);
+            mcu_uart_send(&byte, 1);
+        }
+    } else if (strcmp(cmd, "wait") == 0) {
+        if ( (arg1 != NULL) && (strcmp(arg1, "stopped") == 0) ) {
+            pending_cmd = CmdWaitStopped;
+        } else if ( (arg1 != NULL) && (strcmp(arg1, "moving") == 0) ) {
+            pending_cmd = CmdWaitMoving;
+        } else if ( (arg1 != NULL) && (strcmp(arg1, "sleeping") == 0) ) {
+            pending_cmd = CmdWaitSleeping;
+        } else {
+            script_error("unknown condition");
+        }
+        pending_started = sim_time_us;
+        pending_until = wait_timeout(arg2);
+        pending_move_seen = 0;
+        return 0;
+    } else if (strcmp(cmd, "print") == 0) {
+        print_state();
+    } else if (strcmp(cmd, "limit") == 0) {
+        if ( (arg1 == NULL) || (arg2 == NULL) ) {
+            script_error("missing limit");
+        }
+        if (strcmp(arg1, "error") == 0) {
+            limits.error = atof(arg2);
+        } else if (strcmp(arg1, "overshoot") == 0) {
+            limits.overshoot = atof(arg2);
+        } else if (strcmp(arg1, "stalls") == 0) {
+            limits.stalls = (uint32_t)atoi(arg2);
+        } else {
+            script_error("unknown limit");
+        }
+    } else {
+        script_error("unknown command");
+    }
+    return 1;
+}
+
+static uint8_t pending_done(void) {
+    if (sim_time_us >= pending_until) {
+        if (pending_cmd != CmdRun) {
+            totals.timeouts++;
+            if (!report_name) {
+                printf("[%10.3f] wait timed out\n", sim_time_us * 1e-6);
+            }
+        }
+        return 1;
+    }
+    switch (pending_cmd) {
+        case CmdWaitStopped:
+            if (firmware_moving()) {
+                pending_move_seen = 1;
+                return 0;
+            }
+            // commands are received and a move started within a few milliseconds
+            return pending_move_seen || (sim_time_us - pending_started >= MOVE_START_TIMEOUT_MS * 1000ULL);
+        case CmdWaitMoving:
+            return firmware_moving();
+        case CmdWaitSleeping:
+            return sim_stop_mode;
+        default:
+            return 0;
+    }
+}
+
+uint64_t sim_next_action_time(void) {
+    if ( (pending_cmd == CmdNone) || (pending_cmd == CmdWaitSleeping) ) {
+        // the firmware has just entered Stop mode, if that's what we are waiting for
+        return sim_time_us;
+    }
+    if ( (pending_cmd == CmdWaitStopped) && (!pending_move_seen) &&
+            (pending_started + MOVE_START_TIMEOUT_MS * 1000ULL < pending_until) ) {
+        return pending_started + MOVE_START_TIMEOUT_MS * 1000ULL;
+    }
+    return pending_until;
+}
+
+void sim_poll(void) {
+    if (sim_time_us / 1000 != last_ms) {
+        last_ms = sim_time_us / 1000;
+        if (firmware_moving() && (!move_active)) {
+            move_begin();
+        } else if ( (!firmware_moving()) && move_active ) {
+            move_end();
+        }
+        if (move_active) {
+            move_sample();
+        }
+        if (trace && (!sim_stop_mode)) {
+            fprintf(trace, "%.3f,%.2f,%ld,%ld,%.3f,%.3f,%u,%.4f,%.3f,%d\n", sim_time_us * 1e-3, model.location,
+                    (long)location, (long)target_location, model_rod_rpm(), target_rpm(), curr_pwm, model.current,
+                    model.supply_voltage, status);
+        }
+    }
+    if ( tx_frame_len && (sim_time_us - tx_last_byte > TX_FRAME_GAP_US) ) {
+        tx_flush();
+    }
+
+    if ( (pending_cmd != CmdNone) && pending_done() ) {
+        pending_cmd = CmdNone;
+    }
+    while (pending_cmd == CmdNone) {
+        if (script_pos == script_len) {
+            finish(0);
+        }
+        script_step();
+    }
+}
+
+static void load_script(FILE * f) {
+    char line[MAX_LINE];
+    while ( fgets(line, sizeof(line), f) && (script_len < MAX_SCRIPT_LINES) ) {
+        script[script_len++] = strdup(line);
+    }
+}
+
+static int is_set_command(const char * line) {
+    while ( (*line == ' ') || (*line == '\t') ) {
+        line++;
+    }
+    return strncmp(line, "set ", 4) == 0;
+}
+
+int main(int argc, char ** argv) {
+    int i;
+    for (i = 1; (i < argc) && (argv[i][0] == '-'); i++) {
+        if (strcmp(argv[i], "-v") == 0) {
+            verbose = 1;
+        } else if (strcmp(argv[i], "-q") == 0) {
+            quiet = 1;
+        } else if ( (strcmp(argv[i], "-r") == 0) && (i + 1 < argc) ) {
+            report_name = argv[++i];
+        } else if ( (strcmp(argv[i], "-t") == 0) && (i + 1 < argc) ) {
+            trace = fopen(argv[++i], "w");
+            if (trace == NULL) {
+                fprintf(stderr, "sim: can't create %s\n", argv[i]);
+                return 1;
+            }
+            fprintf(trace, "time_ms,model_location,location,target_location,rod_rpm,target_rpm,pwm,current,"
+                    "supply_voltage,status\n");
+        } else if ( (strcmp(argv[i], "-f") == 0) && (i + 1 < argc) ) {
+            flash_file = argv[++i];
+        } else {
+            fprintf(stderr, "usage: %s [-v] [-q] [-r name] [-t trace.csv] [-f flash.bin] [script]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (i < argc) {
+        FILE * f = fopen(argv[i], "r");
+        if (f == NULL) {
+            fprintf(stderr, "sim: can't open %s\n", argv[i]);
+            return 1;
+        }
+        load_script(f);
+        fclose(f);
+    } else {
+        load_script(stdin);
+    }
+
+    mcu_init();
+    if (flash_file) {
+        FILE * f = fopen(flash_file, "rb");
+        if (f) {
+            if (fread((void *)FLASH_BASE, 1, 0x8000, f) != 0x8000) {
+                fprintf(stderr, "sim: %s is not a 32 kB flash image\n", flash_file);
+                return 1;
+            }
+            fclose(f);
+        }
+    }
+    // curtain is half way down unless the script says otherwise
+    model_init(model_params.full_length / 2);
+    while ( (script_pos < script_len) && is_set_command(script[script_pos]) ) {
+        script_step();
+    }
+    model.supply_voltage = model_params.battery_voltage;
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    firmware_main();
+    return 0;
+}
@@ -83,6 +83,20 @@ LoopFillZerobss:
   cmp r2, r4
   bcc FillZerobss
 
+/* Paint the unused RAM up to the top of the stack for the stack usage measurement (see ramstats.h) */
+  ldr r2, =_end
+  ldr r4, =_estack
+  ldr r3, =0xa5a5a5a5
+  b LoopPaintStack
+
+PaintStack:
+  str  r3, [r2]
+  adds r2, r2, #4
+
+LoopPaintStack:
+  cmp r2, r4
+  bcc PaintStack
+
 /* Call the clock system intitialization function.*/
   bl  SystemInit
 /* Call static constructors */